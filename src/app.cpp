@@ -12,11 +12,11 @@ App::App(Platform& plt) :
 	window_dim(plt.window_draw()),
 	camera(window_dim),
 	plt(plt),
-	scene(Gui::num_ids()),
+	scene(Gui::num_ids(), jobs),
 	gui(window_dim) {
 
 	GL::global_params();
-	Renderer::setup(window_dim);
+	Renderer::setup(window_dim, jobs);
 }
 
 App::~App() {
@@ -56,6 +56,7 @@ void App::event(SDL_Event e) {
 
 		Vec2 d(e.motion.xrel, e.motion.yrel);
 		Vec2 p = plt.scale_mouse({e.motion.x, e.motion.y});
+		Renderer::cursor(p);
 		
 		if(gui_capture) {
 			gui.drag_to(scene, camera.pos(), screen_to_world(p));
@@ -75,7 +76,7 @@ void App::event(SDL_Event e) {
 
 		if(e.button.button == SDL_BUTTON_LEFT) {
 
-			Scene_Object::ID id = Renderer::read_id(p);
+			Scene_Object::ID id = read_id(p);
 			if(gui.select(scene, id, camera.pos(), screen_to_world(p))) {
 				cam_mode = Camera_Control::none;
 				plt.grab_mouse();
@@ -139,6 +140,11 @@ void App::render_selected(Scene_Object& obj) {
 		obj.render_mesh(view);
 		Renderer::outline(viewproj, view, obj);
 
+	} else if(gui.mode() == Gui::Mode::render) {
+
+		obj.render_mesh(view);
+		Renderer::outline(viewproj, view, obj);
+
 	} else if(gui.mode() == Gui::Mode::model) {
 		
 		obj.pose = {};
@@ -156,6 +162,8 @@ void App::render_selected(Scene_Object& obj) {
 
 void App::render() {
 
+	jobs.run_main();
+
 	proj = camera.proj();
 	view = camera.view();	
 	viewproj = proj * view;
@@ -163,8 +171,114 @@ void App::render() {
 
 	Renderer::begin();
 	Renderer::proj(proj);
-	
-	if(gui.mode() == Gui::Mode::scene) {
+	render_scene();
+	Renderer::complete();
+
+	// GUI
+	float height = gui.menu(scene, undo, settings_open);
+	gui.objs(scene, undo, height);
+	gui.error();
+	if(settings_open) settings();
+	if(gui.mode() == Gui::Mode::render) render_image();
+}
+
+void App::start_render() {
+
+	tracer.set_options(trace_opt);
+	sync_render();
+	Vec2 dim = window_dim * render_scale;
+	tracer.view((uint32_t)std::max(dim.x, 1.0f), (uint32_t)std::max(dim.y, 1.0f), camera.pos(), iviewproj);
+	tracer.restart();
+	tracing = true;
+}
+
+void App::sync_render() {
+
+	std::unordered_map<TLAS::Key, uint64_t> meshes;
+	std::unordered_set<Scene_Object::ID> objs;
+	scene.for_objs([&](Scene_Object& obj) {
+		obj.sync_mesh();
+		const GL::Mesh& mesh = obj.mesh();
+		TLAS::Key key = (TLAS::Key)(uintptr_t)&mesh;
+		if(meshes.find(key) == meshes.end()) {
+			auto synced = render_meshes.find(key);
+			if(synced == render_meshes.end() || synced->second != mesh.version()) {
+				tracer.set_mesh(key, mesh.verts(), mesh.indices(), mesh.flat(), jobs);
+			}
+			meshes[key] = mesh.version();
+		}
+		tracer.set_instance(obj.id(), key, obj.pose.transform());
+		objs.insert(obj.id());
+	});
+
+	for(auto& entry : render_meshes) {
+		if(meshes.find(entry.first) == meshes.end()) tracer.erase_mesh(entry.first);
+	}
+	for(Scene_Object::ID id : render_objs) {
+		if(objs.find(id) == objs.end()) tracer.erase_instance(id);
+	}
+	render_meshes = std::move(meshes);
+	render_objs = std::move(objs);
+	tracer.commit();
+}
+
+void App::render_image() {
+
+	ImGui::Begin("Path Tracer", nullptr, ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoSavedSettings);
+
+	if(ImGui::Button(tracing ? "Restart" : "Start")) start_render();
+	if(tracing) {
+		ImGui::SameLine();
+		if(ImGui::Button("Stop")) tracing = false;
+	}
+	int depth = (int)trace_opt.depth;
+	if(ImGui::SliderInt("Bounces", &depth, 0, 16)) trace_opt.depth = depth;
+	ImGui::SliderInt("Samples", &render_samples, 1, 4096);
+
+	// One pass over every tile per frame, using all cores
+	// Objects moved or edited since the last frame restart accumulation
+	if(tracing) sync_render();
+	const Path_Tracer::Stats& s = tracer.stats();
+	if(tracing && s.samples < (size_t)render_samples) {
+		tracer.sample(jobs);
+		tracer.image(render_pixels, jobs);
+		render_tex.image(tracer.width(), tracer.height(), render_pixels.data());
+		Platform::wake();
+	}
+
+	if(s.tris) {
+		ImGui::Text("%zu triangles in %zu instances, %zu nodes", s.tris, s.instances, s.nodes);
+		ImGui::Text("Updated in %.3f ms, top level %s", s.build_ms, s.rebuilt ? "rebuilt" : "refitted");
+		ImGui::Text("%zu samples, %.2f samples/s", s.samples, s.samples_per_second());
+		ImGui::Text("%.2f Mrays/s", s.rays_per_second() / 1e6);
+	}
+	if(render_tex.get_id()) {
+		ImGui::Image((ImTextureID)(intptr_t)render_tex.get_id(), {(float)tracer.width(), (float)tracer.height()});
+	}
+	ImGui::End();
+}
+
+void App::settings() {
+
+	ImGui::Begin("Display Settings", &settings_open, ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoSavedSettings);
+	Renderer::settings_gui();
+
+	ImGui::Separator();
+	ImGui::Checkbox("Only Redraw On Change", &plt.pacing.idle);
+	if(plt.pacing.idle) {
+		ImGui::Text("Sleeps until input or background work changes the frame.");
+	} else {
+		ImGui::Text("Redraws every display refresh.");
+	}
+	ImGui::SliderInt("Max FPS", &plt.pacing.max_fps, 0, 240);
+	if(plt.pacing.max_fps == 0) ImGui::Text("Frame rate limited by vsync only.");
+
+	ImGui::End();
+}
+
+void App::render_scene() {
+
+	if(gui.mode() == Gui::Mode::scene || gui.mode() == Gui::Mode::render) {
         scene.render_objs(view, gui.selected_id());
 	}
 	gui.render_base(viewproj);
@@ -173,13 +287,17 @@ void App::render() {
 	if(selected.has_value()) {
 		render_selected(*selected);
 	}
-	Renderer::complete();
+}
 
-	// GUI
-	float height = gui.menu(scene, undo, settings_open);
-	gui.objs(scene, undo, height);
-	gui.error();
-	if(settings_open) Renderer::settings_gui(&settings_open);
+Scene_Object::ID App::read_id(Vec2 pos) {
+
+	// Re-render the last frame's view to pick from fresh IDs
+	if(Renderer::needs_id_pass()) {
+		Renderer::begin_id_pass();
+		render_scene();
+		Renderer::complete_id_pass();
+	}
+	return Renderer::read_id(pos);
 }
 
 Vec3 App::screen_to_world(Vec2 mouse) {
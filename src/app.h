@@ -3,14 +3,18 @@
 
 #include <map>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <SDL2/SDL.h>
 
 #include "lib/mathutils.h"
 #include "lib/camera.h"
 #include "platform/gl.h"
 #include "scene/scene.h"
+#include "rays/tracer.h"
 
 #include "gui.h"
+#include "jobs.h"
 #include "undo.h"
 
 class Platform;
@@ -22,12 +26,20 @@ public:
 	void render();
 	void event(SDL_Event e);
 	void settings();
+	void render_image();
 
 private:
 	Scene_Object::ID read_id(Vec2 pos);
 	void apply_window_dim(Vec2 new_dim);
+	void render_scene();
 	void render_selected(Scene_Object& obj);
 	Vec3 screen_to_world(Vec2 mouse);
+	/// Snapshot the camera into the path tracer and start sampling
+	void start_render();
+	/// Bring the path tracer's scene up to date. Meshes are keyed by their
+	/// GL mesh, so objects sharing one share its BVH; moved objects only move
+	/// their instance, and edited meshes are refitted when they can be.
+	void sync_render();
 
 	// Camera data
     enum class Camera_Control {
@@ -43,10 +55,25 @@ private:
 
 	// Systems
 	Platform& plt;
+	Jobs jobs;
 	Scene scene;
 	Gui gui;
 	Undo undo;
 
 	bool gui_capture = false;
 	bool settings_open = false;
+
+	// Render mode: path traced at a fraction of the window size, up to a
+	// number of samples per pixel
+	static constexpr float render_scale = 0.5f;
+	Path_Tracer tracer;
+	Path_Tracer::Options trace_opt;
+	/// Meshes in the tracer and the version each was last synced at, and
+	/// the objects placed
+	std::unordered_map<TLAS::Key, uint64_t> render_meshes;
+	std::unordered_set<Scene_Object::ID> render_objs;
+	GL::Tex2D render_tex;
+	std::vector<unsigned char> render_pixels;
+	int render_samples = 256;
+	bool tracing = false;
 };
@@ -2,6 +2,7 @@
 #include "gui.h"
 #include "scene/util.h"
 #include "scene/render.h"
+#include "platform/platform.h"
 
 #include <imgui/imgui.h>
 #include <nfd/nfd.h>
@@ -14,21 +15,21 @@ Gui::Gui(Vec2 dim) :
 	widget_lines(1.0f),
 	window_dim(dim) {
 
-	x_trans = Scene_Object((Scene_Object::ID)Basic::x_trans, Pose::rotated({0.0f, 0.0f, -90.0f}), Util::arrow_mesh(0.03f, 0.075f, 1.0f), Gui::Color::red);
-	y_trans = Scene_Object((Scene_Object::ID)Basic::y_trans, {}, Util::arrow_mesh(0.03f, 0.075f, 1.0f), Gui::Color::green);
-	z_trans = Scene_Object((Scene_Object::ID)Basic::z_trans, Pose::rotated({90.0f, 0.0f, 0.0f}), Util::arrow_mesh(0.03f, 0.075f, 1.0f), Gui::Color::blue);
+	x_trans = Scene_Object((Scene_Object::ID)Basic::x_trans, Pose::rotated({0.0f, 0.0f, -90.0f}), Util::shared_arrow_mesh(0.03f, 0.075f, 1.0f), Gui::Color::red);
+	y_trans = Scene_Object((Scene_Object::ID)Basic::y_trans, {}, Util::shared_arrow_mesh(0.03f, 0.075f, 1.0f), Gui::Color::green);
+	z_trans = Scene_Object((Scene_Object::ID)Basic::z_trans, Pose::rotated({90.0f, 0.0f, 0.0f}), Util::shared_arrow_mesh(0.03f, 0.075f, 1.0f), Gui::Color::blue);
 
-	xy_trans = Scene_Object((Scene_Object::ID)Basic::xy_trans, Pose::rotated({-90.0f, 0.0f, 0.0f}), Util::square_mesh(0.1f), Gui::Color::blue);
-	yz_trans = Scene_Object((Scene_Object::ID)Basic::yz_trans, Pose::rotated({0.0f, 0.0f, -90.0f}), Util::square_mesh(0.1f), Gui::Color::red);
-	xz_trans = Scene_Object((Scene_Object::ID)Basic::xz_trans, {}, Util::square_mesh(0.1f), Gui::Color::green);
+	xy_trans = Scene_Object((Scene_Object::ID)Basic::xy_trans, Pose::rotated({-90.0f, 0.0f, 0.0f}), Util::shared_square_mesh(0.1f), Gui::Color::blue);
+	yz_trans = Scene_Object((Scene_Object::ID)Basic::yz_trans, Pose::rotated({0.0f, 0.0f, -90.0f}), Util::shared_square_mesh(0.1f), Gui::Color::red);
+	xz_trans = Scene_Object((Scene_Object::ID)Basic::xz_trans, {}, Util::shared_square_mesh(0.1f), Gui::Color::green);
 
-	x_rot = Scene_Object((Scene_Object::ID)Basic::x_rot, Pose::rotated({0.0f, 0.0f, -90.0f}), Util::torus_mesh(0.975f, 1.0f), Gui::Color::red);
-	y_rot = Scene_Object((Scene_Object::ID)Basic::y_rot, {}, Util::torus_mesh(0.975f, 1.0f), Gui::Color::green);
-	z_rot = Scene_Object((Scene_Object::ID)Basic::z_rot, Pose::rotated({90.0f, 0.0f, 0.0f}), Util::torus_mesh(0.975f, 1.0f), Gui::Color::blue);
+	x_rot = Scene_Object((Scene_Object::ID)Basic::x_rot, Pose::rotated({0.0f, 0.0f, -90.0f}), Util::shared_torus_mesh(0.975f, 1.0f), Gui::Color::red);
+	y_rot = Scene_Object((Scene_Object::ID)Basic::y_rot, {}, Util::shared_torus_mesh(0.975f, 1.0f), Gui::Color::green);
+	z_rot = Scene_Object((Scene_Object::ID)Basic::z_rot, Pose::rotated({90.0f, 0.0f, 0.0f}), Util::shared_torus_mesh(0.975f, 1.0f), Gui::Color::blue);
 
-	x_scale = Scene_Object((Scene_Object::ID)Basic::x_scale, Pose::rotated({0.0f, 0.0f, -90.0f}), Util::scale_mesh(), Gui::Color::red);
-	y_scale = Scene_Object((Scene_Object::ID)Basic::y_scale, {}, Util::scale_mesh(), Gui::Color::green);
-	z_scale = Scene_Object((Scene_Object::ID)Basic::z_scale, Pose::rotated({90.0f, 0.0f, 0.0f}), Util::scale_mesh(), Gui::Color::blue);
+	x_scale = Scene_Object((Scene_Object::ID)Basic::x_scale, Pose::rotated({0.0f, 0.0f, -90.0f}), Util::shared_scale_mesh(), Gui::Color::red);
+	y_scale = Scene_Object((Scene_Object::ID)Basic::y_scale, {}, Util::shared_scale_mesh(), Gui::Color::green);
+	z_scale = Scene_Object((Scene_Object::ID)Basic::z_scale, Pose::rotated({90.0f, 0.0f, 0.0f}), Util::shared_scale_mesh(), Gui::Color::blue);
 
 	create_baseplane();
 }
@@ -174,13 +175,13 @@ void Gui::write_scene(Scene& scene) {
 	}
 }
 
-void Gui::load_scene(Scene& scene, Undo& undo) {
+void Gui::load_scene(Scene& scene, Undo& undo, bool clear_first) {
 
 	char* path = nullptr;
 	NFD_OpenDialog(file_types, nullptr, &path);
 	
 	if(path) {
-		std::string error = scene.load(true, undo, std::string(path));
+		std::string error = scene.load(clear_first, undo, std::string(path), weld_opt, welded);
 		if(!error.empty()) {
 			set_error(error);
 		}
@@ -225,16 +226,13 @@ void Gui::objs(Scene& scene, Undo& undo, float menu_height) {
 		}
 
 		if(ImGui::Button("Load Objects")) {
-			char* path = nullptr;
-			NFD_OpenDialog(file_types, nullptr, &path);
+			load_scene(scene, undo, false);
+		}
 
-			if(path) {
-				std::string error = scene.load(false, undo, std::string(path));
-				if(!error.empty()) {
-					set_error(error);
-				}
-				free(path);
-			}
+		ImGui::Checkbox("Weld Vertices", &weld_opt.enabled);
+		if(weld_opt.enabled) {
+			ImGui::SliderFloat("Tolerance", &weld_opt.tolerance, 1e-7f, 1e-2f, "%.1e", 4.0f);
+			ImGui::Text("Welded %zu vertices", welded);
 		}
 
 		if(!scene.empty())
@@ -303,7 +301,7 @@ void Gui::objs(Scene& scene, Undo& undo, float menu_height) {
 				if(wrap_button("Delete"))
 					to_delete = obj.id();
 			}
-		} else if(_mode == Mode::model) {
+		} else if(_mode == Mode::model || _mode == Mode::render) {
 
 		} else assert(false);
 
@@ -319,6 +317,61 @@ void Gui::objs(Scene& scene, Undo& undo, float menu_height) {
 
 	if(_mode == Mode::model) {
 
+		auto obj = scene.get(selected_mesh);
+		if(obj.has_value()) {
+			ImGui::Separator();
+			Scene_Object& o = obj->get();
+			const Optimize::Stats& opt = o.optimize_stats();
+			if(opt.tris) ImGui::Text("Optimized %zu triangles: ACMR %.3f to %.3f", opt.tris, opt.acmr_before, opt.acmr_after);
+			if(ImGui::Button("Compact Mesh")) o.compact_mesh();
+			std::string err;
+			if(ImGui::Button("Catmull-Clark")) err = scene.subdivide(selected_mesh, Subdivide::Scheme::catmull_clark);
+			ImGui::SameLine();
+			if(ImGui::Button("Loop")) err = scene.subdivide(selected_mesh, Subdivide::Scheme::loop);
+			ImGui::SameLine();
+			if(ImGui::Button("Remesh")) err = scene.remesh(selected_mesh);
+
+			// Simplification advances a slice per frame while its object is selected
+			ImGui::Separator();
+			if(o.simplify_step(simplify_budget)) {
+				const Simplifier::Stats& s = o.simplifier()->stats();
+				ImGui::Text("Simplifying: %zu of %zu faces", s.faces, s.faces_before);
+				if(ImGui::Button("Stop")) o.simplify_stop();
+				Platform::wake();
+			} else {
+				ImGui::SliderFloat("Keep Faces", &simplify_keep, 0.01f, 1.0f, "%.2f");
+				if(ImGui::Button("Simplify")) err = o.simplify(simplify_keep);
+				if(const Simplifier* simp = o.simplifier()) {
+					const Simplifier::Stats& s = simp->stats();
+					ImGui::Text("%zu to %zu faces, %.0f collapses/s", s.faces_before, s.faces, s.rate());
+				}
+			}
+
+			// Repeated strokes on the same region reuse the factored system
+			ImGui::Separator();
+			auto sel = Renderer::he_selected();
+			int order = (int)fair_opt.order;
+			ImGui::SliderInt("Rings", &fair_rings, 1, 32);
+			ImGui::SliderInt("Order", &order, 1, 2);
+			ImGui::SliderFloat("Strength", &fair_opt.strength, 0.01f, 10.0f, "%.2f", 2.0f);
+			fair_opt.order = (unsigned int)order;
+			if(ImGui::Button("Smooth")) {
+				fair_opt.mode = Fairing::Mode::smooth;
+				err = o.fair(fair_opt, sel, (unsigned int)fair_rings);
+			}
+			ImGui::SameLine();
+			if(ImGui::Button("Fair")) {
+				fair_opt.mode = Fairing::Mode::fair;
+				err = o.fair(fair_opt, sel, (unsigned int)fair_rings);
+			}
+			if(const Fairing* fair = o.fairing()) {
+				const Fairing::Stats& s = fair->stats();
+				ImGui::Text("%zu vertices, built in %.1f ms", s.free, s.build_ms);
+				ImGui::Text("Solved in %.1f ms, %zu iterations", s.solve_ms, s.iterations);
+			}
+			if(!err.empty()) set_error(err);
+		}
+
 		auto sel = Renderer::he_selected();
 		if(sel.has_value()) {
 			ImGui::Separator();
@@ -412,8 +465,8 @@ float Gui::menu(Scene& scene, Undo& undo, bool& settings) {
 		if(state_button(Gui::Mode::model, "Model"))
 			_mode = Gui::Mode::model;
 
-		// if(state_button(Gui::Mode::render, "Render"))
-		// 	_mode = Gui::Mode::render;
+		if(state_button(Gui::Mode::render, "Render"))
+			_mode = Gui::Mode::render;
 
 		// if(state_button(Gui::Mode::rig, "Rig"))
 		// 	_mode = Gui::Mode::rig;
@@ -630,6 +683,10 @@ bool Gui::select(Scene& scene, Scene_Object::ID id, Vec3 cam, Vec3 dir) {
 	switch(_mode) {
 	case Mode::scene: return select_scene(scene, id, cam, dir);
 	case Mode::model: return select_model(scene, id, cam, dir);
+	case Mode::render: {
+		selected_mesh = id;
+		return false;
+	}
 	default: assert(false);
 	}
 	return dragging;
@@ -638,7 +695,8 @@ bool Gui::select(Scene& scene, Scene_Object::ID id, Vec3 cam, Vec3 dir) {
 void Gui::clear_select() {
 	
 	switch(_mode) {
-	case Mode::scene: selected_mesh = 0; break;
+	case Mode::scene:
+	case Mode::render: selected_mesh = 0; break;
 	case Mode::model: {
 		Renderer::set_he_select(0);
 	} break;
@@ -13,7 +13,7 @@ public:
 	enum class Mode {
 		scene,
 		model,
-		// render,
+		render,
 		// rig,
 		// animate,
 		// simulate
@@ -62,7 +62,7 @@ public:
 
 private:
 	static inline const char* file_types = "dae,obj,fbx,glb,gltf,3ds,blend";
-	void load_scene(Scene& scene, Undo& undo);
+	void load_scene(Scene& scene, Undo& undo, bool clear_first = true);
 	void write_scene(Scene& scene);
 
 	Vec3 apply_action(const Scene_Object& obj);
@@ -79,6 +79,18 @@ private:
 	// Edit mode
 	Mode _mode = Mode::scene;
 
+	// Import options, and vertices welded by the last import
+	Weld::Options weld_opt;
+	size_t welded = 0;
+
+	// Model mode simplification: fraction of faces kept, and time spent per frame
+	float simplify_keep = 0.5f;
+	static inline const double simplify_budget = 1.0 / 120.0;
+
+	// Model mode fairing: rings around the selection, and solver options
+	int fair_rings = 4;
+	Fairing::Options fair_opt;
+
 	// Object transform actions
 	enum class Action {
 		move, rotate, scale
@@ -0,0 +1,183 @@
+
+#include "jobs.h"
+#include "lib/log.h"
+#include "platform/platform.h"
+
+// Worker index in its pool's queues, or 0 for threads outside any pool
+static thread_local const Jobs* current = nullptr;
+static thread_local unsigned int current_idx = 0;
+
+Jobs::Group::~Group() {
+	assert(done());
+}
+
+bool Jobs::Group::done() const {
+	return pending.load(std::memory_order_acquire) == 0;
+}
+
+Jobs::Graph::Node Jobs::Graph::add(Task task, std::initializer_list<Node> deps) {
+	Node node = items.size();
+	Item& item = items.emplace_back();
+	item.task = std::move(task);
+	for(Node dep : deps) {
+		assert(dep < node);
+		items[dep].next.push_back(node);
+		item.n_deps++;
+	}
+	return node;
+}
+
+void Jobs::Graph::clear() {
+	items.clear();
+}
+
+size_t Jobs::Graph::size() const {
+	return items.size();
+}
+
+Jobs::Jobs(unsigned int threads) : main_id(std::this_thread::get_id()) {
+
+	if(threads == 0) {
+		threads = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+	}
+
+	for(unsigned int i = 0; i <= threads; i++) {
+		queues.push_back(std::make_unique<Queue>());
+	}
+	for(unsigned int i = 0; i < threads; i++) {
+		workers.emplace_back([this, i]() { work(i + 1); });
+	}
+}
+
+Jobs::~Jobs() {
+	{
+		std::lock_guard<std::mutex> guard(sleep_lock);
+		stop = true;
+	}
+	sleep.notify_all();
+	for(std::thread& t : workers) t.join();
+}
+
+unsigned int Jobs::threads() const {
+	return (unsigned int)workers.size() + 1;
+}
+
+void Jobs::push(Task task) {
+
+	unsigned int idx = current == this ? current_idx : 0;
+	{
+		Queue& q = *queues[idx];
+		std::lock_guard<std::mutex> guard(q.lock);
+		q.tasks.push_back(std::move(task));
+	}
+	queued.fetch_add(1, std::memory_order_release);
+
+	// Take the lock so a worker can't miss the wakeup between checking and sleeping
+	{ std::lock_guard<std::mutex> guard(sleep_lock); }
+	sleep.notify_one();
+}
+
+bool Jobs::find(Task& task) {
+
+	if(queued.load(std::memory_order_acquire) == 0) return false;
+
+	unsigned int self = current == this ? current_idx : 0;
+	unsigned int n = (unsigned int)queues.size();
+
+	// Own queue newest first, then the shared queue and other workers oldest first
+	for(unsigned int i = 0; i < n; i++) {
+		unsigned int idx = i == 0 ? self : (i == self ? 0 : i);
+		Queue& q = *queues[idx];
+		std::lock_guard<std::mutex> guard(q.lock);
+		if(q.tasks.empty()) continue;
+		if(i == 0 && self != 0) {
+			task = std::move(q.tasks.back());
+			q.tasks.pop_back();
+		} else {
+			task = std::move(q.tasks.front());
+			q.tasks.pop_front();
+		}
+		queued.fetch_sub(1, std::memory_order_relaxed);
+		return true;
+	}
+	return false;
+}
+
+void Jobs::work(unsigned int idx) {
+
+	current = this;
+	current_idx = idx;
+
+	for(;;) {
+		Task task;
+		if(find(task)) {
+			task();
+			continue;
+		}
+		std::unique_lock<std::mutex> guard(sleep_lock);
+		sleep.wait(guard, [this]() { return stop || queued.load(std::memory_order_acquire) > 0; });
+		if(stop && queued.load(std::memory_order_acquire) == 0) return;
+	}
+}
+
+void Jobs::run(Group& group, Task task) {
+	group.pending.fetch_add(1, std::memory_order_relaxed);
+	push([&group, task = std::move(task)]() {
+		task();
+		group.pending.fetch_sub(1, std::memory_order_release);
+	});
+}
+
+void Jobs::wait(Group& group) {
+	while(!group.done()) {
+		Task task;
+		if(find(task)) task();
+		else std::this_thread::yield();
+	}
+}
+
+void Jobs::run(Graph& graph) {
+
+	Group group;
+	std::function<void(Graph::Node)> start = [&](Graph::Node node) {
+		run(group, [&, node]() {
+			Graph::Item& item = graph.items[node];
+			item.task();
+			for(Graph::Node next : item.next) {
+				if(graph.items[next].waiting.fetch_sub(1, std::memory_order_acq_rel) == 1) start(next);
+			}
+		});
+	};
+
+	for(Graph::Item& item : graph.items) {
+		item.waiting.store(item.n_deps, std::memory_order_relaxed);
+	}
+	for(Graph::Node node = 0; node < graph.items.size(); node++) {
+		if(graph.items[node].n_deps == 0) start(node);
+	}
+	wait(group);
+}
+
+void Jobs::on_main(Task task) {
+	{
+		std::lock_guard<std::mutex> guard(main_lock);
+		main_tasks.push_back(std::move(task));
+	}
+	Platform::wake();
+}
+
+void Jobs::run_main() {
+
+	assert(is_main());
+
+	std::vector<Task> tasks;
+	{
+		std::lock_guard<std::mutex> guard(main_lock);
+		std::swap(tasks, main_tasks);
+	}
+	for(Task& task : tasks) task();
+}
+
+bool Jobs::is_main() const {
+	return std::this_thread::get_id() == main_id;
+}
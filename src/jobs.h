@@ -0,0 +1,126 @@
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Work-stealing thread pool. Each worker pushes and pops tasks at the back of
+/// its own queue and steals from the front of the others'; tasks submitted from
+/// other threads go to a shared queue. A thread waiting on a group runs queued
+/// tasks meanwhile, so tasks may wait on tasks they spawn.
+class Jobs {
+public:
+	using Task = std::function<void()>;
+
+	/// Counts outstanding tasks submitted with run(Group&, Task)
+	class Group {
+	public:
+		Group() = default;
+		Group(const Group&) = delete;
+		Group& operator=(const Group&) = delete;
+		~Group();
+
+		bool done() const;
+
+	private:
+		std::atomic<size_t> pending = 0;
+		friend class Jobs;
+	};
+
+	/// Tasks with dependencies. A node may only depend on nodes added before it.
+	class Graph {
+	public:
+		using Node = size_t;
+		Node add(Task task, std::initializer_list<Node> deps = {});
+		void clear();
+		size_t size() const;
+
+	private:
+		struct Item {
+			Task task;
+			std::vector<Node> next;
+			size_t n_deps = 0;
+			std::atomic<size_t> waiting = 0;
+		};
+		std::deque<Item> items;
+		friend class Jobs;
+	};
+
+	/// Zero threads uses one worker per core, less the calling thread
+	explicit Jobs(unsigned int threads = 0);
+	~Jobs();
+
+	Jobs(const Jobs&) = delete;
+	Jobs& operator=(const Jobs&) = delete;
+
+	/// Worker threads plus the thread that waits
+	unsigned int threads() const;
+
+	void run(Group& group, Task task);
+	void wait(Group& group);
+
+	/// Run all nodes of the graph, respecting dependencies; returns when done
+	void run(Graph& graph);
+
+	/// Call f(i) for every i in [begin, end), in chunks of at least grain
+	/// indices, and return when all are done. The calling thread takes part.
+	template<typename F>
+	void parallel_for(size_t begin, size_t end, size_t grain, F&& f) {
+
+		if(end <= begin) return;
+		size_t n = end - begin;
+		grain = std::max(grain, size_t(1));
+		size_t chunks = std::min((n + grain - 1) / grain, size_t(threads()) * 4);
+
+		if(chunks <= 1) {
+			for(size_t i = begin; i < end; i++) f(i);
+			return;
+		}
+
+		size_t step = (n + chunks - 1) / chunks;
+		Group group;
+		for(size_t lo = begin + step; lo < end; lo += step) {
+			size_t hi = std::min(end, lo + step);
+			run(group, [lo, hi, &f]() {
+				for(size_t i = lo; i < hi; i++) f(i);
+			});
+		}
+		for(size_t i = begin; i < begin + step; i++) f(i);
+		wait(group);
+	}
+
+	/// Queue a task for the main thread, e.g. GL calls, and wake the event loop
+	void on_main(Task task);
+	/// Run tasks queued by on_main; only call from the main thread
+	void run_main();
+	bool is_main() const;
+
+private:
+	struct Queue {
+		std::mutex lock;
+		std::deque<Task> tasks;
+	};
+
+	void push(Task task);
+	bool find(Task& task);
+	void work(unsigned int idx);
+
+	// queues[0] is shared; queues[i + 1] belongs to worker i
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> workers;
+	std::atomic<size_t> queued = 0;
+	std::mutex sleep_lock;
+	std::condition_variable sleep;
+	bool stop = false;
+
+	std::thread::id main_id;
+	std::mutex main_lock;
+	std::vector<Task> main_tasks;
+};
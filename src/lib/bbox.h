@@ -2,7 +2,7 @@
 #pragma once
 
 #include <cmath>
-#include <vector>
+#include <array>
 #include <algorithm>
 #include <ostream>
 #include <cfloat>
@@ -45,10 +45,28 @@ struct BBox {
         min = hmin(min, point);
 		max = hmax(max, point);
     }
+    /// Expand bounding box to include another box
+    void enclose(BBox box) {
+        min = hmin(min, box.min);
+        max = hmax(max, box.max);
+    }
+
+    Vec3 center() const {
+        return 0.5f * (min + max);
+    }
+    bool empty() const {
+        return min.x > max.x || min.y > max.y || min.z > max.z;
+    }
+    /// Surface area, or zero if empty
+    float surface_area() const {
+        if(empty()) return 0.0f;
+        Vec3 e = max - min;
+        return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
 
     /// Get the eight corner points of the bounding box
-    std::vector<Vec3> corners() const {
-        std::vector<Vec3> ret(8);
+    std::array<Vec3, 8> corners() const {
+        std::array<Vec3, 8> ret;
         ret[0] = Vec3(min.x, min.y, min.z);
         ret[1] = Vec3(max.x, min.y, min.z);
         ret[2] = Vec3(min.x, max.y, min.z);
@@ -67,9 +85,9 @@ struct BBox {
         min_out = Vec2(FLT_MAX);
         max_out = Vec2(-FLT_MAX);
         auto c = corners();
+        Mat4::transform(transform, c.data(), c.data(), c.size());
         bool partially_behind = false, all_behind = true;
-        for(auto& v : c) {
-            Vec3 p = transform * v;
+        for(auto& p : c) {
             if(p.z < 0) {
                 partially_behind = true;
             } else {
@@ -0,0 +1,121 @@
+
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/// Binary min-heap over integer handles in [0, n). Each handle is in the heap
+/// at most once; its position is tracked so that its key can be changed or
+/// it can be removed in O(log n).
+template<typename Key>
+class Indexed_Heap {
+public:
+	static constexpr size_t none = (size_t)-1;
+
+	explicit Indexed_Heap(size_t n = 0) : pos(n, none) {}
+
+	void resize(size_t n) {
+		pos.resize(n, none);
+	}
+	void clear() {
+		for(const Entry& e : heap) pos[e.id] = none;
+		heap.clear();
+	}
+
+	bool empty() const {
+		return heap.empty();
+	}
+	size_t size() const {
+		return heap.size();
+	}
+	bool contains(size_t id) const {
+		return pos[id] != none;
+	}
+
+	size_t top() const {
+		return heap.front().id;
+	}
+	Key top_key() const {
+		return heap.front().key;
+	}
+	Key key(size_t id) const {
+		return heap[pos[id]].key;
+	}
+
+	/// Insert the handle, or move it if already present
+	void set(size_t id, Key key) {
+		size_t i = pos[id];
+		if(i == none) {
+			i = heap.size();
+			heap.push_back({key, id});
+			pos[id] = i;
+			up(i);
+		} else if(key < heap[i].key) {
+			heap[i].key = key;
+			up(i);
+		} else {
+			heap[i].key = key;
+			down(i);
+		}
+	}
+
+	void erase(size_t id) {
+		size_t i = pos[id];
+		if(i == none) return;
+		move(heap.size() - 1, i);
+		heap.pop_back();
+		pos[id] = none;
+		if(i < heap.size()) {
+			up(i);
+			down(i);
+		}
+	}
+
+	size_t pop() {
+		size_t id = top();
+		erase(id);
+		return id;
+	}
+
+private:
+	struct Entry {
+		Key key;
+		size_t id;
+	};
+
+	void move(size_t from, size_t to) {
+		heap[to] = heap[from];
+		pos[heap[to].id] = to;
+	}
+
+	void up(size_t i) {
+		Entry e = heap[i];
+		while(i > 0) {
+			size_t parent = (i - 1) / 2;
+			if(!(e.key < heap[parent].key)) break;
+			move(parent, i);
+			i = parent;
+		}
+		heap[i] = e;
+		pos[e.id] = i;
+	}
+
+	void down(size_t i) {
+		Entry e = heap[i];
+		size_t n = heap.size();
+		while(true) {
+			size_t child = 2 * i + 1;
+			if(child >= n) break;
+			if(child + 1 < n && heap[child + 1].key < heap[child].key) child++;
+			if(!(heap[child].key < e.key)) break;
+			move(child, i);
+			i = child;
+		}
+		heap[i] = e;
+		pos[e.id] = i;
+	}
+
+	std::vector<Entry> heap;
+	std::vector<size_t> pos;
+};
@@ -1,39 +1,283 @@
-
 #pragma once
 
-#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#ifdef __GNUC__
+#define LOG_PRINTF(f, a) __attribute__((format(printf, f, a)))
+#else
+#define LOG_PRINTF(f, a)
+#endif
+
+// Messages are formatted on the calling thread into a per-thread ring buffer
+// and written to stdout by a background flusher thread. Producers never take
+// a lock unless their ring is full; the flusher merges rings by sequence
+// number, so messages from one thread always come out in order.
+
+namespace Log {
+
+/// Strip directories from a path; usable in constant expressions
+constexpr const char* file_name(const char* path) {
+	const char* name = path;
+	for(const char* p = path; *p; p++) {
+		if(*p == '/' || *p == '\\') name = p + 1;
+	}
+	return name;
+}
+
+/// Single-producer single-consumer message queue owned by one thread
+struct Ring {
+
+	struct Slot {
+		uint64_t seq;
+		uint32_t len;
+		uint32_t more;
+		char text[112];
+	};
+	static constexpr size_t slots = 512;
+
+	alignas(64) std::atomic<size_t> head = 0;
+	alignas(64) std::atomic<size_t> tail = 0;
+	std::atomic<bool> retired = false;
+	Slot slot[slots];
+};
+
+class Logger {
+public:
+	static Logger& get() {
+		// Intentionally leaked so that logging stays valid during static destruction
+		static Logger* logger = new Logger;
+		static Shutdown shutdown{logger};
+		return *logger;
+	}
+
+	void write(const char* msg, size_t len) {
+
+		if(stopped.load(std::memory_order_acquire)) {
+			std::lock_guard<std::mutex> guard(lock);
+			drain();
+			emit(msg, len);
+			return;
+		}
+
+		Ring& ring = local();
+		size_t chunk = sizeof(Ring::Slot::text);
+		size_t count = std::max(len, size_t(1));
+		count = (count + chunk - 1) / chunk;
+
+		// Huge messages (e.g. shader sources) bypass the ring
+		if(count > Ring::slots / 2) {
+			std::lock_guard<std::mutex> guard(lock);
+			drain();
+			emit(msg, len);
+			return;
+		}
+
+		size_t head = ring.head.load(std::memory_order_relaxed);
+		while(head + count - ring.tail.load(std::memory_order_acquire) > Ring::slots) {
+			if(stopped.load(std::memory_order_acquire)) {
+				flush();
+			} else {
+				wake.notify_one();
+				std::this_thread::yield();
+			}
+		}
+
+		uint64_t s = seq.fetch_add(1, std::memory_order_relaxed);
+		for(size_t i = 0; i < count; i++) {
+			Ring::Slot& slot = ring.slot[(head + i) % Ring::slots];
+			size_t n = std::min(chunk, len - std::min(len, i * chunk));
+			std::memcpy(slot.text, msg + i * chunk, n);
+			slot.seq = s;
+			slot.len = (uint32_t)n;
+			slot.more = i + 1 < count;
+		}
+		ring.head.store(head + count, std::memory_order_release);
+	}
 
-inline std::mutex printf_lock;
+	/// Write out everything logged so far
+	void flush() {
+		std::lock_guard<std::mutex> guard(lock);
+		drain();
+	}
 
-inline void log(std::string fmt, ...) {
-	std::lock_guard<std::mutex> lock(printf_lock);
+private:
+	Logger() = default;
+
+	/// Stops the flusher at exit; later messages are written synchronously
+	struct Shutdown {
+		Logger* logger;
+		~Shutdown() {
+			{
+				std::lock_guard<std::mutex> guard(logger->lock);
+				logger->stopped.store(true, std::memory_order_release);
+			}
+			logger->wake.notify_one();
+			if(logger->flusher.joinable()) logger->flusher.join();
+			logger->flush();
+		}
+	};
+
+	struct Owner {
+		Ring* ring = nullptr;
+		~Owner() {
+			if(ring) ring->retired.store(true, std::memory_order_release);
+		}
+	};
+
+	Ring& local() {
+		thread_local Owner owner;
+		if(!owner.ring) {
+			auto ring = std::make_unique<Ring>();
+			owner.ring = ring.get();
+			std::lock_guard<std::mutex> guard(lock);
+			rings.push_back(std::move(ring));
+			if(!flusher.joinable()) flusher = std::thread([this]() { run(); });
+		}
+		return *owner.ring;
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> guard(lock);
+		while(!stopped.load(std::memory_order_acquire)) {
+			drain();
+			wake.wait_for(guard, std::chrono::milliseconds(10));
+		}
+	}
+
+	/// Consume all complete messages from every ring; requires lock
+	void drain() {
+
+		for(auto& ring : rings) {
+			size_t tail = ring->tail.load(std::memory_order_relaxed);
+			size_t head = ring->head.load(std::memory_order_acquire);
+			size_t start = tail;
+			for(; tail != head; tail++) {
+				const Ring::Slot& slot = ring->slot[tail % Ring::slots];
+				if(tail == start) pending.push_back({slot.seq, std::string()});
+				pending.back().second.append(slot.text, slot.len);
+				if(!slot.more) start = tail + 1;
+			}
+			ring->tail.store(tail, std::memory_order_release);
+		}
+
+		rings.erase(std::remove_if(rings.begin(), rings.end(),
+		                           [](const std::unique_ptr<Ring>& r) {
+			                           return r->retired.load(std::memory_order_acquire) &&
+			                                  r->head.load() == r->tail.load();
+		                           }),
+		            rings.end());
+
+		if(pending.empty()) return;
+		std::sort(pending.begin(), pending.end(),
+		          [](const auto& a, const auto& b) { return a.first < b.first; });
+		for(auto& msg : pending) fwrite(msg.second.data(), 1, msg.second.size(), stdout);
+		fflush(stdout);
+		pending.clear();
+	}
+
+	void emit(const char* msg, size_t len) {
+		fwrite(msg, 1, len, stdout);
+		fflush(stdout);
+	}
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::thread flusher;
+	std::atomic<bool> stopped = false;
+	std::atomic<uint64_t> seq = 0;
+	std::vector<std::unique_ptr<Ring>> rings;
+	std::vector<std::pair<uint64_t, std::string>> pending;
+};
+
+/// Per-call-site limit of `burst` messages per second
+class Limit {
+public:
+	/// Returns whether to log, and how many messages were dropped since the last one
+	bool allow(unsigned int& dropped, unsigned int burst = 5) {
+		int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+		                  std::chrono::steady_clock::now().time_since_epoch())
+		                  .count();
+		int64_t start = window.load(std::memory_order_relaxed);
+		if(now - start >= 1000 && window.compare_exchange_strong(start, now)) {
+			count.store(0, std::memory_order_relaxed);
+		}
+		if(count.fetch_add(1, std::memory_order_relaxed) < burst) {
+			dropped = suppressed.exchange(0, std::memory_order_relaxed);
+			return true;
+		}
+		suppressed.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+private:
+	std::atomic<int64_t> window = INT64_MIN / 2;
+	std::atomic<unsigned int> count = 0, suppressed = 0;
+};
+
+inline void flush() {
+	Logger::get().flush();
+}
+
+} // namespace Log
+
+inline void log(const char* fmt, ...) LOG_PRINTF(1, 2);
+inline void log(const char* fmt, ...) {
+
+	char buf[512];
 	va_list args;
 	va_start(args, fmt);
-	vprintf(fmt.c_str(), args);
+	int len = vsnprintf(buf, sizeof(buf), fmt, args);
 	va_end(args);
-	fflush(stdout);
-}
+	if(len < 0) return;
 
-inline std::string last_file(std::string path) {
-	size_t p = path.find_last_of("\\/") + 1;
-	return path.substr(p, path.size() - p);
+	if((size_t)len < sizeof(buf)) {
+		Log::Logger::get().write(buf, len);
+	} else {
+		std::string big(len + 1, '\0');
+		va_start(args, fmt);
+		vsnprintf(&big[0], big.size(), fmt, args);
+		va_end(args);
+		Log::Logger::get().write(big.data(), len);
+	}
 }
 
+/// File name of the current source file, trimmed at compile time
+#define LOG_FILE ([]() { constexpr const char* f = Log::file_name(__FILE__); return f; }())
+
 /// Log informational message
 #define info(fmt, ...) (void)( \
-	log("%s:%u [info] " fmt "\n", last_file(__FILE__).c_str(), __LINE__, ##__VA_ARGS__))
+	log("%s:%u [info] " fmt "\n", LOG_FILE, __LINE__, ##__VA_ARGS__))
 
 /// Log warning (red)
 #define warn(fmt, ...) (void)( \
-	log("\033[0;31m%s:%u [warn] " fmt "\033[0m\n", last_file(__FILE__).c_str(), __LINE__, ##__VA_ARGS__))
+	log("\033[0;31m%s:%u [warn] " fmt "\033[0m\n", LOG_FILE, __LINE__, ##__VA_ARGS__))
+
+/// Log warning at most a few times per second from this call site
+#define warn_limited(fmt, ...) (void)([&]() { \
+	static Log::Limit limit; \
+	unsigned int dropped = 0; \
+	if(!limit.allow(dropped)) return; \
+	if(dropped) log("\033[0;31m%s:%u [warn] (%u similar warnings suppressed)\033[0m\n", LOG_FILE, __LINE__, dropped); \
+	warn(fmt, ##__VA_ARGS__); \
+}())
 
 /// Log fatal error and exit program
 #define die(fmt, ...) (void)( \
-	log("\033[0;31m%s:%u [fatal] " fmt "\033[0m\n", last_file(__FILE__).c_str(), __LINE__, ##__VA_ARGS__), \
-	std::exit(__LINE__));
+	log("\033[0;31m%s:%u [fatal] " fmt "\033[0m\n", LOG_FILE, __LINE__, ##__VA_ARGS__), \
+	Log::flush(), std::exit(__LINE__));
 
 #ifdef _MSC_VER
 #define DEBUG_BREAK __debugbreak()
@@ -46,9 +290,9 @@ inline std::string last_file(std::string path) {
 #endif
 
 #define fail_assert(msg, file, line) (void)( \
-	log("\033[1;31m%s:%u [ASSERT] " msg "\033[0m\n", file, line), DEBUG_BREAK, std::exit(__LINE__), 0)
+	log("\033[1;31m%s:%u [ASSERT] " msg "\033[0m\n", file, line), Log::flush(), DEBUG_BREAK, std::exit(__LINE__), 0)
 
 #undef assert
 #define assert(expr) (void)( \
 		(!!(expr)) || \
-		(fail_assert(#expr, last_file(__FILE__).c_str(), __LINE__), 0))
+		(fail_assert(#expr, LOG_FILE, __LINE__), 0))
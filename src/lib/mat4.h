@@ -6,6 +6,7 @@
 #include <ostream>
 
 #include "log.h"
+#include "simd.h"
 #include "vec4.h"
 
 struct Mat4 {
@@ -42,8 +43,23 @@ struct Mat4 {
 	/// an object is closer if is depth is greater.
 	static Mat4 project(float fov, float ar, float n);
 
-	Mat4() {
-		*this = I;
+	/// Return translate(t) * r * scale(s) without the intermediate products
+	static Mat4 trs(Vec3 t, Mat4 r, Vec3 s);
+
+	/// Batch kernels; out may alias in.
+	/// Transform n points as operator*(Vec3), including the projection
+	static void transform(Mat4 m, const Vec3* in, Vec3* out, size_t n);
+	/// Transform n directions as rotate(Vec3)
+	static void transform_dirs(Mat4 m, const Vec3* in, Vec3* out, size_t n);
+	/// Set out[i] = m * in[i] for n matrices
+	static void mul(Mat4 m, const Mat4* in, Mat4* out, size_t n);
+	/// Set out[i] = trs(t[i], r[i], s[i]) for n poses
+	static void trs(const Vec3* t, const Mat4* r, const Vec3* s, Mat4* out, size_t n);
+
+	Mat4() : cols{{1.0f, 0.0f, 0.0f, 0.0f}, 
+				  {0.0f, 1.0f, 0.0f, 0.0f},
+				  {0.0f, 0.0f, 1.0f, 0.0f},
+				  {0.0f, 0.0f, 0.0f, 1.0f}} {
 	}
 	Mat4(Vec4 x, Vec4 y, Vec4 z, Vec4 w) {
 		cols[0] = x;
@@ -103,6 +119,14 @@ struct Mat4 {
 		return *this;
 	}
 
+	bool operator==(Mat4 m) const {
+		return cols[0] == m.cols[0] && cols[1] == m.cols[1] &&
+			   cols[2] == m.cols[2] && cols[3] == m.cols[3];
+	}
+	bool operator!=(Mat4 m) const {
+		return !operator==(m);
+	}
+
 
 	Mat4 operator+(Mat4 m) const {
 		Mat4 r;
@@ -149,19 +173,32 @@ struct Mat4 {
 	Mat4 operator*(Mat4 m) const {
 		Mat4 ret;
 		for(int i = 0; i < 4; i++) {
-			for(int j = 0; j < 4; j++) {
-				ret[i][j] = 0.0f;
-				for(int k = 0; k < 4; k++) {
-					ret[i][j] += m[i][k] * cols[k][j];
-				}
-			}
+			ret.cols[i] = operator*(m.cols[i]);
 		}
 		return ret;
 	}
 
 	Vec4 operator*(Vec4 v) const {
+#if defined(SIMD_SSE)
+		__m128 r = _mm_mul_ps(_mm_loadu_ps(cols[0].data), _mm_set1_ps(v.x));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(cols[1].data), _mm_set1_ps(v.y)));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(cols[2].data), _mm_set1_ps(v.z)));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(cols[3].data), _mm_set1_ps(v.w)));
+		Vec4 ret;
+		_mm_storeu_ps(ret.data, r);
+		return ret;
+#elif defined(SIMD_NEON)
+		float32x4_t r = vmulq_n_f32(vld1q_f32(cols[0].data), v.x);
+		r = vmlaq_n_f32(r, vld1q_f32(cols[1].data), v.y);
+		r = vmlaq_n_f32(r, vld1q_f32(cols[2].data), v.z);
+		r = vmlaq_n_f32(r, vld1q_f32(cols[3].data), v.w);
+		Vec4 ret;
+		vst1q_f32(ret.data, r);
+		return ret;
+#else
 		return v[0] * cols[0] + v[1] * cols[1] +
 			   v[2] * cols[2] + v[3] * cols[3];
+#endif
 	}
 
 	/// Expands v to Vec4(v, 1.0), multiplies, and projects back to 3D
@@ -272,7 +309,73 @@ inline Mat4 Mat4::transpose(Mat4 m) {
 	return r;
 }
 
+#ifdef SIMD_SSE
+namespace Mat4_SSE {
+	// 2x2 matrices packed as (m00, m01, m10, m11)
+	/// a * b
+	inline __m128 mul2(__m128 a, __m128 b) {
+		return _mm_add_ps(_mm_mul_ps(a, SIMD_SWIZZLE(b, 0, 3, 0, 3)),
+						  _mm_mul_ps(SIMD_SWIZZLE(a, 1, 0, 3, 2), SIMD_SWIZZLE(b, 2, 1, 2, 1)));
+	}
+	/// adj(a) * b
+	inline __m128 adj_mul2(__m128 a, __m128 b) {
+		return _mm_sub_ps(_mm_mul_ps(SIMD_SWIZZLE(a, 3, 3, 0, 0), b),
+						  _mm_mul_ps(SIMD_SWIZZLE(a, 1, 1, 2, 2), SIMD_SWIZZLE(b, 2, 3, 0, 1)));
+	}
+	/// a * adj(b)
+	inline __m128 mul_adj2(__m128 a, __m128 b) {
+		return _mm_sub_ps(_mm_mul_ps(a, SIMD_SWIZZLE(b, 3, 0, 3, 0)),
+						  _mm_mul_ps(SIMD_SWIZZLE(a, 1, 0, 3, 2), SIMD_SWIZZLE(b, 2, 1, 2, 1)));
+	}
+}
+#endif
+
 inline Mat4 Mat4::inverse(Mat4 m) {
+#ifdef SIMD_SSE
+	// Block inverse over 2x2 sub-matrices. Treating columns as rows inverts
+	// the transpose, whose rows are our columns, so no extra shuffles are needed.
+	using namespace Mat4_SSE;
+	__m128 c0 = _mm_loadu_ps(m.cols[0].data), c1 = _mm_loadu_ps(m.cols[1].data);
+	__m128 c2 = _mm_loadu_ps(m.cols[2].data), c3 = _mm_loadu_ps(m.cols[3].data);
+
+	__m128 A = _mm_movelh_ps(c0, c1), B = _mm_movehl_ps(c1, c0);
+	__m128 C = _mm_movelh_ps(c2, c3), D = _mm_movehl_ps(c3, c2);
+
+	// (|A|, |B|, |C|, |D|)
+	__m128 det_sub = _mm_sub_ps(
+		_mm_mul_ps(SIMD_SHUFFLE(c0, c2, 0, 2, 0, 2), SIMD_SHUFFLE(c1, c3, 1, 3, 1, 3)),
+		_mm_mul_ps(SIMD_SHUFFLE(c0, c2, 1, 3, 1, 3), SIMD_SHUFFLE(c1, c3, 0, 2, 0, 2)));
+	__m128 det_A = SIMD_SWIZZLE(det_sub, 0, 0, 0, 0);
+	__m128 det_B = SIMD_SWIZZLE(det_sub, 1, 1, 1, 1);
+	__m128 det_C = SIMD_SWIZZLE(det_sub, 2, 2, 2, 2);
+	__m128 det_D = SIMD_SWIZZLE(det_sub, 3, 3, 3, 3);
+
+	__m128 D_C = adj_mul2(D, C);
+	__m128 A_B = adj_mul2(A, B);
+	__m128 X = _mm_sub_ps(_mm_mul_ps(det_D, A), mul2(B, D_C));
+	__m128 W = _mm_sub_ps(_mm_mul_ps(det_A, D), mul2(C, A_B));
+	__m128 Y = _mm_sub_ps(_mm_mul_ps(det_B, C), mul_adj2(D, A_B));
+	__m128 Z = _mm_sub_ps(_mm_mul_ps(det_C, B), mul_adj2(A, D_C));
+
+	// |M| = |A||D| + |B||C| - tr(adj(A)B adj(D)C)
+	__m128 tr = _mm_mul_ps(A_B, SIMD_SWIZZLE(D_C, 0, 2, 1, 3));
+	tr = _mm_add_ps(tr, SIMD_SWIZZLE(tr, 2, 3, 0, 1));
+	tr = _mm_add_ps(tr, SIMD_SWIZZLE(tr, 1, 0, 3, 2));
+	__m128 det = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(det_A, det_D), _mm_mul_ps(det_B, det_C)), tr);
+
+	__m128 inv_det = _mm_div_ps(_mm_setr_ps(1.0f, -1.0f, -1.0f, 1.0f), det);
+	X = _mm_mul_ps(X, inv_det);
+	Y = _mm_mul_ps(Y, inv_det);
+	Z = _mm_mul_ps(Z, inv_det);
+	W = _mm_mul_ps(W, inv_det);
+
+	Mat4 r;
+	_mm_storeu_ps(r.cols[0].data, SIMD_SHUFFLE(X, Y, 3, 1, 3, 1));
+	_mm_storeu_ps(r.cols[1].data, SIMD_SHUFFLE(X, Y, 2, 0, 2, 0));
+	_mm_storeu_ps(r.cols[2].data, SIMD_SHUFFLE(Z, W, 3, 1, 3, 1));
+	_mm_storeu_ps(r.cols[3].data, SIMD_SHUFFLE(Z, W, 2, 0, 2, 0));
+	return r;
+#else
 	Mat4 r;
 	r[0][0] = m[1][2]*m[2][3]*m[3][1] - m[1][3]*m[2][2]*m[3][1] + m[1][3]*m[2][1]*m[3][2] - m[1][1]*m[2][3]*m[3][2] - m[1][2]*m[2][1]*m[3][3] + m[1][1]*m[2][2]*m[3][3];
 	r[0][1] = m[0][3]*m[2][2]*m[3][1] - m[0][2]*m[2][3]*m[3][1] - m[0][3]*m[2][1]*m[3][2] + m[0][1]*m[2][3]*m[3][2] + m[0][2]*m[2][1]*m[3][3] - m[0][1]*m[2][2]*m[3][3];
@@ -292,6 +395,84 @@ inline Mat4 Mat4::inverse(Mat4 m) {
 	r[3][3] = m[0][1]*m[1][2]*m[2][0] - m[0][2]*m[1][1]*m[2][0] + m[0][2]*m[1][0]*m[2][1] - m[0][0]*m[1][2]*m[2][1] - m[0][1]*m[1][0]*m[2][2] + m[0][0]*m[1][1]*m[2][2];
 	r /= m.det();
 	return r;
+#endif
+}
+
+inline Mat4 Mat4::trs(Vec3 t, Mat4 r, Vec3 s) {
+	return {r.cols[0] * s.x, r.cols[1] * s.y, r.cols[2] * s.z, Vec4(t, 1.0f)};
+}
+
+inline void Mat4::trs(const Vec3* t, const Mat4* r, const Vec3* s, Mat4* out, size_t n) {
+	for(size_t i = 0; i < n; i++) {
+		out[i] = trs(t[i], r[i], s[i]);
+	}
+}
+
+inline void Mat4::mul(Mat4 m, const Mat4* in, Mat4* out, size_t n) {
+	for(size_t i = 0; i < n; i++) {
+		out[i] = m * in[i];
+	}
+}
+
+inline void Mat4::transform(Mat4 m, const Vec3* in, Vec3* out, size_t n) {
+#if defined(SIMD_SSE)
+	__m128 c0 = _mm_loadu_ps(m.cols[0].data), c1 = _mm_loadu_ps(m.cols[1].data);
+	__m128 c2 = _mm_loadu_ps(m.cols[2].data), c3 = _mm_loadu_ps(m.cols[3].data);
+	for(size_t i = 0; i < n; i++) {
+		__m128 r = _mm_add_ps(c3, _mm_mul_ps(c0, _mm_set1_ps(in[i].x)));
+		r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps(in[i].y)));
+		r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(in[i].z)));
+		r = _mm_div_ps(r, SIMD_SWIZZLE(r, 3, 3, 3, 3));
+		float v[4];
+		_mm_storeu_ps(v, r);
+		out[i] = Vec3(v[0], v[1], v[2]);
+	}
+#elif defined(SIMD_NEON)
+	float32x4_t c0 = vld1q_f32(m.cols[0].data), c1 = vld1q_f32(m.cols[1].data);
+	float32x4_t c2 = vld1q_f32(m.cols[2].data), c3 = vld1q_f32(m.cols[3].data);
+	for(size_t i = 0; i < n; i++) {
+		float32x4_t r = vmlaq_n_f32(c3, c0, in[i].x);
+		r = vmlaq_n_f32(r, c1, in[i].y);
+		r = vmlaq_n_f32(r, c2, in[i].z);
+		float v[4];
+		vst1q_f32(v, r);
+		out[i] = Vec3(v[0] / v[3], v[1] / v[3], v[2] / v[3]);
+	}
+#else
+	for(size_t i = 0; i < n; i++) {
+		out[i] = m * in[i];
+	}
+#endif
+}
+
+inline void Mat4::transform_dirs(Mat4 m, const Vec3* in, Vec3* out, size_t n) {
+#if defined(SIMD_SSE)
+	__m128 c0 = _mm_loadu_ps(m.cols[0].data), c1 = _mm_loadu_ps(m.cols[1].data);
+	__m128 c2 = _mm_loadu_ps(m.cols[2].data);
+	for(size_t i = 0; i < n; i++) {
+		__m128 r = _mm_mul_ps(c0, _mm_set1_ps(in[i].x));
+		r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps(in[i].y)));
+		r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(in[i].z)));
+		float v[4];
+		_mm_storeu_ps(v, r);
+		out[i] = Vec3(v[0], v[1], v[2]);
+	}
+#elif defined(SIMD_NEON)
+	float32x4_t c0 = vld1q_f32(m.cols[0].data), c1 = vld1q_f32(m.cols[1].data);
+	float32x4_t c2 = vld1q_f32(m.cols[2].data);
+	for(size_t i = 0; i < n; i++) {
+		float32x4_t r = vmulq_n_f32(c0, in[i].x);
+		r = vmlaq_n_f32(r, c1, in[i].y);
+		r = vmlaq_n_f32(r, c2, in[i].z);
+		float v[4];
+		vst1q_f32(v, r);
+		out[i] = Vec3(v[0], v[1], v[2]);
+	}
+#else
+	for(size_t i = 0; i < n; i++) {
+		out[i] = m.rotate(in[i]);
+	}
+#endif
 }
 
 inline Mat4 Mat4::axes(Vec3 x, Vec3 y, Vec3 z) {
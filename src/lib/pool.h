@@ -0,0 +1,157 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+/// Fixed-size slot allocator. Slots are carved from chunks that double in size
+/// and freed slots are recycled through an intrusive free list. Chunks are only
+/// returned to the heap by reset() or destruction, which release everything at
+/// once. Not thread-safe: each pool belongs to one container.
+class Pool {
+public:
+	struct Stats {
+		size_t live = 0, free = 0, chunks = 0, bytes = 0;
+	};
+
+	Pool() = default;
+	Pool(const Pool&) = delete;
+	Pool& operator=(const Pool&) = delete;
+	~Pool() {
+		release();
+	}
+
+	/// Allocate a slot of the given size. The first call fixes the slot size;
+	/// other sizes are forwarded to the global heap.
+	void* alloc(size_t size) {
+		if(slot_size == 0) slot_size = std::max(round(size), sizeof(Free));
+		if(round(size) > slot_size) return ::operator new(size);
+
+		if(free_list) {
+			Free* slot = free_list;
+			free_list = slot->next;
+			n_free--;
+			n_live++;
+			return slot;
+		}
+		if(next == end) grow();
+		void* slot = next;
+		next += slot_size;
+		n_live++;
+		return slot;
+	}
+
+	void dealloc(void* ptr, size_t size) {
+		if(round(size) > slot_size) {
+			::operator delete(ptr);
+			return;
+		}
+		Free* slot = (Free*)ptr;
+		slot->next = free_list;
+		free_list = slot;
+		n_live--;
+		n_free++;
+	}
+
+	/// Drop all slots in O(chunks). The largest chunk is kept for reuse.
+	/// Anything still pointing into the pool is invalidated.
+	void reset() {
+		if(chunks.empty()) return;
+		Chunk keep = chunks.back();
+		chunks.pop_back();
+		release();
+		chunks.push_back(keep);
+		next = keep.data;
+		end = keep.data + keep.size;
+	}
+
+	Stats stats() const {
+		Stats s;
+		s.live = n_live;
+		s.free = n_free + (slot_size ? (end - next) / slot_size : 0);
+		s.chunks = chunks.size();
+		for(const Chunk& c : chunks) s.bytes += c.size;
+		return s;
+	}
+
+private:
+	struct Free {
+		Free* next;
+	};
+	struct Chunk {
+		char* data;
+		size_t size;
+	};
+
+	static size_t round(size_t size) {
+		const size_t align = alignof(std::max_align_t);
+		return (size + align - 1) / align * align;
+	}
+
+	void grow() {
+		size_t slots = chunks.empty() ? 64 : 2 * chunks.back().size / slot_size;
+		Chunk c = {(char*)::operator new(slots * slot_size), slots * slot_size};
+		chunks.push_back(c);
+		next = c.data;
+		end = c.data + c.size;
+	}
+
+	void release() {
+		for(Chunk& c : chunks) ::operator delete(c.data);
+		chunks.clear();
+		free_list = nullptr;
+		next = end = nullptr;
+		n_live = n_free = 0;
+	}
+
+	size_t slot_size = 0;
+	size_t n_live = 0, n_free = 0;
+	Free* free_list = nullptr;
+	char *next = nullptr, *end = nullptr;
+	std::vector<Chunk> chunks;
+};
+
+/// Standard allocator drawing single elements from a Pool, which must outlive
+/// every container using it. Copies and rebinds share the pool. Containers must
+/// allocate one node type at a time, as std::list does.
+template<typename T>
+class Pool_Allocator {
+public:
+	using value_type = T;
+	using propagate_on_container_copy_assignment = std::true_type;
+	using propagate_on_container_move_assignment = std::true_type;
+	using propagate_on_container_swap = std::true_type;
+	using is_always_equal = std::false_type;
+
+	explicit Pool_Allocator(Pool& pool) : _pool(&pool) {}
+	template<typename U>
+	Pool_Allocator(const Pool_Allocator<U>& src) : _pool(src._pool) {}
+
+	T* allocate(size_t n) {
+		if(n == 1) return (T*)_pool->alloc(sizeof(T));
+		return (T*)::operator new(n * sizeof(T));
+	}
+	void deallocate(T* ptr, size_t n) {
+		if(n == 1) _pool->dealloc(ptr, sizeof(T));
+		else ::operator delete(ptr);
+	}
+
+	Pool& pool() const {
+		return *_pool;
+	}
+
+	template<typename U>
+	bool operator==(const Pool_Allocator<U>& other) const {
+		return _pool == other._pool;
+	}
+	template<typename U>
+	bool operator!=(const Pool_Allocator<U>& other) const {
+		return _pool != other._pool;
+	}
+
+private:
+	Pool* _pool;
+	template<typename U> friend class Pool_Allocator;
+};
@@ -0,0 +1,182 @@
+
+#pragma once
+
+// Selects a 4-wide float instruction set at compile time. Exactly one of
+// SIMD_SSE or SIMD_NEON is defined when intrinsics are available; otherwise
+// callers fall back to scalar code. Only baseline SSE/SSE2 is assumed on x86,
+// so no extra compiler flags are needed.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define SIMD_SSE
+	#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define SIMD_NEON
+	#include <arm_neon.h>
+#endif
+
+#ifdef SIMD_SSE
+	#define SIMD_SHUFFLE(a, b, x, y, z, w) _mm_shuffle_ps(a, b, (x) | ((y) << 2) | ((z) << 4) | ((w) << 6))
+	#define SIMD_SWIZZLE(v, x, y, z, w) SIMD_SHUFFLE(v, v, x, y, z, w)
+#endif
+
+#include <cstdint>
+#include <cstring>
+
+/// Four floats operated on together. Comparisons return lane masks with all
+/// bits set or clear, for use with select, & and |, and lane_mask.
+/// Lets kernels be written once for SSE, NEON, and scalar code.
+struct Float4 {
+
+	Float4() {}
+	explicit Float4(float s) {
+#if defined(SIMD_SSE)
+		v = _mm_set1_ps(s);
+#elif defined(SIMD_NEON)
+		v = vdupq_n_f32(s);
+#else
+		for(int i = 0; i < 4; i++) v[i] = s;
+#endif
+	}
+
+	static Float4 load(const float* p) {
+		Float4 r;
+#if defined(SIMD_SSE)
+		r.v = _mm_loadu_ps(p);
+#elif defined(SIMD_NEON)
+		r.v = vld1q_f32(p);
+#else
+		for(int i = 0; i < 4; i++) r.v[i] = p[i];
+#endif
+		return r;
+	}
+	void store(float* p) const {
+#if defined(SIMD_SSE)
+		_mm_storeu_ps(p, v);
+#elif defined(SIMD_NEON)
+		vst1q_f32(p, v);
+#else
+		for(int i = 0; i < 4; i++) p[i] = v[i];
+#endif
+	}
+
+#if defined(SIMD_SSE)
+	__m128 v;
+#elif defined(SIMD_NEON)
+	float32x4_t v;
+#else
+	float v[4];
+#endif
+};
+
+#if defined(SIMD_SSE)
+
+inline Float4 simd_wrap(__m128 v) {
+	Float4 r;
+	r.v = v;
+	return r;
+}
+inline Float4 operator+(Float4 a, Float4 b) {return simd_wrap(_mm_add_ps(a.v, b.v));}
+inline Float4 operator-(Float4 a, Float4 b) {return simd_wrap(_mm_sub_ps(a.v, b.v));}
+inline Float4 operator*(Float4 a, Float4 b) {return simd_wrap(_mm_mul_ps(a.v, b.v));}
+inline Float4 operator/(Float4 a, Float4 b) {return simd_wrap(_mm_div_ps(a.v, b.v));}
+inline Float4 min(Float4 a, Float4 b) {return simd_wrap(_mm_min_ps(a.v, b.v));}
+inline Float4 max(Float4 a, Float4 b) {return simd_wrap(_mm_max_ps(a.v, b.v));}
+inline Float4 operator<(Float4 a, Float4 b) {return simd_wrap(_mm_cmplt_ps(a.v, b.v));}
+inline Float4 operator<=(Float4 a, Float4 b) {return simd_wrap(_mm_cmple_ps(a.v, b.v));}
+inline Float4 operator>(Float4 a, Float4 b) {return simd_wrap(_mm_cmpgt_ps(a.v, b.v));}
+inline Float4 operator>=(Float4 a, Float4 b) {return simd_wrap(_mm_cmpge_ps(a.v, b.v));}
+inline Float4 operator&(Float4 a, Float4 b) {return simd_wrap(_mm_and_ps(a.v, b.v));}
+inline Float4 operator|(Float4 a, Float4 b) {return simd_wrap(_mm_or_ps(a.v, b.v));}
+/// Lanes of a where the mask is set, otherwise lanes of b
+inline Float4 select(Float4 mask, Float4 a, Float4 b) {
+	return simd_wrap(_mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)));
+}
+/// One bit per lane of a comparison result, lane 0 lowest
+inline int lane_mask(Float4 m) {return _mm_movemask_ps(m.v);}
+
+#elif defined(SIMD_NEON)
+
+inline Float4 simd_wrap(float32x4_t v) {
+	Float4 r;
+	r.v = v;
+	return r;
+}
+inline Float4 simd_wrap(uint32x4_t m) {return simd_wrap(vreinterpretq_f32_u32(m));}
+inline uint32x4_t simd_bits(Float4 a) {return vreinterpretq_u32_f32(a.v);}
+inline Float4 operator+(Float4 a, Float4 b) {return simd_wrap(vaddq_f32(a.v, b.v));}
+inline Float4 operator-(Float4 a, Float4 b) {return simd_wrap(vsubq_f32(a.v, b.v));}
+inline Float4 operator*(Float4 a, Float4 b) {return simd_wrap(vmulq_f32(a.v, b.v));}
+inline Float4 operator/(Float4 a, Float4 b) {
+#if defined(__aarch64__)
+	return simd_wrap(vdivq_f32(a.v, b.v));
+#else
+	float32x4_t r = vrecpeq_f32(b.v);
+	r = vmulq_f32(r, vrecpsq_f32(b.v, r));
+	r = vmulq_f32(r, vrecpsq_f32(b.v, r));
+	return simd_wrap(vmulq_f32(a.v, r));
+#endif
+}
+inline Float4 min(Float4 a, Float4 b) {return simd_wrap(vminq_f32(a.v, b.v));}
+inline Float4 max(Float4 a, Float4 b) {return simd_wrap(vmaxq_f32(a.v, b.v));}
+inline Float4 operator<(Float4 a, Float4 b) {return simd_wrap(vcltq_f32(a.v, b.v));}
+inline Float4 operator<=(Float4 a, Float4 b) {return simd_wrap(vcleq_f32(a.v, b.v));}
+inline Float4 operator>(Float4 a, Float4 b) {return simd_wrap(vcgtq_f32(a.v, b.v));}
+inline Float4 operator>=(Float4 a, Float4 b) {return simd_wrap(vcgeq_f32(a.v, b.v));}
+inline Float4 operator&(Float4 a, Float4 b) {return simd_wrap(vandq_u32(simd_bits(a), simd_bits(b)));}
+inline Float4 operator|(Float4 a, Float4 b) {return simd_wrap(vorrq_u32(simd_bits(a), simd_bits(b)));}
+inline Float4 select(Float4 mask, Float4 a, Float4 b) {return simd_wrap(vbslq_f32(simd_bits(mask), a.v, b.v));}
+inline int lane_mask(Float4 m) {
+	static const uint32_t weights[4] = {1, 2, 4, 8};
+	uint32x4_t bits = vandq_u32(simd_bits(m), vld1q_u32(weights));
+	uint32x2_t sum = vpadd_u32(vget_low_u32(bits), vget_high_u32(bits));
+	sum = vpadd_u32(sum, sum);
+	return (int)vget_lane_u32(sum, 0);
+}
+
+#else
+
+template<typename F>
+inline Float4 simd_lanes(Float4 a, Float4 b, F f) {
+	Float4 r;
+	for(int i = 0; i < 4; i++) r.v[i] = f(a.v[i], b.v[i]);
+	return r;
+}
+inline float simd_mask(bool b) {
+	uint32_t bits = b ? 0xffffffffu : 0u;
+	float f;
+	std::memcpy(&f, &bits, 4);
+	return f;
+}
+inline uint32_t simd_bits(float f) {
+	uint32_t bits;
+	std::memcpy(&bits, &f, 4);
+	return bits;
+}
+inline Float4 operator+(Float4 a, Float4 b) {return simd_lanes(a, b, [](float x, float y) {return x + y;});}
+inline Float4 operator-(Float4 a, Float4 b) {return simd_lanes(a, b, [](float x, float y) {return x - y;});}
+inline Float4 operator*(Float4 a, Float4 b) {return simd_lanes(a, b, [](float x, float y) {return x * y;});}
+inline Float4 operator/(Float4 a, Float4 b) {return simd_lanes(a, b, [](float x, float y) {return x / y;});}
+inline Float4 min(Float4 a, Float4 b) {return simd_lanes(a, b, [](float x, float y) {return y < x ? y : x;});}
+inline Float4 max(Float4 a, Float4 b) {return simd_lanes(a, b, [](float x, float y) {return y > x ? y : x;});}
+inline Float4 operator<(Float4 a, Float4 b) {return simd_lanes(a, b, [](float x, float y) {return simd_mask(x < y);});}
+inline Float4 operator<=(Float4 a, Float4 b) {return simd_lanes(a, b, [](float x, float y) {return simd_mask(x <= y);});}
+inline Float4 operator>(Float4 a, Float4 b) {return simd_lanes(a, b, [](float x, float y) {return simd_mask(x > y);});}
+inline Float4 operator>=(Float4 a, Float4 b) {return simd_lanes(a, b, [](float x, float y) {return simd_mask(x >= y);});}
+inline Float4 operator&(Float4 a, Float4 b) {
+	return simd_lanes(a, b, [](float x, float y) {return simd_mask((simd_bits(x) & simd_bits(y)) != 0);});
+}
+inline Float4 operator|(Float4 a, Float4 b) {
+	return simd_lanes(a, b, [](float x, float y) {return simd_mask((simd_bits(x) | simd_bits(y)) != 0);});
+}
+inline Float4 select(Float4 mask, Float4 a, Float4 b) {
+	Float4 r;
+	for(int i = 0; i < 4; i++) r.v[i] = simd_bits(mask.v[i]) ? a.v[i] : b.v[i];
+	return r;
+}
+inline int lane_mask(Float4 m) {
+	int bits = 0;
+	for(int i = 0; i < 4; i++) bits |= (simd_bits(m.v[i]) ? 1 : 0) << i;
+	return bits;
+}
+
+#endif
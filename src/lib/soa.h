@@ -0,0 +1,227 @@
+
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "simd.h"
+#include "vec3.h"
+#include "mat4.h"
+#include "bbox.h"
+
+/// Vec3 data stored as separate x, y, and z arrays, so whole-array passes
+/// can process four elements per instruction.
+struct SoA_Vec3 {
+
+	SoA_Vec3() {}
+	explicit SoA_Vec3(size_t n) {
+		resize(n);
+	}
+	/// Gather the given Vec3 member out of an array of structs
+	template<typename T>
+	SoA_Vec3(const std::vector<T>& src, Vec3 T::* member) {
+		reserve(src.size());
+		for(const T& t : src) push_back(t.*member);
+	}
+
+	size_t size() const {
+		return x.size();
+	}
+	void resize(size_t n) {
+		x.resize(n);
+		y.resize(n);
+		z.resize(n);
+	}
+	void reserve(size_t n) {
+		x.reserve(n);
+		y.reserve(n);
+		z.reserve(n);
+	}
+	void clear() {
+		x.clear();
+		y.clear();
+		z.clear();
+	}
+	void push_back(Vec3 v) {
+		x.push_back(v.x);
+		y.push_back(v.y);
+		z.push_back(v.z);
+	}
+
+	Vec3 get(size_t i) const {
+		return Vec3(x[i], y[i], z[i]);
+	}
+	void set(size_t i, Vec3 v) {
+		x[i] = v.x;
+		y[i] = v.y;
+		z[i] = v.z;
+	}
+
+	std::vector<float> x, y, z;
+};
+
+namespace SoA {
+
+/// Bounding box of all points
+inline BBox bounds(const SoA_Vec3& v) {
+
+	BBox box;
+	size_t n = v.size(), i = 0;
+	if(n == 0) return box;
+
+#ifdef SIMD_SSE
+	if(n >= 4) {
+		__m128 min_x = _mm_loadu_ps(&v.x[0]), max_x = min_x;
+		__m128 min_y = _mm_loadu_ps(&v.y[0]), max_y = min_y;
+		__m128 min_z = _mm_loadu_ps(&v.z[0]), max_z = min_z;
+		for(i = 4; i + 4 <= n; i += 4) {
+			__m128 px = _mm_loadu_ps(&v.x[i]), py = _mm_loadu_ps(&v.y[i]), pz = _mm_loadu_ps(&v.z[i]);
+			min_x = _mm_min_ps(min_x, px); max_x = _mm_max_ps(max_x, px);
+			min_y = _mm_min_ps(min_y, py); max_y = _mm_max_ps(max_y, py);
+			min_z = _mm_min_ps(min_z, pz); max_z = _mm_max_ps(max_z, pz);
+		}
+		float lo[3][4], hi[3][4];
+		_mm_storeu_ps(lo[0], min_x); _mm_storeu_ps(hi[0], max_x);
+		_mm_storeu_ps(lo[1], min_y); _mm_storeu_ps(hi[1], max_y);
+		_mm_storeu_ps(lo[2], min_z); _mm_storeu_ps(hi[2], max_z);
+		for(int j = 0; j < 4; j++) {
+			box.enclose(Vec3(lo[0][j], lo[1][j], lo[2][j]));
+			box.enclose(Vec3(hi[0][j], hi[1][j], hi[2][j]));
+		}
+	}
+#endif
+
+	for(; i < n; i++) {
+		box.enclose(v.get(i));
+	}
+	return box;
+}
+
+/// True if no component is infinite or NaN
+inline bool finite(const SoA_Vec3& v) {
+
+	size_t n = v.size(), i = 0;
+
+#ifdef SIMD_SSE
+	// x - x is zero exactly when x is finite
+	__m128 zero = _mm_setzero_ps();
+	__m128 ok = _mm_cmpeq_ps(zero, zero);
+	for(; i + 4 <= n; i += 4) {
+		__m128 px = _mm_loadu_ps(&v.x[i]), py = _mm_loadu_ps(&v.y[i]), pz = _mm_loadu_ps(&v.z[i]);
+		ok = _mm_and_ps(ok, _mm_cmpeq_ps(_mm_sub_ps(px, px), zero));
+		ok = _mm_and_ps(ok, _mm_cmpeq_ps(_mm_sub_ps(py, py), zero));
+		ok = _mm_and_ps(ok, _mm_cmpeq_ps(_mm_sub_ps(pz, pz), zero));
+	}
+	if(_mm_movemask_ps(ok) != 0xf) return false;
+#endif
+
+	for(; i < n; i++) {
+		if(!std::isfinite(v.x[i]) || !std::isfinite(v.y[i]) || !std::isfinite(v.z[i]))
+			return false;
+	}
+	return true;
+}
+
+/// Mean of all points. Sums in float blocks and accumulates blocks in double,
+/// so large meshes don't lose precision.
+inline Vec3 centroid(const SoA_Vec3& v) {
+
+	size_t n = v.size();
+	if(n == 0) return Vec3();
+
+	const size_t block = 1024;
+	double sx = 0.0, sy = 0.0, sz = 0.0;
+	for(size_t b = 0; b < n; b += block) {
+		size_t end = std::min(n, b + block);
+		float bx = 0.0f, by = 0.0f, bz = 0.0f;
+		for(size_t i = b; i < end; i++) {
+			bx += v.x[i];
+			by += v.y[i];
+			bz += v.z[i];
+		}
+		sx += bx;
+		sy += by;
+		sz += bz;
+	}
+	return Vec3((float)(sx / n), (float)(sy / n), (float)(sz / n));
+}
+
+/// Apply the affine part of m to every element, in place. Points get the
+/// translation; directions (points = false) only the linear part.
+inline void transform(Mat4 m, SoA_Vec3& v, bool points = true) {
+
+	size_t n = v.size(), i = 0;
+	Vec3 t = points ? m[3].xyz() : Vec3();
+
+#ifdef SIMD_SSE
+	__m128 m00 = _mm_set1_ps(m[0][0]), m01 = _mm_set1_ps(m[0][1]), m02 = _mm_set1_ps(m[0][2]);
+	__m128 m10 = _mm_set1_ps(m[1][0]), m11 = _mm_set1_ps(m[1][1]), m12 = _mm_set1_ps(m[1][2]);
+	__m128 m20 = _mm_set1_ps(m[2][0]), m21 = _mm_set1_ps(m[2][1]), m22 = _mm_set1_ps(m[2][2]);
+	__m128 tx = _mm_set1_ps(t.x), ty = _mm_set1_ps(t.y), tz = _mm_set1_ps(t.z);
+	for(; i + 4 <= n; i += 4) {
+		__m128 px = _mm_loadu_ps(&v.x[i]), py = _mm_loadu_ps(&v.y[i]), pz = _mm_loadu_ps(&v.z[i]);
+		__m128 rx = _mm_add_ps(tx, _mm_add_ps(_mm_mul_ps(m00, px), _mm_add_ps(_mm_mul_ps(m10, py), _mm_mul_ps(m20, pz))));
+		__m128 ry = _mm_add_ps(ty, _mm_add_ps(_mm_mul_ps(m01, px), _mm_add_ps(_mm_mul_ps(m11, py), _mm_mul_ps(m21, pz))));
+		__m128 rz = _mm_add_ps(tz, _mm_add_ps(_mm_mul_ps(m02, px), _mm_add_ps(_mm_mul_ps(m12, py), _mm_mul_ps(m22, pz))));
+		_mm_storeu_ps(&v.x[i], rx);
+		_mm_storeu_ps(&v.y[i], ry);
+		_mm_storeu_ps(&v.z[i], rz);
+	}
+#endif
+
+	for(; i < n; i++) {
+		v.set(i, m.rotate(v.get(i)) + t);
+	}
+}
+
+/// Normalize every element in place; zero vectors are left as-is
+inline void normalize(SoA_Vec3& v) {
+
+	size_t n = v.size(), i = 0;
+
+#ifdef SIMD_SSE
+	__m128 zero = _mm_setzero_ps();
+	for(; i + 4 <= n; i += 4) {
+		__m128 px = _mm_loadu_ps(&v.x[i]), py = _mm_loadu_ps(&v.y[i]), pz = _mm_loadu_ps(&v.z[i]);
+		__m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(px, px), _mm_add_ps(_mm_mul_ps(py, py), _mm_mul_ps(pz, pz))));
+		__m128 nonzero = _mm_cmpneq_ps(len, zero);
+		__m128 inv = _mm_and_ps(nonzero, _mm_div_ps(_mm_set1_ps(1.0f), len));
+		inv = _mm_or_ps(inv, _mm_andnot_ps(nonzero, _mm_set1_ps(1.0f)));
+		_mm_storeu_ps(&v.x[i], _mm_mul_ps(px, inv));
+		_mm_storeu_ps(&v.y[i], _mm_mul_ps(py, inv));
+		_mm_storeu_ps(&v.z[i], _mm_mul_ps(pz, inv));
+	}
+#endif
+
+	for(; i < n; i++) {
+		Vec3 p = v.get(i);
+		float len = p.norm();
+		if(len != 0.0f) v.set(i, p / len);
+	}
+}
+
+/// Compute unit vertex normals as the area-weighted sum of adjacent triangle
+/// normals. Triangles are index triples into pos.
+template<typename Index>
+inline void vertex_normals(const SoA_Vec3& pos, const std::vector<Index>& tris, SoA_Vec3& norm) {
+
+	norm.clear();
+	norm.resize(pos.size());
+
+	// The unnormalized cross product is already weighted by twice the area
+	for(size_t t = 0; t + 2 < tris.size(); t += 3) {
+		Index a = tris[t], b = tris[t + 1], c = tris[t + 2];
+		float ux = pos.x[b] - pos.x[a], uy = pos.y[b] - pos.y[a], uz = pos.z[b] - pos.z[a];
+		float vx = pos.x[c] - pos.x[a], vy = pos.y[c] - pos.y[a], vz = pos.z[c] - pos.z[a];
+		float nx = uy * vz - uz * vy, ny = uz * vx - ux * vz, nz = ux * vy - uy * vx;
+		for(Index i : {a, b, c}) {
+			norm.x[i] += nx;
+			norm.y[i] += ny;
+			norm.z[i] += nz;
+		}
+	}
+	normalize(norm);
+}
+
+}
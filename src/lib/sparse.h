@@ -0,0 +1,185 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/// Compressed sparse row matrix of doubles. Columns within each row are
+/// sorted and unique.
+struct Sparse_Matrix {
+
+	struct Entry {
+		uint32_t row, col;
+		double val;
+	};
+
+	uint32_t rows = 0, cols = 0;
+	/// Per row, plus one: offset of its first entry
+	std::vector<uint32_t> row_start;
+	std::vector<uint32_t> col;
+	std::vector<double> val;
+
+	/// Assemble from unordered entries, summing duplicates
+	static Sparse_Matrix from_entries(uint32_t rows, uint32_t cols, std::vector<Entry>& entries) {
+
+		std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+			return a.row != b.row ? a.row < b.row : a.col < b.col;
+		});
+
+		Sparse_Matrix m;
+		m.rows = rows;
+		m.cols = cols;
+		m.row_start.assign(rows + 1, 0);
+		for(size_t i = 0; i < entries.size(); i++) {
+			const Entry& e = entries[i];
+			if(i > 0 && entries[i - 1].row == e.row && entries[i - 1].col == e.col) {
+				m.val.back() += e.val;
+				continue;
+			}
+			m.col.push_back(e.col);
+			m.val.push_back(e.val);
+			m.row_start[e.row + 1]++;
+		}
+		for(uint32_t r = 0; r < rows; r++) m.row_start[r + 1] += m.row_start[r];
+		return m;
+	}
+
+	size_t nonzeros() const {
+		return val.size();
+	}
+
+	/// y = Ax
+	void multiply(const std::vector<double>& x, std::vector<double>& y) const {
+		y.resize(rows);
+		for(uint32_t r = 0; r < rows; r++) {
+			double s = 0.0;
+			for(uint32_t i = row_start[r]; i < row_start[r + 1]; i++) s += val[i] * x[col[i]];
+			y[r] = s;
+		}
+	}
+};
+
+/// Incomplete Cholesky factorization with zero fill-in, IC(0): the lower
+/// triangle L has the sparsity of the lower triangle of A, and LL^T
+/// approximates A. Used as a preconditioner for conjugate gradients.
+class Incomplete_Cholesky {
+public:
+	/// Factor a symmetric positive definite matrix. If a pivot breaks down,
+	/// the diagonal is scaled up and the factorization retried.
+	bool factor(const Sparse_Matrix& A) {
+
+		n = A.rows;
+		row_start.assign(n + 1, 0);
+		col.clear();
+		for(uint32_t r = 0; r < n; r++) {
+			for(uint32_t i = A.row_start[r]; i < A.row_start[r + 1] && A.col[i] <= r; i++) {
+				col.push_back(A.col[i]);
+			}
+			row_start[r + 1] = (uint32_t)col.size();
+			if(row_start[r + 1] == row_start[r] || col.back() != r) return false;
+		}
+
+		for(double shift = 0.0; shift < 1.0; shift = shift == 0.0 ? 1e-3 : shift * 4.0) {
+			if(try_factor(A, shift)) return true;
+		}
+		return false;
+	}
+
+	/// Solve LL^T z = r
+	void solve(const std::vector<double>& r, std::vector<double>& z) const {
+
+		z = r;
+		for(uint32_t i = 0; i < n; i++) {
+			double s = z[i];
+			uint32_t d = row_start[i + 1] - 1;
+			for(uint32_t k = row_start[i]; k < d; k++) s -= val[k] * z[col[k]];
+			z[i] = s / val[d];
+		}
+		for(uint32_t i = n; i-- > 0;) {
+			uint32_t d = row_start[i + 1] - 1;
+			z[i] /= val[d];
+			for(uint32_t k = row_start[i]; k < d; k++) z[col[k]] -= val[k] * z[i];
+		}
+	}
+
+private:
+	bool try_factor(const Sparse_Matrix& A, double shift) {
+
+		val.assign(col.size(), 0.0);
+		for(uint32_t i = 0; i < n; i++) {
+			uint32_t a = A.row_start[i];
+			for(uint32_t k = row_start[i]; k < row_start[i + 1]; k++, a++) {
+				uint32_t j = col[k];
+				double s = A.val[a];
+				if(j == i) s *= 1.0 + shift;
+
+				// Sparse dot product of rows i and j over columns below j
+				uint32_t p = row_start[i], q = row_start[j];
+				while(p < k && q < row_start[j + 1] - 1) {
+					if(col[p] < col[q]) p++;
+					else if(col[q] < col[p]) q++;
+					else s -= val[p++] * val[q++];
+				}
+
+				if(j == i) {
+					if(!(s > 0.0)) return false;
+					val[k] = std::sqrt(s);
+				} else {
+					val[k] = s / val[row_start[j + 1] - 1];
+				}
+			}
+		}
+		return true;
+	}
+
+	uint32_t n = 0;
+	std::vector<uint32_t> row_start, col;
+	std::vector<double> val;
+};
+
+/// Preconditioned conjugate gradients for symmetric positive definite A,
+/// starting from the given x. Stops once the residual norm falls below tol
+/// times the norm of b. Returns the number of iterations taken.
+inline size_t conjugate_gradient(const Sparse_Matrix& A, const Incomplete_Cholesky& P,
+                                 const std::vector<double>& b, std::vector<double>& x, double tol,
+                                 size_t max_iters) {
+
+	size_t n = A.rows;
+	std::vector<double> r(n), z, p, Ap;
+	auto dot = [n](const std::vector<double>& u, const std::vector<double>& v) {
+		double s = 0.0;
+		for(size_t i = 0; i < n; i++) s += u[i] * v[i];
+		return s;
+	};
+
+	A.multiply(x, Ap);
+	for(size_t i = 0; i < n; i++) r[i] = b[i] - Ap[i];
+	double limit = tol * tol * dot(b, b);
+	if(dot(r, r) <= limit) return 0;
+
+	P.solve(r, z);
+	p = z;
+	double rz = dot(r, z);
+
+	size_t iter = 0;
+	while(iter < max_iters) {
+		iter++;
+		A.multiply(p, Ap);
+		double pAp = dot(p, Ap);
+		if(!(pAp > 0.0)) break;
+		double alpha = rz / pAp;
+		for(size_t i = 0; i < n; i++) {
+			x[i] += alpha * p[i];
+			r[i] -= alpha * Ap[i];
+		}
+		if(dot(r, r) <= limit) break;
+		P.solve(r, z);
+		double rz_next = dot(r, z);
+		double beta = rz_next / rz;
+		rz = rz_next;
+		for(size_t i = 0; i < n; i++) p[i] = z[i] + beta * p[i];
+	}
+	return iter;
+}
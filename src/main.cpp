@@ -1,9 +1,145 @@
 
+#include <cstdlib>
 #include <iostream>
+#include <string>
 #include "platform/platform.h"
+#include "rays/tracer.h"
+#include "lib/log.h"
+
+/// Positive integer argument, at most max; false if malformed
+static bool parse_count(const char* arg, uint32_t max, uint32_t& out) {
+	char* end = nullptr;
+	unsigned long long n = std::strtoull(arg, &end, 10);
+	if(arg[0] == '-' || end == arg || *end || n == 0 || n > max) return false;
+	out = (uint32_t)n;
+	return true;
+}
+
+/// Point the tracer's camera at the whole scene from above one corner.
+/// Returns false if there is nothing to look at.
+static bool frame_scene(Path_Tracer& tracer, uint32_t w, uint32_t h) {
+	BBox box = tracer.bbox();
+	if(box.empty()) return false;
+	Vec3 center = box.center();
+	float radius = std::max(0.5f * (box.max - box.min).norm(), 1e-3f);
+	Vec3 eye = center + Vec3(1.0f, 1.0f, 1.0f).unit() * (2.0f * radius);
+	Mat4 view = Mat4::look_at(eye, center, Vec3(0.0f, 1.0f, 0.0f));
+	tracer.view(w, h, eye, Mat4::inverse(Mat4::project(60.0f, (float)w / h, 0.01f * radius) * view));
+	return true;
+}
+
+/// s4d --render scene output.ppm [width height samples]
+/// Path traces the scene from a camera framing it without opening a window.
+static int render_headless(int argc, char** argv) {
+
+	uint32_t w = 640, h = 360, samples = 64;
+	if(argc < 4 || argc > 7 || (argc > 4 && !parse_count(argv[4], 1 << 15, w)) ||
+	   (argc > 5 && !parse_count(argv[5], 1 << 15, h)) || (argc > 6 && !parse_count(argv[6], 1 << 20, samples))) {
+		std::cout << "Usage: " << argv[0] << " --render scene output.ppm [width height samples]" << std::endl;
+		return 1;
+	}
+	std::string in = argv[2], out = argv[3];
+
+	Jobs jobs;
+	std::vector<Scene::Imported> meshes;
+	std::string err = Scene::import(in, {}, jobs, meshes);
+	if(!err.empty()) {
+		std::cout << err << std::endl;
+		return 1;
+	}
+
+	Path_Tracer tracer;
+	std::vector<GL::Mesh::Vert> verts;
+	std::vector<GL::Mesh::Index> idxs;
+	std::vector<GLuint> face_ids;
+	for(size_t i = 0; i < meshes.size(); i++) {
+		Scene::Imported& mesh = meshes[i];
+		if(!mesh.err.empty()) {
+			warn("Skipping mesh %s: %s", mesh.name.c_str(), mesh.err.c_str());
+			continue;
+		}
+		mesh.mesh.to_triangles(verts, idxs, face_ids, false);
+		tracer.set_mesh(i, verts, idxs, false, jobs);
+		tracer.set_instance(i, i, mesh.pose.transform());
+	}
+	tracer.commit();
+
+	if(!frame_scene(tracer, w, h)) {
+		std::cout << in << ": no triangles" << std::endl;
+		return 1;
+	}
+	for(uint32_t i = 0; i < samples; i++) tracer.sample(jobs);
+
+	const Path_Tracer::Stats& s = tracer.stats();
+	info("%zu triangles, %zu nodes, built in %.1f ms", s.tris, s.nodes, s.build_ms);
+	info("%zu samples in %.2f s on %u threads: %.2f samples/s, %.2f Mrays/s", s.samples, s.seconds,
+	     jobs.threads(), s.samples_per_second(), s.rays_per_second() / 1e6);
+
+	err = tracer.write(out, jobs);
+	if(!err.empty()) {
+		std::cout << err << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+/// s4d --bench scene...
+/// Reports ray throughput for each scene, viewed from a camera framing it.
+static int bench_headless(int argc, char** argv) {
+
+	if(argc < 3) {
+		std::cout << "Usage: " << argv[0] << " --bench scene..." << std::endl;
+		return 1;
+	}
+	const uint32_t w = 1024, h = 1024;
+
+	Jobs jobs;
+	for(int i = 2; i < argc; i++) {
+
+		std::vector<Scene::Imported> meshes;
+		std::string err = Scene::import(argv[i], {}, jobs, meshes);
+		if(!err.empty()) {
+			std::cout << argv[i] << ": " << err << std::endl;
+			continue;
+		}
+
+		Path_Tracer tracer;
+		std::vector<GL::Mesh::Vert> verts;
+		std::vector<GL::Mesh::Index> idxs;
+		std::vector<GLuint> face_ids;
+		for(size_t j = 0; j < meshes.size(); j++) {
+			if(!meshes[j].err.empty()) continue;
+			meshes[j].mesh.to_triangles(verts, idxs, face_ids, false);
+			tracer.set_mesh(j, verts, idxs, false, jobs);
+			tracer.set_instance(j, j, meshes[j].pose.transform());
+		}
+		tracer.commit();
+
+		if(!frame_scene(tracer, w, h)) {
+			std::cout << argv[i] << ": no triangles" << std::endl;
+			continue;
+		}
+
+		Path_Tracer::Bench b = tracer.benchmark(jobs);
+		const Path_Tracer::Stats& s = tracer.stats();
+		std::cout << argv[i] << ": " << s.tris << " triangles, " << s.nodes << " nodes, built in " << s.build_ms
+		          << " ms" << std::endl;
+		std::cout << "  primary " << b.primary << " Mrays/s, packets " << b.primary_packets << " Mrays/s" << std::endl;
+		std::cout << "  secondary " << b.secondary << " Mrays/s, packets " << b.secondary_packets << " Mrays/s"
+		          << std::endl;
+	}
+	return 0;
+}
 
 int main(int argc, char** argv) {
 
+	if(argc > 1 && std::string(argv[1]) == "--render") {
+		return render_headless(argc, argv);
+	}
+	if(argc > 1 && std::string(argv[1]) == "--bench") {
+		return bench_headless(argc, argv);
+	}
+
 	Platform eng;
 	App app(eng);
 	eng.loop(app);
@@ -2,7 +2,9 @@
 #include "gl.h"
 #include "../lib/log.h"
 
+#include <algorithm>
 #include <fstream>
+#include <cstring>
 
 namespace GL {
 
@@ -10,17 +12,26 @@ static void setup_debug_proc();
 static void check_leaked_handles();
 static bool is_nvidia = false;
 static bool is_gl45 = false;
+static bool has_buffer_storage = false;
+static bool has_indirect = false;
+static GLuint empty_vao = 0;
+static uint64_t mesh_versions = 0;
 
 void setup() {
 	std::string ver = version();
 	is_nvidia = ver.find("NVIDIA") != std::string::npos;
 	is_gl45 = ver.find("4.5") != std::string::npos;
+	has_buffer_storage = GLAD_GL_VERSION_4_4 && glBufferStorage;
+	has_indirect = GLAD_GL_VERSION_4_3 && glMultiDrawElementsIndirect;
 
 	setup_debug_proc();
 	Effects::init();
+	glGenVertexArrays(1, &empty_vao);
 }
 
 void shutdown() {
+	glDeleteVertexArrays(1, &empty_vao);
+	empty_vao = 0;
 	Effects::destroy();
 	check_leaked_handles();
 }
@@ -41,6 +52,8 @@ std::string renderer() {
 }
 
 void global_params() {
+	// Base triangle for flat-shaded face ids; only clustered draws change it
+	glVertexAttribI4ui(8, 0, 0, 0, 0);
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
 	glPolygonOffset(1.0f, 1.0f);
@@ -87,6 +100,20 @@ void disable(Opt opt) {
 	}
 }
 
+void draw_points(GLuint count, float size) {
+	glPointSize(size);
+	glBindVertexArray(empty_vao);
+	glDrawArrays(GL_POINTS, 0, count);
+	glBindVertexArray(0);
+	glPointSize(1.0f);
+}
+
+void draw_lines(GLuint count) {
+	glBindVertexArray(empty_vao);
+	glDrawArrays(GL_LINES, 0, 2 * count);
+	glBindVertexArray(0);
+}
+
 void viewport(Vec2 dim) {
 	glViewport(0, 0, (GLsizei)dim.x, (GLsizei)dim.y);
 }
@@ -95,19 +122,25 @@ Mesh::Mesh() {
 	create();
 }
 
-Mesh::Mesh(std::vector<Vert>&& vertices, std::vector<Index>&& indices) {
+Mesh::Mesh(std::vector<Vert>&& vertices, std::vector<Index>&& indices, std::vector<GLuint>&& face_ids) {
 	create();
-	update(std::move(vertices), std::move(indices));
+	update(std::move(vertices), std::move(indices), std::move(face_ids));
 }
 
 Mesh::Mesh(Mesh&& src) {
 	vao = src.vao; src.vao = 0;
 	ebo = src.ebo; src.ebo = 0;
 	vbo = src.vbo; src.vbo = 0;
+	id_buf = std::move(src.id_buf);
 	n_elem = src.n_elem; src.n_elem = 0;
+	_version = src._version; src._version = 0;
 	_bbox = src._bbox; src._bbox.reset();
 	_verts = std::move(src._verts);
 	_idxs = std::move(src._idxs);
+	_face_ids = std::move(src._face_ids);
+	_clusters = std::move(src._clusters);
+	cmd_buf = src.cmd_buf; src.cmd_buf = 0;
+	base_buf = src.base_buf; src.base_buf = 0;
 }
 
 void Mesh::operator=(Mesh&& src) {
@@ -115,10 +148,16 @@ void Mesh::operator=(Mesh&& src) {
 	vao = src.vao; src.vao = 0;
 	vbo = src.vbo; src.vbo = 0;
 	ebo = src.ebo; src.ebo = 0;
+	id_buf = std::move(src.id_buf);
 	n_elem = src.n_elem; src.n_elem = 0;
+	_version = src._version; src._version = 0;
 	_bbox = src._bbox; src._bbox.reset();
 	_verts = std::move(src._verts);
 	_idxs = std::move(src._idxs);
+	_face_ids = std::move(src._face_ids);
+	_clusters = std::move(src._clusters);
+	cmd_buf = src.cmd_buf; src.cmd_buf = 0;
+	base_buf = src.base_buf; src.base_buf = 0;
 }
 
 Mesh::~Mesh() {
@@ -126,6 +165,7 @@ Mesh::~Mesh() {
 }
 
 void Mesh::create() {
+	_version = ++mesh_versions;
 	glGenVertexArrays(1, &vao);
 	glGenBuffers(1, &vbo);
 	glGenBuffers(1, &ebo);
@@ -150,14 +190,19 @@ void Mesh::create() {
 void Mesh::destroy() {
 	glDeleteBuffers(1, &ebo);
 	glDeleteBuffers(1, &vbo);
+	glDeleteBuffers(1, &cmd_buf);
+	glDeleteBuffers(1, &base_buf);
 	glDeleteVertexArrays(1, &vao);
-	ebo = vao = vbo = 0;
+	ebo = vao = vbo = cmd_buf = base_buf = 0;
+	id_buf = Tex_Buffer();
 }
 
-void Mesh::update(std::vector<Vert>&& vertices, std::vector<Index>&& indices) {
+void Mesh::update(std::vector<Vert>&& vertices, std::vector<Index>&& indices, std::vector<GLuint>&& face_ids) {
 
 	_verts = std::move(vertices);
 	_idxs = std::move(indices);
+	_face_ids = std::move(face_ids);
+	assert(_face_ids.empty() || _face_ids.size() == _idxs.size() / 3);
 	
 	glBindVertexArray(vao);
 
@@ -169,11 +214,109 @@ void Mesh::update(std::vector<Vert>&& vertices, std::vector<Index>&& indices) {
 
 	glBindVertexArray(0);
 
-	_bbox.reset();
-	for(auto& v : _verts) {
-		_bbox.enclose(v.pos);
+	if(!_face_ids.empty()) {
+		id_buf.update(GL_R32UI, _face_ids.data(), sizeof(GLuint) * _face_ids.size());
 	}
+
+	_bbox.reset();
+	for(const Vert& v : _verts) _bbox.enclose(v.pos);
 	n_elem = _idxs.size();
+	_version = ++mesh_versions;
+
+	_clusters.clear();
+	if(tris() >= cluster_min_tris) build_clusters();
+}
+
+/// Call f(first, count) for each run of consecutive values in a sorted list
+template<typename F>
+static void for_runs(const std::vector<GLuint>& list, F&& f) {
+	for(size_t i = 0; i < list.size();) {
+		size_t j = i + 1;
+		while(j < list.size() && list[j] == list[j - 1] + 1) j++;
+		f(list[i], (GLuint)(j - i));
+		i = j;
+	}
+}
+
+void Mesh::patch(const std::vector<Vert>& vertices, const std::vector<Index>& indices,
+                 const std::vector<GLuint>& dirty_verts, const std::vector<GLuint>& dirty_tris) {
+
+	assert(vertices.size() == _verts.size() && indices.size() == _idxs.size());
+
+	glBindVertexArray(vao);
+
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	for_runs(dirty_verts, [&](GLuint first, GLuint count) {
+		std::copy_n(vertices.begin() + first, count, _verts.begin() + first);
+		glBufferSubData(GL_ARRAY_BUFFER, sizeof(Vert) * first, sizeof(Vert) * count, &_verts[first]);
+	});
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+	for_runs(dirty_tris, [&](GLuint first, GLuint count) {
+		std::copy_n(indices.begin() + 3 * first, 3 * count, _idxs.begin() + 3 * first);
+		glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, sizeof(Index) * 3 * first, sizeof(Index) * 3 * count, &_idxs[3 * first]);
+	});
+
+	glBindVertexArray(0);
+
+	for(GLuint v : dirty_verts) _bbox.enclose(_verts[v].pos);
+	for(GLuint t : dirty_tris) {
+		if(t / cluster_tris >= _clusters.size()) continue;
+		Cluster& c = _clusters[t / cluster_tris];
+		for(GLuint i = 0; i < 3; i++) {
+			c.radius = std::max(c.radius, (_verts[_idxs[3 * t + i]].pos - c.center).norm());
+		}
+		c.spread = PI;
+	}
+	_version = ++mesh_versions;
+}
+
+void Mesh::build_clusters() {
+
+	// Triangle order is usually already spatially coherent (see Optimize::mesh),
+	// so clusters are fixed-size runs of the index buffer
+	GLuint n_tris = tris();
+	_clusters.reserve((n_tris + cluster_tris - 1) / cluster_tris);
+
+	for(GLuint first = 0; first < n_tris; first += cluster_tris) {
+
+		Cluster c;
+		c.first = first;
+		c.count = std::min(cluster_tris, n_tris - first);
+
+		BBox box;
+		Vec3 axis;
+		for(GLuint t = first; t < first + c.count; t++) {
+			Vec3 a = _verts[_idxs[3 * t]].pos, b = _verts[_idxs[3 * t + 1]].pos, d = _verts[_idxs[3 * t + 2]].pos;
+			box.enclose(a);
+			box.enclose(b);
+			box.enclose(d);
+			axis += cross(b - a, d - a);
+		}
+
+		c.center = 0.5f * (box.min + box.max);
+		c.radius = 0.0f;
+		c.axis = axis.norm() > 0.0f ? axis.unit() : Vec3();
+		float min_dot = c.axis.norm() > 0.0f ? 1.0f : -1.0f;
+
+		for(GLuint t = first; t < first + c.count; t++) {
+			Vec3 a = _verts[_idxs[3 * t]].pos, b = _verts[_idxs[3 * t + 1]].pos, d = _verts[_idxs[3 * t + 2]].pos;
+			c.radius = std::max(c.radius, std::max((a - c.center).norm(), std::max((b - c.center).norm(), (d - c.center).norm())));
+			Vec3 n = cross(b - a, d - a);
+			if(n.norm() > 0.0f) min_dot = std::min(min_dot, dot(n.unit(), c.axis));
+		}
+		c.spread = min_dot > 0.0f ? std::acos(std::min(min_dot, 1.0f)) : PI;
+
+		_clusters.push_back(c);
+	}
+}
+
+uint64_t Mesh::version() const {
+	return _version;
+}
+
+const std::vector<Mesh::Cluster>& Mesh::clusters() const {
+	return _clusters;
 }
 
 GLuint Mesh::tris() const {
@@ -188,16 +331,354 @@ const std::vector<Mesh::Index>& Mesh::indices() const {
 	return _idxs;
 }
 
+const std::vector<GLuint>& Mesh::face_ids() const {
+	return _face_ids;
+}
+
+bool Mesh::flat() const {
+	return !_face_ids.empty();
+}
+
 BBox Mesh::bbox() const {
 	return _bbox;
 }
 
 void Mesh::render() const {
+	if(flat()) id_buf.bind(1);
 	glBindVertexArray(vao);
 	glDrawElements(GL_TRIANGLES, n_elem, GL_UNSIGNED_INT, nullptr);
 	glBindVertexArray(0);
 }
 
+GLuint Mesh::render_culled(const Mat4& mvp, bool backface, Vec3 eye) const {
+
+	if(_clusters.empty()) {
+		render();
+		return tris();
+	}
+
+	// Object-space frustum planes, normalized so sphere distances are exact
+	Vec4 planes[6];
+	for(int i = 0; i < 3; i++) {
+		Vec4 row(mvp[0][i], mvp[1][i], mvp[2][i], mvp[3][i]);
+		Vec4 w(mvp[0][3], mvp[1][3], mvp[2][3], mvp[3][3]);
+		planes[2 * i] = w + row;
+		planes[2 * i + 1] = w - row;
+	}
+	for(Vec4& p : planes) {
+		float l = p.xyz().norm();
+		if(l > 0.0f) p /= l;
+	}
+
+	auto visible = [&](const Cluster& c) {
+		for(const Vec4& p : planes) {
+			if(dot(p.xyz(), c.center) + p.w < -c.radius) return false;
+		}
+		if(backface && c.spread < PI / 2.0f) {
+			// Back-facing if every normal in the cone points away from every
+			// point in the sphere, as seen from the eye
+			Vec3 v = c.center - eye;
+			float d = v.norm();
+			if(d <= c.radius) return true;
+			float angle = c.spread + std::asin(c.radius / d);
+			if(angle < PI / 2.0f && dot(v / d, c.axis) > std::sin(angle)) return false;
+		}
+		return true;
+	};
+
+	// Merge adjacent visible clusters into runs of (first triangle, count)
+	cmds.clear();
+	GLuint drawn = 0;
+	for(const Cluster& c : _clusters) {
+		if(!visible(c)) continue;
+		drawn += c.count;
+		size_t n = cmds.size();
+		if(n && cmds[n - 2] + cmds[n - 1] == c.first) cmds[n - 1] += c.count;
+		else cmds.insert(cmds.end(), {c.first, c.count});
+	}
+	if(cmds.empty()) return 0;
+
+	if(flat()) id_buf.bind(1);
+	glBindVertexArray(vao);
+
+	size_t runs = cmds.size() / 2;
+	if(has_indirect) {
+
+		// DrawElementsIndirectCommand: count, instances, first index, base vertex, base instance
+		bases.clear();
+		indirect.resize(5 * runs);
+		for(size_t i = 0; i < runs; i++) {
+			indirect[5 * i] = 3 * cmds[2 * i + 1];
+			indirect[5 * i + 1] = 1;
+			indirect[5 * i + 2] = 3 * cmds[2 * i];
+			indirect[5 * i + 3] = 0;
+			indirect[5 * i + 4] = (GLuint)i;
+			bases.push_back(cmds[2 * i]);
+		}
+
+		if(!cmd_buf) {
+			glGenBuffers(1, &cmd_buf);
+			glGenBuffers(1, &base_buf);
+		}
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, cmd_buf);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(GLuint) * indirect.size(), indirect.data(), GL_STREAM_DRAW);
+
+		glBindBuffer(GL_ARRAY_BUFFER, base_buf);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(GLuint) * bases.size(), bases.data(), GL_STREAM_DRAW);
+		glVertexAttribIPointer(8, 1, GL_UNSIGNED_INT, sizeof(GLuint), (GLvoid*)0);
+		glVertexAttribDivisor(8, 1);
+		glEnableVertexAttribArray(8);
+
+		glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr, (GLsizei)runs, 0);
+
+		glDisableVertexAttribArray(8);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	} else {
+		for(size_t i = 0; i < runs; i++) {
+			glVertexAttribI4ui(8, cmds[2 * i], 0, 0, 0);
+			glDrawElements(GL_TRIANGLES, 3 * cmds[2 * i + 1], GL_UNSIGNED_INT, (GLvoid*)(sizeof(Index) * 3 * cmds[2 * i]));
+		}
+		glVertexAttribI4ui(8, 0, 0, 0, 0);
+	}
+
+	glBindVertexArray(0);
+	return drawn;
+}
+
+void Mesh::render_instanced(GLuint count) const {
+	glBindVertexArray(vao);
+	glDrawElementsInstanced(GL_TRIANGLES, n_elem, GL_UNSIGNED_INT, nullptr, count);
+	glBindVertexArray(0);
+}
+
+Tex_Buffer::Tex_Buffer() {}
+
+Tex_Buffer::Tex_Buffer(Tex_Buffer&& src) {
+	buf = src.buf; src.buf = 0;
+	tex = src.tex; src.tex = 0;
+	capacity = src.capacity; src.capacity = 0;
+}
+
+void Tex_Buffer::operator=(Tex_Buffer&& src) {
+	destroy();
+	buf = src.buf; src.buf = 0;
+	tex = src.tex; src.tex = 0;
+	capacity = src.capacity; src.capacity = 0;
+}
+
+Tex_Buffer::~Tex_Buffer() {
+	destroy();
+}
+
+void Tex_Buffer::destroy() {
+	glDeleteTextures(1, &tex);
+	glDeleteBuffers(1, &buf);
+	buf = tex = 0;
+	capacity = 0;
+}
+
+void Tex_Buffer::update(GLenum format, const void* data, size_t size) {
+
+	if(!buf) {
+		glGenBuffers(1, &buf);
+		glGenTextures(1, &tex);
+	}
+
+	glBindBuffer(GL_TEXTURE_BUFFER, buf);
+	if(size > capacity) {
+		glBufferData(GL_TEXTURE_BUFFER, size, data, GL_STATIC_DRAW);
+		capacity = size;
+	} else if(size) {
+		glBufferSubData(GL_TEXTURE_BUFFER, 0, size, data);
+	}
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+	glBindTexture(GL_TEXTURE_BUFFER, tex);
+	glTexBuffer(GL_TEXTURE_BUFFER, format, buf);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+}
+
+void Tex_Buffer::bind(int unit) const {
+	glActiveTexture(GL_TEXTURE0 + unit);
+	glBindTexture(GL_TEXTURE_BUFFER, tex);
+	glActiveTexture(GL_TEXTURE0);
+}
+
+bool Tex_Buffer::empty() const {
+	return capacity == 0;
+}
+
+Tex2D::Tex2D() {}
+
+Tex2D::Tex2D(Tex2D&& src) {
+	tex = src.tex; src.tex = 0;
+	w = src.w; src.w = 0;
+	h = src.h; src.h = 0;
+}
+
+void Tex2D::operator=(Tex2D&& src) {
+	destroy();
+	tex = src.tex; src.tex = 0;
+	w = src.w; src.w = 0;
+	h = src.h; src.h = 0;
+}
+
+Tex2D::~Tex2D() {
+	destroy();
+}
+
+void Tex2D::destroy() {
+	glDeleteTextures(1, &tex);
+	tex = 0;
+	w = h = 0;
+}
+
+void Tex2D::image(int _w, int _h, const unsigned char* data) {
+
+	if(!tex) {
+		glGenTextures(1, &tex);
+		glBindTexture(GL_TEXTURE_2D, tex);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	} else {
+		glBindTexture(GL_TEXTURE_2D, tex);
+	}
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	if(_w != w || _h != h) {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, _w, _h, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+		w = _w;
+		h = _h;
+	} else {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, data);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+GLuint Tex2D::get_id() const {
+	return tex;
+}
+
+Stream_Buffer::Stream_Buffer() {}
+
+Stream_Buffer::Stream_Buffer(Stream_Buffer&& src) {
+	buf = src.buf; src.buf = 0;
+	mapped = src.mapped; src.mapped = nullptr;
+	capacity = src.capacity; src.capacity = 0;
+	region = src.region; src.region = 0;
+	persistent = src.persistent; src.persistent = false;
+	for(int i = 0; i < n_regions; i++) {
+		fences[i] = src.fences[i]; src.fences[i] = nullptr;
+	}
+}
+
+void Stream_Buffer::operator=(Stream_Buffer&& src) {
+	destroy();
+	buf = src.buf; src.buf = 0;
+	mapped = src.mapped; src.mapped = nullptr;
+	capacity = src.capacity; src.capacity = 0;
+	region = src.region; src.region = 0;
+	persistent = src.persistent; src.persistent = false;
+	for(int i = 0; i < n_regions; i++) {
+		fences[i] = src.fences[i]; src.fences[i] = nullptr;
+	}
+}
+
+Stream_Buffer::~Stream_Buffer() {
+	destroy();
+}
+
+void Stream_Buffer::create(size_t cap) {
+
+	destroy();
+
+	// Keep region offsets aligned for any attribute layout
+	capacity = (cap + 255) & ~(size_t)255;
+	persistent = has_buffer_storage;
+
+	glGenBuffers(1, &buf);
+	glBindBuffer(GL_ARRAY_BUFFER, buf);
+
+	if(persistent) {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, capacity * n_regions, nullptr, flags);
+		mapped = (GLubyte*)glMapBufferRange(GL_ARRAY_BUFFER, 0, capacity * n_regions, flags);
+		if(!mapped) {
+			warn("Failed to map stream buffer; falling back to sub-data updates.");
+			glDeleteBuffers(1, &buf);
+			glGenBuffers(1, &buf);
+			glBindBuffer(GL_ARRAY_BUFFER, buf);
+			persistent = false;
+		}
+	}
+	if(!persistent) {
+		glBufferData(GL_ARRAY_BUFFER, capacity, nullptr, GL_DYNAMIC_DRAW);
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void Stream_Buffer::destroy() {
+	for(int i = 0; i < n_regions; i++) {
+		if(fences[i]) glDeleteSync(fences[i]);
+		fences[i] = nullptr;
+	}
+	if(mapped) {
+		glBindBuffer(GL_ARRAY_BUFFER, buf);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		mapped = nullptr;
+	}
+	glDeleteBuffers(1, &buf);
+	buf = 0;
+	capacity = 0;
+	region = 0;
+}
+
+size_t Stream_Buffer::write(const void* data, size_t size) {
+
+	if(!buf || size > capacity) {
+		create(std::max({size, capacity * 2, min_capacity}));
+	}
+	if(!size) return 0;
+
+	if(!persistent) {
+		glBindBuffer(GL_ARRAY_BUFFER, buf);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, size, data);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		return 0;
+	}
+
+	region = (region + 1) % n_regions;
+
+	// Wait until the GPU is done with the last draw that read this region
+	if(fences[region]) {
+		GLenum result;
+		do {
+			result = glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+		} while(result == GL_TIMEOUT_EXPIRED);
+		glDeleteSync(fences[region]);
+		fences[region] = nullptr;
+	}
+
+	size_t offset = region * capacity;
+	std::memcpy(mapped + offset, data, size);
+	return offset;
+}
+
+void Stream_Buffer::fence() {
+	if(!persistent) return;
+	if(fences[region]) glDeleteSync(fences[region]);
+	fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+GLuint Stream_Buffer::buffer() const {
+	return buf;
+}
+
 Instances::Instances(GL::Mesh&& mesh) : mesh(std::move(mesh)) {
 	create();
 }
@@ -205,7 +686,7 @@ Instances::Instances(GL::Mesh&& mesh) : mesh(std::move(mesh)) {
 Instances::Instances(Instances&& src) {
 	mesh = std::move(src.mesh);
 	data = std::move(src.data);
-	vbo = src.vbo; src.vbo = 0;
+	stream = std::move(src.stream);
 	dirty = src.dirty; src.dirty = false;
 }
 
@@ -216,26 +697,25 @@ Instances::~Instances() {
 void Instances::operator=(Instances&& src) {
 	mesh = std::move(src.mesh);
 	data = std::move(src.data);
-	vbo = src.vbo; src.vbo = 0;
+	stream = std::move(src.stream);
 	dirty = src.dirty; src.dirty = false;
 }
 
 void Instances::create() {
-	glGenBuffers(1, &vbo);
 	glBindVertexArray(mesh.vao);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
 
 	glEnableVertexAttribArray(3);
-	glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(Info), (GLvoid*)0);
 	glVertexAttribDivisor(3, 1);
 
 	const int base_idx = 4;
 	for(int i = 0; i < 4; i++) {
 		glEnableVertexAttribArray(base_idx + i);
-		glVertexAttribPointer(base_idx + i, 4, GL_FLOAT, GL_FALSE, sizeof(Info), (void*)(sizeof(GLuint) + sizeof(Vec4) * i));
 		glVertexAttribDivisor(base_idx + i, 1);
 	}
 	glBindVertexArray(0);
+
+	// Attribute pointers are specified on the first update
+	dirty = true;
 }
 
 void Instances::render() {
@@ -244,6 +724,7 @@ void Instances::render() {
 	glBindVertexArray(mesh.vao);
 	glDrawElementsInstanced(GL_TRIANGLES, mesh.n_elem, GL_UNSIGNED_INT, nullptr, data.size());
 	glBindVertexArray(0);
+	stream.fence();
 }
 
 void Instances::add(Mat4 transform, GLuint id) {
@@ -258,17 +739,23 @@ void Instances::clear() {
 
 void Instances::update() {
 
+	size_t offset = stream.write(data.data(), sizeof(Info) * data.size());
+
 	glBindVertexArray(mesh.vao);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(Info) * data.size(), data.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, stream.buffer());
+
+	glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(Info), (GLvoid*)offset);
+
+	const int base_idx = 4;
+	for(int i = 0; i < 4; i++) {
+		glVertexAttribPointer(base_idx + i, 4, GL_FLOAT, GL_FALSE, sizeof(Info), (GLvoid*)(offset + sizeof(GLuint) + sizeof(Vec4) * i));
+	}
 	glBindVertexArray(0);
 
 	dirty = false;
 }
 
 void Instances::destroy() {
-	glDeleteBuffers(1, &vbo);
-	vbo = 0;
 	mesh.destroy();
 }
 
@@ -280,7 +767,7 @@ Lines::Lines(Lines&& src) {
 	dirty = src.dirty; src.dirty = false;
 	thickness = src.thickness; src.thickness = 0.0f;
 	vao = src.vao; src.vao = 0;
-	vbo = src.vbo; src.vbo = 0;
+	stream = std::move(src.stream);
 	vertices = std::move(src.vertices);
 }
 
@@ -289,7 +776,7 @@ void Lines::operator=(Lines&& src) {
 	dirty = src.dirty; src.dirty = false;
 	thickness = src.thickness; src.thickness = 0.0f;
 	vao = src.vao; src.vao = 0;
-	vbo = src.vbo; src.vbo = 0;
+	stream = std::move(src.stream);
 	vertices = std::move(src.vertices);
 }
 
@@ -299,9 +786,12 @@ Lines::~Lines() {
 
 void Lines::update() const {
 
+	size_t offset = stream.write(vertices.data(), sizeof(Line_Vert) * vertices.size());
+
 	glBindVertexArray(vao);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(Line_Vert) * vertices.size(), vertices.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, stream.buffer());
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Line_Vert), (GLvoid*)offset);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Line_Vert), (GLvoid*)(offset + sizeof(Vec3)));
 	glBindVertexArray(0);
 
 	dirty = false;
@@ -318,6 +808,7 @@ void Lines::render(bool smooth) const {
 	glBindVertexArray(vao);
 	glDrawArrays(GL_LINES, 0, vertices.size());
 	glBindVertexArray(0);
+	stream.fence();
 }
 
 void Lines::clear() {
@@ -340,24 +831,19 @@ void Lines::add(Vec3 start, Vec3 end, Vec3 color) {
 
 void Lines::create() {
 	glGenVertexArrays(1, &vao);
-	glGenBuffers(1, &vbo);
 
 	glBindVertexArray(vao);
-
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Line_Vert), (GLvoid*)0);
 	glEnableVertexAttribArray(0);
-
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Line_Vert), (GLvoid*)sizeof(Vec3));
 	glEnableVertexAttribArray(1);
-	
 	glBindVertexArray(0);
+
+	// Attribute pointers are specified on the first update
+	dirty = true;
 }
 
 void Lines::destroy() {
-	glDeleteBuffers(1, &vbo);
 	glDeleteVertexArrays(1, &vao);
-	vao = vbo = 0;
+	vao = 0;
 	vertices.clear();
 	dirty = false;
 }
@@ -673,15 +1159,25 @@ void Effects::init() {
 	resolve_shader.load(effects_v, resolve_f);
 	outline_shader.load(effects_v, outline_f);
 	outline_shader_ms.load(effects_v, is_gl45 ? outline_ms_f_4 : outline_ms_f_33);
+	fxaa_shader.load(effects_v, fxaa_f);
+
+	// Framebuffer outputs are nearest-filtered; FXAA needs bilinear taps
+	glGenSamplers(1, &linear_sampler);
+	glSamplerParameteri(linear_sampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glSamplerParameteri(linear_sampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glSamplerParameteri(linear_sampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glSamplerParameteri(linear_sampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 }
 
 void Effects::destroy() {
 
 	glDeleteVertexArrays(1, &vao);
-	vao = 0;
+	glDeleteSamplers(1, &linear_sampler);
+	vao = linear_sampler = 0;
 	resolve_shader.~Shader();
 	outline_shader.~Shader();
 	outline_shader_ms.~Shader();
+	fxaa_shader.~Shader();
 }
 
 void Effects::outline(const Framebuffer& from, const Framebuffer& to, Vec3 color, Vec2 min, Vec2 max) {
@@ -737,6 +1233,29 @@ void Effects::resolve_to_screen(int buf, const Framebuffer& framebuffer) {
 	glBindVertexArray(0);
 }
 
+void Effects::fxaa_to_screen(int buf, const Framebuffer& framebuffer) {
+
+	Framebuffer::bind_screen();
+
+	fxaa_shader.bind();
+
+	assert(!framebuffer.is_multisampled());
+	assert(buf >= 0 && buf < (int)framebuffer.output_textures.size());
+	glBindTexture(GL_TEXTURE_2D, framebuffer.output_textures[buf]);
+	glBindSampler(0, linear_sampler);
+
+	fxaa_shader.uniform("tex", 0);
+	fxaa_shader.uniform("i_screen_size", 1.0f / Vec2(framebuffer.w, framebuffer.h));
+	fxaa_shader.uniform("bounds", 4, screen_quad);
+
+	glBindVertexArray(vao);
+	glDisable(GL_DEPTH_TEST);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	glEnable(GL_DEPTH_TEST);
+	glBindVertexArray(0);
+	glBindSampler(0, 0);
+}
+
 void Effects::resolve_to(int buf, const Framebuffer& from, const Framebuffer& to, bool avg) {
 
 	to.bind();
@@ -816,7 +1335,7 @@ static void debug_proc(GLenum glsource, GLenum gltype, GLuint id, GLenum severit
 	switch(severity) {
 	case GL_DEBUG_SEVERITY_HIGH:
 	case GL_DEBUG_SEVERITY_MEDIUM:
-		warn("OpenGL | source: %s type: %s message: %s", source.c_str(), type.c_str(), message.c_str());
+		warn_limited("OpenGL | source: %s type: %s message: %s", source.c_str(), type.c_str(), message.c_str());
 		break;
 	}
 }
@@ -966,6 +1485,46 @@ void main() {
 
 	out_color = vec4(color, 1.0f);
 })";
+const std::string Effects::fxaa_f = R"(
+#version 330 core
+
+uniform sampler2D tex;
+uniform vec2 i_screen_size;
+out vec4 out_color;
+
+const float span_max = 8.0f;
+const float reduce_mul = 1.0f / 8.0f;
+const float reduce_min = 1.0f / 128.0f;
+const vec3 luma = vec3(0.299f, 0.587f, 0.114f);
+
+void main() {
+
+	vec2 uv = gl_FragCoord.xy * i_screen_size;
+
+	vec3 m = texture(tex, uv).rgb;
+	float l_nw = dot(textureOffset(tex, uv, ivec2(-1, 1)).rgb, luma);
+	float l_ne = dot(textureOffset(tex, uv, ivec2(1, 1)).rgb, luma);
+	float l_sw = dot(textureOffset(tex, uv, ivec2(-1, -1)).rgb, luma);
+	float l_se = dot(textureOffset(tex, uv, ivec2(1, -1)).rgb, luma);
+	float l_m = dot(m, luma);
+
+	float l_min = min(l_m, min(min(l_nw, l_ne), min(l_sw, l_se)));
+	float l_max = max(l_m, max(max(l_nw, l_ne), max(l_sw, l_se)));
+
+	// Blur along the edge, perpendicular to the luma gradient
+	vec2 dir = vec2(-((l_nw + l_ne) - (l_sw + l_se)), (l_nw + l_sw) - (l_ne + l_se));
+	float reduce = max((l_nw + l_ne + l_sw + l_se) * 0.25f * reduce_mul, reduce_min);
+	float scale = 1.0f / (min(abs(dir.x), abs(dir.y)) + reduce);
+	dir = clamp(dir * scale, vec2(-span_max), vec2(span_max)) * i_screen_size;
+
+	vec3 a = 0.5f * (texture(tex, uv + dir * (1.0f / 3.0f - 0.5f)).rgb +
+					 texture(tex, uv + dir * (2.0f / 3.0f - 0.5f)).rgb);
+	vec3 b = a * 0.5f + 0.25f * (texture(tex, uv - dir * 0.5f).rgb +
+								 texture(tex, uv + dir * 0.5f).rgb);
+
+	float l_b = dot(b, luma);
+	out_color = vec4(l_b < l_min || l_b > l_max ? a : b, 1.0f);
+})";
 
 namespace Shaders {
 	const std::string line_v = R"(
@@ -1000,16 +1559,20 @@ void main() {
 layout (location = 0) in vec3 v_pos;
 layout (location = 1) in vec3 v_norm;
 layout (location = 2) in uint v_id;
+// First triangle of the current draw, for clustered meshes drawn in pieces
+layout (location = 8) in uint v_tri_base;
 
-uniform mat4 mvp, normal;
+uniform mat4 mvp, modelview, normal;
 uniform vec3 color;
 
-smooth out vec3 f_norm, f_color;
-flat out uint f_id;
+smooth out vec3 f_pos, f_norm, f_color;
+flat out uint f_id, f_tri_base;
 
 void main() {
 	f_id = v_id;
+	f_tri_base = v_tri_base;
 	f_color = color;
+	f_pos = (modelview * vec4(v_pos, 1.0f)).xyz;
 	f_norm = (normal * vec4(v_norm, 0.0f)).xyz;
 	gl_Position = mvp * vec4(v_pos, 1.0f);
 })";
@@ -1026,36 +1589,141 @@ layout (location = 4) in mat4 i_trans;
 uniform bool use_i_id;
 uniform mat4 proj, modelview;
 
-smooth out vec3 f_norm, f_color;
-flat out uint f_id;
+smooth out vec3 f_pos, f_norm, f_color;
+flat out uint f_id, f_tri_base;
 
 void main() {
 	f_id = use_i_id ? i_id : v_id;
+	f_tri_base = 0u;
 	mat4 mv = modelview * i_trans;
 	mat4 n = transpose(inverse(mv));
+	f_pos = (mv * vec4(v_pos, 1.0f)).xyz;
+	f_norm = (n * vec4(v_norm, 0.0f)).xyz;
+	gl_Position = proj * mv * vec4(v_pos, 1.0f);
+})";
+	const std::string halfedge_v = R"(
+#version 330 core
+
+layout (location = 0) in vec3 v_pos;
+layout (location = 1) in vec3 v_norm;
+
+// 0: vertex spheres, 1: edge cylinders, 2: halfedge arrows,
+// 3: vertex points, 4: edge lines (drawn without attributes)
+uniform int kind;
+uniform uint id_base;
+uniform mat4 proj, modelview;
+
+// If set, instances draw the subset of elements listed in instances
+uniform bool indirect;
+uniform usamplerBuffer instances;
+
+// Vertices are vec4(position, size), followed by vec4(face center, 0)
+uniform samplerBuffer positions;
+// Edges are (v0, v1); halfedges are (v0, v1, face)
+uniform usamplerBuffer elements;
+
+smooth out vec3 f_pos, f_norm, f_color;
+flat out uint f_id, f_tri_base;
+
+mat4 translate(vec3 t) {
+	return mat4(vec4(1.0f, 0.0f, 0.0f, 0.0f), vec4(0.0f, 1.0f, 0.0f, 0.0f), 
+				vec4(0.0f, 0.0f, 1.0f, 0.0f), vec4(t, 1.0f));
+}
+
+mat4 scale(vec3 s) {
+	return mat4(vec4(s.x, 0.0f, 0.0f, 0.0f), vec4(0.0f, s.y, 0.0f, 0.0f), 
+				vec4(0.0f, 0.0f, s.z, 0.0f), vec4(0.0f, 0.0f, 0.0f, 1.0f));
+}
+
+// Rotate +y onto the segment and scale it to the segment's length
+mat4 align(vec3 v0, vec3 v1, float width) {
+	vec3 dir = v1 - v0;
+	float l = length(dir);
+	dir /= l;
+	mat4 rot = mat4(1.0f);
+	vec3 x = cross(dir, vec3(0.0f, 1.0f, 0.0f));
+	if(x != vec3(0.0f)) {
+		x = normalize(x);
+		vec3 z = cross(x, dir);
+		rot = mat4(vec4(x, 0.0f), vec4(dir, 0.0f), vec4(z, 0.0f), vec4(0.0f, 0.0f, 0.0f, 1.0f));
+	} else if(dir.y == -1.0f) {
+		l = -l;
+	}
+	return rot * scale(vec3(width, l, width));
+}
+
+void main() {
+
+	f_tri_base = 0u;
+	if(kind >= 3) {
+		int i = kind == 3 ? gl_VertexID : gl_VertexID / 2;
+		int v = kind == 3 ? i : int(texelFetch(elements, i)[gl_VertexID % 2]);
+		vec4 pos = modelview * vec4(texelFetch(positions, v).xyz, 1.0f);
+		f_id = id_base + uint(i);
+		f_pos = pos.xyz;
+		f_norm = vec3(0.0f, 0.0f, 1.0f);
+		gl_Position = proj * pos;
+		return;
+	}
+
+	int elem = indirect ? int(texelFetch(instances, gl_InstanceID).r) : gl_InstanceID;
+
+	mat4 trans;
+	if(kind == 0) {
+		vec4 v = texelFetch(positions, elem);
+		trans = translate(v.xyz) * scale(vec3(v.w));
+	} else if(kind == 1) {
+		uvec4 e = texelFetch(elements, elem);
+		vec4 v0 = texelFetch(positions, int(e.x));
+		vec4 v1 = texelFetch(positions, int(e.y));
+		float s = 0.5f * min(v0.w, v1.w);
+		trans = translate(v0.xyz) * align(v0.xyz, v1.xyz, s);
+	} else {
+		uvec4 h = texelFetch(elements, elem);
+		vec4 v0 = texelFetch(positions, int(h.x));
+		vec4 v1 = texelFetch(positions, int(h.y));
+		vec3 face = texelFetch(positions, int(h.z)).xyz;
+		float s = 0.5f * min(v0.w, v1.w);
+		// Move to center of edge and towards center of face
+		vec3 offset = (v1.xyz - v0.xyz) * 0.2f;
+		offset += normalize(face - 0.5f * (v0.xyz + v1.xyz)) * s * 0.125f;
+		trans = translate(v0.xyz + offset) * align(v0.xyz, v1.xyz, 0.6f * s) * scale(vec3(1.0f, 0.6f, 1.0f));
+	}
+
+	f_id = id_base + uint(elem);
+	mat4 mv = modelview * trans;
+	mat4 n = transpose(inverse(mv));
+	f_pos = (mv * vec4(v_pos, 1.0f)).xyz;
 	f_norm = (n * vec4(v_norm, 0.0f)).xyz;
 	gl_Position = proj * mv * vec4(v_pos, 1.0f);
 })";
 	const std::string mesh_f = R"(
 #version 330 core
 
-uniform bool solid, use_v_id;
+uniform bool solid, use_v_id, flat_shade;
 uniform uint id, sel_id;
 uniform vec3 color, sel_color;
+uniform usamplerBuffer face_ids;
 
 layout (location = 0) out vec4 out_col;
 layout (location = 1) out vec4 out_id;
 
+smooth in vec3 f_pos;
 smooth in vec3 f_color;
 smooth in vec3 f_norm;
-flat in uint f_id;
+flat in uint f_id, f_tri_base;
 
 void main() {
 
+	// Flat meshes share vertices between faces, so the face normal comes from
+	// the view-space position derivatives and the id from the per-triangle buffer.
+	uint v_id = flat_shade ? texelFetch(face_ids, int(f_tri_base) + gl_PrimitiveID).r : f_id;
+	vec3 norm = flat_shade ? cross(dFdx(f_pos), dFdy(f_pos)) : f_norm;
+
 	vec3 use_color;
 	if(use_v_id) {
-		out_id = vec4((f_id & 0xffu) / 255.0f, ((f_id >> 8) & 0xffu) / 255.0f, ((f_id >> 16) & 0xffu) / 255.0f, 1.0f);
-		use_color = f_id == sel_id ? sel_color : color;
+		out_id = vec4((v_id & 0xffu) / 255.0f, ((v_id >> 8) & 0xffu) / 255.0f, ((v_id >> 16) & 0xffu) / 255.0f, 1.0f);
+		use_color = v_id == sel_id ? sel_color : color;
 	} else {
 		out_id = vec4((id & 0xffu) / 255.0f, ((id >> 8) & 0xffu) / 255.0f, ((id >> 16) & 0xffu) / 255.0f, 1.0f);
 		use_color = id == sel_id ? sel_color : color;
@@ -1064,7 +1732,7 @@ void main() {
 	if(solid) {
 		out_col = vec4(use_color, 1.0f);
 	} else {
-		float ndotl = max(normalize(f_norm).z, 0.0f);
+		float ndotl = max(normalize(norm).z, 0.0f);
 		float light = clamp(0.2f + ndotl, 0.0f, 1.0f);
 		out_col = vec4(light * use_color, 1.0f);
 	}
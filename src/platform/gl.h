@@ -31,6 +31,56 @@ void disable(Opt opt);
 
 void color_mask(bool enable);
 
+/// Draw primitives with no vertex attributes, for shaders that pull
+/// their inputs from buffer textures by gl_VertexID
+void draw_points(GLuint count, float size);
+void draw_lines(GLuint count);
+
+/// Buffer texture, for pulling per-element data into shaders with texelFetch
+class Tex_Buffer {
+public:
+	Tex_Buffer();
+	Tex_Buffer(const Tex_Buffer& src) = delete;
+	Tex_Buffer(Tex_Buffer&& src);
+	~Tex_Buffer();
+
+	void operator=(const Tex_Buffer& src) = delete;
+	void operator=(Tex_Buffer&& src);
+
+	/// Format is a sized internal format, e.g. GL_RGBA32F or GL_R32UI
+	void update(GLenum format, const void* data, size_t size);
+	void bind(int unit) const;
+	bool empty() const;
+
+private:
+	void destroy();
+
+	GLuint buf = 0, tex = 0;
+	size_t capacity = 0;
+};
+
+/// RGBA8 2D texture, e.g. for showing CPU-rendered images
+class Tex2D {
+public:
+	Tex2D();
+	Tex2D(const Tex2D& src) = delete;
+	Tex2D(Tex2D&& src);
+	~Tex2D();
+
+	void operator=(const Tex2D& src) = delete;
+	void operator=(Tex2D&& src);
+
+	/// Upload w by h RGBA8 pixels, first row at the top
+	void image(int w, int h, const unsigned char* data);
+	GLuint get_id() const;
+
+private:
+	void destroy();
+
+	GLuint tex = 0;
+	int w = 0, h = 0;
+};
+
 class Mesh {
 public:
 	typedef GLuint Index;
@@ -41,7 +91,7 @@ public:
 	};
 
 	Mesh();
-	Mesh(std::vector<Vert>&& vertices, std::vector<Index>&& indices);
+	Mesh(std::vector<Vert>&& vertices, std::vector<Index>&& indices, std::vector<GLuint>&& face_ids = {});
 	Mesh(const Mesh& src) = delete;
 	Mesh(Mesh&& src);
 	~Mesh();
@@ -49,29 +99,110 @@ public:
 	void operator=(const Mesh& src) = delete;
 	void operator=(Mesh&& src);
 
+	/// Bounding sphere and normal cone of a contiguous run of triangles
+	struct Cluster {
+		Vec3 center;
+		float radius;
+		Vec3 axis;
+		/// Half-angle of the normal cone; at least pi/2 if it can never be back-facing
+		float spread;
+		GLuint first, count;
+	};
+	/// Meshes with at least this many triangles are split into clusters
+	static constexpr GLuint cluster_min_tris = 16384;
+	static constexpr GLuint cluster_tris = 128;
+
 	/// Assumes proper shader is already bound
 	void render() const;
-	void update(std::vector<Vert>&& vertices, std::vector<Index>&& indices);
+	void render_instanced(GLuint count) const;
+	/// Draw the clusters that intersect the view volume of mvp (in object space).
+	/// With backface, clusters facing away from eye (in object space) are also
+	/// skipped. Unclustered meshes are drawn whole. Returns triangles drawn.
+	GLuint render_culled(const Mat4& mvp, bool backface, Vec3 eye) const;
+	/// If face_ids is non-empty (one id per triangle), the mesh is flat shaded:
+	/// vertices may be shared between faces, normals are derived in the
+	/// fragment shader, and ids are looked up by gl_PrimitiveID.
+	void update(std::vector<Vert>&& vertices, std::vector<Index>&& indices, std::vector<GLuint>&& face_ids = {});
+	/// Copy the listed vertices and triangles (sorted, without repeats) from
+	/// full-size arrays, uploading runs of consecutive entries together.
+	/// Triangles using a listed vertex must be listed too. The bounding box
+	/// and clusters only grow, and patched clusters are no longer backface
+	/// culled, so culling stays conservative until the next update().
+	void patch(const std::vector<Vert>& vertices, const std::vector<Index>& indices,
+	           const std::vector<GLuint>& dirty_verts, const std::vector<GLuint>& dirty_tris);
 
 	BBox bbox() const;
 	const std::vector<Vert>& verts() const;
 	const std::vector<Index>& indices() const;
+	const std::vector<GLuint>& face_ids() const;
 	GLuint tris() const;
+	bool flat() const;
+	const std::vector<Cluster>& clusters() const;
+	/// Changes whenever the contents do; unique among all meshes
+	uint64_t version() const;
 
 private:
 	void create();
 	void destroy();
+	void build_clusters();
 
 	BBox _bbox;
 	GLuint vao = 0, vbo = 0, ebo = 0;
 	GLuint n_elem = 0;
+	uint64_t _version = 0;
+	Tex_Buffer id_buf;
 
 	std::vector<Vert> _verts;
 	std::vector<Index> _idxs;
+	std::vector<GLuint> _face_ids;
+
+	// Visible runs of clusters are drawn with one indirect command each; the
+	// per-command base triangle is an instanced attribute, so flat shading can
+	// still find face ids from gl_PrimitiveID.
+	std::vector<Cluster> _clusters;
+	mutable GLuint cmd_buf = 0, base_buf = 0;
+	mutable std::vector<GLuint> cmds, indirect, bases;
 
 	friend class Instances;
 };
 
+/// Vertex buffer for data that is rewritten often (lines, instance data).
+/// Storage grows geometrically and is updated in place. With GL 4.4 buffer
+/// storage, the buffer is persistently mapped and split into a ring of regions
+/// guarded by fences, so a write never waits on or reallocates memory the GPU
+/// is still reading.
+class Stream_Buffer {
+public:
+	Stream_Buffer();
+	Stream_Buffer(const Stream_Buffer& src) = delete;
+	Stream_Buffer(Stream_Buffer&& src);
+	~Stream_Buffer();
+
+	void operator=(const Stream_Buffer& src) = delete;
+	void operator=(Stream_Buffer&& src);
+
+	/// Copy data into the next free region and return its byte offset.
+	/// The buffer object may change, so re-specify attribute pointers after writing.
+	size_t write(const void* data, size_t size);
+	/// Call after submitting a draw that reads the last write
+	void fence();
+	GLuint buffer() const;
+
+private:
+	void create(size_t capacity);
+	void destroy();
+
+	static const int n_regions = 3;
+	static const size_t min_capacity = 4096;
+
+	GLuint buf = 0;
+	GLsync fences[n_regions] = {};
+	GLubyte* mapped = nullptr;
+	size_t capacity = 0;
+	int region = 0;
+	bool persistent = false;
+};
+
 class Instances {
 public:
 	Instances(GL::Mesh&& mesh);
@@ -91,7 +222,7 @@ private:
 	void destroy();
 	void update();
 
-	GLuint vbo = 0;
+	Stream_Buffer stream;
 	bool dirty = false;
 
 	Mesh mesh;
@@ -127,7 +258,8 @@ private:
 
 	mutable bool dirty = false;
 	float thickness = 0.0f;
-	GLuint vao = 0, vbo = 0;
+	GLuint vao = 0;
+	mutable Stream_Buffer stream;
 
 	struct Line_Vert {
 		Vec3 pos;
@@ -223,13 +355,15 @@ public:
 	static void resolve_to(int buf, const Framebuffer& from, const Framebuffer& to, bool avg = true);
 
 	static void outline(const Framebuffer& from, const Framebuffer& to, Vec3 color, Vec2 min, Vec2 max);
+	/// Single-sample framebuffers only
+	static void fxaa_to_screen(int buf, const Framebuffer& framebuffer);
 
 private:
 	static void init();
 	static void destroy();
 
-	static inline Shader resolve_shader, outline_shader, outline_shader_ms;
-	static inline GLuint vao;
+	static inline Shader resolve_shader, outline_shader, outline_shader_ms, fxaa_shader;
+	static inline GLuint vao, linear_sampler;
 	static inline const Vec2 screen_quad[] = {
 		{-1.0f,  1.0f},
 		{-1.0f, -1.0f},
@@ -243,11 +377,13 @@ private:
 	static const std::string effects_v;
 	static const std::string outline_f, outline_ms_f_33, outline_ms_f_4;
 	static const std::string resolve_f;
+	static const std::string fxaa_f;
 };
 
 namespace Shaders {
 	extern const std::string line_v, line_f;
 	extern const std::string mesh_v, mesh_f;
 	extern const std::string inst_v;
+	extern const std::string halfedge_v;
 }
 }
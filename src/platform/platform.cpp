@@ -146,15 +146,28 @@ void Platform::begin_frame() {
 	ImGui::NewFrame();
 }
 
+void Platform::wake() {
+	SDL_Event e = {};
+	e.type = SDL_USEREVENT;
+	SDL_PushEvent(&e);
+}
+
 void Platform::loop(App& app) {
 
 	bool running = true;
+	int redraw = redraw_frames;
 	while(running) {
-		
-		begin_frame();
 
 		SDL_Event e;
-		while(SDL_PollEvent(&e)) {
+		bool have_event = SDL_PollEvent(&e);
+
+		// Nothing changed since the last few frames: sleep until it does
+		if(!have_event && pacing.idle && redraw == 0) {
+			have_event = SDL_WaitEventTimeout(&e, idle_timeout_ms);
+			if(!have_event) continue;
+		}
+
+		while(have_event) {
 
 			ImGui_ImplSDL2_ProcessEvent(&e);
 
@@ -170,12 +183,24 @@ void Platform::loop(App& app) {
 			}
 
 			app.event(e);
+			redraw = redraw_frames;
+			have_event = SDL_PollEvent(&e);
 		}
 
-		app.render();
+		Uint32 frame_start = SDL_GetTicks();
 
+		begin_frame();
+		app.render();
 		complete_frame();
 		set_dpi();
+
+		if(redraw > 0) redraw--;
+
+		if(pacing.max_fps > 0) {
+			Uint32 frame_ms = 1000 / pacing.max_fps;
+			Uint32 elapsed = SDL_GetTicks() - frame_start;
+			if(elapsed < frame_ms) SDL_Delay(frame_ms - elapsed);
+		}
 	}
 }
 
@@ -13,6 +13,16 @@ public:
 	~Platform();
 
 	void loop(App& app);
+	/// Wake an idle loop to draw a frame; safe to call from any thread
+	static void wake();
+
+	struct Pacing {
+		/// Block for events and only redraw when something may have changed
+		bool idle = true;
+		/// Cap on frames per second while drawing, or 0 for no cap
+		int max_fps = 0;
+	};
+	Pacing pacing;
 
 	Vec2 window_draw();
 	Vec2 window_size();
@@ -35,6 +45,10 @@ private:
 	void begin_frame();
 	void complete_frame();
 
+	// Frames drawn after the last event, so UI state can settle
+	static const int redraw_frames = 3;
+	static const Uint32 idle_timeout_ms = 500;
+
 	SDL_Window* window = nullptr;
 	SDL_GLContext gl_context = nullptr;
 };
@@ -0,0 +1,589 @@
+
+#include "bvh.h"
+#include "../jobs.h"
+#include "../lib/log.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Subtrees at least this large are built as separate tasks
+static const uint32_t parallel_min = 1 << 14;
+// Below this depth splits follow the SAH; deeper ones split at the median,
+// which halves the count, so no binary node is deeper than max_depth
+static const uint32_t max_sah_depth = 48;
+static const uint32_t max_depth = max_sah_depth + 32;
+// Leaves are forced to split above this size even if the SAH disagrees
+static const uint32_t max_sah_leaf = 16;
+// Four-wide nodes are no deeper than the binary tree, and each popped node
+// pushes up to four children, so the stack grows by at most three per level
+static const int stack_size = 3 * max_depth + 1;
+
+struct BVH::Builder {
+
+	/// Binary tree node. Leaves: the first triangle and the count. Interior
+	/// nodes: the first of two adjacent children, and a count of zero.
+	struct Node {
+		BBox box;
+		uint32_t start = 0, count = 0;
+
+		bool leaf() const {
+			return count > 0;
+		}
+	};
+
+	Builder(Jobs& jobs) : jobs(jobs) {}
+
+	Jobs& jobs;
+	std::vector<BBox> boxes;
+	std::vector<Vec3> centers;
+	std::vector<uint32_t> order;
+
+	/// Build the subtree over order[begin, end) as node slot of out
+	void build(uint32_t begin, uint32_t end, uint32_t depth, std::vector<Node>& out, uint32_t slot) {
+
+		BBox box, cbox;
+		for(uint32_t i = begin; i < end; i++) {
+			box.enclose(boxes[order[i]]);
+			cbox.enclose(centers[order[i]]);
+		}
+		uint32_t n = end - begin;
+		out[slot].box = box;
+		out[slot].start = begin;
+		out[slot].count = n;
+		if(n <= max_leaf) return;
+
+		uint32_t mid = begin;
+		int best_axis = -1;
+		if(depth < max_sah_depth) {
+			uint32_t best_bin = 0;
+			float best_cost = FLT_MAX;
+			for(int a = 0; a < 3; a++) {
+				float lo = cbox.min[a], extent = cbox.max[a] - lo;
+				if(!(extent > 0.0f)) continue;
+				float scale = bins / extent;
+
+				BBox bin_box[bins];
+				uint32_t bin_count[bins] = {};
+				for(uint32_t i = begin; i < end; i++) {
+					uint32_t p = order[i];
+					uint32_t b = std::min(bins - 1, (uint32_t)((centers[p][a] - lo) * scale));
+					bin_count[b]++;
+					bin_box[b].enclose(boxes[p]);
+				}
+
+				float right_area[bins];
+				uint32_t right_count[bins];
+				BBox acc;
+				uint32_t count = 0;
+				for(uint32_t b = bins - 1; b > 0; b--) {
+					acc.enclose(bin_box[b]);
+					count += bin_count[b];
+					right_area[b] = acc.surface_area();
+					right_count[b] = count;
+				}
+				acc.reset();
+				count = 0;
+				for(uint32_t b = 0; b + 1 < bins; b++) {
+					acc.enclose(bin_box[b]);
+					count += bin_count[b];
+					if(count == 0 || right_count[b + 1] == 0) continue;
+					float cost = acc.surface_area() * count + right_area[b + 1] * right_count[b + 1];
+					if(cost < best_cost) {
+						best_cost = cost;
+						best_axis = a;
+						best_bin = b;
+					}
+				}
+			}
+
+			// Traversal and intersection cost the same
+			float leaf_cost = box.surface_area() * n;
+			if(best_axis >= 0 && box.surface_area() + best_cost >= leaf_cost && n <= max_sah_leaf) return;
+			if(best_axis < 0 && n <= max_sah_leaf) return;
+
+			if(best_axis >= 0) {
+				float lo = cbox.min[best_axis];
+				float scale = bins / (cbox.max[best_axis] - lo);
+				auto split = std::partition(order.begin() + begin, order.begin() + end, [&](uint32_t p) {
+					return std::min(bins - 1, (uint32_t)((centers[p][best_axis] - lo) * scale)) <= best_bin;
+				});
+				mid = (uint32_t)(split - order.begin());
+			}
+		}
+
+		// Median split along the widest axis of the centers
+		if(mid == begin || mid == end) {
+			Vec3 extent = cbox.max - cbox.min;
+			int a = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+			mid = begin + n / 2;
+			std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+			                 [&](uint32_t l, uint32_t r) {
+				return centers[l][a] < centers[r][a];
+			});
+		}
+
+		uint32_t left = (uint32_t)out.size();
+		out.emplace_back();
+		out.emplace_back();
+		out[slot].start = left;
+		out[slot].count = 0;
+
+		if(n >= parallel_min) {
+			std::vector<Node> sub_left(1), sub_right(1);
+			Jobs::Group group;
+			jobs.run(group, [&]() {
+				build(begin, mid, depth + 1, sub_left, 0);
+			});
+			build(mid, end, depth + 1, sub_right, 0);
+			jobs.wait(group);
+			splice(out, left, sub_left);
+			splice(out, left + 1, sub_right);
+		} else {
+			build(begin, mid, depth + 1, out, left);
+			build(mid, end, depth + 1, out, left + 1);
+		}
+	}
+
+	/// Move a subtree built on its own into slot of out
+	static void splice(std::vector<Node>& out, uint32_t slot, const std::vector<Node>& sub) {
+		uint32_t base = (uint32_t)out.size() - 1;
+		out[slot] = sub[0];
+		if(!out[slot].leaf()) out[slot].start += base;
+		for(size_t i = 1; i < sub.size(); i++) {
+			Node node = sub[i];
+			if(!node.leaf()) node.start += base;
+			out.push_back(node);
+		}
+	}
+
+	/// Four-wide node over the children of a binary interior node: open the
+	/// interior child with the largest area until there are four
+	uint32_t collapse(const std::vector<Node>& tree, uint32_t root, const std::vector<Triangle>& prims, BVH& bvh) {
+
+		uint32_t kids[4] = {tree[root].start, tree[root].start + 1};
+		int n = 2;
+		if(tree[root].leaf()) {
+			kids[0] = root;
+			n = 1;
+		}
+		while(n < 4) {
+			int open = -1;
+			float area = -1.0f;
+			for(int k = 0; k < n; k++) {
+				const Node& kid = tree[kids[k]];
+				if(!kid.leaf() && kid.box.surface_area() > area) {
+					area = kid.box.surface_area();
+					open = k;
+				}
+			}
+			if(open < 0) break;
+			uint32_t first = tree[kids[open]].start;
+			kids[open] = first;
+			kids[n++] = first + 1;
+		}
+
+		uint32_t idx = (uint32_t)bvh.nodes.size();
+		bvh.nodes.emplace_back();
+		{
+			BVH::Node& node = bvh.nodes[idx];
+			for(int k = 0; k < 4; k++) {
+				node.min_x[k] = node.min_y[k] = node.min_z[k] = FLT_MAX;
+				node.max_x[k] = node.max_y[k] = node.max_z[k] = -FLT_MAX;
+				node.child[k] = none;
+				node.blocks[k] = 0;
+			}
+		}
+
+		for(int k = 0; k < n; k++) {
+			const Node& kid = tree[kids[k]];
+			uint32_t child, count = 0;
+			if(kid.leaf()) {
+				child = (uint32_t)bvh.blocks.size();
+				count = (kid.count + 3) / 4;
+				for(uint32_t b = 0; b < count; b++) {
+					BVH::Block block = {};
+					for(uint32_t j = 0; j < 4; j++) {
+						block.id[j] = none;
+						uint32_t i = b * 4 + j;
+						if(i >= kid.count) continue;
+						const Triangle& tri = prims[order[kid.start + i]];
+						block.v0x[j] = tri.v0.x;
+						block.v0y[j] = tri.v0.y;
+						block.v0z[j] = tri.v0.z;
+						block.e1x[j] = tri.e1.x;
+						block.e1y[j] = tri.e1.y;
+						block.e1z[j] = tri.e1.z;
+						block.e2x[j] = tri.e2.x;
+						block.e2y[j] = tri.e2.y;
+						block.e2z[j] = tri.e2.z;
+						block.id[j] = tri.id;
+					}
+					bvh.blocks.push_back(block);
+				}
+			} else {
+				child = collapse(tree, kids[k], prims, bvh);
+			}
+
+			BVH::Node& node = bvh.nodes[idx];
+			node.min_x[k] = kid.box.min.x;
+			node.min_y[k] = kid.box.min.y;
+			node.min_z[k] = kid.box.min.z;
+			node.max_x[k] = kid.box.max.x;
+			node.max_y[k] = kid.box.max.y;
+			node.max_z[k] = kid.box.max.z;
+			node.child[k] = child;
+			node.blocks[k] = count;
+		}
+		return idx;
+	}
+};
+
+void BVH::build(std::vector<Triangle>&& prims, Jobs& jobs) {
+
+	clear();
+	if(prims.empty()) return;
+
+	uint32_t n = (uint32_t)prims.size();
+	Builder builder(jobs);
+	builder.boxes.resize(n);
+	builder.centers.resize(n);
+	builder.order.resize(n);
+	jobs.parallel_for(0, n, 4096, [&](size_t i) {
+		builder.boxes[i] = prims[i].bbox();
+		builder.centers[i] = builder.boxes[i].center();
+		builder.order[i] = (uint32_t)i;
+	});
+
+	std::vector<Builder::Node> tree;
+	tree.reserve(2 * (size_t)n / max_leaf + 1);
+	tree.emplace_back();
+	builder.build(0, n, 0, tree, 0);
+
+	box = tree[0].box;
+	n_triangles = n;
+	nodes.reserve(tree.size() / 3 + 1);
+	blocks.reserve(tree.size() / 2 + 1);
+	builder.collapse(tree, 0, prims, *this);
+	prims.clear();
+}
+
+void BVH::refit(const std::vector<Triangle>& tris, Jobs& jobs) {
+
+	jobs.parallel_for(0, blocks.size(), 1024, [&](size_t i) {
+		Block& b = blocks[i];
+		for(int j = 0; j < 4 && b.id[j] != none; j++) {
+			const Triangle& tri = tris[b.id[j]];
+			b.v0x[j] = tri.v0.x;
+			b.v0y[j] = tri.v0.y;
+			b.v0z[j] = tri.v0.z;
+			b.e1x[j] = tri.e1.x;
+			b.e1y[j] = tri.e1.y;
+			b.e1z[j] = tri.e1.z;
+			b.e2x[j] = tri.e2.x;
+			b.e2y[j] = tri.e2.y;
+			b.e2z[j] = tri.e2.z;
+		}
+	});
+
+	// Children always come after their parent, so go backwards
+	for(size_t i = nodes.size(); i-- > 0;) {
+		Node& node = nodes[i];
+		for(int k = 0; k < 4 && node.child[k] != none; k++) {
+			BBox slot;
+			if(node.blocks[k]) {
+				for(uint32_t b = node.child[k]; b < node.child[k] + node.blocks[k]; b++) {
+					for(int j = 0; j < 4 && blocks[b].id[j] != none; j++) {
+						slot.enclose(tris[blocks[b].id[j]].bbox());
+					}
+				}
+			} else {
+				const Node& c = nodes[node.child[k]];
+				for(int l = 0; l < 4 && c.child[l] != none; l++) {
+					slot.enclose(BBox(Vec3(c.min_x[l], c.min_y[l], c.min_z[l]), Vec3(c.max_x[l], c.max_y[l], c.max_z[l])));
+				}
+			}
+			node.min_x[k] = slot.min.x;
+			node.min_y[k] = slot.min.y;
+			node.min_z[k] = slot.min.z;
+			node.max_x[k] = slot.max.x;
+			node.max_y[k] = slot.max.y;
+			node.max_z[k] = slot.max.z;
+		}
+	}
+
+	box = {};
+	if(nodes.empty()) return;
+	const Node& root = nodes[0];
+	for(int k = 0; k < 4 && root.child[k] != none; k++) {
+		box.enclose(BBox(Vec3(root.min_x[k], root.min_y[k], root.min_z[k]), Vec3(root.max_x[k], root.max_y[k], root.max_z[k])));
+	}
+}
+
+float BVH::area() const {
+	float area = 0.0f;
+	for(const Node& node : nodes) {
+		for(int k = 0; k < 4 && node.child[k] != none; k++) {
+			area += BBox(Vec3(node.min_x[k], node.min_y[k], node.min_z[k]), Vec3(node.max_x[k], node.max_y[k], node.max_z[k]))
+			            .surface_area();
+		}
+	}
+	return area;
+}
+
+void BVH::clear() {
+	box = {};
+	n_triangles = 0;
+	nodes.clear();
+	blocks.clear();
+}
+
+namespace {
+
+/// One ray in every lane, for testing it against four boxes or triangles
+struct Ray_Lanes {
+	Ray_Lanes(const Ray& ray) :
+		ox(ray.point.x), oy(ray.point.y), oz(ray.point.z),
+		dx(ray.dir.x), dy(ray.dir.y), dz(ray.dir.z),
+		ix(ray.inv_dir.x), iy(ray.inv_dir.y), iz(ray.inv_dir.z) {
+		// Offsets of the near and far bounds on each axis, from min_x
+		near_x = ray.inv_dir.x < 0.0f ? 12 : 0;
+		near_y = ray.inv_dir.y < 0.0f ? 16 : 4;
+		near_z = ray.inv_dir.z < 0.0f ? 20 : 8;
+	}
+
+	Float4 ox, oy, oz, dx, dy, dz, ix, iy, iz;
+	int near_x, near_y, near_z;
+};
+
+struct Entry {
+	uint32_t child, blocks;
+	float enter;
+};
+
+}
+
+/// Which of the four child boxes the ray enters before tmax, and where.
+/// Picking near and far bounds by direction also rejects empty slots.
+static int enter_children(const BVH::Node& node, const Ray_Lanes& r, float tmax, Float4& enter) {
+	const float* b = node.min_x;
+	Float4 near_x = (Float4::load(b + r.near_x) - r.ox) * r.ix;
+	Float4 near_y = (Float4::load(b + r.near_y) - r.oy) * r.iy;
+	Float4 near_z = (Float4::load(b + r.near_z) - r.oz) * r.iz;
+	Float4 far_x = (Float4::load(b + (r.near_x ^ 12)) - r.ox) * r.ix;
+	Float4 far_y = (Float4::load(b + (r.near_y ^ 4 ^ 16)) - r.oy) * r.iy;
+	Float4 far_z = (Float4::load(b + (r.near_z ^ 8 ^ 20)) - r.oz) * r.iz;
+	enter = max(max(near_x, near_y), max(near_z, Float4(0.0f)));
+	Float4 exit = min(min(far_x, far_y), min(far_z, Float4(tmax)));
+	return lane_mask(enter <= exit);
+}
+
+/// Moller-Trumbore against four triangles at once; lanes that hit before tmax
+static int block_hit(const BVH::Block& b, const Ray_Lanes& r, float tmax, Float4& t, Float4& u, Float4& v) {
+	Float4 e1x = Float4::load(b.e1x), e1y = Float4::load(b.e1y), e1z = Float4::load(b.e1z);
+	Float4 e2x = Float4::load(b.e2x), e2y = Float4::load(b.e2y), e2z = Float4::load(b.e2z);
+	Float4 px = r.dy * e2z - r.dz * e2y;
+	Float4 py = r.dz * e2x - r.dx * e2z;
+	Float4 pz = r.dx * e2y - r.dy * e2x;
+	Float4 det = e1x * px + e1y * py + e1z * pz;
+	Float4 inv = Float4(1.0f) / det;
+	Float4 sx = r.ox - Float4::load(b.v0x), sy = r.oy - Float4::load(b.v0y), sz = r.oz - Float4::load(b.v0z);
+	u = (sx * px + sy * py + sz * pz) * inv;
+	Float4 qx = sy * e1z - sz * e1y;
+	Float4 qy = sz * e1x - sx * e1z;
+	Float4 qz = sx * e1y - sy * e1x;
+	v = (r.dx * qx + r.dy * qy + r.dz * qz) * inv;
+	t = (e2x * qx + e2y * qy + e2z * qz) * inv;
+	Float4 zero(0.0f);
+	Float4 ok = ((det < zero) | (det > zero)) & (u >= zero) & (v >= zero) & (u + v <= Float4(1.0f));
+	return lane_mask(ok & (t > zero) & (t < Float4(tmax)));
+}
+
+bool BVH::hit(const Ray& ray, Hit& hit) const {
+
+	hit = {};
+	hit.t = ray.tmax;
+	if(nodes.empty()) return false;
+
+	Ray_Lanes r(ray);
+	Entry stack[stack_size];
+	int top = 0;
+	stack[top++] = {0, 0, 0.0f};
+
+	while(top > 0) {
+		Entry e = stack[--top];
+		if(e.enter > hit.t) continue;
+
+		if(e.blocks) {
+			for(uint32_t i = e.child; i < e.child + e.blocks; i++) {
+				Float4 t, u, v;
+				int bits = block_hit(blocks[i], r, hit.t, t, u, v);
+				if(!bits) continue;
+				float ts[4], us[4], vs[4];
+				t.store(ts);
+				u.store(us);
+				v.store(vs);
+				for(int j = 0; j < 4; j++) {
+					if((bits >> j & 1) && ts[j] < hit.t) {
+						hit.t = ts[j];
+						hit.u = us[j];
+						hit.v = vs[j];
+						hit.id = blocks[i].id[j];
+					}
+				}
+			}
+			continue;
+		}
+
+		const Node& node = nodes[e.child];
+		Float4 enter;
+		int bits = enter_children(node, r, hit.t, enter);
+		if(!bits) continue;
+		float dist[4];
+		enter.store(dist);
+
+		// Push farther children first, so the nearest is visited next
+		Entry next[4];
+		int n = 0;
+		for(int k = 0; k < 4; k++) {
+			if(!(bits >> k & 1)) continue;
+			Entry c = {node.child[k], node.blocks[k], dist[k]};
+			int j = n++;
+			while(j > 0 && next[j - 1].enter < c.enter) {
+				next[j] = next[j - 1];
+				j--;
+			}
+			next[j] = c;
+		}
+		assert(top + n <= stack_size);
+		for(int k = 0; k < n; k++) stack[top++] = next[k];
+	}
+	return hit.hit();
+}
+
+bool BVH::occluded(const Ray& ray) const {
+
+	if(nodes.empty()) return false;
+
+	Ray_Lanes r(ray);
+	Entry stack[stack_size];
+	int top = 0;
+	stack[top++] = {0, 0, 0.0f};
+
+	while(top > 0) {
+		Entry e = stack[--top];
+		if(e.blocks) {
+			for(uint32_t i = e.child; i < e.child + e.blocks; i++) {
+				Float4 t, u, v;
+				if(block_hit(blocks[i], r, ray.tmax, t, u, v)) return true;
+			}
+			continue;
+		}
+		const Node& node = nodes[e.child];
+		Float4 enter;
+		int bits = enter_children(node, r, ray.tmax, enter);
+		assert(top + 4 <= stack_size);
+		for(int k = 0; k < 4; k++) {
+			if(bits >> k & 1) stack[top++] = {node.child[k], node.blocks[k], 0.0f};
+		}
+	}
+	return false;
+}
+
+void BVH::hit(const Ray_Packet& rays, Hit_Packet& hits) const {
+
+	Float4 zero(0.0f);
+	Float4 ox = Float4::load(rays.ox), oy = Float4::load(rays.oy), oz = Float4::load(rays.oz);
+	Float4 dx = Float4::load(rays.dx), dy = Float4::load(rays.dy), dz = Float4::load(rays.dz);
+	Float4 ix = Float4::load(rays.ix), iy = Float4::load(rays.iy), iz = Float4::load(rays.iz);
+	Float4 t_hit = Float4::load(rays.tmax), u_hit = zero, v_hit = zero;
+	Float4 active = t_hit > zero;
+	for(int j = 0; j < 4; j++) hits.id[j] = none;
+
+	auto finish = [&]() {
+		t_hit.store(hits.t);
+		u_hit.store(hits.u);
+		v_hit.store(hits.v);
+	};
+	if(nodes.empty() || !lane_mask(active)) return finish();
+
+	// The farthest any active ray still looks
+	auto reach = [&]() {
+		float t[4];
+		select(active, t_hit, zero).store(t);
+		return std::max(std::max(t[0], t[1]), std::max(t[2], t[3]));
+	};
+
+	Entry stack[stack_size];
+	int top = 0;
+	stack[top++] = {0, 0, 0.0f};
+
+	while(top > 0) {
+		Entry e = stack[--top];
+		if(e.enter > reach()) continue;
+
+		if(e.blocks) {
+			for(uint32_t i = e.child; i < e.child + e.blocks; i++) {
+				const Block& b = blocks[i];
+				for(int j = 0; j < 4 && b.id[j] != none; j++) {
+					Float4 e1x(b.e1x[j]), e1y(b.e1y[j]), e1z(b.e1z[j]);
+					Float4 e2x(b.e2x[j]), e2y(b.e2y[j]), e2z(b.e2z[j]);
+					Float4 px = dy * e2z - dz * e2y;
+					Float4 py = dz * e2x - dx * e2z;
+					Float4 pz = dx * e2y - dy * e2x;
+					Float4 det = e1x * px + e1y * py + e1z * pz;
+					Float4 inv = Float4(1.0f) / det;
+					Float4 sx = ox - Float4(b.v0x[j]), sy = oy - Float4(b.v0y[j]), sz = oz - Float4(b.v0z[j]);
+					Float4 u = (sx * px + sy * py + sz * pz) * inv;
+					Float4 qx = sy * e1z - sz * e1y;
+					Float4 qy = sz * e1x - sx * e1z;
+					Float4 qz = sx * e1y - sy * e1x;
+					Float4 v = (dx * qx + dy * qy + dz * qz) * inv;
+					Float4 t = (e2x * qx + e2y * qy + e2z * qz) * inv;
+					Float4 ok = active & ((det < zero) | (det > zero)) & (u >= zero) & (v >= zero) &
+					            (u + v <= Float4(1.0f)) & (t > zero) & (t < t_hit);
+					int bits = lane_mask(ok);
+					if(!bits) continue;
+					t_hit = select(ok, t, t_hit);
+					u_hit = select(ok, u, u_hit);
+					v_hit = select(ok, v, v_hit);
+					for(int l = 0; l < 4; l++) {
+						if(bits >> l & 1) hits.id[l] = b.id[j];
+					}
+				}
+			}
+			continue;
+		}
+
+		const Node& node = nodes[e.child];
+		Entry next[4];
+		int n = 0;
+		for(int k = 0; k < 4 && node.child[k] != none; k++) {
+			Float4 x0 = (Float4(node.min_x[k]) - ox) * ix, x1 = (Float4(node.max_x[k]) - ox) * ix;
+			Float4 y0 = (Float4(node.min_y[k]) - oy) * iy, y1 = (Float4(node.max_y[k]) - oy) * iy;
+			Float4 z0 = (Float4(node.min_z[k]) - oz) * iz, z1 = (Float4(node.max_z[k]) - oz) * iz;
+			Float4 enter = max(max(min(x0, x1), min(y0, y1)), max(min(z0, z1), zero));
+			Float4 exit = min(min(max(x0, x1), max(y0, y1)), min(max(z0, z1), t_hit));
+			Float4 ok = active & (enter <= exit);
+			int bits = lane_mask(ok);
+			if(!bits) continue;
+
+			// Order children by the nearest entry of any ray
+			float dist[4];
+			enter.store(dist);
+			float near = FLT_MAX;
+			for(int l = 0; l < 4; l++) {
+				if(bits >> l & 1) near = std::min(near, dist[l]);
+			}
+			Entry c = {node.child[k], node.blocks[k], near};
+			int j = n++;
+			while(j > 0 && next[j - 1].enter < c.enter) {
+				next[j] = next[j - 1];
+				j--;
+			}
+			next[j] = c;
+		}
+		assert(top + n <= stack_size);
+		for(int k = 0; k < n; k++) stack[top++] = next[k];
+	}
+	finish();
+}
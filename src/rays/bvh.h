@@ -0,0 +1,167 @@
+
+#pragma once
+
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+
+#include "../lib/mathutils.h"
+
+class Jobs;
+
+/// Ray with a unit direction, looking for hits in (0, tmax]
+struct Ray {
+	Ray() {}
+	Ray(Vec3 point, Vec3 dir, float tmax = FLT_MAX) :
+		point(point),
+		dir(dir),
+		inv_dir(1.0f / dir),
+		tmax(tmax) {
+	}
+
+	Vec3 point, dir, inv_dir;
+	float tmax = FLT_MAX;
+};
+
+/// Triangle stored as a corner and two edges, for Moller-Trumbore tests
+struct Triangle {
+	Triangle() {}
+	Triangle(Vec3 a, Vec3 b, Vec3 c, uint32_t id) :
+		v0(a),
+		e1(b - a),
+		e2(c - a),
+		id(id) {
+	}
+
+	BBox bbox() const {
+		BBox box;
+		box.enclose(v0);
+		box.enclose(v0 + e1);
+		box.enclose(v0 + e2);
+		return box;
+	}
+
+	Vec3 v0, e1, e2;
+	/// Caller's index, reported by hits
+	uint32_t id = 0;
+};
+
+struct Hit {
+	float t = FLT_MAX;
+	uint32_t id = UINT32_MAX;
+	/// Barycentric weights of the second and third corners
+	float u = 0.0f, v = 0.0f;
+	/// Instance that was hit, in a two-level hierarchy
+	uint32_t instance = 0;
+
+	bool hit() const {
+		return id != UINT32_MAX;
+	}
+};
+
+/// Four rays traced together, one per lane, e.g. for a 2x2 block of
+/// pixels. Lanes with tmax <= 0 are inactive.
+struct Ray_Packet {
+	void set(int lane, const Ray& ray) {
+		ox[lane] = ray.point.x;
+		oy[lane] = ray.point.y;
+		oz[lane] = ray.point.z;
+		dx[lane] = ray.dir.x;
+		dy[lane] = ray.dir.y;
+		dz[lane] = ray.dir.z;
+		ix[lane] = ray.inv_dir.x;
+		iy[lane] = ray.inv_dir.y;
+		iz[lane] = ray.inv_dir.z;
+		tmax[lane] = ray.tmax;
+	}
+
+	float ox[4] = {}, oy[4] = {}, oz[4] = {};
+	float dx[4] = {}, dy[4] = {}, dz[4] = {};
+	float ix[4] = {}, iy[4] = {}, iz[4] = {};
+	float tmax[4] = {};
+};
+
+struct Hit_Packet {
+	Hit get(int lane) const {
+		Hit hit;
+		hit.t = t[lane];
+		hit.id = id[lane];
+		hit.u = u[lane];
+		hit.v = v[lane];
+		hit.instance = instance[lane];
+		return hit;
+	}
+
+	float t[4], u[4], v[4];
+	uint32_t id[4];
+	uint32_t instance[4] = {};
+};
+
+/// Bounding volume hierarchy over triangles. A binary tree is built top-down
+/// with the binned surface area heuristic, large subtrees in parallel, then
+/// collapsed into a four-wide tree. Each wide node keeps its children's
+/// bounds as SoA so one ray is tested against all four at once, and leaves
+/// hold triangles in groups of four for the same reason. Packets of four
+/// rays are traced together, testing all four rays against each box and
+/// triangle.
+class BVH {
+public:
+	static constexpr uint32_t bins = 16;
+	static constexpr uint32_t max_leaf = 4;
+
+	void build(std::vector<Triangle>&& tris, Jobs& jobs);
+	/// Move the triangles without changing the tree. Takes the same triangles
+	/// as the last build, indexed by id, with new positions. Traversal slows
+	/// as the tree gets looser, so large deformations call for a rebuild.
+	void refit(const std::vector<Triangle>& tris, Jobs& jobs);
+	void clear();
+
+	/// Closest hit along the ray
+	bool hit(const Ray& ray, Hit& hit) const;
+	/// Closest hits for each active ray of the packet. Pays off when the rays
+	/// are coherent, like camera rays for neighboring pixels; incoherent rays
+	/// are faster traced one at a time.
+	void hit(const Ray_Packet& rays, Hit_Packet& hits) const;
+	/// Whether anything is hit along the ray
+	bool occluded(const Ray& ray) const;
+
+	BBox bbox() const {
+		return box;
+	}
+	size_t n_nodes() const {
+		return nodes.size();
+	}
+	size_t n_tris() const {
+		return n_triangles;
+	}
+	/// Summed surface area of every node's child boxes; grows as refitting
+	/// loosens the tree
+	float area() const;
+
+	static constexpr uint32_t none = UINT32_MAX;
+
+	/// Four children: interior nodes by index, leaves as a run of blocks.
+	/// Unused slots have inverted bounds and no child.
+	struct Node {
+		float min_x[4], min_y[4], min_z[4];
+		float max_x[4], max_y[4], max_z[4];
+		uint32_t child[4];
+		/// Zero for interior nodes
+		uint32_t blocks[4];
+	};
+	/// Four triangles as SoA; unused lanes are degenerate and never hit
+	struct Block {
+		float v0x[4], v0y[4], v0z[4];
+		float e1x[4], e1y[4], e1z[4];
+		float e2x[4], e2y[4], e2z[4];
+		uint32_t id[4];
+	};
+
+private:
+	struct Builder;
+
+	BBox box;
+	size_t n_triangles = 0;
+	std::vector<Node> nodes;
+	std::vector<Block> blocks;
+};
@@ -0,0 +1,366 @@
+
+#include "tlas.h"
+#include "../jobs.h"
+
+#include <algorithm>
+
+// Rebuild a level once refitting has grown its nodes' total area by this much
+static const float rebuild_growth = 2.0f;
+// Instances per top-level leaf
+static const uint32_t max_leaf = 2;
+static const int stack_size = 64;
+
+/// Where the ray enters the box, if it does before tmax
+static bool enter(const BBox& box, const Ray& ray, float tmax, float& t) {
+	float t0 = 0.0f, t1 = tmax;
+	for(int i = 0; i < 3; i++) {
+		float a = (box.min[i] - ray.point[i]) * ray.inv_dir[i];
+		float b = (box.max[i] - ray.point[i]) * ray.inv_dir[i];
+		t0 = std::max(t0, std::min(a, b));
+		t1 = std::min(t1, std::max(a, b));
+	}
+	t = t0;
+	return t0 <= t1;
+}
+
+/// The ray in an instance's space. The direction is not normalized, so
+/// distances along it are the same as along the world-space ray.
+static Ray local(const Ray& ray, const Mat4& inverse, float tmax) {
+	return Ray(inverse * ray.point, inverse.rotate(ray.dir), tmax);
+}
+
+void TLAS::set_mesh(Key key, const std::vector<GL::Mesh::Vert>& verts, const std::vector<GL::Mesh::Index>& idxs,
+                    bool flat, Jobs& jobs) {
+
+	std::unique_ptr<Mesh>& slot = meshes[key];
+	bool fresh = !slot;
+	if(fresh) {
+		// Instances may have been waiting for this mesh
+		slot = std::make_unique<Mesh>();
+		changed = true;
+	}
+	Mesh& mesh = *slot;
+
+	// Degenerate triangles are kept, so that a refit sees the same ids
+	size_t n = idxs.size() / 3;
+	mesh.tris.resize(n);
+	mesh.norms.resize(4 * n);
+	jobs.parallel_for(0, n, 4096, [&](size_t i) {
+		const GL::Mesh::Vert& a = verts[idxs[3 * i]];
+		const GL::Mesh::Vert& b = verts[idxs[3 * i + 1]];
+		const GL::Mesh::Vert& c = verts[idxs[3 * i + 2]];
+		mesh.tris[i] = Triangle(a.pos, b.pos, c.pos, (uint32_t)i);
+		Vec3 ng = cross(b.pos - a.pos, c.pos - a.pos);
+		ng = ng.norm() > 0.0f ? ng.unit() : Vec3();
+		mesh.norms[4 * i] = ng;
+		if(flat) {
+			mesh.norms[4 * i + 1] = mesh.norms[4 * i + 2] = mesh.norms[4 * i + 3] = ng;
+			return;
+		}
+		mesh.norms[4 * i + 1] = a.norm.norm() > 0.0f ? a.norm.unit() : ng;
+		mesh.norms[4 * i + 2] = b.norm.norm() > 0.0f ? b.norm.unit() : ng;
+		mesh.norms[4 * i + 3] = c.norm.norm() > 0.0f ? c.norm.unit() : ng;
+	});
+
+	bool refit = !fresh && idxs == mesh.idxs;
+	if(refit) {
+		// Refitting keeps the old splits, which get worse as triangles move
+		mesh.bvh.refit(mesh.tris, jobs);
+		refit = mesh.bvh.area() <= rebuild_growth * mesh.built_area;
+	}
+	if(!refit) {
+		mesh.idxs = idxs;
+		mesh.bvh.build(std::vector<Triangle>(mesh.tris), jobs);
+		mesh.built_area = mesh.bvh.area();
+	}
+	moved = true;
+}
+
+void TLAS::erase_mesh(Key key) {
+	auto entry = meshes.find(key);
+	if(entry == meshes.end()) return;
+	retired.push_back(std::move(entry->second));
+	meshes.erase(entry);
+	changed = true;
+}
+
+void TLAS::set_instance(Key key, Key mesh, Mat4 transform) {
+	auto entry = placed.find(key);
+	if(entry == placed.end() || entry->second.mesh != mesh) {
+		placed[key] = {mesh, transform};
+		changed = true;
+	} else if(!(entry->second.transform == transform)) {
+		entry->second.transform = transform;
+		moved = true;
+	}
+}
+
+void TLAS::erase_instance(Key key) {
+	if(placed.erase(key)) changed = true;
+}
+
+bool TLAS::commit() {
+
+	last_rebuilt = false;
+	if(changed) {
+		instances.clear();
+		for(auto& entry : placed) {
+			Placed& p = entry.second;
+			auto mesh = meshes.find(p.mesh);
+			if(mesh == meshes.end()) {
+				p.index = BVH::none;
+				continue;
+			}
+			p.index = (uint32_t)instances.size();
+			Instance inst;
+			inst.mesh = mesh->second.get();
+			place(inst, p);
+			instances.push_back(inst);
+		}
+		retired.clear();
+		build_top();
+		last_rebuilt = true;
+	} else if(moved) {
+		for(auto& entry : placed) {
+			if(entry.second.index != BVH::none) place(instances[entry.second.index], entry.second);
+		}
+		refit_top();
+	} else {
+		return false;
+	}
+	changed = moved = false;
+	return true;
+}
+
+void TLAS::place(Instance& inst, const Placed& p) const {
+	inst.transform = p.transform;
+	inst.inverse = Mat4::inverse(p.transform);
+	inst.normal = Mat4::transpose(inst.inverse);
+	inst.box = {};
+	BBox box = inst.mesh->bvh.bbox();
+	if(box.empty()) return;
+	auto c = box.corners();
+	Mat4::transform(p.transform, c.data(), c.data(), c.size());
+	for(Vec3 v : c) inst.box.enclose(v);
+}
+
+void TLAS::build_top() {
+
+	nodes.clear();
+	order.resize(instances.size());
+	for(uint32_t i = 0; i < order.size(); i++) order[i] = i;
+	built_area = 0.0f;
+	if(instances.empty()) return;
+
+	nodes.reserve(2 * instances.size());
+	nodes.emplace_back();
+	build_node(0, 0, (uint32_t)instances.size());
+	for(const Node& node : nodes) built_area += node.box.surface_area();
+}
+
+void TLAS::build_node(uint32_t node, uint32_t begin, uint32_t end) {
+
+	BBox box, cbox;
+	for(uint32_t i = begin; i < end; i++) {
+		box.enclose(instances[order[i]].box);
+		cbox.enclose(instances[order[i]].box.center());
+	}
+	nodes[node].box = box;
+	if(end - begin <= max_leaf) {
+		nodes[node].start = begin;
+		nodes[node].count = end - begin;
+		return;
+	}
+
+	// Split at the median along the widest axis of the centers
+	Vec3 extent = cbox.max - cbox.min;
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	uint32_t mid = begin + (end - begin) / 2;
+	std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](uint32_t a, uint32_t b) {
+		return instances[a].box.center()[axis] < instances[b].box.center()[axis];
+	});
+
+	uint32_t first = (uint32_t)nodes.size();
+	nodes.emplace_back();
+	nodes.emplace_back();
+	nodes[node].start = first;
+	nodes[node].count = 0;
+	build_node(first, begin, mid);
+	build_node(first + 1, mid, end);
+}
+
+void TLAS::refit_top() {
+
+	// Children always come after their parent, so go backwards
+	float area = 0.0f;
+	for(size_t i = nodes.size(); i-- > 0;) {
+		Node& node = nodes[i];
+		node.box = {};
+		if(node.count) {
+			for(uint32_t j = node.start; j < node.start + node.count; j++) node.box.enclose(instances[order[j]].box);
+		} else {
+			node.box.enclose(nodes[node.start].box);
+			node.box.enclose(nodes[node.start + 1].box);
+		}
+		area += node.box.surface_area();
+	}
+	if(area > rebuild_growth * built_area) {
+		build_top();
+		last_rebuilt = true;
+	}
+}
+
+bool TLAS::hit(const Ray& ray, Hit& hit) const {
+
+	hit = {};
+	hit.t = ray.tmax;
+	if(nodes.empty()) return false;
+
+	uint32_t stack[stack_size];
+	int top = 0;
+	stack[top++] = 0;
+
+	while(top > 0) {
+		const Node& node = nodes[stack[--top]];
+		float t;
+		if(!enter(node.box, ray, hit.t, t)) continue;
+
+		if(node.count) {
+			for(uint32_t j = node.start; j < node.start + node.count; j++) {
+				const Instance& inst = instances[order[j]];
+				Hit h;
+				if(inst.mesh->bvh.hit(local(ray, inst.inverse, hit.t), h)) {
+					hit = h;
+					hit.instance = order[j];
+				}
+			}
+			continue;
+		}
+
+		// Visit the nearer child first
+		float t0 = FLT_MAX, t1 = FLT_MAX;
+		bool hit0 = enter(nodes[node.start].box, ray, hit.t, t0);
+		bool hit1 = enter(nodes[node.start + 1].box, ray, hit.t, t1);
+		if(hit0 && hit1) {
+			stack[top++] = t0 < t1 ? node.start + 1 : node.start;
+			stack[top++] = t0 < t1 ? node.start : node.start + 1;
+		} else if(hit0) {
+			stack[top++] = node.start;
+		} else if(hit1) {
+			stack[top++] = node.start + 1;
+		}
+	}
+	return hit.hit();
+}
+
+bool TLAS::occluded(const Ray& ray) const {
+
+	if(nodes.empty()) return false;
+
+	uint32_t stack[stack_size];
+	int top = 0;
+	stack[top++] = 0;
+
+	while(top > 0) {
+		const Node& node = nodes[stack[--top]];
+		float t;
+		if(!enter(node.box, ray, ray.tmax, t)) continue;
+		if(node.count) {
+			for(uint32_t j = node.start; j < node.start + node.count; j++) {
+				const Instance& inst = instances[order[j]];
+				if(inst.mesh->bvh.occluded(local(ray, inst.inverse, ray.tmax))) return true;
+			}
+		} else {
+			stack[top++] = node.start;
+			stack[top++] = node.start + 1;
+		}
+	}
+	return false;
+}
+
+void TLAS::hit(const Ray_Packet& rays, Hit_Packet& hits) const {
+
+	Ray lanes[4];
+	bool active[4];
+	for(int l = 0; l < 4; l++) {
+		active[l] = rays.tmax[l] > 0.0f;
+		hits.t[l] = rays.tmax[l];
+		hits.u[l] = hits.v[l] = 0.0f;
+		hits.id[l] = BVH::none;
+		hits.instance[l] = 0;
+		if(active[l]) {
+			lanes[l] = Ray(Vec3(rays.ox[l], rays.oy[l], rays.oz[l]), Vec3(rays.dx[l], rays.dy[l], rays.dz[l]));
+		}
+	}
+	if(nodes.empty()) return;
+
+	// The top level is small, so its boxes are tested one ray at a time;
+	// each instance gets the rays that reach it as a packet
+	uint32_t stack[stack_size];
+	int top = 0;
+	stack[top++] = 0;
+
+	while(top > 0) {
+		const Node& node = nodes[stack[--top]];
+		bool any = false;
+		for(int l = 0; l < 4; l++) {
+			float t;
+			any = any || (active[l] && enter(node.box, lanes[l], hits.t[l], t));
+		}
+		if(!any) continue;
+
+		if(!node.count) {
+			stack[top++] = node.start;
+			stack[top++] = node.start + 1;
+			continue;
+		}
+		for(uint32_t j = node.start; j < node.start + node.count; j++) {
+			const Instance& inst = instances[order[j]];
+			Ray_Packet packet;
+			for(int l = 0; l < 4; l++) {
+				if(active[l]) packet.set(l, local(lanes[l], inst.inverse, hits.t[l]));
+			}
+			Hit_Packet h;
+			inst.mesh->bvh.hit(packet, h);
+			for(int l = 0; l < 4; l++) {
+				if(h.id[l] == BVH::none) continue;
+				hits.t[l] = h.t[l];
+				hits.u[l] = h.u[l];
+				hits.v[l] = h.v[l];
+				hits.id[l] = h.id[l];
+				hits.instance[l] = order[j];
+			}
+		}
+	}
+}
+
+TLAS::Surface TLAS::surface(const Ray& ray, const Hit& hit) const {
+
+	const Instance& inst = instances[hit.instance];
+	const Vec3* n = &inst.mesh->norms[4 * (size_t)hit.id];
+
+	Surface s;
+	s.point = ray.point + hit.t * ray.dir;
+	s.ng = inst.normal.rotate(n[0]).unit();
+	if(dot(s.ng, ray.dir) > 0.0f) s.ng = -s.ng;
+	s.ns = inst.normal.rotate(n[1] * (1.0f - hit.u - hit.v) + n[2] * hit.u + n[3] * hit.v);
+	if(dot(s.ns, s.ng) < 0.0f) s.ns = -s.ns;
+	s.ns = s.ns.norm() > 0.0f ? s.ns.unit() : s.ng;
+	return s;
+}
+
+BBox TLAS::bbox() const {
+	return nodes.empty() ? BBox() : nodes[0].box;
+}
+
+size_t TLAS::n_tris() const {
+	size_t n = 0;
+	for(const Instance& inst : instances) n += inst.mesh->tris.size();
+	return n;
+}
+
+size_t TLAS::n_nodes() const {
+	size_t n = nodes.size();
+	for(const auto& entry : meshes) n += entry.second->bvh.n_nodes();
+	return n;
+}
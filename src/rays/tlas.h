@@ -0,0 +1,110 @@
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+#include "bvh.h"
+#include "../platform/gl.h"
+
+/// Two-level BVH. Each mesh has a bottom-level BVH in its own space, shared
+/// by all of its instances, and a small top level is built over the
+/// instances' world-space bounds. Moving an instance refits the top level,
+/// and changing only a mesh's vertex positions refits its bottom level, so
+/// neither is rebuilt from scratch. The top level is rebuilt when instances
+/// are added or removed, or when refitting has let it grow too loose.
+class TLAS {
+public:
+	/// Callers name meshes and instances with their own keys
+	using Key = uint64_t;
+
+	/// Set a mesh's triangles. If the indices are the same as last time, the
+	/// bottom level is refitted rather than rebuilt, unless that has let it
+	/// grow too loose. Flat meshes shade with their face normals, like
+	/// GL::Mesh::flat() ones in the viewport.
+	void set_mesh(Key mesh, const std::vector<GL::Mesh::Vert>& verts, const std::vector<GL::Mesh::Index>& idxs,
+	              bool flat, Jobs& jobs);
+	void erase_mesh(Key mesh);
+
+	/// Place an instance of a mesh
+	void set_instance(Key instance, Key mesh, Mat4 transform);
+	void erase_instance(Key instance);
+
+	/// Bring the top level up to date with the changes made since the last
+	/// commit. Returns whether there were any.
+	bool commit();
+
+	/// Closest hit along a world-space ray. Hits report the triangle in its
+	/// mesh and the instance, as an index for surface.
+	bool hit(const Ray& ray, Hit& hit) const;
+	void hit(const Ray_Packet& rays, Hit_Packet& hits) const;
+	bool occluded(const Ray& ray) const;
+
+	/// World-space point and normals at a hit. The geometric normal faces the
+	/// ray; the shading normal is interpolated and on the same side.
+	struct Surface {
+		Vec3 point, ng, ns;
+	};
+	Surface surface(const Ray& ray, const Hit& hit) const;
+
+	BBox bbox() const;
+	size_t n_instances() const {
+		return instances.size();
+	}
+	/// Triangles in the scene, counting each instance
+	size_t n_tris() const;
+	/// Nodes in the top level and every bottom level
+	size_t n_nodes() const;
+	/// Whether the last commit rebuilt the top level, rather than refitting it
+	bool rebuilt() const {
+		return last_rebuilt;
+	}
+
+private:
+	struct Mesh {
+		BVH bvh;
+		/// Object space, indexed by id
+		std::vector<Triangle> tris;
+		std::vector<GL::Mesh::Index> idxs;
+		/// Per triangle: the geometric normal, then the three corner normals
+		std::vector<Vec3> norms;
+		/// BVH::area() at the last build
+		float built_area = 0.0f;
+	};
+	struct Placed {
+		Key mesh;
+		Mat4 transform;
+		/// Into instances, once committed
+		uint32_t index = BVH::none;
+	};
+	struct Instance {
+		const Mesh* mesh = nullptr;
+		Mat4 transform, inverse, normal;
+		BBox box;
+	};
+	/// Binary node: leaves hold instances [start, start + count) of order,
+	/// interior nodes two adjacent children starting at start
+	struct Node {
+		BBox box;
+		uint32_t start = 0, count = 0;
+	};
+
+	void place(Instance& inst, const Placed& placed) const;
+	void build_top();
+	void build_node(uint32_t node, uint32_t begin, uint32_t end);
+	void refit_top();
+
+	std::unordered_map<Key, std::unique_ptr<Mesh>> meshes;
+	/// Erased meshes may still be instanced until the next commit
+	std::vector<std::unique_ptr<Mesh>> retired;
+	std::map<Key, Placed> placed;
+
+	std::vector<Instance> instances;
+	std::vector<uint32_t> order;
+	std::vector<Node> nodes;
+	/// Sum of node areas at the last rebuild
+	float built_area = 0.0f;
+
+	bool moved = false, changed = false, last_rebuilt = false;
+};
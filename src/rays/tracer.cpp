@@ -0,0 +1,274 @@
+
+#include "tracer.h"
+#include "../jobs.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+
+static const float pi = 3.14159265358979f;
+// Bounces after which paths may be terminated early
+static const unsigned int min_bounces = 2;
+
+/// Per-pixel random numbers, seeded from the pixel and sample index so
+/// images do not depend on which thread took which tile
+static uint64_t mix(uint64_t x) {
+	x += 0x9e3779b97f4a7c15ull;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+static float uniform(uint64_t& state) {
+	state = mix(state);
+	return (float)(state >> 40) * (1.0f / 16777216.0f);
+}
+
+/// Cosine-weighted direction about the unit normal n
+static Vec3 cosine_sample(Vec3 n, uint64_t& rng) {
+	float r = std::sqrt(uniform(rng)), phi = 2.0f * pi * uniform(rng);
+	float x = r * std::cos(phi), y = r * std::sin(phi);
+	float z = std::sqrt(std::max(0.0f, 1.0f - x * x - y * y));
+	Vec3 t = std::abs(n.x) > 0.5f ? cross(n, Vec3(0.0f, 1.0f, 0.0f)) : cross(n, Vec3(1.0f, 0.0f, 0.0f));
+	t.normalize();
+	Vec3 b = cross(n, t);
+	return (x * t + y * b + z * n).unit();
+}
+
+void Path_Tracer::set_mesh(TLAS::Key mesh, const std::vector<GL::Mesh::Vert>& verts,
+                           const std::vector<GL::Mesh::Index>& idxs, bool flat, Jobs& jobs) {
+	auto start = std::chrono::steady_clock::now();
+	scene.set_mesh(mesh, verts, idxs, flat, jobs);
+	pending_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Path_Tracer::erase_mesh(TLAS::Key mesh) {
+	scene.erase_mesh(mesh);
+}
+
+void Path_Tracer::set_instance(TLAS::Key instance, TLAS::Key mesh, Mat4 transform) {
+	scene.set_instance(instance, mesh, transform);
+}
+
+void Path_Tracer::erase_instance(TLAS::Key instance) {
+	scene.erase_instance(instance);
+}
+
+void Path_Tracer::commit() {
+
+	auto start = std::chrono::steady_clock::now();
+	bool changed = scene.commit();
+	pending_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	if(!changed) return;
+
+	_stats.build_ms = pending_ms;
+	_stats.rebuilt = scene.rebuilt();
+	_stats.tris = scene.n_tris();
+	_stats.nodes = scene.n_nodes();
+	_stats.instances = scene.n_instances();
+	pending_ms = 0.0;
+	restart();
+}
+
+void Path_Tracer::view(uint32_t width, uint32_t height, Vec3 e, Mat4 ivp) {
+	if(width == w && height == h && e == eye && ivp == iviewproj) return;
+	w = width;
+	h = height;
+	eye = e;
+	iviewproj = ivp;
+	accum.assign((size_t)w * h, Vec3());
+	restart();
+}
+
+void Path_Tracer::set_options(Options o) {
+	opt = o;
+	restart();
+}
+
+void Path_Tracer::restart() {
+	std::fill(accum.begin(), accum.end(), Vec3());
+	_stats.samples = 0;
+	_stats.rays = 0;
+	_stats.seconds = 0.0;
+}
+
+Vec3 Path_Tracer::trace(Ray ray, Hit hit, uint64_t& rng, size_t& rays) const {
+
+	Vec3 light, throughput(1.0f);
+	Vec3 sun_dir = opt.sun_dir.unit();
+
+	for(unsigned int bounce = 0;; bounce++) {
+
+		if(!hit.hit()) {
+			float up = clamp(0.5f + 0.5f * ray.dir.y, 0.0f, 1.0f);
+			light += throughput * (opt.sky * up + Vec3(0.2f) * (1.0f - up));
+			break;
+		}
+
+		TLAS::Surface surf = scene.surface(ray, hit);
+		Vec3 ns = surf.ns;
+
+		// Step off the surface in proportion to the coordinates' magnitude
+		Vec3 p = surf.point;
+		Vec3 scale = p.abs();
+		p += surf.ng * (1e-4f * std::max(1.0f, std::max(scale.x, std::max(scale.y, scale.z))));
+
+		throughput *= opt.albedo;
+
+		float sun_cos = dot(ns, sun_dir);
+		if(sun_cos > 0.0f) {
+			rays++;
+			if(!scene.occluded(Ray(p, sun_dir))) light += throughput * opt.sun * sun_cos;
+		}
+		if(bounce == opt.depth) break;
+
+		if(bounce >= min_bounces) {
+			float survive = std::min(0.95f, std::max(throughput.x, std::max(throughput.y, throughput.z)));
+			if(uniform(rng) >= survive) break;
+			throughput /= survive;
+		}
+		ray = Ray(p, cosine_sample(ns, rng));
+		rays++;
+		scene.hit(ray, hit);
+	}
+	return light;
+}
+
+Ray Path_Tracer::camera_ray(float sx, float sy) const {
+	return Ray(eye, (iviewproj * Vec3(sx, sy, 0.5f) - eye).unit());
+}
+
+void Path_Tracer::render_tile(uint32_t tile, size_t& rays) {
+
+	uint32_t tiles_x = (w + tile_size - 1) / tile_size;
+	uint32_t x0 = (tile % tiles_x) * tile_size, y0 = (tile / tiles_x) * tile_size;
+	uint32_t x1 = std::min(w, x0 + tile_size), y1 = std::min(h, y0 + tile_size);
+
+	for(uint32_t y = y0; y < y1; y += 2) {
+		for(uint32_t x = x0; x < x1; x += 2) {
+
+			Ray_Packet packet;
+			Ray ray[4];
+			uint64_t rng[4];
+			for(int lane = 0; lane < 4; lane++) {
+				uint32_t px = x + (lane & 1), py = y + (lane >> 1);
+				if(px >= x1 || py >= y1) continue;
+				size_t pixel = (size_t)py * w + px;
+				rng[lane] = mix(pixel * 0x100000001b3ull + _stats.samples);
+				float sx = 2.0f * (px + uniform(rng[lane])) / w - 1.0f;
+				float sy = 1.0f - 2.0f * (py + uniform(rng[lane])) / h;
+				ray[lane] = camera_ray(sx, sy);
+				packet.set(lane, ray[lane]);
+				rays++;
+			}
+
+			Hit_Packet hits;
+			scene.hit(packet, hits);
+			for(int lane = 0; lane < 4; lane++) {
+				if(!(packet.tmax[lane] > 0.0f)) continue;
+				size_t pixel = (size_t)(y + (lane >> 1)) * w + x + (lane & 1);
+				accum[pixel] += trace(ray[lane], hits.get(lane), rng[lane], rays);
+			}
+		}
+	}
+}
+
+void Path_Tracer::sample(Jobs& jobs) {
+
+	if(accum.empty()) return;
+	auto start = std::chrono::steady_clock::now();
+
+	uint32_t tiles = ((w + tile_size - 1) / tile_size) * ((h + tile_size - 1) / tile_size);
+	std::atomic<uint32_t> next = 0;
+	std::atomic<size_t> rays = 0;
+	jobs.parallel_for(0, jobs.threads(), 1, [&](size_t) {
+		size_t local = 0;
+		uint32_t tile;
+		while((tile = next.fetch_add(1, std::memory_order_relaxed)) < tiles) render_tile(tile, local);
+		rays += local;
+	});
+
+	_stats.samples++;
+	_stats.rays += rays;
+	_stats.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+Path_Tracer::Bench Path_Tracer::benchmark(Jobs& jobs) const {
+
+	Bench bench;
+	size_t n = (size_t)w * h;
+	if(!n) return bench;
+
+	// Camera rays in 2x2 pixel quads, so neighboring rays share a packet
+	std::vector<Ray> primary(n);
+	jobs.parallel_for(0, n, 4096, [&](size_t i) {
+		size_t quad = i / 4, lane = i % 4;
+		size_t quads_x = (w + 1) / 2;
+		uint32_t x = std::min(w - 1, (uint32_t)(2 * (quad % quads_x) + (lane & 1)));
+		uint32_t y = std::min(h - 1, (uint32_t)(2 * (quad / quads_x) + (lane >> 1)));
+		primary[i] = camera_ray(2.0f * (x + 0.5f) / w - 1.0f, 1.0f - 2.0f * (y + 0.5f) / h);
+	});
+
+	std::vector<Hit> hits(n);
+	auto time = [&](const std::vector<Ray>& rays, bool packets) {
+		auto start = std::chrono::steady_clock::now();
+		jobs.parallel_for(0, (rays.size() + 3) / 4, 256, [&](size_t i) {
+			size_t first = 4 * i, count = std::min((size_t)4, rays.size() - first);
+			if(packets) {
+				Ray_Packet packet;
+				Hit_Packet result;
+				for(size_t j = 0; j < count; j++) packet.set((int)j, rays[first + j]);
+				scene.hit(packet, result);
+				for(size_t j = 0; j < count; j++) hits[first + j] = result.get((int)j);
+			} else {
+				for(size_t j = 0; j < count; j++) scene.hit(rays[first + j], hits[first + j]);
+			}
+		});
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		return seconds > 0.0 ? rays.size() / seconds / 1e6 : 0.0;
+	};
+
+	bench.primary = time(primary, false);
+	bench.primary_packets = time(primary, true);
+
+	// One diffuse bounce from each camera hit, in no particular order
+	std::vector<Ray> secondary;
+	uint64_t rng = mix(n);
+	for(size_t i = 0; i < n; i++) {
+		if(!hits[i].hit()) continue;
+		TLAS::Surface surf = scene.surface(primary[i], hits[i]);
+		secondary.push_back(Ray(surf.point + surf.ng * 1e-4f, cosine_sample(surf.ng, rng)));
+	}
+	if(secondary.empty()) return bench;
+	hits.resize(secondary.size());
+	bench.secondary = time(secondary, false);
+	bench.secondary_packets = time(secondary, true);
+	return bench;
+}
+
+void Path_Tracer::image(std::vector<unsigned char>& rgba, Jobs& jobs) const {
+
+	rgba.resize(accum.size() * 4);
+	float scale = _stats.samples ? 1.0f / _stats.samples : 0.0f;
+	jobs.parallel_for(0, accum.size(), 4096, [&](size_t i) {
+		Vec3 c = accum[i] * scale;
+		for(int j = 0; j < 3; j++) {
+			float v = std::pow(clamp(c[j], 0.0f, 1.0f), 1.0f / 2.2f);
+			rgba[4 * i + j] = (unsigned char)(v * 255.0f + 0.5f);
+		}
+		rgba[4 * i + 3] = 255;
+	});
+}
+
+std::string Path_Tracer::write(const std::string& file, Jobs& jobs) const {
+
+	std::vector<unsigned char> rgba;
+	image(rgba, jobs);
+
+	std::ofstream out(file, std::ios::binary);
+	if(!out) return "Could not open " + file + " for writing.";
+	out << "P6\n" << w << " " << h << "\n255\n";
+	for(size_t i = 0; i < accum.size(); i++) out.write((const char*)&rgba[4 * i], 3);
+	if(!out) return "Could not write " + file + ".";
+	return {};
+}
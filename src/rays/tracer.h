@@ -0,0 +1,111 @@
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "tlas.h"
+
+class Jobs;
+
+/// Progressive CPU path tracer. Surfaces are diffuse, lit by a sky and a sun.
+/// Each pass adds one sample to every pixel; the image is cut into tiles
+/// that worker threads take as they finish their last. Camera rays are traced
+/// as packets over 2x2 pixels, bounces one ray at a time. The scene is kept
+/// between renders as a two-level BVH, so moving objects or their vertices
+/// refits it rather than rebuilding it.
+class Path_Tracer {
+public:
+	static constexpr uint32_t tile_size = 16;
+
+	struct Options {
+		/// Bounces after the first hit
+		unsigned int depth = 4;
+		Vec3 albedo = Vec3(0.7f);
+		Vec3 sky = Vec3(0.5f, 0.6f, 0.7f);
+		Vec3 sun_dir = Vec3(0.5f, 1.0f, 0.3f);
+		Vec3 sun = Vec3(0.8f);
+	};
+	struct Stats {
+		size_t samples = 0, rays = 0;
+		double seconds = 0.0;
+		/// Time spent on scene changes up to the last commit, and whether the
+		/// top level was rebuilt or only refitted
+		double build_ms = 0.0;
+		bool rebuilt = false;
+		size_t tris = 0, nodes = 0, instances = 0;
+		/// Samples per pixel added per second
+		double samples_per_second() const {
+			return seconds > 0.0 ? samples / seconds : 0.0;
+		}
+		double rays_per_second() const {
+			return seconds > 0.0 ? rays / seconds : 0.0;
+		}
+	};
+	/// Mrays/s for one ray per pixel from the camera, and for one diffuse
+	/// bounce from each of their hits, traced singly and in packets of four
+	struct Bench {
+		double primary = 0.0, primary_packets = 0.0;
+		double secondary = 0.0, secondary_packets = 0.0;
+	};
+
+	/// Scene changes, applied by commit; see TLAS
+	void set_mesh(TLAS::Key mesh, const std::vector<GL::Mesh::Vert>& verts,
+	              const std::vector<GL::Mesh::Index>& idxs, bool flat, Jobs& jobs);
+	void erase_mesh(TLAS::Key mesh);
+	void set_instance(TLAS::Key instance, TLAS::Key mesh, Mat4 transform);
+	void erase_instance(TLAS::Key instance);
+	/// Apply scene changes, restarting accumulation if there were any
+	void commit();
+
+	/// Image size and camera, from its position and inverse view-projection
+	/// matrix; restarts accumulation if anything changed
+	void view(uint32_t width, uint32_t height, Vec3 eye, Mat4 iviewproj);
+	void set_options(Options opt);
+	/// Drop accumulated samples
+	void restart();
+
+	/// Add one sample to every pixel
+	void sample(Jobs& jobs);
+
+	/// Time closest-hit queries against the current build and view
+	Bench benchmark(Jobs& jobs) const;
+
+	/// Tone mapped RGBA8 pixels, first row at the top
+	void image(std::vector<unsigned char>& rgba, Jobs& jobs) const;
+	/// Write the image as a binary PPM
+	std::string write(const std::string& file, Jobs& jobs) const;
+
+	uint32_t width() const {
+		return w;
+	}
+	uint32_t height() const {
+		return h;
+	}
+	const Stats& stats() const {
+		return _stats;
+	}
+	BBox bbox() const {
+		return scene.bbox();
+	}
+
+private:
+	/// Radiance along a ray, given its first hit
+	Vec3 trace(Ray ray, Hit hit, uint64_t& rng, size_t& rays) const;
+	Ray camera_ray(float sx, float sy) const;
+	void render_tile(uint32_t tile, size_t& rays);
+
+	Options opt;
+	Stats _stats;
+
+	TLAS scene;
+	/// Time spent on scene changes since the last commit
+	double pending_ms = 0.0;
+
+	uint32_t w = 0, h = 0;
+	Vec3 eye;
+	Mat4 iviewproj;
+	/// Sum of samples per pixel
+	std::vector<Vec3> accum;
+};
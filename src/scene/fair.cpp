@@ -0,0 +1,275 @@
+
+#include "fair.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <unordered_set>
+
+// Solver tolerance, relative to the right-hand side
+static const double tolerance = 1e-8;
+static const size_t max_iterations = 2000;
+
+static double ms_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::vector<Fairing::VertexRef> Fairing::region(Halfedge_Mesh& mesh, Halfedge_Mesh::ElementCRef center,
+                                                unsigned int rings) {
+
+	std::unordered_set<const Halfedge_Mesh::Vertex*> found;
+	std::vector<Halfedge_Mesh::VertexCRef> frontier;
+	auto add = [&](Halfedge_Mesh::VertexCRef v) {
+		if(found.insert(&*v).second) frontier.push_back(v);
+	};
+
+	if(auto v = std::get_if<Halfedge_Mesh::VertexCRef>(&center)) {
+		add(*v);
+	} else if(auto e = std::get_if<Halfedge_Mesh::EdgeCRef>(&center)) {
+		add((*e)->halfedge()->vertex());
+		add((*e)->halfedge()->twin()->vertex());
+	} else if(auto h = std::get_if<Halfedge_Mesh::HalfedgeCRef>(&center)) {
+		add((*h)->vertex());
+		add((*h)->twin()->vertex());
+	} else if(auto f = std::get_if<Halfedge_Mesh::FaceCRef>(&center)) {
+		Halfedge_Mesh::HalfedgeCRef g = (*f)->halfedge();
+		do {
+			add(g->vertex());
+			g = g->next();
+		} while(g != (*f)->halfedge());
+	}
+
+	for(unsigned int r = 0; r < rings; r++) {
+		std::vector<Halfedge_Mesh::VertexCRef> ring = std::move(frontier);
+		frontier.clear();
+		for(Halfedge_Mesh::VertexCRef v : ring) {
+			Halfedge_Mesh::HalfedgeCRef h = v->halfedge();
+			do {
+				add(h->twin()->vertex());
+				h = h->twin()->next();
+			} while(h != v->halfedge());
+		}
+	}
+
+	std::vector<VertexRef> ret;
+	ret.reserve(found.size());
+	for(VertexRef v = mesh.vertices_begin(); v != mesh.vertices_end(); v++) {
+		if(found.count(&*v)) ret.push_back(v);
+	}
+	return ret;
+}
+
+uint32_t Fairing::index(VertexRef v) {
+	auto entry = idx.find(&*v);
+	if(entry != idx.end()) return entry->second;
+	uint32_t i = (uint32_t)verts.size();
+	idx[&*v] = i;
+	verts.push_back(v);
+	return i;
+}
+
+void Fairing::laplacian(std::vector<Sparse_Matrix::Entry>& entries, std::vector<double>& area) {
+
+	// Rows are complete for the vertices present so far, which are coupled
+	// through their faces to vertices added along the way
+	uint32_t n_rows = (uint32_t)verts.size();
+	area.assign(n_rows, 0.0);
+
+	std::unordered_set<const Halfedge_Mesh::Face*> faces;
+	std::vector<Halfedge_Mesh::FaceRef> todo;
+	for(uint32_t i = 0; i < n_rows; i++) {
+		Halfedge_Mesh::HalfedgeRef h = verts[i]->halfedge();
+		do {
+			Halfedge_Mesh::FaceRef f = h->face();
+			if(!f->is_boundary() && faces.insert(&*f).second) todo.push_back(f);
+			h = h->twin()->next();
+		} while(h != verts[i]->halfedge());
+	}
+
+	// Fan-triangulate each face. Unlike to_mesh, concave faces are not split
+	// properly; clamping the cotangents keeps their weights positive.
+	auto add_edge = [&](uint32_t i, uint32_t j, double w) {
+		if(i < n_rows) {
+			entries.push_back({i, i, w});
+			entries.push_back({i, j, -w});
+		}
+		if(j < n_rows) {
+			entries.push_back({j, j, w});
+			entries.push_back({j, i, -w});
+		}
+	};
+	for(Halfedge_Mesh::FaceRef f : todo) {
+		Halfedge_Mesh::HalfedgeRef h0 = f->halfedge(), h = h0->next();
+		uint32_t a = index(h0->vertex());
+		while(h->next() != h0) {
+			uint32_t b = index(h->vertex()), c = index(h->next()->vertex());
+			Vec3 pa = verts[a]->pos, pb = verts[b]->pos, pc = verts[c]->pos;
+			double twice_area = cross(pb - pa, pc - pa).norm();
+			if(twice_area > 0.0) {
+				auto cot = [twice_area](Vec3 u, Vec3 v) {
+					return std::max(0.0, (double)dot(u, v) / twice_area);
+				};
+				add_edge(b, c, 0.5 * cot(pb - pa, pc - pa));
+				add_edge(c, a, 0.5 * cot(pc - pb, pa - pb));
+				add_edge(a, b, 0.5 * cot(pa - pc, pb - pc));
+			}
+			for(uint32_t v : {a, b, c}) {
+				if(v < n_rows) area[v] += twice_area / 6.0;
+			}
+			h = h->next();
+		}
+	}
+}
+
+std::string Fairing::begin(Halfedge_Mesh& m, std::vector<VertexRef> free, Options o) {
+
+	auto start = std::chrono::steady_clock::now();
+	mesh = &m;
+	opt = o;
+	_stats = {};
+	verts.clear();
+	idx.clear();
+	auto fail = [this](const char* msg) {
+		verts.clear();
+		return std::string(msg);
+	};
+	if(free.empty()) return "No vertices to move.";
+	if(opt.order < 1 || opt.order > 2) return "Fairing supports orders 1 and 2.";
+
+	for(VertexRef v : free) index(v);
+	n_free = (uint32_t)verts.size();
+
+	// The bi-Laplacian needs full rows of L for everything sharing a face
+	// with a free vertex
+	if(opt.order == 2) {
+		for(uint32_t i = 0; i < n_free; i++) {
+			Halfedge_Mesh::HalfedgeRef h = verts[i]->halfedge();
+			do {
+				if(!h->face()->is_boundary()) {
+					Halfedge_Mesh::HalfedgeRef g = h;
+					do {
+						index(g->vertex());
+						g = g->next();
+					} while(g != h);
+				}
+				h = h->twin()->next();
+			} while(h != verts[i]->halfedge());
+		}
+	}
+
+	std::vector<Sparse_Matrix::Entry> entries;
+	std::vector<double> area;
+	laplacian(entries, area);
+	uint32_t n = (uint32_t)verts.size();
+	Sparse_Matrix L = Sparse_Matrix::from_entries(n, n, entries);
+
+	double edge = 0.0;
+	size_t n_edges = 0;
+	for(uint32_t i = 0; i < n_free; i++) {
+		if(!(area[i] > 0.0)) return fail("The region has degenerate faces.");
+		for(uint32_t k = L.row_start[i]; k < L.row_start[i + 1]; k++) {
+			if(L.col[k] == i) continue;
+			edge += (verts[L.col[k]]->pos - verts[i]->pos).norm();
+			n_edges++;
+		}
+	}
+	edge /= std::max(n_edges, (size_t)1);
+
+	// Rows of the free vertices of L or L M^-1 L
+	entries.clear();
+	if(opt.order == 1) {
+		for(uint32_t i = 0; i < n_free; i++) {
+			for(uint32_t k = L.row_start[i]; k < L.row_start[i + 1]; k++) {
+				entries.push_back({i, L.col[k], L.val[k]});
+			}
+		}
+	} else {
+		for(uint32_t i = 0; i < n_free; i++) {
+			for(uint32_t k = L.row_start[i]; k < L.row_start[i + 1]; k++) {
+				uint32_t mid = L.col[k];
+				if(!(area[mid] > 0.0)) return fail("The region has degenerate faces.");
+				double w = L.val[k] / area[mid];
+				for(uint32_t j = L.row_start[mid]; j < L.row_start[mid + 1]; j++) {
+					entries.push_back({i, L.col[j], w * L.val[j]});
+				}
+			}
+		}
+	}
+
+	mass.assign(n_free, 0.0);
+	if(opt.mode == Mode::smooth) {
+		double t = opt.strength * std::pow(edge * edge, (double)opt.order);
+		for(auto& e : entries) e.val *= t;
+		for(uint32_t i = 0; i < n_free; i++) {
+			mass[i] = area[i];
+			entries.push_back({i, i, area[i]});
+		}
+	} else if(n == n_free) {
+		return fail("Fairing needs vertices outside the region to hold in place.");
+	}
+
+	// Split columns into the free and fixed blocks
+	std::vector<Sparse_Matrix::Entry> fixed;
+	auto split = std::partition(entries.begin(), entries.end(), [this](const Sparse_Matrix::Entry& e) {
+		return e.col < n_free;
+	});
+	for(auto e = split; e != entries.end(); e++) fixed.push_back({e->row, e->col - n_free, e->val});
+	entries.erase(split, entries.end());
+	A = Sparse_Matrix::from_entries(n_free, n_free, entries);
+	B = Sparse_Matrix::from_entries(n_free, n - n_free, fixed);
+
+	_stats.free = n_free;
+	_stats.fixed = n - n_free;
+	_stats.nonzeros = A.nonzeros();
+	if(!factor.factor(A)) return fail("Could not factor the fairing system.");
+	_stats.build_ms = ms_since(start);
+	return {};
+}
+
+std::string Fairing::apply() {
+
+	if(verts.empty()) return "Fairing has not been set up.";
+	auto start = std::chrono::steady_clock::now();
+
+	uint32_t n = (uint32_t)verts.size();
+	std::vector<double> x(n_free), fixed(n - n_free), b, bx;
+	std::vector<Vec3> result(n_free);
+	_stats.iterations = 0;
+
+	for(int c = 0; c < 3; c++) {
+		for(uint32_t i = 0; i < n_free; i++) x[i] = verts[i]->pos[c];
+		for(uint32_t i = n_free; i < n; i++) fixed[i - n_free] = verts[i]->pos[c];
+		B.multiply(fixed, bx);
+		b.resize(n_free);
+		for(uint32_t i = 0; i < n_free; i++) b[i] = mass[i] * x[i] - bx[i];
+		_stats.iterations += conjugate_gradient(A, factor, b, x, tolerance, max_iterations);
+		for(uint32_t i = 0; i < n_free; i++) result[i][c] = (float)x[i];
+	}
+
+	for(Vec3 p : result) {
+		if(!p.valid()) return "Fairing produced invalid positions.";
+	}
+	for(uint32_t i = 0; i < n_free; i++) verts[i]->pos = result[i];
+	mesh->render_pos_dirty_flag = true;
+
+	// Refresh normals around the moved vertices
+	for(uint32_t i = 0; i < n; i++) {
+		Vec3 norm;
+		Halfedge_Mesh::HalfedgeRef h = verts[i]->halfedge();
+		do {
+			if(!h->face()->is_boundary()) {
+				Halfedge_Mesh::HalfedgeRef g = h->next();
+				Vec3 p0 = h->vertex()->pos;
+				while(g->next() != h) {
+					norm += cross(g->vertex()->pos - p0, g->next()->vertex()->pos - p0);
+					g = g->next();
+				}
+			}
+			h = h->twin()->next();
+		} while(h != verts[i]->halfedge());
+		if(norm.norm() > 0.0f) verts[i]->norm = norm.unit();
+	}
+
+	_stats.solve_ms = ms_since(start);
+	return {};
+}
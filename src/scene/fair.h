@@ -0,0 +1,72 @@
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "halfedge.h"
+#include "../lib/sparse.h"
+
+/// Laplacian smoothing and fairing of a region of a mesh. Uses the cotangent
+/// Laplacian L (weights clamped to be non-negative) and lumped vertex areas
+/// M. The system is assembled and factored once per region; while the
+/// connectivity is unchanged, each apply only re-solves from the current
+/// positions.
+class Fairing {
+public:
+	using VertexRef = Halfedge_Mesh::VertexRef;
+
+	enum class Mode {
+		/// Implicit diffusion step: (M + t L_k) x = M x0
+		smooth,
+		/// Minimize the membrane (k = 1) or thin plate (k = 2) energy: L_k x = 0
+		fair
+	};
+	struct Options {
+		Mode mode = Mode::smooth;
+		/// 1 for the Laplacian, 2 for the bi-Laplacian L M^-1 L
+		unsigned int order = 1;
+		/// Smoothing time step, in units of the squared mean edge length
+		float strength = 1.0f;
+		bool operator==(const Options& o) const {
+			return mode == o.mode && order == o.order && strength == o.strength;
+		}
+	};
+	struct Stats {
+		size_t free = 0, fixed = 0, nonzeros = 0, iterations = 0;
+		double build_ms = 0.0, solve_ms = 0.0;
+	};
+
+	/// Vertices within the given number of rings of an element
+	static std::vector<VertexRef> region(Halfedge_Mesh& mesh, Halfedge_Mesh::ElementCRef center,
+	                                     unsigned int rings);
+
+	/// Assemble and factor the system for moving the free vertices, with
+	/// their neighbors held in place. The mesh connectivity must not change
+	/// until the next begin.
+	std::string begin(Halfedge_Mesh& mesh, std::vector<VertexRef> free, Options opt);
+	/// Solve from the current positions and move the free vertices
+	std::string apply();
+	const Stats& stats() const {
+		return _stats;
+	}
+
+private:
+	uint32_t index(VertexRef v);
+	void laplacian(std::vector<Sparse_Matrix::Entry>& entries, std::vector<double>& area);
+
+	Halfedge_Mesh* mesh = nullptr;
+	Options opt;
+	Stats _stats;
+
+	/// Free vertices first, then the fixed vertices they are coupled to
+	std::vector<VertexRef> verts;
+	std::unordered_map<const Halfedge_Mesh::Vertex*, uint32_t> idx;
+	uint32_t n_free = 0;
+	/// Free-free block, its factorization, and free-fixed block
+	Sparse_Matrix A, B;
+	Incomplete_Cholesky factor;
+	/// Right-hand side weights of the free vertices' current positions
+	std::vector<double> mass;
+};
@@ -1,9 +1,17 @@
 
 #include "halfedge.h"
+#include "optimize.h"
+#include "../jobs.h"
+#include "../lib/log.h"
 
+#include <algorithm>
+#include <atomic>
 #include <map>
+#include <mutex>
 #include <set>
 #include <sstream>
+#include <type_traits>
+#include <unordered_map>
 
 Halfedge_Mesh::Halfedge_Mesh(const GL::Mesh& mesh) {
 	from_mesh(mesh);
@@ -12,28 +20,374 @@ Halfedge_Mesh::Halfedge_Mesh(const std::vector<std::vector<Index>>& polygons, co
 	from_poly(polygons, verts);
 }
 Halfedge_Mesh::Halfedge_Mesh(Halfedge_Mesh&& src) {
-	halfedges = std::move(src.halfedges);
-	vertices = std::move(src.vertices);
-	edges = std::move(src.edges);
-	faces = std::move(src.faces);
-	boundaries = std::move(src.boundaries);
-	render_dirty_flag = src.render_dirty_flag;
+	swap(src);
 }
 void Halfedge_Mesh::operator=(Halfedge_Mesh&& src) {
-	halfedges = std::move(src.halfedges);
-	vertices = std::move(src.vertices);
-	edges = std::move(src.edges);
-	faces = std::move(src.faces);
-	boundaries = std::move(src.boundaries);
-	render_dirty_flag = src.render_dirty_flag;
+	swap(src);
+	src.clear();
+}
+
+/// Lists swap allocators along with their nodes, so the pools go with them
+void Halfedge_Mesh::swap(Halfedge_Mesh& src) {
+	std::swap(pools, src.pools);
+	std::swap(halfedges, src.halfedges);
+	std::swap(vertices, src.vertices);
+	std::swap(edges, src.edges);
+	std::swap(faces, src.faces);
+	std::swap(boundaries, src.boundaries);
+	std::swap(next_ids, src.next_ids);
+	std::swap(render_dirty_flag, src.render_dirty_flag);
+	std::swap(render_pos_dirty_flag, src.render_pos_dirty_flag);
+	std::swap(triangulations, src.triangulations);
+	std::swap(layout, src.layout);
+}
+
+/// Empty the list, then drop its pool's chunks all at once. Unlinking the
+/// nodes only pushes them onto the free list, which the reset discards.
+template<typename T>
+static void reset_list(Halfedge_Mesh::List<T>& list) {
+	list.clear();
+	list.get_allocator().pool().reset();
 }
 
 void Halfedge_Mesh::clear() {
-	halfedges.clear();
-	vertices.clear();
-	edges.clear();
-	faces.clear();
-	boundaries.clear();
+	reset_list(halfedges);
+	reset_list(vertices);
+	reset_list(edges);
+	reset_list(faces);
+	reset_list(boundaries);
+	next_ids = {};
+	triangulations.clear();
+	layout = {};
+	render_dirty_flag = true;
+}
+
+/// Interleave the low 10 bits of x with two zero bits between each
+static uint32_t spread_bits(uint32_t x) {
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+/// 30-bit Morton code of p quantized within box
+static uint32_t morton(Vec3 p, const BBox& box) {
+	Vec3 extent = box.max - box.min;
+	Vec3 t = p - box.min;
+	uint32_t q[3];
+	for(int i = 0; i < 3; i++) {
+		float u = extent[i] > 0.0f ? t[i] / extent[i] : 0.0f;
+		q[i] = (uint32_t)std::clamp(u * 1023.0f, 0.0f, 1023.0f);
+	}
+	return spread_bits(q[0]) | (spread_bits(q[1]) << 1) | (spread_bits(q[2]) << 2);
+}
+
+/// Element order sorted by key, ties kept in list order
+static std::vector<Halfedge_Mesh::Index> sort_by(const std::vector<uint32_t>& keys) {
+	std::vector<Halfedge_Mesh::Index> order(keys.size());
+	for(size_t i = 0; i < order.size(); i++) order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](auto a, auto b) { return keys[a] < keys[b]; });
+	return order;
+}
+
+Halfedge_Mesh::Remap Halfedge_Mesh::compact() {
+
+	std::vector<VertexRef> vs;
+	std::vector<EdgeRef> es;
+	std::vector<FaceRef> fs, bs;
+	std::vector<HalfedgeRef> hs;
+	vs.reserve(vertices.size());
+	es.reserve(edges.size());
+	fs.reserve(faces.size());
+	bs.reserve(boundaries.size());
+	hs.reserve(halfedges.size());
+	for(auto v = vertices.begin(); v != vertices.end(); v++) vs.push_back(v);
+	for(auto e = edges.begin(); e != edges.end(); e++) es.push_back(e);
+	for(auto f = faces.begin(); f != faces.end(); f++) fs.push_back(f);
+	for(auto b = boundaries.begin(); b != boundaries.end(); b++) bs.push_back(b);
+	for(auto h = halfedges.begin(); h != halfedges.end(); h++) hs.push_back(h);
+
+	std::unordered_map<const Halfedge*, Index> h_idx;
+	std::unordered_map<const Edge*, Index> e_idx;
+	h_idx.reserve(hs.size());
+	e_idx.reserve(es.size());
+	for(Index i = 0; i < hs.size(); i++) h_idx[&*hs[i]] = i;
+	for(Index i = 0; i < es.size(); i++) e_idx[&*es[i]] = i;
+
+	BBox box = SoA::bounds(positions());
+	std::vector<uint32_t> keys(vs.size());
+	for(Index i = 0; i < vs.size(); i++) keys[i] = morton(vs[i]->pos, box);
+	std::vector<Index> v_order = sort_by(keys);
+
+	keys.resize(fs.size());
+	for(Index i = 0; i < fs.size(); i++) keys[i] = morton(fs[i]->average(), box);
+	std::vector<Index> f_order = sort_by(keys);
+
+	// Halfedges follow their face loops so next() stays close in memory;
+	// edges come in the order their halfedges are first reached
+	std::vector<Index> h_order, e_order;
+	std::vector<bool> h_seen(hs.size(), false), e_seen(es.size(), false);
+	h_order.reserve(hs.size());
+	e_order.reserve(es.size());
+
+	auto visit = [&](Index h) {
+		if(h_seen[h]) return;
+		h_seen[h] = true;
+		h_order.push_back(h);
+		Index e = e_idx[&*hs[h]->edge()];
+		if(!e_seen[e]) {
+			e_seen[e] = true;
+			e_order.push_back(e);
+		}
+	};
+	auto visit_loop = [&](FaceRef f) {
+		HalfedgeRef h = f->halfedge();
+		do {
+			visit(h_idx[&*h]);
+			h = h->next();
+		} while(h != f->halfedge());
+	};
+	for(Index f : f_order) visit_loop(fs[f]);
+	for(FaceRef b : bs) visit_loop(b);
+	// Anything unreachable from a face keeps its relative order
+	for(Index h = 0; h < hs.size(); h++) visit(h);
+	for(Index e = 0; e < es.size(); e++) {
+		if(!e_seen[e]) e_order.push_back(e);
+	}
+
+	// Copy into fresh pools in the new order
+	auto new_pools = std::make_unique<Pools>();
+	List<Vertex> new_vertices{Pool_Allocator<Vertex>(new_pools->vertices)};
+	List<Edge> new_edges{Pool_Allocator<Edge>(new_pools->edges)};
+	List<Face> new_faces{Pool_Allocator<Face>(new_pools->faces)};
+	List<Face> new_boundaries{Pool_Allocator<Face>(new_pools->boundaries)};
+	List<Halfedge> new_halfedges{Pool_Allocator<Halfedge>(new_pools->halfedges)};
+
+	std::unordered_map<const Vertex*, VertexRef> v_map;
+	std::unordered_map<const Edge*, EdgeRef> e_map;
+	std::unordered_map<const Face*, FaceRef> f_map;
+	std::vector<HalfedgeRef> h_map(hs.size());
+	v_map.reserve(vs.size());
+	e_map.reserve(es.size());
+	f_map.reserve(fs.size() + bs.size());
+
+	for(Index i : v_order) v_map[&*vs[i]] = new_vertices.insert(new_vertices.end(), *vs[i]);
+	for(Index i : e_order) e_map[&*es[i]] = new_edges.insert(new_edges.end(), *es[i]);
+	for(Index i : f_order) f_map[&*fs[i]] = new_faces.insert(new_faces.end(), *fs[i]);
+	for(FaceRef b : bs) f_map[&*b] = new_boundaries.insert(new_boundaries.end(), *b);
+	for(Index i : h_order) h_map[i] = new_halfedges.insert(new_halfedges.end(), *hs[i]);
+
+	next_ids = {};
+	for(Vertex& v : new_vertices) v._id = next_ids.vertices++;
+	for(Edge& e : new_edges) e._id = next_ids.edges++;
+	for(Face& f : new_faces) f._id = next_ids.faces++;
+	for(Face& b : new_boundaries) b._id = next_ids.faces++;
+	for(Halfedge& h : new_halfedges) h._id = next_ids.halfedges++;
+
+	auto new_h = [&](HalfedgeRef h) {
+		return h_map[h_idx[&*h]];
+	};
+	for(Vertex& v : new_vertices) v.halfedge() = new_h(v.halfedge());
+	for(Edge& e : new_edges) e.halfedge() = new_h(e.halfedge());
+	for(Face& f : new_faces) f.halfedge() = new_h(f.halfedge());
+	for(Face& b : new_boundaries) b.halfedge() = new_h(b.halfedge());
+	for(Halfedge& h : new_halfedges) {
+		h.twin() = new_h(h.twin());
+		h.next() = new_h(h.next());
+		h.vertex() = v_map[&*h.vertex()];
+		h.edge() = e_map[&*h.edge()];
+		h.face() = f_map[&*h.face()];
+	}
+
+	Remap remap;
+	auto invert = [](const std::vector<Index>& order, std::vector<Index>& out) {
+		out.resize(order.size());
+		for(Index i = 0; i < order.size(); i++) out[order[i]] = i;
+	};
+	invert(v_order, remap.vertices);
+	invert(e_order, remap.edges);
+	invert(f_order, remap.faces);
+	invert(h_order, remap.halfedges);
+
+	// Old nodes go back to the old pools before those are freed
+	vertices = std::move(new_vertices);
+	edges = std::move(new_edges);
+	faces = std::move(new_faces);
+	boundaries = std::move(new_boundaries);
+	halfedges = std::move(new_halfedges);
+	pools = std::move(new_pools);
+
+	render_dirty_flag = true;
+	return remap;
+}
+
+Halfedge_Mesh::Pool_Stats Halfedge_Mesh::pool_stats() const {
+	Pool_Stats stats;
+	stats.vertices = vertices.get_allocator().pool().stats();
+	stats.edges = edges.get_allocator().pool().stats();
+	stats.faces = faces.get_allocator().pool().stats();
+	stats.boundaries = boundaries.get_allocator().pool().stats();
+	stats.halfedges = halfedges.get_allocator().pool().stats();
+	return stats;
+}
+
+Halfedge_Mesh::Flat Halfedge_Mesh::to_flat() const {
+
+	Flat flat;
+	std::unordered_map<const Vertex*, uint32_t> v_idx;
+	std::unordered_map<const Edge*, uint32_t> e_idx;
+	std::unordered_map<const Halfedge*, uint32_t> h_idx;
+	v_idx.reserve(vertices.size());
+	e_idx.reserve(edges.size());
+	h_idx.reserve(halfedges.size());
+
+	flat.pos.reserve(vertices.size());
+	for(const Vertex& v : vertices) {
+		v_idx[&v] = (uint32_t)flat.pos.size();
+		flat.pos.push_back(v.pos);
+	}
+	uint32_t e = 0;
+	for(const Edge& edge : edges) e_idx[&edge] = e++;
+
+	// Number interior halfedges face by face
+	flat.face_start.reserve(faces.size() + 1);
+	uint32_t n_h = 0;
+	for(const Face& f : faces) {
+		flat.face_start.push_back(n_h);
+		HalfedgeCRef h = f.halfedge();
+		do {
+			h_idx[&*h] = n_h++;
+			h = h->next();
+		} while(h != f.halfedge());
+	}
+	flat.face_start.push_back(n_h);
+
+	flat.vertex.resize(n_h);
+	flat.twin.resize(n_h);
+	flat.edge.resize(n_h);
+	flat.face.resize(n_h);
+	flat.edge_halfedge.resize(edges.size(), Flat::none);
+	uint32_t f_idx = 0, i = 0;
+	for(const Face& f : faces) {
+		HalfedgeCRef h = f.halfedge();
+		do {
+			flat.vertex[i] = v_idx[&*h->vertex()];
+			flat.twin[i] = h->twin()->face()->is_boundary() ? Flat::none : h_idx[&*h->twin()];
+			flat.edge[i] = e_idx[&*h->edge()];
+			flat.face[i] = f_idx;
+			if(flat.edge_halfedge[flat.edge[i]] == Flat::none) flat.edge_halfedge[flat.edge[i]] = i;
+			i++;
+			h = h->next();
+		} while(h != f.halfedge());
+		f_idx++;
+	}
+
+	// On the boundary, start from the interior halfedge that follows the
+	// incoming boundary edge. A vertex need not point along its boundary
+	// loop, so look for it around the fan.
+	flat.vertex_halfedge.reserve(vertices.size());
+	for(const Vertex& v : vertices) {
+		HalfedgeCRef h = v.halfedge();
+		do {
+			if(h->face()->is_boundary()) break;
+			h = h->twin()->next();
+		} while(h != v.halfedge());
+		if(h->face()->is_boundary()) h = h->twin()->next();
+		flat.vertex_halfedge.push_back(h_idx[&*h]);
+	}
+	return flat;
+}
+
+void Halfedge_Mesh::from_flat(const Flat& flat) {
+
+	clear();
+
+	uint32_t n_h = (uint32_t)flat.vertex.size();
+	std::vector<VertexRef> vs(flat.pos.size());
+	std::vector<EdgeRef> es(flat.edge_halfedge.size());
+	std::vector<FaceRef> fs(flat.face_start.size() - 1);
+	std::vector<HalfedgeRef> hs(n_h), bs(n_h);
+
+	// Isolated vertices have no halfedge to point at, so they are dropped
+	for(size_t i = 0; i < vs.size(); i++) {
+		if(flat.vertex_halfedge[i] == Flat::none) continue;
+		vs[i] = new_vertex();
+		vs[i]->pos = flat.pos[i];
+	}
+	for(EdgeRef& e : es) e = new_edge();
+	for(FaceRef& f : fs) f = new_face();
+	for(HalfedgeRef& h : hs) h = new_halfedge();
+	for(uint32_t h = 0; h < n_h; h++) {
+		if(flat.twin[h] == Flat::none) bs[h] = new_halfedge();
+	}
+
+	for(uint32_t h = 0; h < n_h; h++) {
+		HalfedgeRef he = hs[h];
+		he->vertex() = vs[flat.vertex[h]];
+		he->edge() = es[flat.edge[h]];
+		he->face() = fs[flat.face[h]];
+		he->next() = hs[flat.next(h)];
+		he->twin() = flat.twin[h] == Flat::none ? bs[h] : hs[flat.twin[h]];
+	}
+	for(size_t e = 0; e < es.size(); e++) es[e]->halfedge() = hs[flat.edge_halfedge[e]];
+	for(size_t f = 0; f < fs.size(); f++) fs[f]->halfedge() = hs[flat.face_start[f]];
+
+	// Boundary halfedges run opposite their interior twins; the next one
+	// along the loop is found by turning around the twin's start vertex
+	std::vector<uint32_t> b_next(n_h, Flat::none);
+	for(uint32_t h = 0; h < n_h; h++) {
+		if(flat.twin[h] != Flat::none) continue;
+		uint32_t g = flat.prev(h);
+		while(flat.twin[g] != Flat::none) g = flat.prev(flat.twin[g]);
+		b_next[h] = g;
+
+		HalfedgeRef t = bs[h];
+		t->twin() = hs[h];
+		t->vertex() = vs[flat.vertex[flat.next(h)]];
+		t->edge() = es[flat.edge[h]];
+		t->next() = bs[g];
+	}
+	std::vector<bool> b_seen(n_h, false);
+	for(uint32_t h = 0; h < n_h; h++) {
+		if(flat.twin[h] != Flat::none || b_seen[h]) continue;
+		FaceRef b = new_boundary();
+		b->halfedge() = bs[h];
+		uint32_t g = h;
+		do {
+			b_seen[g] = true;
+			bs[g]->face() = b;
+			g = b_next[g];
+		} while(g != h);
+	}
+
+	// As in from_poly, boundary vertices point along their boundary loop
+	for(size_t v = 0; v < vs.size(); v++) {
+		uint32_t h = flat.vertex_halfedge[v];
+		if(h == Flat::none) continue;
+		vs[v]->halfedge() = flat.on_boundary((uint32_t)v) ? bs[flat.prev(h)] : hs[h];
+	}
+
+	// Same as compute_normals, without looking up vertex indices
+	std::vector<uint32_t> tris;
+	tris.reserve(3 * (n_h - 2 * fs.size()));
+	for(size_t f = 0; f < fs.size(); f++) {
+		uint32_t h0 = flat.face_start[f];
+		for(uint32_t h = h0 + 1; h + 1 < flat.face_start[f + 1]; h++) {
+			tris.push_back(flat.vertex[h0]);
+			tris.push_back(flat.vertex[h]);
+			tris.push_back(flat.vertex[h + 1]);
+		}
+	}
+	SoA_Vec3 pos, norm;
+	pos.reserve(flat.pos.size());
+	for(Vec3 p : flat.pos) pos.push_back(p);
+	SoA::vertex_normals(pos, tris, norm);
+	for(size_t v = 0; v < vs.size(); v++) {
+		if(flat.vertex_halfedge[v] != Flat::none) vs[v]->norm = norm.get(v);
+	}
+
 	render_dirty_flag = true;
 }
 
@@ -49,80 +403,396 @@ Vec3 Halfedge_Mesh::Face::average() const {
 	return c / d;
 }
 
-void Halfedge_Mesh::to_mesh(GL::Mesh& mesh, bool face_normals) const {
+Optimize::Stats Halfedge_Mesh::to_mesh(GL::Mesh& mesh, bool face_normals, bool optimize) const {
 
 	std::vector<GL::Mesh::Vert> verts;
 	std::vector<GL::Mesh::Index> idxs;
+	std::vector<GLuint> face_ids;
+	Optimize::Stats stats = to_triangles(verts, idxs, face_ids, face_normals, optimize);
+	mesh.update(std::move(verts), std::move(idxs), std::move(face_ids));
+	return stats;
+}
 
-	if(face_normals) {
-		GLuint face_id = 1;
-		for(FaceCRef f = faces_begin(); f != faces_end(); f++, face_id++) {
+Optimize::Stats Halfedge_Mesh::to_triangles(std::vector<GL::Mesh::Vert>& verts, std::vector<GL::Mesh::Index>& idxs,
+                                            std::vector<GLuint>& face_ids, bool face_normals, bool optimize) const {
+
+	verts.clear();
+	idxs.clear();
+	face_ids.clear();
+
+	// Vertices are always shared between faces. For face normals, the renderer
+	// derives the flat normal in the fragment shader and looks up each
+	// triangle's face id by gl_PrimitiveID, so we don't need to emit three
+	// unique vertices per triangle.
+
+	// Need to build this map to get vertex's linear index in O(1)
+	std::unordered_map<const Vertex*, Index> vref_to_idx;
+	vref_to_idx.reserve(vertices.size());
+	verts.reserve(vertices.size());
+	Index i = 0;
+	for (VertexCRef f = vertices_begin(); f != vertices_end(); f++, i++) {
+		vref_to_idx[&*f] = i;
+		verts.push_back({f->pos, f->norm, 0});
+	}
 
-			if(f->is_boundary()) continue;
+	std::vector<Index> face_verts;
+	std::vector<const void*> corner_verts;
+	std::vector<Vec3> corner_pos;
+	triangulations.begin();
 
-			std::vector<GL::Mesh::Vert> face_verts;
-			HalfedgeCRef h = f->halfedge();
-			do {
-				VertexCRef v = h->vertex();
-				face_verts.push_back({v->pos, v->norm, 0});
-				h = h->next();
-			} while (h != f->halfedge());
-
-			assert(face_verts.size() >= 3);
-			for(size_t i = 1; i <= face_verts.size() - 2; i++) {
-				Vec3 v0 = face_verts[0].pos;
-				Vec3 v1 = face_verts[i].pos;
-				Vec3 v2 = face_verts[i+1].pos;
-				Vec3 n = cross(v1 - v0, v2 - v0).unit();
-				idxs.push_back(verts.size());
-				verts.push_back({v0, n, face_id});
-				idxs.push_back(verts.size());
-				verts.push_back({v1, n, face_id});
-				idxs.push_back(verts.size());
-				verts.push_back({v2, n, face_id});
-			}
+	GLuint face_id = 1;
+	for(FaceCRef f = faces_begin(); f != faces_end(); f++, face_id++) {
+
+		if(f->is_boundary()) continue;
+		
+		face_verts.clear();
+		corner_verts.clear();
+		corner_pos.clear();
+		HalfedgeCRef h = f->halfedge();
+		do {
+			face_verts.push_back(vref_to_idx[&*h->vertex()]);
+			corner_verts.push_back(&*h->vertex());
+			corner_pos.push_back(h->vertex()->pos);
+			h = h->next();
+		} while (h != f->halfedge());
+
+		assert(face_verts.size() >= 3);
+		if(face_verts.size() == 3) {
+			idxs.insert(idxs.end(), face_verts.begin(), face_verts.end());
+			if(face_normals) face_ids.push_back(face_id);
+			continue;
 		}
+		const std::vector<uint32_t>& tris = triangulations.get(&*f, corner_verts, corner_pos);
+		for(size_t i = 0; i < tris.size(); i += 3) {
+			idxs.push_back(face_verts[tris[i]]);
+			idxs.push_back(face_verts[tris[i + 1]]);
+			idxs.push_back(face_verts[tris[i + 2]]);
+			if(face_normals) face_ids.push_back(face_id);
+		}
+	}
+	triangulations.end();
+
+	// Small meshes mostly fit in the cache as-is
+	if(optimize && idxs.size() / 3 >= 4096) return Optimize::mesh(verts, idxs, face_ids, &layout);
+	// Keep the optimized order while only positions change, so the triangles
+	// stay the same for the path tracer to refit
+	if(Optimize::replay(layout, verts, idxs, face_ids)) return layout.stats;
+	layout = {};
+	return {};
+}
 
-	} else {
+namespace {
+
+// Violations past this many are only counted
+const size_t max_reported = 16;
+
+/// Checks mesh invariants element by element, safe to call from several
+/// threads at once. In full mode, every reference is checked against the
+/// live elements and reference counts are compared; in local mode neither is
+/// available, so only back-pointers and loops are checked.
+class Checker {
+public:
+	using VertexCRef = Halfedge_Mesh::VertexCRef;
+	using EdgeCRef = Halfedge_Mesh::EdgeCRef;
+	using FaceCRef = Halfedge_Mesh::FaceCRef;
+	using HalfedgeCRef = Halfedge_Mesh::HalfedgeCRef;
+
+	explicit Checker(const Halfedge_Mesh& mesh) : limit(mesh.n_halfedges()) {}
+
+	/// Switch to full mode: index every element, so references can be
+	/// checked and counted
+	void index(const Halfedge_Mesh& mesh) {
+		full = true;
+		std::vector<uint32_t> n(5, 0);
+		auto add = [&](const void* e, size_t type) {
+			idx[e] = n[type]++;
+		};
+		idx.reserve(mesh.n_halfedges() + mesh.n_vertices() + mesh.n_edges() + mesh.n_faces());
+		for(auto v = mesh.vertices_begin(); v != mesh.vertices_end(); v++) add(&*v, 0);
+		for(auto e = mesh.edges_begin(); e != mesh.edges_end(); e++) add(&*e, 1);
+		for(auto f = mesh.faces_begin(); f != mesh.faces_end(); f++) add(&*f, 2);
+		for(auto f = mesh.boundaries_begin(); f != mesh.boundaries_end(); f++) add(&*f, 3);
+		for(auto h = mesh.halfedges_begin(); h != mesh.halfedges_end(); h++) add(&*h, 4);
+		outgoing = std::vector<std::atomic<uint32_t>>(n[0]);
+		edge_refs = std::vector<std::atomic<uint32_t>>(n[1]);
+		face_refs = std::vector<std::atomic<uint32_t>>(n[2]);
+		boundary_refs = std::vector<std::atomic<uint32_t>>(n[3]);
+	}
 
-		// Need to build this map to get vertex's linear index in O(lg n)
-		std::map<VertexCRef, Index> vref_to_idx;
-		Index i = 0;
-		for (VertexCRef f = vertices_begin(); f != vertices_end(); f++, i++) {
-			vref_to_idx[f] = i;
-			verts.push_back({f->pos, f->norm, 0});
+	void halfedge(HalfedgeCRef h) {
+		if(full) {
+			uint32_t v = find(h->vertex()), e = find(h->edge()), f = find(h->face());
+			if(find(h->twin()) == none || find(h->next()) == none || v == none || e == none || f == none) {
+				dangling = true;
+				fail(h, "refers to an erased element");
+				return;
+			}
+			outgoing[v]++;
+			edge_refs[e]++;
+			(h->face()->is_boundary() ? boundary_refs : face_refs)[f]++;
+		}
+		if(h->twin() == h) {
+			fail(h, "is its own twin");
+			return;
 		}
+		if(h->twin()->twin() != h) fail(h, "is not its twin's twin");
+		if(h->twin()->edge() != h->edge()) fail(h, "has a different edge than its twin");
+		if(h->vertex() == h->twin()->vertex()) fail(h, "starts and ends at the same vertex");
+		if(h->next()->vertex() != h->twin()->vertex()) fail(h, "is followed by a halfedge starting elsewhere");
+		if(h->face()->is_boundary() && h->twin()->face()->is_boundary()) {
+			fail(h, "and its twin are both on boundary loops");
+		}
+	}
 
-		for(FaceCRef f = faces_begin(); f != faces_end(); f++) {
+	void vertex(VertexCRef v) {
+		if(!v->pos.valid() || !v->norm.valid()) fail(v, "has a non-finite position or normal");
+		HalfedgeCRef start = v->halfedge();
+		if(!live(start)) {
+			fail(v, "refers to an erased halfedge");
+			return;
+		}
+		if(start->vertex() != v) {
+			fail(v, "has a halfedge that starts elsewhere");
+			return;
+		}
+		if(dangling) return;
+		size_t n = 0;
+		HalfedgeCRef h = start;
+		do {
+			if(h->vertex() != v) {
+				fail(v, "has a halfedge around it that starts elsewhere");
+				return;
+			}
+			h = h->twin()->next();
+			n++;
+		} while(h != start && n <= limit);
+		if(h != start) {
+			fail(v, "has halfedges around it that do not form a cycle");
+		} else if(full && n != outgoing[at(v)]) {
+			fail(v, "is non-manifold: only " + std::to_string(n) + " of its " + std::to_string(outgoing[at(v)]) +
+			            " halfedges are reached around it");
+		}
+	}
 
-			if(f->is_boundary()) continue;
-			
-			std::vector<Index> face_verts;
-			HalfedgeCRef h = f->halfedge();
-			do {
-				face_verts.push_back(vref_to_idx[h->vertex()]);
-				h = h->next();
-			} while (h != f->halfedge());
-
-			assert(face_verts.size() >= 3);
-			for(size_t i = 1; i <= face_verts.size() - 2; i++) {
-				idxs.push_back(face_verts[0]);
-				idxs.push_back(face_verts[i]);
-				idxs.push_back(face_verts[i+1]);
+	void edge(EdgeCRef e) {
+		if(!live(e->halfedge())) {
+			fail(e, "refers to an erased halfedge");
+			return;
+		}
+		if(e->halfedge()->edge() != e) fail(e, "has a halfedge on another edge");
+		if(full && edge_refs[at(e)] != 2) {
+			fail(e, "is used by " + std::to_string(edge_refs[at(e)]) + " halfedges instead of 2");
+		}
+	}
+
+	void face(FaceCRef f, bool boundary) {
+		if(f->is_boundary() != boundary) {
+			fail(f, boundary ? "is in the boundary list but is not a boundary" : "is in the face list but is a boundary");
+		}
+		HalfedgeCRef start = f->halfedge();
+		if(!live(start)) {
+			fail(f, "refers to an erased halfedge");
+			return;
+		}
+		if(dangling) return;
+		size_t n = 0;
+		HalfedgeCRef h = start;
+		do {
+			if(h->face() != f) {
+				fail(f, "has a halfedge in its loop on another face");
+				return;
 			}
+			h = h->next();
+			n++;
+		} while(h != start && n <= limit);
+		if(h != start) {
+			fail(f, "has halfedges that do not form a loop");
+			return;
+		}
+		if(!f->is_boundary() && n < 3) fail(f, "has fewer than three sides");
+		if(full && n != (f->is_boundary() ? boundary_refs : face_refs)[at(f)]) {
+			fail(f, "is used by halfedges outside its loop");
 		}
 	}
 
-	mesh = GL::Mesh(std::move(verts), std::move(idxs));
+	std::string report() {
+		if(count == 0) return {};
+		std::sort(messages.begin(), messages.end());
+		std::string ret = count == 1 ? "" : "Found " + std::to_string(count) + " problems with the mesh:\n";
+		for(const std::string& m : messages) ret += m + "\n";
+		if(count > messages.size()) ret += "...and " + std::to_string(count - messages.size()) + " more.\n";
+		ret.pop_back();
+		return ret;
+	}
+
+private:
+	static constexpr uint32_t none = UINT32_MAX;
+
+	template<typename T>
+	uint32_t find(T ref) const {
+		auto entry = idx.find(&*ref);
+		return entry == idx.end() ? none : entry->second;
+	}
+	template<typename T>
+	bool live(T ref) const {
+		return !full || find(ref) != none;
+	}
+	template<typename T>
+	uint32_t at(T ref) const {
+		return idx.at(&*ref);
+	}
+
+	template<typename T>
+	std::string label(T ref, const char* type) const {
+		return std::string(type) + (full ? " " + std::to_string(at(ref)) : "");
+	}
+	std::string name(VertexCRef v) const {
+		return label(v, "Vertex");
+	}
+	std::string name(EdgeCRef e) const {
+		return label(e, "Edge");
+	}
+	std::string name(FaceCRef f) const {
+		return label(f, f->is_boundary() ? "Boundary loop" : "Face");
+	}
+	std::string name(HalfedgeCRef h) const {
+		return label(h, "Halfedge");
+	}
+
+	template<typename T>
+	void fail(T ref, const std::string& msg) {
+		std::string m = name(ref) + " " + msg + ".";
+		std::lock_guard<std::mutex> lock(mut);
+		if(messages.size() < max_reported) messages.push_back(std::move(m));
+		count++;
+	}
+
+	bool full = false;
+	size_t limit;
+	// Set when a halfedge refers to an erased element; walking loops from
+	// then on could leave the mesh, so only direct checks are done
+	std::atomic<bool> dangling = false;
+	std::unordered_map<const void*, uint32_t> idx;
+	std::vector<std::atomic<uint32_t>> outgoing, edge_refs, face_refs, boundary_refs;
+
+	std::mutex mut;
+	std::vector<std::string> messages;
+	size_t count = 0;
+};
+
+/// Run all checks, with each pass split up by for_range(n, f)
+template<typename F>
+std::string validate_all(const Halfedge_Mesh& mesh, F&& for_range) {
+
+	Checker check(mesh);
+	check.index(mesh);
+
+	std::vector<Halfedge_Mesh::HalfedgeCRef> hs;
+	std::vector<Halfedge_Mesh::VertexCRef> vs;
+	std::vector<Halfedge_Mesh::EdgeCRef> es;
+	std::vector<Halfedge_Mesh::FaceCRef> fs, bs;
+	hs.reserve(mesh.n_halfedges());
+	vs.reserve(mesh.n_vertices());
+	es.reserve(mesh.n_edges());
+	fs.reserve(mesh.n_faces());
+	for(auto h = mesh.halfedges_begin(); h != mesh.halfedges_end(); h++) hs.push_back(h);
+	for(auto v = mesh.vertices_begin(); v != mesh.vertices_end(); v++) vs.push_back(v);
+	for(auto e = mesh.edges_begin(); e != mesh.edges_end(); e++) es.push_back(e);
+	for(auto f = mesh.faces_begin(); f != mesh.faces_end(); f++) fs.push_back(f);
+	for(auto f = mesh.boundaries_begin(); f != mesh.boundaries_end(); f++) bs.push_back(f);
+
+	// Halfedges first, since they count the references the rest compare against
+	for_range(hs.size(), [&](size_t i) {
+		check.halfedge(hs[i]);
+	});
+	for_range(vs.size(), [&](size_t i) {
+		check.vertex(vs[i]);
+	});
+	for_range(es.size(), [&](size_t i) {
+		check.edge(es[i]);
+	});
+	for_range(fs.size(), [&](size_t i) {
+		check.face(fs[i], false);
+	});
+	for_range(bs.size(), [&](size_t i) {
+		check.face(bs[i], true);
+	});
+	return check.report();
+}
+
 }
 
 std::string Halfedge_Mesh::validate() const {
-	
-	// TODO(max): many more validation checks (run after student op)
-	// so we can return an error instead of crashing
+	return validate_all(*this, [](size_t n, auto&& f) {
+		for(size_t i = 0; i < n; i++) f(i);
+	});
+}
 
-	if(!check_finite()) return "A vertex position or normal has a non-finite value.";
-	return {};
+std::string Halfedge_Mesh::validate(Jobs& jobs) const {
+	return validate_all(*this, [&jobs](size_t n, auto&& f) {
+		jobs.parallel_for(0, n, 1024, f);
+	});
+}
+
+std::string Halfedge_Mesh::validate_local(const std::vector<ElementCRef>& touched) const {
+
+	Checker check(*this);
+	std::set<const void*> seen;
+	auto once = [&seen](const auto& ref) {
+		return seen.insert(&*ref).second;
+	};
+
+	// Gather the vertices of the touched elements
+	std::vector<VertexCRef> verts;
+	for(const ElementCRef& elem : touched) {
+		if(auto v = std::get_if<VertexCRef>(&elem)) {
+			verts.push_back(*v);
+		} else if(auto e = std::get_if<EdgeCRef>(&elem)) {
+			if(once(*e)) check.edge(*e);
+			verts.push_back((*e)->halfedge()->vertex());
+			verts.push_back((*e)->halfedge()->twin()->vertex());
+		} else if(auto h = std::get_if<HalfedgeCRef>(&elem)) {
+			if(once(*h)) check.halfedge(*h);
+			verts.push_back((*h)->vertex());
+			verts.push_back((*h)->twin()->vertex());
+		} else if(auto f = std::get_if<FaceCRef>(&elem)) {
+			if(once(*f)) check.face(*f, (*f)->is_boundary());
+			HalfedgeCRef g = (*f)->halfedge();
+			size_t n = 0;
+			do {
+				verts.push_back(g->vertex());
+				g = g->next();
+			} while(g != (*f)->halfedge() && ++n <= halfedges.size());
+		}
+	}
+
+	// Check each vertex and the elements around it, once each
+	for(VertexCRef v : verts) {
+		if(!once(v)) continue;
+		check.vertex(v);
+		HalfedgeCRef h = v->halfedge();
+		size_t n = 0;
+		do {
+			for(HalfedgeCRef g : {h, h->twin()}) {
+				if(once(g)) check.halfedge(g);
+				if(once(g->face())) check.face(g->face(), g->face()->is_boundary());
+			}
+			if(once(h->edge())) check.edge(h->edge());
+			h = h->twin()->next();
+		} while(h != v->halfedge() && h->vertex() == v && ++n <= halfedges.size());
+	}
+	return check.report();
+}
+
+std::string Halfedge_Mesh::validate_edit(const std::vector<ElementCRef>& touched) const {
+	if constexpr(validation == Validation::full) {
+		return validate();
+	} else if constexpr(validation == Validation::local) {
+		return validate_local(touched);
+	} else {
+		(void)touched;
+		return {};
+	}
 }
 
 std::string Halfedge_Mesh::from_mesh(const GL::Mesh& mesh) {
@@ -142,15 +812,46 @@ std::string Halfedge_Mesh::from_mesh(const GL::Mesh& mesh) {
 	return {};
 }
 
-bool Halfedge_Mesh::check_finite() const {
+SoA_Vec3 Halfedge_Mesh::positions() const {
+	SoA_Vec3 ret;
+	ret.reserve(vertices.size());
+	for(const Vertex& v : vertices) ret.push_back(v.pos);
+	return ret;
+}
+
+SoA_Vec3 Halfedge_Mesh::normals() const {
+	SoA_Vec3 ret;
+	ret.reserve(vertices.size());
+	for(const Vertex& v : vertices) ret.push_back(v.norm);
+	return ret;
+}
 
-	for (VertexCRef v = vertices_begin(); v != vertices_end(); v++) {
-		Vec3 p = v->pos, n = v->norm;
-		bool finite = std::isfinite(p.x) && std::isfinite(p.y) && std::isfinite(p.z);
-		finite = finite && std::isfinite(n.x) && std::isfinite(n.y) && std::isfinite(n.z);
-		if(!finite) return false;
+void Halfedge_Mesh::compute_normals() {
+
+	std::unordered_map<const Vertex*, Index> idx;
+	idx.reserve(vertices.size());
+	Index i = 0;
+	for(const Vertex& v : vertices) idx[&v] = i++;
+
+	// Fan-triangulate each face. Concave faces are split properly by to_mesh,
+	// but a fan is good enough for averaging normals.
+	std::vector<Index> tris;
+	for(FaceCRef f = faces_begin(); f != faces_end(); f++) {
+		HalfedgeCRef h0 = f->halfedge(), h = h0->next();
+		Index a = idx[&*h0->vertex()];
+		while(h->next() != h0) {
+			tris.push_back(a);
+			tris.push_back(idx[&*h->vertex()]);
+			tris.push_back(idx[&*h->next()->vertex()]);
+			h = h->next();
+		}
 	}
-	return true;
+
+	SoA_Vec3 norm;
+	SoA::vertex_normals(positions(), tris, norm);
+
+	i = 0;
+	for(Vertex& v : vertices) v.norm = norm.get(i++);
 }
 
 Halfedge_Mesh::VertexCRef Halfedge_Mesh::vert_by_idx(unsigned int idx) const {
@@ -279,7 +980,7 @@ std::string Halfedge_Mesh::from_poly(const std::vector<std::vector<Index>>& poly
 
 	// The number of faces is just the number of polygons in the input.
 	Size nFaces = polygons.size();
-	faces.resize(nFaces);  // allocate storage for faces in our new mesh
+	for (Size i = 0; i < nFaces; i++) new_face();  // allocate storage for faces in our new mesh
 
 	// We will store a map from ordered pairs of vertex indices to
 	// the corresponding halfedge object in our new (halfedge) mesh;
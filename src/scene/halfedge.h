@@ -138,12 +138,29 @@
 
 #pragma once
 
+#include <cstdint>
 #include <list>
+#include <memory>
 #include <vector>
 #include <variant>
 #include <string>
 
 #include "../platform/gl.h"
+#include "../lib/soa.h"
+#include "../lib/pool.h"
+#include "optimize.h"
+#include "triangulate.h"
+
+class Jobs;
+
+/*
+	How much checking Halfedge_Mesh::validate_edit does after each edit:
+	0 for none, 1 for the neighborhood of the edit, 2 for the whole mesh.
+	The build picks a level by build type unless one is given.
+*/
+#ifndef HALFEDGE_VALIDATE
+#define HALFEDGE_VALIDATE 0
+#endif
 
 class Halfedge_Mesh {
 public:
@@ -174,15 +191,26 @@ public:
 	class Face;
 	class Halfedge;
 
+	/*
+		Elements live in lists whose nodes come from a per-list pool (see
+		lib/pool.h), so creating and erasing elements rarely touches the heap.
+		clear() still unlinks every node, since std::list cannot drop its
+		nodes without visiting them, but each unlink only pushes the slot on
+		the pool's free list; the chunks are then released all at once. The
+		pools belong to the mesh.
+	*/
+	template<typename T>
+	using List = std::list<T, Pool_Allocator<T>>;
+
 	/*
 		Rather than using raw pointers to mesh elements, we store references
 		as STL::iterators---for convenience, we give shorter names to these
 		iterators (e.g., EdgeIter instead of list<Edge>::iterator).
 	*/
-	using VertexRef = std::list<Vertex>::iterator;
-	using EdgeRef = std::list<Edge>::iterator;
-	using FaceRef = std::list<Face>::iterator;
-	using HalfedgeRef = std::list<Halfedge>::iterator;
+	using VertexRef = List<Vertex>::iterator;
+	using EdgeRef = List<Edge>::iterator;
+	using FaceRef = List<Face>::iterator;
+	using HalfedgeRef = List<Halfedge>::iterator;
 	using ElementRef = std::variant<VertexRef, EdgeRef, HalfedgeRef, FaceRef>;
 
 	/*
@@ -191,26 +219,32 @@ public:
 		used so frequently, we will use "CIter" as a shorthand abbreviation for
 		"constant iterator."
 	*/
-	using VertexCRef = std::list<Vertex>::const_iterator;
-	using EdgeCRef = std::list<Edge>::const_iterator;
-	using FaceCRef = std::list<Face>::const_iterator;
-	using HalfedgeCRef = std::list<Halfedge>::const_iterator;
+	using VertexCRef = List<Vertex>::const_iterator;
+	using EdgeCRef = List<Edge>::const_iterator;
+	using FaceCRef = List<Face>::const_iterator;
+	using HalfedgeCRef = List<Halfedge>::const_iterator;
 	using ElementCRef = std::variant<VertexCRef, EdgeCRef, HalfedgeCRef, FaceCRef>;
 
 	class Vertex {
 	public:
 		HalfedgeRef& halfedge() {return _halfedge;}
 		HalfedgeCRef halfedge() const {return _halfedge;}
+		unsigned int id() const {return _id;}
 		Vec3 pos, norm;
 	private:
 		HalfedgeRef _halfedge;
+		unsigned int _id = 0;
+		friend class Halfedge_Mesh;
 	};
 	class Edge {
 	public:
 		HalfedgeRef& halfedge() {return _halfedge;}
 		HalfedgeCRef halfedge() const {return _halfedge;}
+		unsigned int id() const {return _id;}
 	private:
 		HalfedgeRef _halfedge;
+		unsigned int _id = 0;
+		friend class Halfedge_Mesh;
 	};
 	class Face {
 	public:
@@ -218,10 +252,13 @@ public:
 		HalfedgeRef& halfedge() {return _halfedge;}
 		HalfedgeCRef halfedge() const {return _halfedge;}
 		bool is_boundary() const {return boundary;}
+		unsigned int id() const {return _id;}
 		Vec3 average() const;
 	private:
 		HalfedgeRef _halfedge;
 		bool boundary = false;
+		unsigned int _id = 0;
+		friend class Halfedge_Mesh;
 	};
 	class Halfedge {
 	public:
@@ -235,22 +272,87 @@ public:
 		EdgeCRef edge() const {return _edge;}
 		FaceRef& face() {return _face;}
 		FaceCRef face() const {return _face;}
+		unsigned int id() const {return _id;}
 	private:
 		HalfedgeRef _twin, _next;
 		VertexRef _vertex;
 		EdgeRef _edge;
 		FaceRef _face;
+		unsigned int _id = 0;
+		friend class Halfedge_Mesh;
 	};
 
-	/// Clear mesh of all elements.
+	/// Clear mesh of all elements. Linear in the element count, without
+	/// touching the heap except to release pool chunks.
 	void clear();
-	/// Export to renderable vertex-index mesh.
-	void to_mesh(GL::Mesh& mesh, bool face_normals) const;
+
+	/// Old-to-new list indices of each element type, as produced by compact()
+	struct Remap {
+		std::vector<Index> vertices, edges, faces, halfedges;
+	};
+	/// Rebuild element storage in fresh pools, ordered for locality: vertices
+	/// and faces along a Morton curve, halfedges by face loop, and edges by
+	/// first use. Ids are renumbered to match. All element references are
+	/// invalidated; use the returned map to update anything that stored list
+	/// indices.
+	Remap compact();
+
+	/// Index-based copy of the connectivity for bulk operations. Halfedges of
+	/// each face are contiguous and in loop order, so next and prev are
+	/// implicit. Boundary loops are not stored: an interior halfedge on the
+	/// boundary has twin == none.
+	struct Flat {
+		static constexpr uint32_t none = UINT32_MAX;
+
+		std::vector<Vec3> pos;
+		/// Per face, plus one: offset of its first halfedge
+		std::vector<uint32_t> face_start;
+		/// Per halfedge
+		std::vector<uint32_t> vertex, twin, edge, face;
+		/// Per edge: one of its halfedges. Per vertex: an outgoing halfedge;
+		/// on the boundary, the one following the incoming boundary halfedge;
+		/// none if the vertex is isolated.
+		std::vector<uint32_t> edge_halfedge, vertex_halfedge;
+
+		uint32_t next(uint32_t h) const {
+			uint32_t f = face[h];
+			return h + 1 == face_start[f + 1] ? face_start[f] : h + 1;
+		}
+		uint32_t prev(uint32_t h) const {
+			uint32_t f = face[h];
+			return h == face_start[f] ? face_start[f + 1] - 1 : h - 1;
+		}
+		bool on_boundary(uint32_t v) const {
+			return twin[prev(vertex_halfedge[v])] == none;
+		}
+	};
+	/// Faces and vertices keep their list order
+	Flat to_flat() const;
+	/// Rebuild the mesh from a flat copy, recreating boundary loops and
+	/// vertex normals
+	void from_flat(const Flat& flat);
+	/// Export to renderable vertex-index mesh. Vertices are always shared; with
+	/// face_normals the mesh is flat shaded and carries one id per face. With
+	/// optimize, large meshes are reordered for the GPU vertex cache (slower to
+	/// build, faster to draw). Polygons are triangulated properly even when
+	/// concave, and the result is cached until the face changes. Without
+	/// optimize, triangles unchanged since the last optimized export keep its
+	/// order. Returns the statistics of the order used, empty if unoptimized.
+	Optimize::Stats to_mesh(GL::Mesh& mesh, bool face_normals, bool optimize = false) const;
+	/// The arrays to_mesh uploads, without touching GL
+	Optimize::Stats to_triangles(std::vector<GL::Mesh::Vert>& verts, std::vector<GL::Mesh::Index>& idxs,
+	                             std::vector<GLuint>& face_ids, bool face_normals, bool optimize = false) const;
 	/// Create mesh from polygon list
 	std::string from_poly(const std::vector<std::vector<Index>>& polygons, const std::vector<GL::Mesh::Vert>& verts);
 	/// Create mesh from renderable triangle mesh (beware of connectivity, does not de-duplicate vertices)
 	std::string from_mesh(const GL::Mesh& mesh);
 
+	/// Vertex positions and normals, in vertex list order
+	SoA_Vec3 positions() const;
+	SoA_Vec3 normals() const;
+	/// Recompute vertex normals from positions (area-weighted face normals)
+	void compute_normals();
+
 	/*
 		These methods delete a specified mesh element. One should think very, very carefully about
 		exactly when and how to delete mesh elements, since other elements will often still point
@@ -270,11 +372,22 @@ public:
 		These methods allocate new mesh elements, returning a pointer (i.e., iterator) to the new element.
 		(These methods cannot have const versions, because they modify the mesh!)
 	*/
-	HalfedgeRef new_halfedge() { return halfedges.insert(halfedges.end(), Halfedge()); }
-	VertexRef new_vertex() { return vertices.insert(vertices.end(), Vertex()); }
-	EdgeRef new_edge() { return edges.insert(edges.end(), Edge()); }
-	FaceRef new_face() { return faces.insert(faces.end(), Face(false)); }
-	FaceRef new_boundary() { return boundaries.insert(boundaries.end(), Face(true)); }
+	HalfedgeRef new_halfedge() { return with_id(halfedges.insert(halfedges.end(), Halfedge()), next_ids.halfedges); }
+	VertexRef new_vertex() { return with_id(vertices.insert(vertices.end(), Vertex()), next_ids.vertices); }
+	EdgeRef new_edge() { return with_id(edges.insert(edges.end(), Edge()), next_ids.edges); }
+	FaceRef new_face() { return with_id(faces.insert(faces.end(), Face(false)), next_ids.faces); }
+	FaceRef new_boundary() { return with_id(boundaries.insert(boundaries.end(), Face(true)), next_ids.faces); }
+
+	/*
+		Each element has an id, unique among live elements of its type and
+		below the matching id_bounds() count, for indexing flat per-element
+		arrays. Ids are never reused until compact() renumbers them densely
+		in list order; boundary faces share the face numbering.
+	*/
+	struct Id_Bounds {
+		unsigned int vertices = 0, edges = 0, faces = 0, halfedges = 0;
+	};
+	Id_Bounds id_bounds() const {return next_ids;}
 
 	/*
 		These methods return iterators to the beginning and end of the lists of
@@ -314,29 +427,69 @@ public:
 	FaceRef boundaries_end() { return boundaries.end(); }
 	FaceCRef boundaries_end() const { return boundaries.end(); }
 
-	/// Check if half-edge mesh is valid
+	/// Check every connectivity invariant and that positions are finite,
+	/// reporting all violations found. The Jobs version checks in parallel.
 	std::string validate() const;
+	std::string validate(Jobs& jobs) const;
+	/// Check the given elements and everything within one ring of their
+	/// vertices, in time proportional to that neighborhood. Cannot detect
+	/// references to erased elements.
+	std::string validate_local(const std::vector<ElementCRef>& touched) const;
+
+	enum class Validation { none, local, full };
+	static constexpr Validation validation = Validation(HALFEDGE_VALIDATE);
+	/// Check after an edit that touched the given elements, as deeply as the
+	/// build's validation level asks
+	std::string validate_edit(const std::vector<ElementCRef>& touched) const;
 
 	/// For rendering
 	mutable bool render_dirty_flag = false;
+	/// Set instead of render_dirty_flag by edits that only move vertices, such
+	/// as Fairing; the GPU overlay then re-uploads just the positions
+	mutable bool render_pos_dirty_flag = false;
 
 	Size n_vertices() const {return vertices.size();};
 	Size n_edges() const {return edges.size();};
 	Size n_faces() const {return faces.size();};
 	Size n_halfedges() const {return halfedges.size();};
 
+	/// Allocation counts of the element pools
+	struct Pool_Stats {
+		Pool::Stats vertices, edges, faces, boundaries, halfedges;
+	};
+	Pool_Stats pool_stats() const;
+
 	VertexCRef vert_by_idx(unsigned int idx) const;
 	EdgeCRef edge_by_idx(unsigned int idx) const;
 	HalfedgeCRef halfedge_by_idx(unsigned int idx) const;
 	FaceCRef face_by_idx(unsigned int idx) const;
 
 private:
-	std::list<Vertex> vertices;
-	std::list<Edge> edges;
-	std::list<Face> faces, boundaries;
-	std::list<Halfedge> halfedges;
-
-	bool check_finite() const;
+	// Pools must outlive the lists, and stay put when the mesh is moved
+	struct Pools {
+		Pool vertices, edges, faces, boundaries, halfedges;
+	};
+	std::unique_ptr<Pools> pools = std::make_unique<Pools>();
+
+	List<Vertex> vertices{Pool_Allocator<Vertex>(pools->vertices)};
+	List<Edge> edges{Pool_Allocator<Edge>(pools->edges)};
+	List<Face> faces{Pool_Allocator<Face>(pools->faces)};
+	List<Face> boundaries{Pool_Allocator<Face>(pools->boundaries)};
+	List<Halfedge> halfedges{Pool_Allocator<Halfedge>(pools->halfedges)};
+
+	Id_Bounds next_ids;
+	template<typename R>
+	static R with_id(R r, unsigned int& next) {
+		r->_id = next++;
+		return r;
+	}
+
+	// Triangulations of polygon faces from the last to_mesh
+	mutable Triangulate::Cache triangulations;
+	// Order chosen by the last optimizing to_mesh, replayed after vertex-only edits
+	mutable Optimize::Layout layout;
+
+	void swap(Halfedge_Mesh& src);
 };
 
 /*
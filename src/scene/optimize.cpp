@@ -0,0 +1,260 @@
+
+#include "optimize.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace Optimize {
+
+float acmr(const std::vector<GL::Mesh::Index>& idxs, unsigned int cache_size) {
+
+	if(idxs.size() < 3) return 0.0f;
+
+	GL::Mesh::Index max_idx = *std::max_element(idxs.begin(), idxs.end());
+
+	// A FIFO cache hits if the vertex was inserted fewer than cache_size misses ago
+	std::vector<size_t> inserted(max_idx + 1, 0);
+	size_t misses = 0;
+	for(GL::Mesh::Index i : idxs) {
+		if(inserted[i] == 0 || misses - inserted[i] >= cache_size) {
+			misses++;
+			inserted[i] = misses;
+		}
+	}
+	return (float)misses / (float)(idxs.size() / 3);
+}
+
+std::vector<GLuint> vertex_cache(const std::vector<GL::Mesh::Index>& idxs, size_t n_verts) {
+
+	// Parameters from Tom Forsyth, "Linear-Speed Vertex Cache Optimisation"
+	const int cache_size = 32;
+	const float decay_power = 1.5f, last_tri_score = 0.75f;
+	const float valence_scale = 2.0f, valence_power = 0.5f;
+	const int max_valence = 64;
+
+	size_t n_tris = idxs.size() / 3;
+	std::vector<GLuint> order;
+	order.reserve(n_tris);
+	if(n_tris == 0) return order;
+
+	float cache_score[cache_size], valence_score[max_valence];
+	for(int i = 0; i < cache_size; i++) {
+		if(i < 3) {
+			cache_score[i] = last_tri_score;
+		} else {
+			float s = 1.0f - (float)(i - 3) / (float)(cache_size - 3);
+			cache_score[i] = std::pow(s, decay_power);
+		}
+	}
+	for(int i = 1; i < max_valence; i++) {
+		valence_score[i] = valence_scale * std::pow((float)i, -valence_power);
+	}
+	auto score = [&](int cache_pos, unsigned int live) {
+		if(live == 0) return -1.0f;
+		float s = cache_pos >= 0 ? cache_score[cache_pos] : 0.0f;
+		return s + valence_score[std::min(live, (unsigned int)max_valence - 1)];
+	};
+
+	// Triangles around each vertex; the first live[v] entries are not yet emitted
+	std::vector<unsigned int> offset(n_verts + 1, 0), live(n_verts, 0);
+	for(GL::Mesh::Index i : idxs) offset[i + 1]++;
+	for(size_t v = 0; v < n_verts; v++) offset[v + 1] += offset[v];
+	std::vector<GLuint> adj(offset[n_verts]);
+	for(size_t t = 0; t < n_tris; t++) {
+		for(int k = 0; k < 3; k++) {
+			GL::Mesh::Index v = idxs[3 * t + k];
+			adj[offset[v] + live[v]++] = (GLuint)t;
+		}
+	}
+
+	std::vector<int> cache_pos(n_verts, -1);
+	std::vector<float> v_score(n_verts), t_score(n_tris, 0.0f);
+	std::vector<bool> emitted(n_tris, false);
+	for(size_t v = 0; v < n_verts; v++) {
+		v_score[v] = score(-1, live[v]);
+		for(unsigned int j = 0; j < live[v]; j++) t_score[adj[offset[v] + j]] += v_score[v];
+	}
+
+	long best = (long)(std::max_element(t_score.begin(), t_score.end()) - t_score.begin());
+	std::vector<GL::Mesh::Index> cache, next;
+	cache.reserve(cache_size + 3);
+	next.reserve(cache_size + 3);
+	size_t cursor = 0;
+
+	while(order.size() < n_tris) {
+
+		// Nothing in the cache touches a live triangle: take the next one in input order
+		if(best < 0) {
+			while(emitted[cursor]) cursor++;
+			best = (long)cursor;
+		}
+
+		GLuint t = (GLuint)best;
+		emitted[t] = true;
+		order.push_back(t);
+
+		// Remove t from its vertices' live lists and put them at the front of the cache
+		next.clear();
+		for(int k = 0; k < 3; k++) {
+			GL::Mesh::Index v = idxs[3 * t + k];
+			GLuint* list = &adj[offset[v]];
+			unsigned int j = 0;
+			while(list[j] != t) j++;
+			std::swap(list[j], list[--live[v]]);
+			next.push_back(v);
+		}
+		for(GL::Mesh::Index v : cache) {
+			if(std::find(next.begin(), next.begin() + 3, v) == next.begin() + 3) next.push_back(v);
+		}
+		std::swap(cache, next);
+
+		// Rescore everything that was or is in the cache
+		best = -1;
+		float best_score = -1.0f;
+		for(size_t i = 0; i < cache.size(); i++) {
+			GL::Mesh::Index v = cache[i];
+			cache_pos[v] = i < (size_t)cache_size ? (int)i : -1;
+			float s = score(cache_pos[v], live[v]);
+			float delta = s - v_score[v];
+			v_score[v] = s;
+			for(unsigned int j = 0; j < live[v]; j++) {
+				GLuint u = adj[offset[v] + j];
+				t_score[u] += delta;
+				if(t_score[u] > best_score) {
+					best_score = t_score[u];
+					best = (long)u;
+				}
+			}
+		}
+		if(cache.size() > (size_t)cache_size) cache.resize(cache_size);
+	}
+	return order;
+}
+
+void overdraw(const std::vector<GL::Mesh::Vert>& verts, const std::vector<GL::Mesh::Index>& idxs,
+              std::vector<GLuint>& order, unsigned int cache_size) {
+
+	const size_t min_cluster = 64;
+	if(order.size() < 2 * min_cluster) return;
+
+	// Split where the cache order jumps to a new region: a triangle with no
+	// vertex in the simulated cache
+	std::vector<size_t> starts = {0};
+	std::vector<size_t> inserted(verts.size(), 0);
+	size_t misses = 0;
+	for(size_t i = 0; i < order.size(); i++) {
+		int tri_misses = 0;
+		for(int k = 0; k < 3; k++) {
+			GL::Mesh::Index v = idxs[3 * order[i] + k];
+			if(inserted[v] == 0 || misses - inserted[v] >= cache_size) {
+				inserted[v] = ++misses;
+				tri_misses++;
+			}
+		}
+		if(tri_misses == 3 && i - starts.back() >= min_cluster) starts.push_back(i);
+	}
+	starts.push_back(order.size());
+	if(starts.size() <= 2) return;
+
+	Vec3 center;
+	for(const GL::Mesh::Vert& v : verts) center += v.pos;
+	center /= (float)verts.size();
+
+	// Clusters whose area-weighted normal points away from the center are likely
+	// on the outside and should be drawn first
+	struct Cluster {
+		size_t begin, end;
+		float key;
+	};
+	std::vector<Cluster> clusters;
+	for(size_t c = 0; c + 1 < starts.size(); c++) {
+		Vec3 n, centroid;
+		float area = 0.0f;
+		for(size_t i = starts[c]; i < starts[c + 1]; i++) {
+			GLuint t = order[i];
+			Vec3 a = verts[idxs[3 * t]].pos, b = verts[idxs[3 * t + 1]].pos, d = verts[idxs[3 * t + 2]].pos;
+			Vec3 tn = cross(b - a, d - a);
+			float w = tn.norm();
+			n += tn;
+			centroid += w * (a + b + d) / 3.0f;
+			area += w;
+		}
+		float key = 0.0f;
+		if(area > 0.0f && n.norm() > 0.0f) key = dot(centroid / area - center, n.unit());
+		clusters.push_back({starts[c], starts[c + 1], key});
+	}
+	std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b) {
+		return a.key > b.key;
+	});
+
+	std::vector<GLuint> sorted;
+	sorted.reserve(order.size());
+	for(const Cluster& c : clusters) {
+		sorted.insert(sorted.end(), order.begin() + c.begin, order.begin() + c.end);
+	}
+	order = std::move(sorted);
+}
+
+/// Move triangles into order and renumber vertices through remap
+static void apply(const std::vector<GLuint>& order, const std::vector<GL::Mesh::Index>& remap,
+                  std::vector<GL::Mesh::Vert>& verts, std::vector<GL::Mesh::Index>& idxs,
+                  std::vector<GLuint>& face_ids) {
+
+	std::vector<GL::Mesh::Index> new_idxs(idxs.size());
+	std::vector<GLuint> new_ids(face_ids.size());
+	for(size_t i = 0; i < order.size(); i++) {
+		GLuint t = order[i];
+		for(int k = 0; k < 3; k++) new_idxs[3 * i + k] = remap[idxs[3 * t + k]];
+		if(!face_ids.empty()) new_ids[i] = face_ids[t];
+	}
+	std::vector<GL::Mesh::Vert> new_verts(verts.size());
+	for(size_t v = 0; v < verts.size(); v++) new_verts[remap[v]] = verts[v];
+
+	verts = std::move(new_verts);
+	idxs = std::move(new_idxs);
+	face_ids = std::move(new_ids);
+}
+
+Stats mesh(std::vector<GL::Mesh::Vert>& verts, std::vector<GL::Mesh::Index>& idxs,
+           std::vector<GLuint>& face_ids, Layout* layout) {
+
+	Stats stats;
+	stats.tris = idxs.size() / 3;
+	stats.acmr_before = acmr(idxs);
+
+	std::vector<GLuint> order = vertex_cache(idxs, verts.size());
+	overdraw(verts, idxs, order);
+
+	// Number vertices in order of first use; unused ones go last
+	const GL::Mesh::Index unused = (GL::Mesh::Index)-1;
+	std::vector<GL::Mesh::Index> remap(verts.size(), unused);
+	GL::Mesh::Index next = 0;
+	for(GLuint t : order) {
+		for(int k = 0; k < 3; k++) {
+			GL::Mesh::Index& r = remap[idxs[3 * t + k]];
+			if(r == unused) r = next++;
+		}
+	}
+	for(GL::Mesh::Index& r : remap) {
+		if(r == unused) r = next++;
+	}
+
+	if(layout) layout->source = idxs;
+	apply(order, remap, verts, idxs, face_ids);
+	stats.acmr_after = acmr(idxs);
+	if(layout) {
+		layout->order = std::move(order);
+		layout->remap = std::move(remap);
+		layout->stats = stats;
+	}
+	return stats;
+}
+
+bool replay(const Layout& layout, std::vector<GL::Mesh::Vert>& verts, std::vector<GL::Mesh::Index>& idxs,
+            std::vector<GLuint>& face_ids) {
+	if(layout.source.empty() || idxs != layout.source || verts.size() != layout.remap.size()) return false;
+	apply(layout.order, layout.remap, verts, idxs, face_ids);
+	return true;
+}
+
+}
@@ -0,0 +1,57 @@
+
+#pragma once
+
+#include <vector>
+
+#include "../platform/gl.h"
+
+/// Index and vertex reordering for faster drawing of static meshes
+namespace Optimize {
+
+/// Average cache misses per triangle, simulating a FIFO post-transform
+/// vertex cache of the given size. 0.5 is ideal for large regular meshes,
+/// 3 is the worst case.
+float acmr(const std::vector<GL::Mesh::Index>& idxs, unsigned int cache_size = 16);
+
+/// Triangle order maximizing post-transform cache reuse, using Forsyth's
+/// linear-speed heuristic. Returns the new order as old triangle indices.
+std::vector<GLuint> vertex_cache(const std::vector<GL::Mesh::Index>& idxs, size_t n_verts);
+
+/// Reorder runs of the cache-optimized triangle order so that clusters facing
+/// away from the mesh center, which tend to occlude the rest, draw first.
+/// Updates the triangle order in place.
+void overdraw(const std::vector<GL::Mesh::Vert>& verts, const std::vector<GL::Mesh::Index>& idxs,
+              std::vector<GLuint>& order, unsigned int cache_size = 16);
+
+struct Stats {
+	/// Triangles reordered; zero if the mesh was left as is
+	size_t tris = 0;
+	float acmr_before = 0.0f, acmr_after = 0.0f;
+};
+
+/// The reordering chosen by mesh, kept so that a mesh with the same triangles
+/// but moved vertices can be given the same order. The overdraw pass depends
+/// on positions, so re-optimizing would change the triangle order after
+/// vertex-only edits.
+struct Layout {
+	/// The indices before reordering
+	std::vector<GL::Mesh::Index> source;
+	/// New triangle order as old triangles, and new vertex numbers
+	std::vector<GLuint> order;
+	std::vector<GL::Mesh::Index> remap;
+	Stats stats;
+};
+
+/// Run all passes: triangles are reordered for vertex cache reuse and then for
+/// overdraw, and vertices are renumbered in order of first use. Per-triangle
+/// face ids, if present, move with their triangles. If layout is given, the
+/// reordering is saved in it.
+Stats mesh(std::vector<GL::Mesh::Vert>& verts, std::vector<GL::Mesh::Index>& idxs,
+           std::vector<GLuint>& face_ids, Layout* layout = nullptr);
+
+/// Reorder as layout says, if the indices are the ones it was made for.
+/// Returns whether they were.
+bool replay(const Layout& layout, std::vector<GL::Mesh::Vert>& verts, std::vector<GL::Mesh::Index>& idxs,
+            std::vector<GLuint>& face_ids);
+
+}
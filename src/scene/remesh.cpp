@@ -0,0 +1,536 @@
+
+#include "remesh.h"
+#include "../jobs.h"
+#include "../lib/soa.h"
+
+#include <atomic>
+#include <cstring>
+
+namespace Remesh {
+
+using Flat = Halfedge_Mesh::Flat;
+static const uint32_t none = Flat::none;
+static const size_t grain = 4096;
+
+// Passes repeat until nothing changes, up to this many times
+static const int max_rounds = 8;
+
+// Every face is a triangle, so halfedge h is corner h % 3 of face h / 3
+static uint32_t next(uint32_t h) {
+	return h % 3 == 2 ? h - 2 : h + 1;
+}
+static uint32_t prev(uint32_t h) {
+	return h % 3 == 0 ? h + 2 : h - 1;
+}
+
+/// Call f on each halfedge leaving v, ending at the outgoing boundary
+/// halfedge if there is one
+template<typename F>
+static void for_outgoing(const Flat& m, uint32_t v, F&& f) {
+	uint32_t start = m.vertex_halfedge[v], h = start;
+	while(true) {
+		f(h);
+		uint32_t t = m.twin[h];
+		if(t == none) break;
+		h = next(t);
+		if(h == start) break;
+	}
+}
+
+static bool on_boundary(const Flat& m, uint32_t v) {
+	return m.twin[prev(m.vertex_halfedge[v])] == none;
+}
+
+static float length(const Flat& m, uint32_t h) {
+	return (m.pos[m.vertex[next(h)]] - m.pos[m.vertex[h]]).norm();
+}
+
+/// Each edge is handled through the lower index of its two halfedges
+static bool canonical(const Flat& m, uint32_t h) {
+	return m.twin[h] == none || h < m.twin[h];
+}
+
+/// Sort key ordering by a non-negative float, ties broken by index
+static uint64_t key(float f, uint32_t idx) {
+	uint32_t bits;
+	std::memcpy(&bits, &f, sizeof(bits));
+	return ((uint64_t)bits << 32) | idx;
+}
+
+/// Point every vertex at an outgoing halfedge, following the Flat boundary
+/// convention. Vertices with no faces get none.
+static void link_vertices(Flat& m, Jobs& jobs) {
+	m.vertex_halfedge.assign(m.pos.size(), none);
+	for(uint32_t h = 0; h < m.vertex.size(); h++) m.vertex_halfedge[m.vertex[h]] = h;
+	jobs.parallel_for(0, m.pos.size(), grain, [&](size_t v) {
+		uint32_t start = m.vertex_halfedge[v], h = start;
+		if(start == none) return;
+		while(true) {
+			uint32_t t = m.twin[prev(h)];
+			if(t == none || t == start) break;
+			h = t;
+		}
+		m.vertex_halfedge[v] = h;
+	});
+}
+
+/// Vertices claim the candidate with the lowest key among those touching
+/// them; a candidate holding all its vertices is independent of all others
+class Claims {
+public:
+	Claims(size_t n, Jobs& jobs) : claims(n) {
+		jobs.parallel_for(0, n, grain, [&](size_t i) {
+			claims[i].store(UINT64_MAX, std::memory_order_relaxed);
+		});
+	}
+	void claim(uint32_t v, uint64_t key) {
+		uint64_t cur = claims[v].load(std::memory_order_relaxed);
+		while(key < cur && !claims[v].compare_exchange_weak(cur, key, std::memory_order_relaxed));
+	}
+	bool holds(uint32_t v, uint64_t key) const {
+		return claims[v].load(std::memory_order_relaxed) == key;
+	}
+
+private:
+	std::vector<std::atomic<uint64_t>> claims;
+};
+
+/// Split edges longer than high at their midpoints. Each face splits at most
+/// its longest long edge per round, so faces are rebuilt independently: a
+/// split face (a, b, c) becomes (a, m, c) and (m, b, c).
+static bool split_round(Flat& m, float high, Jobs& jobs) {
+
+	uint32_t n_h = (uint32_t)m.vertex.size(), n_f = n_h / 3;
+	std::vector<float> len(n_h);
+	jobs.parallel_for(0, n_h, grain, [&](size_t h) {
+		len[h] = length(m, (uint32_t)h);
+	});
+	auto edge_key = [&](uint32_t h) {
+		uint32_t t = m.twin[h];
+		return key(len[h], t == none ? h : std::min(h, t));
+	};
+
+	// A face's candidate is its longest long edge; an edge is split if it is
+	// the candidate of the faces on both sides
+	std::vector<uint8_t> best(n_f, 3), cut(n_f, 3);
+	jobs.parallel_for(0, n_f, grain, [&](size_t f) {
+		uint64_t best_key = 0;
+		for(uint32_t i = 0; i < 3; i++) {
+			uint32_t h = 3 * (uint32_t)f + i;
+			if(len[h] > high && (best[f] == 3 || edge_key(h) > best_key)) {
+				best[f] = (uint8_t)i;
+				best_key = edge_key(h);
+			}
+		}
+	});
+	jobs.parallel_for(0, n_f, grain, [&](size_t f) {
+		uint8_t i = best[f];
+		if(i == 3) return;
+		uint32_t t = m.twin[3 * f + i];
+		if(t == none || best[t / 3] == t % 3) cut[f] = i;
+	});
+
+	// Output faces and midpoint vertices
+	std::vector<uint32_t> face_out(n_f), mid(n_h, none);
+	uint32_t n_out = 0, n_v = (uint32_t)m.pos.size(), n_mid = n_v;
+	for(uint32_t f = 0; f < n_f; f++) {
+		face_out[f] = n_out;
+		n_out += cut[f] == 3 ? 1 : 2;
+		if(cut[f] == 3) continue;
+		uint32_t h = 3 * f + cut[f], t = m.twin[h];
+		if(mid[h] == none) {
+			mid[h] = n_mid++;
+			if(t != none) mid[t] = mid[h];
+		}
+	}
+	if(n_mid == n_v) return false;
+
+	// Where each old halfedge goes; split ones go to two halves
+	std::vector<uint32_t> first(n_h), second(n_h, none);
+	jobs.parallel_for(0, n_f, grain, [&](size_t f) {
+		uint32_t o = 3 * face_out[f], h0 = 3 * (uint32_t)f, i = cut[f];
+		if(i == 3) {
+			for(uint32_t j = 0; j < 3; j++) first[h0 + j] = o + j;
+			return;
+		}
+		first[h0 + i] = o;
+		second[h0 + i] = o + 3;
+		first[h0 + (i + 1) % 3] = o + 4;
+		first[h0 + (i + 2) % 3] = o + 2;
+	});
+
+	Flat out;
+	out.vertex.resize(3 * (size_t)n_out);
+	out.twin.resize(3 * (size_t)n_out);
+	out.pos = std::move(m.pos);
+	out.pos.resize(n_mid);
+
+	auto twin_of = [&](uint32_t h) {
+		uint32_t t = m.twin[h];
+		return t == none ? none : first[t];
+	};
+	jobs.parallel_for(0, n_f, grain, [&](size_t f) {
+		uint32_t o = 3 * face_out[f], h0 = 3 * (uint32_t)f, i = cut[f];
+		if(i == 3) {
+			for(uint32_t j = 0; j < 3; j++) {
+				out.vertex[o + j] = m.vertex[h0 + j];
+				out.twin[o + j] = twin_of(h0 + j);
+			}
+			return;
+		}
+		uint32_t h = h0 + i, hn = h0 + (i + 1) % 3, hp = h0 + (i + 2) % 3, t = m.twin[h];
+		uint32_t a = m.vertex[h], b = m.vertex[hn], c = m.vertex[hp], mm = mid[h];
+		if(canonical(m, h)) out.pos[mm] = 0.5f * (out.pos[a] + out.pos[b]);
+
+		out.vertex[o] = a;
+		out.vertex[o + 1] = mm;
+		out.vertex[o + 2] = c;
+		out.vertex[o + 3] = mm;
+		out.vertex[o + 4] = b;
+		out.vertex[o + 5] = c;
+
+		out.twin[o] = t == none ? none : second[t];
+		out.twin[o + 1] = o + 5;
+		out.twin[o + 2] = twin_of(hp);
+		out.twin[o + 3] = t == none ? none : first[t];
+		out.twin[o + 4] = twin_of(hn);
+		out.twin[o + 5] = o + 1;
+	});
+
+	m.vertex = std::move(out.vertex);
+	m.twin = std::move(out.twin);
+	m.pos = std::move(out.pos);
+	link_vertices(m, jobs);
+	return true;
+}
+
+/// Check and apply the collapse of interior edge h (a to b) onto its
+/// midpoint, keeping a. Only touches faces around a and b.
+static bool collapse(Flat& m, uint32_t h, float high, std::vector<uint8_t>& alive) {
+
+	uint32_t t = m.twin[h];
+	uint32_t a = m.vertex[h], b = m.vertex[t];
+	Vec3 p = 0.5f * (m.pos[a] + m.pos[b]);
+
+	// The opposite vertices lose an edge, so may not drop below valence 3
+	for(uint32_t v : {m.vertex[prev(h)], m.vertex[prev(t)]}) {
+		size_t n = 0;
+		for_outgoing(m, v, [&](uint32_t) {
+			n++;
+		});
+		if(n <= 3) return false;
+	}
+
+	// Link condition: a and b may only share c and d
+	size_t shared = 0, n_a = 0, n_b = 0;
+	bool ok = true;
+	for_outgoing(m, a, [&](uint32_t g) {
+		uint32_t x = m.vertex[next(g)];
+		n_a++;
+		if(x != b && (m.pos[x] - p).norm() > high) ok = false;
+	});
+	for_outgoing(m, b, [&](uint32_t g) {
+		uint32_t x = m.vertex[next(g)];
+		n_b++;
+		if(x != a && (m.pos[x] - p).norm() > high) ok = false;
+		for_outgoing(m, a, [&](uint32_t k) {
+			if(m.vertex[next(k)] == x) shared++;
+		});
+	});
+	if(!ok || shared != 2 || (n_a == 3 && n_b == 3)) return false;
+
+	// Surviving faces may not flip
+	for(uint32_t v : {a, b}) {
+		for_outgoing(m, v, [&](uint32_t g) {
+			if(g / 3 == h / 3 || g / 3 == t / 3) return;
+			Vec3 x = m.pos[m.vertex[next(g)]], y = m.pos[m.vertex[prev(g)]];
+			Vec3 n0 = cross(x - m.pos[v], y - m.pos[v]), n1 = cross(x - p, y - p);
+			if(dot(n0, n1) <= 0.0f) ok = false;
+		});
+	}
+	if(!ok) return false;
+
+	for_outgoing(m, b, [&](uint32_t g) {
+		m.vertex[g] = a;
+	});
+	uint32_t o1 = m.twin[next(h)], o2 = m.twin[prev(h)];
+	uint32_t p1 = m.twin[next(t)], p2 = m.twin[prev(t)];
+	m.twin[o1] = o2;
+	m.twin[o2] = o1;
+	m.twin[p1] = p2;
+	m.twin[p2] = p1;
+	for(uint32_t f : {h / 3, t / 3}) {
+		for(uint32_t j = 0; j < 3; j++) m.vertex[3 * f + j] = none;
+	}
+	m.pos[a] = p;
+	alive[b] = 0;
+	return true;
+}
+
+/// Collapse interior edges shorter than low, unless that would create edges
+/// longer than high. Candidates claim both endpoints and their neighbors, so
+/// the faces they touch are disjoint.
+static bool collapse_round(Flat& m, float low, float high, Jobs& jobs) {
+
+	uint32_t n_h = (uint32_t)m.vertex.size(), n_v = (uint32_t)m.pos.size();
+	std::vector<uint8_t> fixed(n_v);
+	jobs.parallel_for(0, n_v, grain, [&](size_t v) {
+		fixed[v] = m.vertex_halfedge[v] == none || on_boundary(m, (uint32_t)v);
+	});
+	auto candidate = [&](uint32_t h) {
+		uint32_t t = m.twin[h];
+		if(t == none || t < h) return false;
+		return !fixed[m.vertex[h]] && !fixed[m.vertex[t]] && length(m, h) < low;
+	};
+	auto for_region = [&](uint32_t h, auto&& f) {
+		for(uint32_t v : {m.vertex[h], m.vertex[m.twin[h]]}) {
+			f(v);
+			for_outgoing(m, v, [&](uint32_t g) {
+				f(m.vertex[next(g)]);
+			});
+		}
+	};
+
+	// Winners are found before any edits, since collapses rewrite faces that
+	// losing candidates would otherwise still be reading
+	std::vector<uint64_t> keys(n_h, UINT64_MAX);
+	Claims claims(n_v, jobs);
+	jobs.parallel_for(0, n_h, grain, [&](size_t i) {
+		uint32_t h = (uint32_t)i;
+		if(!candidate(h)) return;
+		keys[h] = key(length(m, h), h);
+		for_region(h, [&](uint32_t v) {
+			claims.claim(v, keys[h]);
+		});
+	});
+	jobs.parallel_for(0, n_h, grain, [&](size_t h) {
+		if(keys[h] == UINT64_MAX) return;
+		bool held = true;
+		for_region((uint32_t)h, [&](uint32_t v) {
+			if(!claims.holds(v, keys[h])) held = false;
+		});
+		if(!held) keys[h] = UINT64_MAX;
+	});
+
+	std::vector<uint8_t> alive(n_v, 1);
+	std::atomic<size_t> collapsed = 0;
+	jobs.parallel_for(0, n_h, grain, [&](size_t h) {
+		if(keys[h] != UINT64_MAX && collapse(m, (uint32_t)h, high, alive)) collapsed++;
+	});
+	if(collapsed == 0) return false;
+
+	// Drop removed faces and vertices
+	std::vector<uint32_t> v_map(n_v, none), f_map(n_h / 3, none);
+	uint32_t n_v_out = 0, n_f_out = 0;
+	for(uint32_t v = 0; v < n_v; v++) {
+		if(alive[v]) v_map[v] = n_v_out++;
+	}
+	for(uint32_t f = 0; f < n_h / 3; f++) {
+		if(m.vertex[3 * f] != none) f_map[f] = n_f_out++;
+	}
+
+	Flat out;
+	out.pos.resize(n_v_out);
+	out.vertex.resize(3 * (size_t)n_f_out);
+	out.twin.resize(3 * (size_t)n_f_out);
+	jobs.parallel_for(0, n_v, grain, [&](size_t v) {
+		if(v_map[v] != none) out.pos[v_map[v]] = m.pos[v];
+	});
+	jobs.parallel_for(0, n_h / 3, grain, [&](size_t f) {
+		if(f_map[f] == none) return;
+		for(uint32_t j = 0; j < 3; j++) {
+			uint32_t h = 3 * (uint32_t)f + j, o = 3 * f_map[f] + j, t = m.twin[h];
+			out.vertex[o] = v_map[m.vertex[h]];
+			out.twin[o] = t == none ? none : 3 * f_map[t / 3] + t % 3;
+		}
+	});
+
+	m.vertex = std::move(out.vertex);
+	m.twin = std::move(out.twin);
+	m.pos = std::move(out.pos);
+	link_vertices(m, jobs);
+	return true;
+}
+
+/// Flip interior edges when that brings the four vertices involved closer to
+/// valence 6 (4 on the boundary). Candidates claim their four vertices.
+static bool flip_round(Flat& m, Jobs& jobs) {
+
+	uint32_t n_h = (uint32_t)m.vertex.size(), n_v = (uint32_t)m.pos.size();
+	std::vector<int> valence(n_v, 0), target(n_v, 6);
+	jobs.parallel_for(0, n_v, grain, [&](size_t v) {
+		if(m.vertex_halfedge[v] == none) return;
+		int n = 0;
+		for_outgoing(m, (uint32_t)v, [&](uint32_t) {
+			n++;
+		});
+		if(on_boundary(m, (uint32_t)v)) {
+			n++;
+			target[v] = 4;
+		}
+		valence[v] = n;
+	});
+
+	auto gain = [&](uint32_t h) {
+		uint32_t t = m.twin[h];
+		if(t == none || t < h) return 0;
+		uint32_t a = m.vertex[h], b = m.vertex[t], c = m.vertex[prev(h)], d = m.vertex[prev(t)];
+		if(valence[a] <= 3 || valence[b] <= 3) return 0;
+		auto dev = [&](uint32_t v, int delta) {
+			int x = valence[v] + delta - target[v];
+			return x * x;
+		};
+		int before = dev(a, 0) + dev(b, 0) + dev(c, 0) + dev(d, 0);
+		int after = dev(a, -1) + dev(b, -1) + dev(c, 1) + dev(d, 1);
+		return before - after;
+	};
+	auto for_quad = [&](uint32_t h, auto&& f) {
+		uint32_t t = m.twin[h];
+		for(uint32_t v : {m.vertex[h], m.vertex[t], m.vertex[prev(h)], m.vertex[prev(t)]}) f(v);
+	};
+
+	// Larger gains get lower keys and win
+	std::vector<uint64_t> keys(n_h, UINT64_MAX);
+	Claims claims(n_v, jobs);
+	jobs.parallel_for(0, n_h, grain, [&](size_t i) {
+		uint32_t h = (uint32_t)i;
+		int g = gain(h);
+		if(g <= 0) return;
+		keys[h] = key((float)(64 - std::min(g, 63)), h);
+		for_quad(h, [&](uint32_t v) {
+			claims.claim(v, keys[h]);
+		});
+	});
+	jobs.parallel_for(0, n_h, grain, [&](size_t h) {
+		if(keys[h] == UINT64_MAX) return;
+		bool held = true;
+		for_quad((uint32_t)h, [&](uint32_t v) {
+			if(!claims.holds(v, keys[h])) held = false;
+		});
+		if(!held) keys[h] = UINT64_MAX;
+	});
+
+	std::atomic<size_t> flipped = 0;
+	jobs.parallel_for(0, n_h, grain, [&](size_t i) {
+		uint32_t h = (uint32_t)i;
+		if(keys[h] == UINT64_MAX) return;
+
+		uint32_t t = m.twin[h], nh = next(h), ph = prev(h), nt = next(t), pt = prev(t);
+		uint32_t a = m.vertex[h], b = m.vertex[t], c = m.vertex[ph], d = m.vertex[pt];
+
+		// The new edge must not exist already, and the new faces must not fold
+		bool exists = false;
+		for_outgoing(m, c, [&](uint32_t e) {
+			if(m.vertex[next(e)] == d) exists = true;
+		});
+		if(exists) return;
+		Vec3 pa = m.pos[a], pb = m.pos[b], pc = m.pos[c], pd = m.pos[d];
+		Vec3 n = cross(pb - pa, pc - pa) + cross(pa - pb, pd - pb);
+		if(dot(cross(pc - pd, pa - pd), n) <= 0.0f || dot(cross(pd - pc, pb - pc), n) <= 0.0f) return;
+
+		// (a, b, c) and (b, a, d) become (d, c, a) and (c, d, b)
+		uint32_t t_nh = m.twin[nh], t_ph = m.twin[ph], t_nt = m.twin[nt], t_pt = m.twin[pt];
+		m.vertex[h] = d;
+		m.vertex[nh] = c;
+		m.vertex[ph] = a;
+		m.vertex[t] = c;
+		m.vertex[nt] = d;
+		m.vertex[pt] = b;
+		m.twin[nh] = t_ph;
+		m.twin[ph] = t_nt;
+		m.twin[nt] = t_pt;
+		m.twin[pt] = t_nh;
+		if(t_ph != none) m.twin[t_ph] = nh;
+		if(t_nt != none) m.twin[t_nt] = ph;
+		if(t_pt != none) m.twin[t_pt] = nt;
+		if(t_nh != none) m.twin[t_nh] = pt;
+		flipped++;
+	});
+	if(flipped == 0) return false;
+
+	link_vertices(m, jobs);
+	return true;
+}
+
+/// Move interior vertices toward the centroid of their neighbors, within the
+/// tangent plane given by the vertex normal
+static void relax(Flat& m, Jobs& jobs) {
+
+	uint32_t n_v = (uint32_t)m.pos.size();
+	SoA_Vec3 src, dst(n_v);
+	src.reserve(n_v);
+	for(Vec3 p : m.pos) src.push_back(p);
+
+	jobs.parallel_for(0, n_v, grain, [&](size_t i) {
+		uint32_t v = (uint32_t)i;
+		Vec3 p = src.get(v);
+		if(m.vertex_halfedge[v] == none || on_boundary(m, v)) {
+			dst.set(v, p);
+			return;
+		}
+		Vec3 q, n;
+		float count = 0.0f;
+		for_outgoing(m, v, [&](uint32_t h) {
+			Vec3 x = src.get(m.vertex[next(h)]), y = src.get(m.vertex[prev(h)]);
+			q += x;
+			n += cross(x - p, y - p);
+			count += 1.0f;
+		});
+		q /= count;
+		if(n.norm() > 0.0f) {
+			n = n.unit();
+			q += n * dot(n, p - q);
+		}
+		dst.set(v, q);
+	});
+
+	for(uint32_t v = 0; v < n_v; v++) m.pos[v] = dst.get(v);
+}
+
+/// Rebuild the face and edge arrays of a triangle Flat
+static void finish(Flat& m) {
+
+	uint32_t n_h = (uint32_t)m.vertex.size(), n_f = n_h / 3;
+	m.face_start.resize(n_f + 1);
+	for(uint32_t f = 0; f <= n_f; f++) m.face_start[f] = 3 * f;
+	m.face.resize(n_h);
+	for(uint32_t h = 0; h < n_h; h++) m.face[h] = h / 3;
+
+	m.edge.resize(n_h);
+	m.edge_halfedge.clear();
+	for(uint32_t h = 0; h < n_h; h++) {
+		if(!canonical(m, h)) continue;
+		uint32_t e = (uint32_t)m.edge_halfedge.size();
+		m.edge[h] = e;
+		if(m.twin[h] != none) m.edge[m.twin[h]] = e;
+		m.edge_halfedge.push_back(h);
+	}
+}
+
+std::string mesh(Halfedge_Mesh& mesh, Options opt, Jobs& jobs) {
+
+	Flat m = mesh.to_flat();
+	if(m.vertex.size() != 3 * (m.face_start.size() - 1)) return "Remeshing requires a triangle mesh.";
+	if(m.vertex.empty()) return {};
+
+	float l = opt.length;
+	if(l <= 0.0f) {
+		double sum = 0.0;
+		for(uint32_t h = 0; h < m.vertex.size(); h++) sum += length(m, h);
+		l = (float)(sum / m.vertex.size());
+	}
+	float low = 0.8f * l, high = 4.0f / 3.0f * l;
+
+	for(unsigned int i = 0; i < opt.iterations; i++) {
+		for(int r = 0; r < max_rounds && split_round(m, high, jobs); r++);
+		for(int r = 0; r < max_rounds && collapse_round(m, low, high, jobs); r++);
+		for(int r = 0; r < max_rounds && flip_round(m, jobs); r++);
+		relax(m, jobs);
+	}
+
+	finish(m);
+	mesh.from_flat(m);
+	return {};
+}
+
+}
@@ -0,0 +1,25 @@
+
+#pragma once
+
+#include <string>
+
+#include "halfedge.h"
+
+class Jobs;
+
+/// Isotropic remeshing (Botsch and Kobbelt) of triangle meshes, run on the
+/// flat form of the mesh. Split, collapse and flip passes each work on a set
+/// of elements chosen so that no two touch the same faces, which are then
+/// processed in parallel; smoothing is a parallel pass over SoA positions.
+namespace Remesh {
+
+struct Options {
+	/// Target edge length; zero uses the current mean edge length
+	float length = 0.0f;
+	unsigned int iterations = 5;
+};
+
+/// Boundary vertices stay in place, though long boundary edges are split
+std::string mesh(Halfedge_Mesh& mesh, Options opt, Jobs& jobs);
+
+}
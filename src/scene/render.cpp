@@ -3,39 +3,78 @@
 #include "util.h"
 #include "../gui.h"
 #include "../lib/mathutils.h"
+#include "../jobs.h"
 
 #include <imgui/imgui.h>
+#include <algorithm>
+#include <unordered_map>
 
-Renderer::Renderer(Vec2 dim) :
+Renderer::Renderer(Vec2 dim, Jobs& jobs) :
+	jobs(jobs),
 	samples(4),
 	window_dim(dim),
 	id_buffer(new GLubyte[(int)dim.x * (int)dim.y * 4]),
-	framebuffer(2, dim, samples, true),
-	id_resolve(1, dim, 1, false),
     mesh_shader(GL::Shaders::mesh_v, GL::Shaders::mesh_f),
 	line_shader(GL::Shaders::line_v, GL::Shaders::line_f),
 	inst_shader(GL::Shaders::inst_v, GL::Shaders::mesh_f),
+	he_shader(GL::Shaders::halfedge_v, GL::Shaders::mesh_f),
 	spheres(Util::sphere_mesh(0.05f, 1)),
 	cylinders(Util::cyl_mesh(0.05f, 1.0f)),
-	arrows(Util::arrow_mesh(0.05f, 0.1f, 1.0f))
-{}
+	arrows(Util::arrow_mesh(0.05f, 0.1f, 1.0f)),
+	sphere_mesh(Util::sphere_mesh(0.05f, 1)),
+	cyl_mesh(Util::cyl_mesh(0.05f, 1.0f)),
+	arrow_mesh(Util::arrow_mesh(0.05f, 0.1f, 1.0f))
+{
+	configure();
+}
 
 Renderer::~Renderer() {
 	delete[] id_buffer;
 	id_buffer = nullptr;
 }
 
-void Renderer::setup(Vec2 dim) {
-	data = new Renderer(dim);
+void Renderer::setup(Vec2 dim, Jobs& jobs) {
+	data = new Renderer(dim, jobs);
 }
 
 void Renderer::update_dim(Vec2 dim) {
 	assert(data);
 	data->window_dim = dim;
+	data->lod_dirty = true;
 	delete[] data->id_buffer;
 	data->id_buffer = new GLubyte[(int)dim.x * (int)dim.y * 4]();
-	data->framebuffer.resize(dim, data->samples);
-	data->id_resolve.resize(dim);
+	data->configure();
+}
+
+void Renderer::configure() {
+
+	// The main framebuffer only carries IDs if they are needed every frame;
+	// the resolve target only exists if those IDs are multisampled.
+	int s = aa == AA::msaa ? samples : 1;
+	framebuffer.setup(id_on_click ? 1 : 2, window_dim, s, true);
+
+	if(s > 1 && !id_on_click) id_resolve.setup(1, window_dim, 1, false);
+	else id_resolve = GL::Framebuffer();
+
+	if(id_on_click) id_framebuffer.setup(2, window_dim, 1, true);
+	else id_framebuffer = GL::Framebuffer();
+}
+
+GL::Framebuffer& Renderer::target() {
+	return id_pass ? id_framebuffer : framebuffer;
+}
+
+const GL::Framebuffer& Renderer::id_source(int& buf) const {
+	if(id_on_click) {
+		buf = 1;
+		return id_framebuffer;
+	}
+	if(framebuffer.is_multisampled()) {
+		buf = 0;
+		return id_resolve;
+	}
+	buf = 1;
+	return framebuffer;
 }
 
 void Renderer::shutdown() {
@@ -48,22 +87,57 @@ void Renderer::proj(Mat4 proj) {
 	data->_proj = proj;
 }
 
+void Renderer::cursor(Vec2 pos) {
+	assert(data);
+	data->cursor_pos = pos;
+}
+
 void Renderer::complete() {
 	assert(data);
-	data->framebuffer.blit_to(1, data->id_resolve, false);
-	
-	if(!data->id_resolve.can_read_at())
-		data->id_resolve.read(0, data->id_buffer);
 
-	data->framebuffer.blit_to_screen(0, data->window_dim);
+	if(!data->id_on_click) {
+		if(data->framebuffer.is_multisampled())
+			data->framebuffer.blit_to(1, data->id_resolve, false);
+
+		int buf = 0;
+		const GL::Framebuffer& ids = data->id_source(buf);
+		if(!ids.can_read_at()) ids.read(buf, data->id_buffer);
+	}
+
+	if(data->aa == AA::fxaa) GL::Effects::fxaa_to_screen(0, data->framebuffer);
+	else data->framebuffer.blit_to_screen(0, data->window_dim);
 }
 
 void Renderer::begin() {
 	assert(data);
-	data->framebuffer.clear(0, Vec4(Gui::Color::background, 1.0f));
-	data->framebuffer.clear(1, {0.0f, 0.0f, 0.0f, 1.0f});
-	data->framebuffer.clear_d();
-	data->framebuffer.bind();
+	GL::Framebuffer& fb = data->target();
+	fb.clear(0, Vec4(Gui::Color::background, 1.0f));
+	if(!data->id_on_click || data->id_pass) fb.clear(1, {0.0f, 0.0f, 0.0f, 1.0f});
+	fb.clear_d();
+	fb.bind();
+
+	data->last_drawn = data->tris_drawn;
+	data->last_total = data->tris_total;
+	data->tris_drawn = data->tris_total = 0;
+}
+
+bool Renderer::needs_id_pass() {
+	assert(data);
+	return data->id_on_click;
+}
+
+void Renderer::begin_id_pass() {
+	assert(data && data->id_on_click);
+	data->id_pass = true;
+	begin();
+}
+
+void Renderer::complete_id_pass() {
+	assert(data && data->id_pass);
+	data->id_pass = false;
+	if(!data->id_framebuffer.can_read_at())
+		data->id_framebuffer.read(1, data->id_buffer);
+	GL::Framebuffer::bind_screen();
 }
 
 void Renderer::lines(const GL::Lines& lines, Mat4 viewproj, float alpha) {
@@ -71,7 +145,7 @@ void Renderer::lines(const GL::Lines& lines, Mat4 viewproj, float alpha) {
 	data->line_shader.bind();
 	data->line_shader.uniform("viewproj", viewproj);
 	data->line_shader.uniform("alpha", alpha);
-	lines.render(data->framebuffer.is_multisampled());
+	lines.render(data->target().is_multisampled());
 }
 
 void Renderer::mesh(const GL::Mesh& mesh, Renderer::MeshOpt opt) {
@@ -80,43 +154,114 @@ void Renderer::mesh(const GL::Mesh& mesh, Renderer::MeshOpt opt) {
 	data->mesh_shader.uniform("use_v_id", opt.per_vert_id);
 	data->mesh_shader.uniform("id", opt.id);
 	data->mesh_shader.uniform("mvp", data->_proj * opt.modelview);
+	data->mesh_shader.uniform("modelview", opt.modelview);
 	data->mesh_shader.uniform("normal", Mat4::transpose(Mat4::inverse(opt.modelview)));
 	data->mesh_shader.uniform("solid", opt.solid_color);
+	data->mesh_shader.uniform("flat_shade", mesh.flat());
+	data->mesh_shader.uniform("face_ids", 1);
 	data->mesh_shader.uniform("sel_color", opt.sel_color);
 	data->mesh_shader.uniform("sel_id", opt.sel_id);
 	
 	if(opt.depth_only) GL::color_mask(false);
 
+	// The cone test assumes normals stay perpendicular, so skip it under non-uniform scale
+	Mat4 mvp = data->_proj * opt.modelview;
+	Vec3 eye = (Mat4::inverse(opt.modelview) * Vec4(0.0f, 0.0f, 0.0f, 1.0f)).xyz();
+	float sx = opt.modelview[0].xyz().norm(), sy = opt.modelview[1].xyz().norm(),
+	      sz = opt.modelview[2].xyz().norm();
+	bool uniform = std::abs(sx - sy) <= 1e-3f * sx && std::abs(sx - sz) <= 1e-3f * sx;
+	bool backface = data->cluster_backface && uniform && !opt.wireframe;
+	auto draw = [&]() {
+		if(!data->cluster_cull) {
+			mesh.render();
+			return mesh.tris();
+		}
+		return mesh.render_culled(mvp, backface, eye);
+	};
+
 	if(opt.wireframe) {
 		data->mesh_shader.uniform("color", Vec3());
 		GL::enable(GL::Opt::wireframe);
-		mesh.render();
+		draw();
 		GL::disable(GL::Opt::wireframe);
 	}
 
 	data->mesh_shader.uniform("color", opt.color);
-	mesh.render();
+	data->tris_drawn += draw();
+	data->tris_total += mesh.tris();
 
 	if(opt.depth_only) GL::color_mask(true);
 }
 
-void Renderer::settings_gui(bool* open) {
+void Renderer::settings_gui() {
 	assert(data);
-	ImGui::Begin("Display Settings", open, ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoSavedSettings);
 	
-	ImGui::InputInt("Multisampling", &data->samples);
-	if(data->samples < 1) data->samples = 1;
-	if(data->samples > 16) data->samples = 16;
+	// Only the framebuffers affected by a change are reallocated
+	bool changed = false;
+	const char* aa_names[] = {"MSAA", "FXAA", "Off"};
+	int aa = (int)data->aa;
+	if(ImGui::Combo("Anti-Aliasing", &aa, aa_names, 3)) {
+		data->aa = (AA)aa;
+		changed = true;
+	}
 
-	if(ImGui::Button("Apply")) {
-		data->framebuffer.resize(data->window_dim, data->samples);
+	switch(data->aa) {
+	case AA::msaa: {
+		int samples = data->samples;
+		ImGui::InputInt("Samples", &samples);
+		samples = std::clamp(samples, 1, 16);
+		if(samples != data->samples) {
+			data->samples = samples;
+			changed = true;
+		}
+		ImGui::Text("Renders every pixel %d times and resolves each frame.", data->samples);
+		ImGui::Text("Smoothest edges; fill cost and memory grow with samples.");
+	} break;
+	case AA::fxaa: {
+		ImGui::Text("Renders one sample per pixel plus one filter pass.");
+		ImGui::Text("Far cheaper than MSAA at high resolutions; edges may shimmer.");
+	} break;
+	case AA::none: {
+		ImGui::Text("Renders one sample per pixel with no filtering.");
+		ImGui::Text("Cheapest; visibly aliased.");
+	} break;
 	}
 
+	ImGui::Separator();
+	if(ImGui::Checkbox("Render IDs Only On Click", &data->id_on_click)) changed = true;
+	if(data->id_on_click) {
+		ImGui::Text("Frames skip the ID buffer, its resolve, and its readback.");
+		ImGui::Text("Each click re-renders the scene once to pick.");
+	} else {
+		ImGui::Text("IDs are rendered with every frame, adding one color buffer.");
+	}
+
+	if(changed) data->configure();
+
+	if(ImGui::Checkbox("GPU Element Overlay", &data->gpu_overlay)) {
+		data->loaded_mesh = nullptr;
+	}
+	if(data->gpu_overlay) {
+		ImGui::Checkbox("Overlay LOD", &data->lod);
+		if(data->lod) {
+			if(ImGui::SliderFloat("Detail Size (px)", &data->lod_pixels, 0.0f, 16.0f)) data->lod_dirty = true;
+			if(ImGui::SliderFloat("Detail Radius (px)", &data->lod_radius, 0.0f, 2000.0f)) data->lod_dirty = true;
+			if(data->lod_radius == 0.0f) ImGui::Text("Full detail everywhere on screen.");
+		}
+	}
+
+	ImGui::Separator();
+	ImGui::Checkbox("Cluster Culling", &data->cluster_cull);
+	if(data->cluster_cull) {
+		ImGui::Checkbox("Cull Back-Facing Clusters", &data->cluster_backface);
+		ImGui::Text("Meshes over %u triangles skip clusters outside the view.", GL::Mesh::cluster_min_tris);
+		if(data->cluster_backface) ImGui::Text("Open meshes lose their inner side.");
+	}
+	ImGui::Text("Triangles drawn: %zu of %zu", data->last_drawn, data->last_total);
+
 	ImGui::Separator();
 	ImGui::Text("GPU: %s", GL::renderer().c_str());
 	ImGui::Text("OpenGL: %s", GL::version().c_str());
-
-	ImGui::End();
 }
 
 Scene_Object::ID Renderer::read_id(Vec2 pos) {
@@ -124,10 +269,12 @@ Scene_Object::ID Renderer::read_id(Vec2 pos) {
 	int x = (int)pos.x;
 	int y = (int)(data->window_dim.y - pos.y - 1);
 
-	if(data->id_resolve.can_read_at()) {
+	int buf = 0;
+	const GL::Framebuffer& ids = data->id_source(buf);
+	if(ids.can_read_at()) {
 
 		GLubyte read[4] = {};
-		data->id_resolve.read_at(0, x, y, read);
+		ids.read_at(buf, x, y, read);
 		return (int)read[0] | (int)read[1] << 8 | (int)read[2] << 16;
 
 	} else {
@@ -146,11 +293,12 @@ Scene_Object::ID Renderer::read_id(Vec2 pos) {
 
 void Renderer::reset_depth() {
 	assert(data);
-	data->framebuffer.clear_d();
+	data->target().clear_d();
 }
 
 void Renderer::outline(Mat4 viewproj, Mat4 view, const Scene_Object& obj) {
 	assert(data);
+	if(data->id_pass) return;
 	data->framebuffer.clear_d();
 	obj.render_mesh(view, false, true);
 
@@ -166,10 +314,15 @@ void Renderer::outline(Mat4 viewproj, Mat4 view, const Scene_Object& obj) {
 
 void Renderer::build_halfedge(const Halfedge_Mesh& mesh) {
 
-	if(loaded_mesh == &mesh && !mesh.render_dirty_flag) return;
+	if(loaded_mesh == &mesh && !mesh.render_dirty_flag && !mesh.render_pos_dirty_flag) return;
 	
-	selected_compo = 0;
+	if((mesh.render_dirty_flag && !keep_select) || loaded_mesh != &mesh) {
+		selected_compo = 0;
+		element_dirty = true;
+	}
+	keep_select = false;
 	mesh.render_dirty_flag = false;
+	mesh.render_pos_dirty_flag = false;
 	loaded_mesh = &mesh;
 
 	std::map<Halfedge_Mesh::VertexCRef, float> size;
@@ -192,7 +345,7 @@ void Renderer::build_halfedge(const Halfedge_Mesh& mesh) {
 		} while(he != v->halfedge());
 
 		size[v] = d;
-		spheres.add(Mat4::translate(v->pos) * Mat4::scale(d), verts++);
+		spheres.add(Mat4::trs(v->pos, Mat4::I, Vec3(d)), verts++);
 	}
 
 	edges = verts;
@@ -215,14 +368,15 @@ void Renderer::build_halfedge(const Halfedge_Mesh& mesh) {
 		// Create rotated coordinate frame to align edge
 		Mat4 rot;
 		Vec3 x = cross(dir, {0.0f, 1.0f, 0.0f});
-		Vec3 z = cross(x, dir);
 		if(x.norm() != 0.0f) {
+			x = x.unit();
+			Vec3 z = cross(x, dir);
 			rot = Mat4::axes(x, dir, z);
 		} else if(dir.y == -1.0f) {
 			l = -l;
 		}
 
-		cylinders.add(Mat4::translate(v0) * rot * Mat4::scale({s, l, s}), edges++);
+		cylinders.add(Mat4::trs(v0, rot, {s, l, s}), edges++);
 	}
 
 	halfedges = edges;
@@ -253,17 +407,185 @@ void Renderer::build_halfedge(const Halfedge_Mesh& mesh) {
 		// Align edge
 		Mat4 rot;
 		Vec3 x = cross(dir, {0.0f, 1.0f, 0.0f});
-		Vec3 z = cross(x, dir);
 		if(x.norm() != 0.0f) {
+			x = x.unit();
+			Vec3 z = cross(x, dir);
 			rot = Mat4::axes(x, dir, z);
 		} else if(dir.y == -1.0f) {
 			l = -l;
 		}
 
-		arrows.add(Mat4::translate(v0 + offset) * rot * Mat4::scale({0.6f * s, 0.6f * l, 0.6f * s}), halfedges++);
+		arrows.add(Mat4::trs(v0 + offset, rot, {0.6f * s, 0.6f * l, 0.6f * s}), halfedges++);
 	}
 }
 
+void Renderer::upload_halfedge_pos(const Halfedge_Mesh& mesh) {
+
+	// Vertices as (position, sphere size), then face centers
+	std::vector<Halfedge_Mesh::VertexCRef> vert_list;
+	std::vector<Halfedge_Mesh::FaceCRef> face_list;
+	vert_list.reserve(mesh.n_vertices());
+	face_list.reserve(mesh.n_faces());
+	for(auto v = mesh.vertices_begin(); v != mesh.vertices_end(); v++) vert_list.push_back(v);
+	for(auto f = mesh.faces_begin(); f != mesh.faces_end(); f++) face_list.push_back(f);
+
+	size_t n_verts = vert_list.size();
+	pos_data.resize(n_verts + face_list.size());
+
+	jobs.parallel_for(0, pos_data.size(), 1024, [&](size_t i) {
+
+		if(i >= n_verts) {
+			pos_data[i] = Vec4(face_list[i - n_verts]->average(), 0.0f);
+			return;
+		}
+		auto v = vert_list[i];
+		
+		// Sphere size ~ 0.05 * min incident edge length
+		float d = FLT_MAX;
+		auto he = v->halfedge();
+		do {
+			Vec3 n = he->twin()->vertex()->pos;
+			float e = (n - v->pos).norm();
+			d = std::min(d, e);
+			he = he->twin()->next();
+		} while(he != v->halfedge());
+
+		pos_data[i] = Vec4(v->pos, d);
+	});
+
+	he_positions.update(GL_RGBA32F, pos_data.data(), sizeof(Vec4) * pos_data.size());
+	lod_dirty = true;
+}
+
+void Renderer::select_halfedge_lod(Mat4 modelview) {
+
+	// The detail region only needs to follow the cursor roughly, so small
+	// mouse moves do not pay for another pass over every element
+	bool cursor_moved = lod_radius > 0.0f && (cursor_pos - lod_cursor).norm() > 0.25f * lod_radius;
+	if(!lod_dirty && !cursor_moved && modelview == lod_view && _proj == lod_proj) return;
+	lod_dirty = false;
+	lod_view = modelview;
+	lod_proj = _proj;
+	lod_cursor = cursor_pos;
+
+	GLuint n_verts = verts - faces, n_edges = edges - verts, n_arrows = halfedges - edges;
+	Mat4 viewproj = _proj * modelview;
+	// Pixels per unit radius at unit view depth
+	float px_scale = _proj[1][1] * window_dim.y * 0.5f;
+
+	// Projected sphere radius in pixels, or zero if off screen or outside the
+	// full detail region around the cursor
+	lod_px.resize(n_verts);
+	jobs.parallel_for(0, n_verts, 4096, [&](size_t i) {
+
+		lod_px[i] = 0.0f;
+		Vec4 clip = viewproj * Vec4(pos_data[i].xyz(), 1.0f);
+		if(clip.w <= 0.0f) return;
+
+		Vec2 ndc(clip.x / clip.w, clip.y / clip.w);
+		if(std::abs(ndc.x) > 1.1f || std::abs(ndc.y) > 1.1f) return;
+
+		Vec2 px((ndc.x + 1.0f) * 0.5f * window_dim.x, (1.0f - ndc.y) * 0.5f * window_dim.y);
+		if(lod_radius > 0.0f && (px - cursor_pos).norm() > lod_radius) return;
+
+		lod_px[i] = 0.05f * pos_data[i].w * px_scale / clip.w;
+	});
+
+	lod_list.clear();
+	for(GLuint i = 0; i < n_verts; i++) {
+		if(lod_px[i] >= lod_pixels) lod_list.push_back(i);
+	}
+	n_lod_verts = (GLuint)lod_list.size();
+	lod_verts.update(GL_R32UI, lod_list.data(), sizeof(GLuint) * lod_list.size());
+
+	// Cylinders are half as wide as the smaller endpoint sphere
+	lod_edge_full.assign(n_edges, false);
+	lod_list.clear();
+	for(GLuint i = 0; i < n_edges; i++) {
+		float px = 0.5f * std::min(lod_px[edge_data[2 * i]], lod_px[edge_data[2 * i + 1]]);
+		if(px >= lod_pixels) {
+			lod_edge_full[i] = true;
+			lod_list.push_back(i);
+		}
+	}
+	n_lod_edges = (GLuint)lod_list.size();
+	lod_edges.update(GL_R32UI, lod_list.data(), sizeof(GLuint) * lod_list.size());
+
+	lod_list.clear();
+	for(GLuint i = 0; i < n_arrows; i++) {
+		if(lod_edge_full[arrow_data[4 * i + 3]]) lod_list.push_back(i);
+	}
+	n_lod_halfedges = (GLuint)lod_list.size();
+	lod_halfedges.update(GL_R32UI, lod_list.data(), sizeof(GLuint) * lod_list.size());
+}
+
+void Renderer::build_halfedge_gpu(const Halfedge_Mesh& mesh) {
+
+	if(loaded_mesh == &mesh && !mesh.render_dirty_flag) {
+		if(mesh.render_pos_dirty_flag) {
+			upload_halfedge_pos(mesh);
+			mesh.render_pos_dirty_flag = false;
+		}
+		return;
+	}
+
+	if(!keep_select || loaded_mesh != &mesh) {
+		selected_compo = 0;
+		element_dirty = true;
+	}
+	keep_select = false;
+	mesh.render_dirty_flag = false;
+	mesh.render_pos_dirty_flag = false;
+	loaded_mesh = &mesh;
+
+	// Only connectivity is stored per element; instance transforms are built
+	// in the vertex shader, so position edits only re-upload he_positions.
+	std::unordered_map<const Halfedge_Mesh::Vertex*, GLuint> v_idx;
+	std::unordered_map<const Halfedge_Mesh::Edge*, GLuint> e_idx;
+	std::unordered_map<const Halfedge_Mesh::Face*, GLuint> f_idx;
+	v_idx.reserve(mesh.n_vertices());
+	e_idx.reserve(mesh.n_edges());
+	f_idx.reserve(mesh.n_faces());
+
+	GLuint idx = 0;
+	for(auto v = mesh.vertices_begin(); v != mesh.vertices_end(); v++) {
+		v_idx[&*v] = idx++;
+	}
+	for(auto f = mesh.faces_begin(); f != mesh.faces_end(); f++) {
+		f_idx[&*f] = idx++;
+	}
+
+	idx = 0;
+	edge_data.clear();
+	edge_data.reserve(2 * mesh.n_edges());
+	for(auto e = mesh.edges_begin(); e != mesh.edges_end(); e++) {
+		e_idx[&*e] = idx++;
+		edge_data.push_back(v_idx[&*e->halfedge()->vertex()]);
+		edge_data.push_back(v_idx[&*e->halfedge()->twin()->vertex()]);
+	}
+	he_edges.update(GL_RG32UI, edge_data.data(), sizeof(GLuint) * edge_data.size());
+
+	GLuint n_arrows = 0;
+	arrow_data.clear();
+	arrow_data.reserve(4 * mesh.n_halfedges());
+	for(auto h = mesh.halfedges_begin(); h != mesh.halfedges_end(); h++) {
+		if(h->face()->is_boundary()) continue;
+		arrow_data.push_back(v_idx[&*h->vertex()]);
+		arrow_data.push_back(v_idx[&*h->twin()->vertex()]);
+		arrow_data.push_back(f_idx[&*h->face()]);
+		arrow_data.push_back(e_idx[&*h->edge()]);
+		n_arrows++;
+	}
+	he_halfedges.update(GL_RGBA32UI, arrow_data.data(), sizeof(GLuint) * arrow_data.size());
+
+	upload_halfedge_pos(mesh);
+
+	faces = mesh.n_faces() + 1;
+	verts = faces + mesh.n_vertices();
+	edges = verts + mesh.n_edges();
+	halfedges = edges + n_arrows;
+}
+
 void Renderer::set_he_select(unsigned int id) {
 	assert(data);
 	data->selected_compo = id;
@@ -275,6 +597,35 @@ unsigned int Renderer::get_he_select() {
 	return data->selected_compo;
 }
 
+void Renderer::clear_he_select(const Halfedge_Mesh& mesh) {
+	assert(data);
+	if(data->loaded_mesh != &mesh) return;
+	data->selected_compo = 0;
+	data->sel_cache = std::nullopt;
+	data->element_dirty = true;
+}
+
+void Renderer::remap_he_select(const Halfedge_Mesh& mesh, const Halfedge_Mesh::Remap& remap) {
+
+	assert(data);
+	if(data->loaded_mesh != &mesh) return;
+
+	// Element counts are unchanged, so only the offset within each range moves
+	unsigned int id = data->selected_compo;
+	auto map = [](const std::vector<Halfedge_Mesh::Index>& order, unsigned int base, unsigned int id) {
+		return id - base < order.size() ? base + (unsigned int)order[id - base] : 0u;
+	};
+	if(id == 0) return;
+	else if(id < data->faces) id = map(remap.faces, 1, id);
+	else if(id < data->verts) id = map(remap.vertices, data->faces, id);
+	else if(id < data->edges) id = map(remap.edges, data->verts, id);
+	else if(id < data->halfedges) id = map(remap.halfedges, data->edges, id);
+
+	data->selected_compo = id;
+	data->element_dirty = true;
+	data->keep_select = true;
+}
+
 std::optional<Halfedge_Mesh::ElementCRef> Renderer::he_selected() {
 	
 	assert(data);
@@ -295,7 +646,8 @@ std::optional<Halfedge_Mesh::ElementCRef> Renderer::he_selected() {
 void Renderer::halfedge(const GL::Mesh& faces, const Halfedge_Mesh& mesh, Renderer::HalfedgeOpt opt) {
 
 	assert(data);
-	data->build_halfedge(mesh);
+	if(data->gpu_overlay) data->build_halfedge_gpu(mesh);
+	else data->build_halfedge(mesh);
 
 	MeshOpt fopt;
 	fopt.modelview = opt.modelview;
@@ -305,6 +657,68 @@ void Renderer::halfedge(const GL::Mesh& faces, const Halfedge_Mesh& mesh, Render
 	fopt.sel_id = data->selected_compo;
 	Renderer::mesh(faces, fopt);
 
+	if(data->gpu_overlay) {
+
+		GL::Shader& shader = data->he_shader;
+		shader.bind();
+		shader.uniform("use_v_id", true);
+		shader.uniform("solid", false);
+		shader.uniform("flat_shade", false);
+		shader.uniform("face_ids", 1);
+		shader.uniform("positions", 2);
+		shader.uniform("elements", 3);
+		shader.uniform("instances", 4);
+		shader.uniform("indirect", data->lod);
+		shader.uniform("proj", data->_proj);
+		shader.uniform("modelview", opt.modelview);
+		shader.uniform("color", opt.color);
+		shader.uniform("sel_color", Gui::Color::outline);
+		shader.uniform("sel_id", data->selected_compo);
+
+		data->he_positions.bind(2);
+
+		GLuint n_verts = data->verts - data->faces;
+		GLuint n_edges = data->edges - data->verts;
+		GLuint n_arrows = data->halfedges - data->edges;
+
+		// Everything gets a point or line; only elements that are large enough
+		// and near the cursor get full geometry, which covers the cheap version.
+		if(data->lod) {
+			data->select_halfedge_lod(opt.modelview);
+
+			shader.uniform("kind", 3);
+			shader.uniform("id_base", data->faces);
+			GL::draw_points(n_verts, 3.0f);
+
+			data->he_edges.bind(3);
+			shader.uniform("kind", 4);
+			shader.uniform("id_base", data->verts);
+			GL::draw_lines(n_edges);
+
+			n_verts = data->n_lod_verts;
+			n_edges = data->n_lod_edges;
+			n_arrows = data->n_lod_halfedges;
+		}
+
+		if(data->lod) data->lod_verts.bind(4);
+		shader.uniform("kind", 0);
+		shader.uniform("id_base", data->faces);
+		data->sphere_mesh.render_instanced(n_verts);
+
+		data->he_edges.bind(3);
+		if(data->lod) data->lod_edges.bind(4);
+		shader.uniform("kind", 1);
+		shader.uniform("id_base", data->verts);
+		data->cyl_mesh.render_instanced(n_edges);
+
+		data->he_halfedges.bind(3);
+		if(data->lod) data->lod_halfedges.bind(4);
+		shader.uniform("kind", 2);
+		shader.uniform("id_base", data->edges);
+		data->arrow_mesh.render_instanced(n_arrows);
+		return;
+	}
+
 	data->inst_shader.bind();
 	data->inst_shader.uniform("use_v_id", true);
 	data->inst_shader.uniform("use_i_id", true);
@@ -9,16 +9,22 @@
 // Singleton
 class Renderer {
 public:
-    static void setup(Vec2 dim);
+    static void setup(Vec2 dim, Jobs& jobs);
     static void shutdown();
     
     static void begin();
     static void complete();
     static void reset_depth();
+
+    /// If set, frames skip the ID buffer; re-render with an ID pass before read_id
+    static bool needs_id_pass();
+    static void begin_id_pass();
+    static void complete_id_pass();
     
     static void proj(Mat4 proj);
+    static void cursor(Vec2 pos);
     static void update_dim(Vec2 dim);
-    static void settings_gui(bool* open);
+    static void settings_gui();
     static Scene_Object::ID read_id(Vec2 pos);
 
     struct MeshOpt {
@@ -41,6 +47,10 @@ public:
     
     static void set_he_select(unsigned int id);
     static unsigned int get_he_select();
+    /// Drop the selection before an edit that erases or replaces elements
+    static void clear_he_select(const Halfedge_Mesh& mesh);
+    /// Keep the selected element across Halfedge_Mesh::compact()
+    static void remap_he_select(const Halfedge_Mesh& mesh, const Halfedge_Mesh::Remap& remap);
     // NOTE(max): O(n) if changed
     static std::optional<Halfedge_Mesh::ElementCRef> he_selected();
 
@@ -50,22 +60,60 @@ public:
 
 private:
     void build_halfedge(const Halfedge_Mesh& mesh);
+    void build_halfedge_gpu(const Halfedge_Mesh& mesh);
+    void upload_halfedge_pos(const Halfedge_Mesh& mesh);
+    void select_halfedge_lod(Mat4 modelview);
+
+    void configure();
+    GL::Framebuffer& target();
+    const GL::Framebuffer& id_source(int& buf) const;
 
-    Renderer(Vec2 dim);
+    Renderer(Vec2 dim, Jobs& jobs);
     ~Renderer();
     static inline Renderer* data = nullptr;
 
+    enum class AA : int {
+        msaa,
+        fxaa,
+        none
+    };
+
+    Jobs& jobs;
+    AA aa = AA::msaa;
     int samples;
+    bool id_on_click = false, id_pass = false;
     Vec2 window_dim;
     GLubyte* id_buffer;
-	GL::Framebuffer framebuffer, id_resolve;
-    GL::Shader mesh_shader, line_shader, inst_shader; 
+	GL::Framebuffer framebuffer, id_resolve, id_framebuffer;
+    GL::Shader mesh_shader, line_shader, inst_shader, he_shader; 
     GL::Instances spheres, cylinders, arrows;
+
+    // Element overlay pulled from buffer textures; see build_halfedge_gpu
+    bool gpu_overlay = true;
+    GL::Mesh sphere_mesh, cyl_mesh, arrow_mesh;
+    GL::Tex_Buffer he_positions, he_edges, he_halfedges;
+    std::vector<Vec4> pos_data;
+    std::vector<GLuint> edge_data, arrow_data;
+
+    // Screen-space LOD for the GPU overlay; see select_halfedge_lod
+    bool lod = true, lod_dirty = true;
+    float lod_pixels = 2.0f, lod_radius = 300.0f;
+    Vec2 cursor_pos, lod_cursor;
+    Mat4 lod_view, lod_proj;
+    GL::Tex_Buffer lod_verts, lod_edges, lod_halfedges;
+    GLuint n_lod_verts = 0, n_lod_edges = 0, n_lod_halfedges = 0;
+    std::vector<float> lod_px;
+    std::vector<bool> lod_edge_full;
+    std::vector<GLuint> lod_list;
+
+    // Per-cluster culling of large meshes; see GL::Mesh::render_culled
+    bool cluster_cull = true, cluster_backface = false;
+    size_t tris_drawn = 0, tris_total = 0, last_drawn = 0, last_total = 0;
     
     Mat4 _proj;
     unsigned int selected_compo = -1;
     const Halfedge_Mesh* loaded_mesh = nullptr;
     unsigned int faces = 0, verts = 0, edges = 0, halfedges = 0;
-    bool element_dirty = true;
+    bool element_dirty = true, keep_select = false;
     std::optional<Halfedge_Mesh::ElementCRef> sel_cache;
 };
@@ -3,6 +3,7 @@
 #include "render.h"
 #include "../lib/log.h"
 #include "../undo.h"
+#include "../jobs.h"
 
 #include <assimp/Importer.hpp>
 #include <assimp/Exporter.hpp>
@@ -11,9 +12,7 @@
 #include <sstream>
 
 Mat4 Pose::transform() const {
-	return Mat4::translate(pos) * 
-		   rotation_mat() *
-		   Mat4::scale(scale);
+	return Mat4::trs(pos, rotation_mat(), scale);
 }
 
 Mat4 Pose::rotation_mat() const {
@@ -52,7 +51,8 @@ Pose Pose::scaled(Vec3 s) {
 	return {{}, {}, s};
 }
 
-Scene_Object::Scene_Object() {
+Scene_Object::Scene_Object() :
+	_mesh(std::make_shared<GL::Mesh>()) {
 
 }
 
@@ -66,14 +66,22 @@ Scene_Object::Scene_Object(Scene_Object&& src) :
 	color = src.color; src.color = {};
 	pose = src.pose; src.pose = {};
 	mesh_dirty = src.mesh_dirty; src.mesh_dirty = false;
+	mesh_optimize = src.mesh_optimize; src.mesh_optimize = false;
+	mesh_stats = src.mesh_stats; src.mesh_stats = {};
+	editable = src.editable; src.editable = true;
 }
 
 Scene_Object::Scene_Object(ID id, Pose p, GL::Mesh&& m, Vec3 c) :
+	Scene_Object(id, p, std::make_shared<GL::Mesh>(std::move(m)), c) {
+}
+
+Scene_Object::Scene_Object(ID id, Pose p, std::shared_ptr<GL::Mesh> m, Vec3 c) :
 	pose(p),
 	color(c),
 	_id(id),
 	_mesh(std::move(m)) {
 	
+	assert(_mesh);
 	mesh_dirty = false;
 	editable = false;
 	opt.name.reserve(max_name_len);
@@ -84,9 +92,11 @@ Scene_Object::Scene_Object(ID id, Pose p, Halfedge_Mesh&& m, Vec3 c) :
 	pose(p),
 	color(c),
 	_id(id),
-	halfedge(std::move(m)) {
+	halfedge(std::move(m)),
+	_mesh(std::make_shared<GL::Mesh>()) {
 	
 	mesh_dirty = true;
+	mesh_optimize = true;
 	editable = true;
 	opt.name.reserve(max_name_len);
 	snprintf(opt.name.data(), opt.name.capacity(), "Object %d", id);
@@ -105,12 +115,18 @@ void Scene_Object::operator=(Scene_Object&& src) {
 	color = src.color; src.color = {};
 	pose = src.pose; src.pose = {};
 	mesh_dirty = src.mesh_dirty; src.mesh_dirty = false;
+	mesh_optimize = src.mesh_optimize; src.mesh_optimize = false;
+	mesh_stats = src.mesh_stats; src.mesh_stats = {};
+	editable = src.editable; src.editable = true;
+	_simplifier = nullptr;
+	_fairing = nullptr;
 }
 
 void Scene_Object::sync_mesh() const {
 	if(editable && mesh_dirty) {
-		halfedge.to_mesh(_mesh, true);
+		mesh_stats = halfedge.to_mesh(*_mesh, true, mesh_optimize);
 		mesh_dirty = false;
+		mesh_optimize = false;
 	}
 }
 
@@ -118,17 +134,143 @@ BBox Scene_Object::bbox() const {
 
 	Mat4 t = pose.transform();
 	BBox ret;
-	std::vector<Vec3> c = _mesh.bbox().corners();
-	for(auto& v : c) ret.enclose(t * v);
+	auto c = _mesh->bbox().corners();
+	Mat4::transform(t, c.data(), c.data(), c.size());
+	for(auto& v : c) ret.enclose(v);
 	return ret;
 }
 
+void Scene_Object::compact_mesh() {
+	if(!editable) return;
+	_simplifier = nullptr;
+	_fairing = nullptr;
+	Halfedge_Mesh::Remap remap = halfedge.compact();
+	Renderer::remap_he_select(halfedge, remap);
+	mesh_dirty = true;
+	mesh_optimize = true;
+}
+
+std::string Scene_Object::validate_rebuilt(Jobs& jobs) {
+	// Every element is new, so any level of checking covers the whole mesh
+	if constexpr(Halfedge_Mesh::validation == Halfedge_Mesh::Validation::none) return {};
+	std::string err = halfedge.validate(jobs);
+	mesh_dirty = true;
+	return err;
+}
+
+std::string Scene_Object::subdivide(Jobs& jobs, Subdivide::Scheme scheme, unsigned int levels) {
+	if(!editable) return {};
+	_simplifier = nullptr;
+	_fairing = nullptr;
+	Renderer::clear_he_select(halfedge);
+	std::string err = Subdivide::mesh(halfedge, scheme, levels, jobs);
+	if(!err.empty()) return err;
+	err = validate_rebuilt(jobs);
+	if(!err.empty()) return err;
+	mesh_dirty = true;
+	mesh_optimize = true;
+	return {};
+}
+
+std::string Scene_Object::remesh(Jobs& jobs, Remesh::Options opt) {
+	if(!editable) return {};
+	_simplifier = nullptr;
+	_fairing = nullptr;
+	Renderer::clear_he_select(halfedge);
+	std::string err = Remesh::mesh(halfedge, opt, jobs);
+	if(!err.empty()) return err;
+	err = validate_rebuilt(jobs);
+	if(!err.empty()) return err;
+	mesh_dirty = true;
+	mesh_optimize = true;
+	return {};
+}
+
+std::string Scene_Object::simplify(float keep) {
+	if(!editable) return {};
+	Simplifier::Options opt;
+	opt.target_faces = (size_t)(keep * halfedge.n_faces());
+	_fairing = nullptr;
+	Renderer::clear_he_select(halfedge);
+	_simplifier = std::make_unique<Simplifier>();
+	std::string err = _simplifier->begin(halfedge, opt);
+	if(!err.empty()) {
+		_simplifier = nullptr;
+		return err;
+	}
+	preview_faces = halfedge.n_faces();
+	return {};
+}
+
+bool Scene_Object::simplify_step(double seconds) {
+	if(!_simplifier || _simplifier->done()) return false;
+
+	// Collapses erase elements, including any picked or faired since the last step
+	Renderer::clear_he_select(halfedge);
+	_fairing = nullptr;
+	bool done = _simplifier->run(seconds);
+	if(done) {
+		const Simplifier::Stats& s = _simplifier->stats();
+		info("Simplified %zu to %zu faces: %zu collapses at %.0f/s", s.faces_before, s.faces, s.collapses, s.rate());
+		mesh_dirty = true;
+		mesh_optimize = true;
+		return false;
+	}
+
+	// The preview is patched per collapse, but the halfedge overlay is rebuilt
+	// from scratch, so it only follows after a tenth of the faces are gone
+	_simplifier->preview(*_mesh);
+	size_t faces = halfedge.n_faces();
+	if(faces <= preview_faces - preview_faces / 10) {
+		preview_faces = faces;
+		halfedge.render_dirty_flag = true;
+	}
+	return true;
+}
+
+void Scene_Object::simplify_stop() {
+	if(!_simplifier || _simplifier->done()) return;
+	_simplifier->stop();
+	mesh_dirty = true;
+	mesh_optimize = true;
+}
+
+std::string Scene_Object::fair(Fairing::Options o, std::optional<Halfedge_Mesh::ElementCRef> center, unsigned int rings) {
+	if(!editable) return {};
+	// Fairing moves vertices under the simplifier's quadrics
+	simplify_stop();
+
+	const void* key = center ? std::visit([](auto ref) {return (const void*)&*ref;}, *center) : nullptr;
+	if(!_fairing || !(fair_opt == o) || fair_center != key || fair_rings != rings) {
+		std::vector<Fairing::VertexRef> region;
+		if(center) {
+			region = Fairing::region(halfedge, *center, rings);
+		} else {
+			for(auto v = halfedge.vertices_begin(); v != halfedge.vertices_end(); v++) region.push_back(v);
+		}
+		_fairing = std::make_unique<Fairing>();
+		std::string err = _fairing->begin(halfedge, std::move(region), o);
+		if(!err.empty()) {
+			_fairing = nullptr;
+			return err;
+		}
+		fair_opt = o;
+		fair_center = key;
+		fair_rings = rings;
+	}
+
+	std::string err = _fairing->apply();
+	if(!err.empty()) return err;
+	mesh_dirty = true;
+	return {};
+}
+
 void Scene_Object::render_halfedge(Mat4 view) const {
 
 	Renderer::HalfedgeOpt opt;
 	opt.modelview = view * pose.transform();
 	opt.color = color;
-	Renderer::halfedge(_mesh, halfedge, opt);
+	Renderer::halfedge(*_mesh, halfedge, opt);
 }
 
 void Scene_Object::render_mesh(Mat4 view, bool solid, bool depth_only) const {
@@ -141,12 +283,13 @@ void Scene_Object::render_mesh(Mat4 view, bool solid, bool depth_only) const {
 	opt.solid_color = solid;
 	opt.depth_only = depth_only;
 	opt.color = color;
-	Renderer::mesh(_mesh, opt);
+	Renderer::mesh(*_mesh, opt);
 }
 
-Scene::Scene(Scene_Object::ID start) :
+Scene::Scene(Scene_Object::ID start, Jobs& jobs) :
 	next_id(start),
-	first_id(start) {
+	first_id(start),
+	jobs(jobs) {
 }
 
 Scene::~Scene() {
@@ -213,6 +356,18 @@ std::optional<std::reference_wrapper<Scene_Object>> Scene::get(Scene_Object::ID
 	return entry->second;
 }
 
+std::string Scene::subdivide(Scene_Object::ID id, Subdivide::Scheme scheme, unsigned int levels) {
+	auto entry = objs.find(id);
+	if(entry == objs.end()) return {};
+	return entry->second.subdivide(jobs, scheme, levels);
+}
+
+std::string Scene::remesh(Scene_Object::ID id, Remesh::Options opt) {
+	auto entry = objs.find(id);
+	if(entry == objs.end()) return {};
+	return entry->second.remesh(jobs, opt);
+}
+
 void Scene::clear(Undo& undo) {
 	next_id = first_id;
 	objs.clear();
@@ -220,65 +375,96 @@ void Scene::clear(Undo& undo) {
 	undo.reset();
 }
 
-void Scene::load_node(std::vector<std::string>& errors, const aiScene* scene, aiNode* node, aiMatrix4x4 transform) {
+void Scene::load_node(std::vector<std::pair<const aiMesh*, aiMatrix4x4>>& meshes, const aiScene* scene, aiNode* node, aiMatrix4x4 transform) {
 
 	transform = transform * node->mTransformation;
 
 	for (unsigned int i = 0; i < node->mNumMeshes; i++) {
-		const aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
+		meshes.push_back({scene->mMeshes[node->mMeshes[i]], transform});
+	}
+
+	for(unsigned int i = 0; i < node->mNumChildren; i++) {
+		load_node(meshes, scene, node->mChildren[i], transform);
+	}
+}
+
+static void import_mesh(Scene::Imported& out, const aiMesh* mesh, aiMatrix4x4 transform, Weld::Options weld,
+                        Jobs& jobs) {
+
+	SoA_Vec3 positions, normals;
+	positions.reserve(mesh->mNumVertices);
+	for (unsigned int i = 0; i < mesh->mNumVertices; i++) {
+		const aiVector3D& p = mesh->mVertices[i];
+		positions.push_back(Vec3(p.x, p.y, p.z));
+	}
+
+	std::vector<std::vector<Halfedge_Mesh::Index>> polys;
+	for (unsigned int i = 0; i < mesh->mNumFaces; i++) {
+		const aiFace& face = mesh->mFaces[i];
 		
-		if(!mesh->HasNormals()) {
-			errors.push_back("Mesh has no normals.");
-			continue;
+		std::vector<Halfedge_Mesh::Index> poly;
+		for(unsigned int j = 0; j < face.mNumIndices; j++) {
+			poly.push_back(face.mIndices[j]);
 		}
+		polys.push_back(poly);
+	}
 
-		std::vector<GL::Mesh::Vert> verts;
+	// Weld before building connectivity, so soups become one surface
+	std::vector<uint32_t> remap;
+	out.welded = Weld::points(positions, weld, remap, jobs);
+	if(out.welded) {
+		size_t dropped = Weld::polygons(polys, remap);
+		if(dropped) warn("Welding %s dropped %zu degenerate polygons", mesh->mName.C_Str(), dropped);
+	}
 
+	if(mesh->HasNormals()) {
+		normals.resize(mesh->mNumVertices);
 		for (unsigned int i = 0; i < mesh->mNumVertices; i++) {
-			const aiVector3D& pos = mesh->mVertices[i];
-			const aiVector3D& norm = mesh->mNormals[i];
-			verts.push_back({Vec3(pos.x, pos.y, pos.z), Vec3(norm.x, norm.y, norm.z)});
+			const aiVector3D& n = mesh->mNormals[i];
+			normals.set(i, Vec3(n.x, n.y, n.z));
 		}
-
-		std::vector<std::vector<Halfedge_Mesh::Index>> polys;
-		for (unsigned int i = 0; i < mesh->mNumFaces; i++) {
-			const aiFace& face = mesh->mFaces[i];
-			
-			std::vector<Halfedge_Mesh::Index> poly;
-			for(unsigned int j = 0; j < face.mNumIndices; j++) {
-				poly.push_back(face.mIndices[j]);
+		// Welded vertices share the average of their normals
+		if(out.welded) {
+			std::vector<Vec3> sum(mesh->mNumVertices);
+			for(size_t i = 0; i < remap.size(); i++) sum[remap[i]] += normals.get(i);
+			for(size_t i = 0; i < remap.size(); i++) {
+				if(remap[i] == i && sum[i].norm() > 0.0f) normals.set(i, sum[i].unit());
 			}
-			polys.push_back(poly);
 		}
-
-		aiVector3D ascale, arot, apos;
-		transform.Decompose(ascale, arot, apos);
-		Vec3 pos(apos.x, apos.y, apos.z);
-		Vec3 rot(arot.x, arot.y, arot.z);
-		Vec3 scale(ascale.x, ascale.y, ascale.z);
-		Pose p = {pos, Degrees(rot).range(0.0f, 360.0f), scale};
-
-		Halfedge_Mesh hemesh;
-		std::string err = hemesh.from_poly(polys, verts);
-		if(!err.empty()) {
-			errors.push_back(err);
-		} else {
-			Scene_Object obj(reserve_id(), p, std::move(hemesh));
-			if(mesh->mName.length) {
-				obj.opt.name = std::string(mesh->mName.C_Str());
+	} else {
+		std::vector<Halfedge_Mesh::Index> tris;
+		for(auto& poly : polys) {
+			for(size_t j = 1; j + 1 < poly.size(); j++) {
+				tris.insert(tris.end(), {poly[0], poly[j], poly[j + 1]});
 			}
-			add(std::move(obj));
 		}
+		SoA::vertex_normals(positions, tris, normals);
 	}
 
-	for(unsigned int i = 0; i < node->mNumChildren; i++) {
-		load_node(errors, scene, node->mChildren[i], transform);
+	if(!SoA::finite(positions) || !SoA::finite(normals)) {
+		out.err = "Mesh has non-finite vertex positions or normals.";
+		return;
+	}
+
+	std::vector<GL::Mesh::Vert> verts;
+	verts.reserve(positions.size());
+	for(size_t i = 0; i < positions.size(); i++) {
+		verts.push_back({positions.get(i), normals.get(i)});
 	}
+
+	aiVector3D ascale, arot, apos;
+	transform.Decompose(ascale, arot, apos);
+	Vec3 pos(apos.x, apos.y, apos.z);
+	Vec3 rot(arot.x, arot.y, arot.z);
+	Vec3 scale(ascale.x, ascale.y, ascale.z);
+	out.pose = {pos, Degrees(rot).range(0.0f, 360.0f), scale};
+
+	out.err = out.mesh.from_poly(polys, verts);
+	if(mesh->mName.length) out.name = std::string(mesh->mName.C_Str());
 }
 
-std::string Scene::load(bool clear_first, Undo& undo, std::string file) {
+std::string Scene::import(std::string file, Weld::Options weld, Jobs& jobs, std::vector<Imported>& results) {
 
-	if(clear_first) clear(undo);
 	Assimp::Importer importer;
 	const aiScene* scene = importer.ReadFile(file.c_str(), 
 		aiProcess_GenSmoothNormals |
@@ -293,9 +479,41 @@ std::string Scene::load(bool clear_first, Undo& undo, std::string file) {
 		return "Parsing scene " + file + ": " + std::string(importer.GetErrorString());
 	}
 
-	std::vector<std::string> errors;
+	std::vector<std::pair<const aiMesh*, aiMatrix4x4>> meshes;
 	scene->mRootNode->mTransformation = aiMatrix4x4();
-	load_node(errors, scene, scene->mRootNode, aiMatrix4x4());
+	load_node(meshes, scene, scene->mRootNode, aiMatrix4x4());
+
+	// Meshes are independent, so build their halfedge meshes in parallel
+	results.clear();
+	results.resize(meshes.size());
+	jobs.parallel_for(0, meshes.size(), 1, [&](size_t i) {
+		import_mesh(results[i], meshes[i].first, meshes[i].second, weld, jobs);
+	});
+	return {};
+}
+
+std::string Scene::load(bool clear_first, Undo& undo, std::string file, Weld::Options weld, size_t& welded) {
+
+	if(clear_first) clear(undo);
+	std::vector<Imported> results;
+	std::string err = import(file, weld, jobs, results);
+	if(!err.empty()) return err;
+
+	welded = 0;
+	for(const Imported& result : results) welded += result.welded;
+
+	// Objects own GL meshes, so they're created here on the main thread
+	std::vector<std::string> errors;
+	for(size_t i = 0; i < results.size(); i++) {
+		Imported& result = results[i];
+		if(!result.err.empty()) {
+			errors.push_back(result.err);
+			continue;
+		}
+		Scene_Object obj(reserve_id(), result.pose, std::move(result.mesh));
+		if(!result.name.empty()) obj.opt.name = result.name;
+		add(std::move(obj));
+	}
 	
 	std::stringstream stream;
 	for(int i = 0; i < errors.size(); i++) {
@@ -333,38 +551,57 @@ std::string Scene::write(std::string file) {
 		scene.mRootNode->mChildren[i]->mMeshes = new unsigned int(i);
 	}
 
-	size_t mesh_idx = 0;
-	for(auto& entry : objs) {
+	std::vector<Scene_Object*> list;
+	list.reserve(n_meshes);
+	for(auto& entry : objs) list.push_back(&entry.second);
+
+	jobs.parallel_for(0, n_meshes, 1, [&](size_t mesh_idx) {
 
-		Scene_Object& obj = entry.second;
+		Scene_Object& obj = *list[mesh_idx];
 		aiMesh* ai_mesh = scene.mMeshes[mesh_idx];
 		aiNode* ai_node = scene.mRootNode->mChildren[mesh_idx];
 
 		const std::vector<GL::Mesh::Vert>& verts = obj.mesh().verts();
-
-		ai_mesh->mVertices = new aiVector3D[verts.size()];
-		ai_mesh->mNormals = new aiVector3D[verts.size()];
-		ai_mesh->mNumVertices = verts.size();
-
-		int j = 0;
-		for(GL::Mesh::Vert v : verts) {
-			ai_mesh->mVertices[j] = aiVector3D(v.pos.x, v.pos.y, v.pos.z);
-			ai_mesh->mNormals[j] = aiVector3D(v.norm.x, v.norm.y, v.norm.z);
-			j++;
+		const std::vector<GL::Mesh::Index>& idxs = obj.mesh().indices();
+
+		// Flat meshes share vertices and leave normals to the shader, so the
+		// file gets separate corners per triangle carrying its face normal
+		bool flat = obj.mesh().flat();
+		size_t n_verts = flat ? idxs.size() : verts.size();
+		ai_mesh->mVertices = new aiVector3D[n_verts];
+		ai_mesh->mNormals = new aiVector3D[n_verts];
+		ai_mesh->mNumVertices = n_verts;
+
+		if(flat) {
+			for(size_t i = 0; i < (idxs.size() / 3); i++) {
+				Vec3 a = verts[idxs[3 * i]].pos, b = verts[idxs[3 * i + 1]].pos, c = verts[idxs[3 * i + 2]].pos;
+				Vec3 n = cross(b - a, c - a);
+				n = n.norm() > 0.0f ? n.unit() : Vec3();
+				for(size_t k = 0; k < 3; k++) {
+					Vec3 p = verts[idxs[3 * i + k]].pos;
+					ai_mesh->mVertices[3 * i + k] = aiVector3D(p.x, p.y, p.z);
+					ai_mesh->mNormals[3 * i + k] = aiVector3D(n.x, n.y, n.z);
+				}
+			}
+		} else {
+			int j = 0;
+			for(GL::Mesh::Vert v : verts) {
+				ai_mesh->mVertices[j] = aiVector3D(v.pos.x, v.pos.y, v.pos.z);
+				ai_mesh->mNormals[j] = aiVector3D(v.norm.x, v.norm.y, v.norm.z);
+				j++;
+			}
 		}
 
-		ai_mesh->mFaces = new aiFace[verts.size() / 3];
-		ai_mesh->mNumFaces = (unsigned int)(verts.size() / 3);
+		ai_mesh->mFaces = new aiFace[idxs.size() / 3];
+		ai_mesh->mNumFaces = (unsigned int)(idxs.size() / 3);
 
-		int k = 0;
-		for(size_t i = 0; i < (verts.size() / 3); i++) {
+		for(size_t i = 0; i < (idxs.size() / 3); i++) {
 			aiFace &face = ai_mesh->mFaces[i];
 			face.mIndices = new unsigned int[3];
 			face.mNumIndices = 3;
-			face.mIndices[0] = k;
-			face.mIndices[1] = k+1;
-			face.mIndices[2] = k+2;
-			k = k + 3;
+			for(size_t k = 0; k < 3; k++) {
+				face.mIndices[k] = flat ? (unsigned int)(3 * i + k) : idxs[3 * i + k];
+			}
 		}
 
 		ai_mesh->mName = aiString(obj.opt.name);
@@ -374,9 +611,7 @@ std::string Scene::write(std::string file) {
 									trans[0][1], trans[1][1], trans[2][1], trans[3][1],
 									trans[0][2], trans[1][2], trans[2][2], trans[3][2],
 									trans[0][3], trans[1][3], trans[2][3], trans[3][3]};
-
-		mesh_idx++;
-	}
+	});
 
 	Assimp::Exporter exporter;
 	if(exporter.Export(&scene, "collada", file.c_str())) {
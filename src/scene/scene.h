@@ -4,14 +4,21 @@
 #include "../lib/mathutils.h"
 #include "../platform/gl.h"
 #include "halfedge.h"
+#include "subdivide.h"
+#include "remesh.h"
+#include "simplify.h"
+#include "fair.h"
+#include "weld.h"
 
 #include <map>
+#include <memory>
 #include <optional>
 #include <functional>
 
 #include <assimp/scene.h>
 
 class Undo;
+class Jobs;
 
 struct Pose {
 	Vec3 pos;
@@ -36,6 +43,8 @@ public:
 
 	Scene_Object();
 	Scene_Object(ID id, Pose pose, GL::Mesh&& mesh, Vec3 color = {0.7f, 0.7f, 0.7f});
+	/// Non-editable object drawing a mesh that may be shared with other objects
+	Scene_Object(ID id, Pose pose, std::shared_ptr<GL::Mesh> mesh, Vec3 color = {0.7f, 0.7f, 0.7f});
 	Scene_Object(ID id, Pose pose, Halfedge_Mesh&& mesh, Vec3 color = {0.7f, 0.7f, 0.7f});
 	Scene_Object(const Scene_Object& src) = delete;
 	Scene_Object(Scene_Object&& src);
@@ -45,11 +54,34 @@ public:
 	void operator=(Scene_Object&& src);
 
 	void sync_mesh() const;
+	/// Defragment and reorder the halfedge mesh; see Halfedge_Mesh::compact
+	void compact_mesh();
+	/// Replace the halfedge mesh with its subdivision; see Subdivide::mesh
+	std::string subdivide(Jobs& jobs, Subdivide::Scheme scheme, unsigned int levels = 1);
+	/// Replace the halfedge mesh with an isotropic remeshing; see Remesh::mesh
+	std::string remesh(Jobs& jobs, Remesh::Options opt = {});
+	/// Start decimating the halfedge mesh to the given fraction of its faces.
+	/// The work is done in time-sliced steps by simplify_step.
+	std::string simplify(float keep);
+	/// Continue a running simplification for up to the given time, syncing
+	/// the preview every so often. Returns whether it is still running.
+	bool simplify_step(double seconds);
+	void simplify_stop();
+	/// The running or last finished simplification, if any
+	const Simplifier* simplifier() const {return _simplifier.get();}
+	/// Smooth or fair the vertices within some rings of an element, or the
+	/// whole mesh. The factored system is reused while the region, options,
+	/// and connectivity stay the same. Stops a running simplification first.
+	std::string fair(Fairing::Options opt, std::optional<Halfedge_Mesh::ElementCRef> center, unsigned int rings);
+	/// The last fairing system, if still valid
+	const Fairing* fairing() const {return _fairing.get();}
+	/// How the last sync reordered the GL mesh, if it did
+	const Optimize::Stats& optimize_stats() const {return mesh_stats;}
 	void render_mesh(Mat4 view, bool solid = false, bool depth_only = false) const;
 	void render_halfedge(Mat4 view) const;
 
 	ID id() const {return _id;}
-	const GL::Mesh& mesh() const {return _mesh;}
+	const GL::Mesh& mesh() const {return *_mesh;}
 	
 	BBox bbox() const;
 	
@@ -68,17 +100,46 @@ private:
 	bool editable = true;
 	Halfedge_Mesh halfedge;
 	
-	mutable GL::Mesh _mesh;
+	// Only non-editable objects share their mesh
+	std::shared_ptr<GL::Mesh> _mesh;
 	mutable bool mesh_dirty = false;
+	// Rebuild with GPU-friendly ordering; set when the mesh is new rather than edited
+	mutable bool mesh_optimize = false;
+	mutable Optimize::Stats mesh_stats;
+
+	/// After replacing the halfedge mesh, check it as the build asks
+	std::string validate_rebuilt(Jobs& jobs);
+
+	// Refers to halfedge, so it is dropped when the object is moved
+	std::unique_ptr<Simplifier> _simplifier;
+	size_t preview_faces = 0;
+	std::unique_ptr<Fairing> _fairing;
+	Fairing::Options fair_opt;
+	const void* fair_center = nullptr;
+	unsigned int fair_rings = 0;
 };
 
 class Scene {
 public:
-    Scene(Scene_Object::ID start);
+    Scene(Scene_Object::ID start, Jobs& jobs);
     ~Scene();
 
+	/// CPU-side result of importing one mesh; turned into an object on the main thread
+	struct Imported {
+		std::string name, err;
+		Pose pose;
+		Halfedge_Mesh mesh;
+		size_t welded = 0;
+	};
+	/// Read the meshes in a file without touching GL, so this also works
+	/// headless. Fails only if the file cannot be parsed; meshes that cannot
+	/// be built carry their own error.
+	static std::string import(std::string file, Weld::Options weld, Jobs& jobs, std::vector<Imported>& meshes);
+
 	std::string write(std::string file);
-	std::string load(bool clear_first, Undo& undo, std::string file);
+	/// Import meshes from a file, welding vertices as asked; reports how many
+	/// vertices were merged away
+	std::string load(bool clear_first, Undo& undo, std::string file, Weld::Options weld, size_t& welded);
 	void clear(Undo& undo);
 
     bool empty();
@@ -94,11 +155,14 @@ public:
     void for_objs(std::function<void(Scene_Object&)> func);
 
     std::optional<std::reference_wrapper<Scene_Object>> get(Scene_Object::ID id);
+	std::string subdivide(Scene_Object::ID id, Subdivide::Scheme scheme, unsigned int levels = 1);
+	std::string remesh(Scene_Object::ID id, Remesh::Options opt = {});
 
 private:
-	void load_node(std::vector<std::string>& errors, const aiScene* scene, aiNode* node, aiMatrix4x4 transform);
+	static void load_node(std::vector<std::pair<const aiMesh*, aiMatrix4x4>>& meshes, const aiScene* scene, aiNode* node, aiMatrix4x4 transform);
 
 	std::map<Scene_Object::ID, Scene_Object> objs;
 	std::map<Scene_Object::ID, Scene_Object> erased;
 	Scene_Object::ID next_id, first_id;
+	Jobs& jobs;
 };
@@ -0,0 +1,413 @@
+
+#include "simplify.h"
+#include "../lib/log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+// Boundary edges get a plane perpendicular to their face, weighted so that
+// they resist moving inward
+static const double boundary_weight = 10.0;
+
+// Faces around a collapse may not turn further than this
+static const float min_cos_flip = 0.2f;
+
+void Simplifier::Quadric::add_plane(Vec3 n, double d, double w) {
+	double a = n.x, b = n.y, c = n.z;
+	q[0] += w * a * a; q[1] += w * a * b; q[2] += w * a * c; q[3] += w * a * d;
+	q[4] += w * b * b; q[5] += w * b * c; q[6] += w * b * d;
+	q[7] += w * c * c; q[8] += w * c * d;
+	q[9] += w * d * d;
+}
+
+Simplifier::Quadric Simplifier::Quadric::operator+(const Quadric& o) const {
+	Quadric r;
+	for(int i = 0; i < 10; i++) r.q[i] = q[i] + o.q[i];
+	return r;
+}
+
+double Simplifier::Quadric::error(Vec3 p) const {
+	double x = p.x, y = p.y, z = p.z;
+	double e = q[0] * x * x + 2.0 * q[1] * x * y + 2.0 * q[2] * x * z + 2.0 * q[3] * x
+	         + q[4] * y * y + 2.0 * q[5] * y * z + 2.0 * q[6] * y
+	         + q[7] * z * z + 2.0 * q[8] * z + q[9];
+	return std::max(e, 0.0);
+}
+
+bool Simplifier::Quadric::optimum(Vec3& p) const {
+
+	// Cramer's rule on A p = -b
+	double c00 = q[4] * q[7] - q[5] * q[5];
+	double c01 = q[2] * q[5] - q[1] * q[7];
+	double c02 = q[1] * q[5] - q[2] * q[4];
+	double det = q[0] * c00 + q[1] * c01 + q[2] * c02;
+	double scale = std::max({std::abs(q[0]), std::abs(q[4]), std::abs(q[7])});
+	if(std::abs(det) <= 1e-9 * scale * scale * scale) return false;
+
+	double c11 = q[0] * q[7] - q[2] * q[2];
+	double c12 = q[1] * q[2] - q[0] * q[5];
+	double c22 = q[0] * q[4] - q[1] * q[1];
+	double bx = -q[3], by = -q[6], bz = -q[8];
+	p.x = (float)((c00 * bx + c01 * by + c02 * bz) / det);
+	p.y = (float)((c01 * bx + c11 * by + c12 * bz) / det);
+	p.z = (float)((c02 * bx + c12 * by + c22 * bz) / det);
+	return p.valid();
+}
+
+uint32_t Simplifier::index(EdgeRef e) const {
+	return e->id();
+}
+
+uint32_t Simplifier::index(VertexRef v) const {
+	return v->id();
+}
+
+std::string Simplifier::begin(Halfedge_Mesh& m, Options o) {
+
+	for(auto f = m.faces_begin(); f != m.faces_end(); f++) {
+		if(f->halfedge()->next()->next()->next() != f->halfedge()) {
+			return "Simplification requires a triangle mesh.";
+		}
+	}
+
+	mesh = &m;
+	opt = o;
+	_stats = {};
+	_stats.faces_before = _stats.faces = m.n_faces();
+	finished = false;
+
+	// Ids may have gaps left by earlier edits; those entries go unused
+	Halfedge_Mesh::Id_Bounds ids = m.id_bounds();
+	edges.assign(ids.edges, EdgeRef());
+	for(auto e = m.edges_begin(); e != m.edges_end(); e++) edges[index(e)] = e;
+
+	v_slot.assign(ids.vertices, 0);
+	f_slot.assign(ids.faces, 0);
+	p_verts.clear();
+	p_idxs.clear();
+	p_verts.reserve(m.n_vertices());
+	p_idxs.reserve(3 * m.n_faces());
+	for(auto v = m.vertices_begin(); v != m.vertices_end(); v++) {
+		v_slot[index(v)] = (uint32_t)p_verts.size();
+		p_verts.push_back({v->pos, v->norm, 0});
+	}
+	for(auto f = m.faces_begin(); f != m.faces_end(); f++) {
+		f_slot[f->id()] = (uint32_t)(p_idxs.size() / 3);
+		p_idxs.resize(p_idxs.size() + 3);
+		preview_face(f);
+	}
+	p_dirty_verts.clear();
+	p_dirty_tris.clear();
+	p_version = 0;
+
+	quadrics.assign(ids.vertices, Quadric());
+	for(auto f = m.faces_begin(); f != m.faces_end(); f++) {
+		HalfedgeRef h = f->halfedge();
+		VertexRef a = h->vertex(), b = h->next()->vertex(), c = h->next()->next()->vertex();
+		Vec3 n = cross(b->pos - a->pos, c->pos - a->pos);
+		float area2 = n.norm();
+		if(area2 == 0.0f) continue;
+		n /= area2;
+		double d = -dot(n, a->pos);
+		for(VertexRef v : {a, b, c}) quadrics[index(v)].add_plane(n, d, 0.5 * area2);
+	}
+	for(auto e = m.edges_begin(); e != m.edges_end(); e++) {
+		HalfedgeRef h = e->halfedge();
+		if(!h->twin()->face()->is_boundary()) {
+			if(!h->face()->is_boundary()) continue;
+			h = h->twin();
+		}
+		Vec3 a = h->vertex()->pos, b = h->twin()->vertex()->pos;
+		Vec3 fn = cross(b - a, h->next()->next()->vertex()->pos - a);
+		Vec3 n = cross(b - a, fn);
+		if(n.norm() == 0.0f) continue;
+		n = n.unit();
+		double d = -dot(n, a);
+		double w = boundary_weight * (b - a).norm_squared();
+		quadrics[index(h->vertex())].add_plane(n, d, w);
+		quadrics[index(h->twin()->vertex())].add_plane(n, d, w);
+	}
+
+	targets.assign(edges.size(), Vec3());
+	dirty.assign(edges.size(), false);
+	queue.clear();
+	queue.resize(edges.size());
+	for(auto e = m.edges_begin(); e != m.edges_end(); e++) cost(index(e));
+	return {};
+}
+
+/// Write the triangle of f into its preview slot
+void Simplifier::preview_face(Halfedge_Mesh::FaceRef f) {
+	uint32_t t = f_slot[f->id()];
+	HalfedgeRef h = f->halfedge();
+	for(uint32_t i = 0; i < 3; i++) {
+		p_idxs[3 * t + i] = v_slot[index(h->vertex())];
+		h = h->next();
+	}
+	p_dirty_tris.push_back(t);
+}
+
+void Simplifier::preview(GL::Mesh& out) {
+	if(out.version() != p_version) {
+		out.update(std::vector<GL::Mesh::Vert>(p_verts), std::vector<GL::Mesh::Index>(p_idxs),
+		           std::vector<GLuint>(p_idxs.size() / 3, 0));
+	} else if(!p_dirty_verts.empty() || !p_dirty_tris.empty()) {
+		for(std::vector<GLuint>* list : {&p_dirty_verts, &p_dirty_tris}) {
+			std::sort(list->begin(), list->end());
+			list->erase(std::unique(list->begin(), list->end()), list->end());
+		}
+		out.patch(p_verts, p_idxs, p_dirty_verts, p_dirty_tris);
+	}
+	p_dirty_verts.clear();
+	p_dirty_tris.clear();
+	p_version = out.version();
+}
+
+void Simplifier::cost(uint32_t e) {
+
+	HalfedgeRef h = edges[e]->halfedge();
+	VertexRef a = h->vertex(), b = h->twin()->vertex();
+	Quadric q = quadrics[index(a)] + quadrics[index(b)];
+
+	Vec3 p;
+	if(!q.optimum(p)) {
+		p = a->pos;
+		for(Vec3 c : {b->pos, 0.5f * (a->pos + b->pos)}) {
+			if(q.error(c) < q.error(p)) p = c;
+		}
+	}
+	targets[e] = p;
+	dirty[e] = false;
+	queue.set(e, q.error(p));
+}
+
+static bool on_boundary(Halfedge_Mesh::VertexCRef v) {
+	Halfedge_Mesh::HalfedgeCRef h = v->halfedge();
+	do {
+		if(h->face()->is_boundary()) return true;
+		h = h->twin()->next();
+	} while(h != v->halfedge());
+	return false;
+}
+
+static void ring(Halfedge_Mesh::VertexCRef v, std::vector<const Halfedge_Mesh::Vertex*>& out) {
+	out.clear();
+	Halfedge_Mesh::HalfedgeCRef h = v->halfedge();
+	do {
+		out.push_back(&*h->twin()->vertex());
+		h = h->twin()->next();
+	} while(h != v->halfedge());
+}
+
+bool Simplifier::can_collapse(HalfedgeRef h, Vec3 p) const {
+
+	HalfedgeRef t = h->twin();
+	VertexRef a = h->vertex(), b = t->vertex();
+	bool boundary = t->face()->is_boundary();
+
+	// A triangle with two boundary edges would be left hanging by one vertex
+	auto ear = [](HalfedgeRef h) {
+		return h->next()->twin()->face()->is_boundary() && h->next()->next()->twin()->face()->is_boundary();
+	};
+	if(ear(h) || (!boundary && ear(t))) return false;
+	if(!boundary && on_boundary(a) && on_boundary(b)) return false;
+
+	// Link condition: the endpoints may only share the vertices opposite the
+	// edge, otherwise the collapse pinches the surface
+	static thread_local std::vector<const Halfedge_Mesh::Vertex*> ring_a, ring_b;
+	ring(a, ring_a);
+	ring(b, ring_b);
+	size_t shared = 0;
+	for(auto v : ring_a) shared += std::count(ring_b.begin(), ring_b.end(), v);
+	if(shared != (boundary ? 1u : 2u)) return false;
+	if(!boundary && ring_a.size() == 3 && ring_b.size() == 3) return false;
+
+	// Reject folds: surviving faces may not flip or turn too far
+	for(VertexRef v : {a, b}) {
+		HalfedgeRef g = v->halfedge();
+		do {
+			if(!g->face()->is_boundary() && g->face() != h->face() && g->face() != t->face()) {
+				Vec3 x = g->next()->vertex()->pos, y = g->next()->next()->vertex()->pos;
+				Vec3 n0 = cross(x - v->pos, y - v->pos), n1 = cross(x - p, y - p);
+				float l0 = n0.norm(), l1 = n1.norm();
+				if(l1 == 0.0f || dot(n0, n1) < min_cos_flip * l0 * l1) return false;
+			}
+			g = g->twin()->next();
+		} while(g != v->halfedge());
+	}
+	return true;
+}
+
+/// Point v at its outgoing boundary halfedge, if any, as from_poly does
+void Simplifier::fix_boundary(VertexRef v) {
+	HalfedgeRef h = v->halfedge();
+	do {
+		if(h->face()->is_boundary()) {
+			v->halfedge() = h;
+			return;
+		}
+		h = h->twin()->next();
+	} while(h != v->halfedge());
+}
+
+void Simplifier::collapse(HalfedgeRef h, Vec3 p) {
+
+	Halfedge_Mesh& m = *mesh;
+	HalfedgeRef t = h->twin();
+	VertexRef a = h->vertex(), b = t->vertex();
+	bool boundary = t->face()->is_boundary();
+
+	// Shrink the preview triangles about to be erased
+	GL::Mesh::Index a_slot = v_slot[index(a)];
+	for(Halfedge_Mesh::FaceRef f : {h->face(), t->face()}) {
+		if(f->is_boundary()) continue;
+		uint32_t s = f_slot[f->id()];
+		for(uint32_t i = 0; i < 3; i++) p_idxs[3 * s + i] = a_slot;
+		p_dirty_tris.push_back(s);
+	}
+
+	// Hand b's halfedges to a, noting the boundary halfedge leading into t
+	HalfedgeRef into_t = t;
+	HalfedgeRef g = b->halfedge();
+	do {
+		g->vertex() = a;
+		if(g->twin()->next() == t) into_t = g->twin();
+		g = g->twin()->next();
+	} while(g != b->halfedge());
+
+	auto remove_edge = [&](EdgeRef e) {
+		queue.erase(index(e));
+		m.erase(e);
+	};
+
+	// Drop triangle h, h1, h2 and glue the outer twins of h1 and h2
+	HalfedgeRef h1 = h->next(), h2 = h1->next();
+	HalfedgeRef o1 = h1->twin(), o2 = h2->twin();
+	VertexRef c = h2->vertex();
+	EdgeRef e2 = h2->edge();
+	remove_edge(h1->edge());
+	o1->twin() = o2;
+	o2->twin() = o1;
+	o1->edge() = e2;
+	e2->halfedge() = o2;
+	c->halfedge() = o1;
+	a->halfedge() = o2;
+	m.erase(h->face());
+	m.erase(h1);
+	m.erase(h2);
+
+	if(boundary) {
+		into_t->next() = t->next();
+		if(t->face()->halfedge() == t) t->face()->halfedge() = t->next();
+	} else {
+		HalfedgeRef t1 = t->next(), t2 = t1->next();
+		HalfedgeRef p1 = t1->twin(), p2 = t2->twin();
+		VertexRef d = t2->vertex();
+		EdgeRef e3 = t1->edge();
+		remove_edge(t2->edge());
+		p1->twin() = p2;
+		p2->twin() = p1;
+		p2->edge() = e3;
+		e3->halfedge() = p1;
+		d->halfedge() = p1;
+		m.erase(t->face());
+		m.erase(t1);
+		m.erase(t2);
+		fix_boundary(d);
+	}
+	remove_edge(h->edge());
+	m.erase(h);
+	m.erase(t);
+
+	uint32_t ai = index(a), bi = index(b);
+	quadrics[ai] = quadrics[ai] + quadrics[bi];
+	m.erase(b);
+	a->pos = p;
+	fix_boundary(a);
+	fix_boundary(c);
+
+	p_verts[a_slot].pos = p;
+	p_dirty_verts.push_back(a_slot);
+
+	// Merged quadrics only grow, so the old keys of a's edges are lower
+	// bounds; they are re-evaluated when they reach the top
+	g = a->halfedge();
+	do {
+		uint32_t e = index(g->edge());
+		if(queue.contains(e)) dirty[e] = true;
+		else cost(e);
+		if(!g->face()->is_boundary()) preview_face(g->face());
+		g = g->twin()->next();
+	} while(g != a->halfedge());
+
+	// Once most triangles are waiting, uploading them all is cheaper
+	if(p_dirty_tris.size() > p_idxs.size() / 3) {
+		p_dirty_verts.clear();
+		p_dirty_tris.clear();
+		p_version = 0;
+	}
+}
+
+void Simplifier::stop() {
+	if(finished) return;
+	_stats.faces = mesh->n_faces();
+	mesh->render_dirty_flag = true;
+	finished = true;
+}
+
+bool Simplifier::run(double seconds) {
+
+	if(finished) return true;
+
+	auto start = std::chrono::steady_clock::now();
+	auto elapsed = [&]() {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	};
+
+	size_t n = 0;
+	while(!queue.empty() && mesh->n_faces() > opt.target_faces) {
+
+		uint32_t e = (uint32_t)queue.top();
+		if(dirty[e]) {
+			cost(e);
+			continue;
+		}
+		double err = queue.top_key();
+		if(err > opt.max_error) break;
+		queue.pop();
+
+		HalfedgeRef h = edges[e]->halfedge();
+		if(h->face()->is_boundary()) h = h->twin();
+
+		// Rejected edges leave the queue until a neighboring collapse changes them
+		if(!can_collapse(h, targets[e])) {
+			_stats.rejected++;
+			continue;
+		}
+		VertexRef a = h->vertex();
+		collapse(h, targets[e]);
+		_stats.collapses++;
+		if constexpr(Halfedge_Mesh::validation != Halfedge_Mesh::Validation::none) {
+			std::string bad = mesh->validate_edit({Halfedge_Mesh::VertexCRef(a)});
+			if(!bad.empty()) {
+				warn("Simplification left an invalid mesh: %s", bad.c_str());
+				stop();
+				return true;
+			}
+		}
+		_stats.error = std::max(_stats.error, err);
+
+		if(++n % 256 == 0 && elapsed() > seconds) {
+			_stats.seconds += elapsed();
+			_stats.faces = mesh->n_faces();
+			return false;
+		}
+	}
+
+	_stats.seconds += elapsed();
+	_stats.faces = mesh->n_faces();
+	mesh->render_dirty_flag = true;
+	finished = true;
+	return true;
+}
@@ -0,0 +1,94 @@
+
+#pragma once
+
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "halfedge.h"
+#include "../lib/heap.h"
+
+/// Quadric error metric decimation (Garland and Heckbert) of a triangle mesh
+/// by edge collapse. Work is split into time-bounded runs so the editor can
+/// show progress; the mesh is valid between runs.
+class Simplifier {
+public:
+	struct Options {
+		/// Stop once the mesh has at most this many faces
+		size_t target_faces = 0;
+		/// Stop before a collapse whose quadric error (area-weighted squared
+		/// distance) exceeds this
+		double max_error = std::numeric_limits<double>::infinity();
+	};
+	struct Stats {
+		size_t faces_before = 0, faces = 0;
+		size_t collapses = 0, rejected = 0;
+		double error = 0.0, seconds = 0.0;
+		double rate() const {
+			return seconds > 0.0 ? (double)collapses / seconds : 0.0;
+		}
+	};
+
+	/// Build the quadrics and edge queue. The mesh must be made of triangles
+	/// and must not be moved or edited elsewhere until finished.
+	std::string begin(Halfedge_Mesh& mesh, Options opt);
+	/// Collapse edges until a stopping condition is met or the time budget
+	/// runs out. Returns true once finished. The mesh is only marked for
+	/// re-rendering when finished; use preview() in between.
+	bool run(double seconds = std::numeric_limits<double>::infinity());
+	/// Show the collapses made so far in out. Each collapse patches a copy of
+	/// the triangles kept since begin(), so only what changed is uploaded,
+	/// unless out was last filled by something else. Faces are not pickable.
+	void preview(GL::Mesh& out);
+	/// Keep the collapses made so far and finish early
+	void stop();
+	bool done() const {
+		return finished;
+	}
+	const Stats& stats() const {
+		return _stats;
+	}
+
+private:
+	using VertexRef = Halfedge_Mesh::VertexRef;
+	using EdgeRef = Halfedge_Mesh::EdgeRef;
+	using HalfedgeRef = Halfedge_Mesh::HalfedgeRef;
+
+	/// Symmetric 4x4 matrix, upper triangle in row order
+	struct Quadric {
+		double q[10] = {};
+		void add_plane(Vec3 n, double d, double weight);
+		Quadric operator+(const Quadric& o) const;
+		double error(Vec3 p) const;
+		/// Minimizer, if the 3x3 part is well conditioned
+		bool optimum(Vec3& p) const;
+	};
+
+	void cost(uint32_t e);
+	bool can_collapse(HalfedgeRef h, Vec3 p) const;
+	void collapse(HalfedgeRef h, Vec3 p);
+	void fix_boundary(VertexRef v);
+	uint32_t index(EdgeRef e) const;
+	uint32_t index(VertexRef v) const;
+	void preview_face(Halfedge_Mesh::FaceRef f);
+
+	Halfedge_Mesh* mesh = nullptr;
+	Options opt;
+	Stats _stats;
+	bool finished = true;
+
+	// Per vertex and per edge arrays, indexed by element id
+	std::vector<Quadric> quadrics;
+	std::vector<EdgeRef> edges;
+	std::vector<Vec3> targets;
+	std::vector<bool> dirty;
+	Indexed_Heap<double> queue;
+
+	// Preview slots of each vertex and face id, fixed at begin(); erased
+	// faces shrink to a point at the vertex that replaced them
+	std::vector<uint32_t> v_slot, f_slot;
+	std::vector<GL::Mesh::Vert> p_verts;
+	std::vector<GL::Mesh::Index> p_idxs;
+	std::vector<GLuint> p_dirty_verts, p_dirty_tris;
+	uint64_t p_version = 0;
+};
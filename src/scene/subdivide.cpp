@@ -0,0 +1,269 @@
+
+#include "subdivide.h"
+#include "../jobs.h"
+
+namespace Subdivide {
+
+using Flat = Halfedge_Mesh::Flat;
+static const uint32_t none = Flat::none;
+static const size_t grain = 4096;
+
+/// Boundary vertices follow the cubic B-spline rule along the boundary; the
+/// neighbors are the ends of the incoming and outgoing boundary edges.
+static Vec3 boundary_point(const Flat& in, uint32_t v, uint32_t last) {
+	Vec3 u = in.pos[in.vertex[in.prev(in.vertex_halfedge[v])]];
+	Vec3 w = in.pos[in.vertex[in.next(last)]];
+	return 0.75f * in.pos[v] + 0.125f * (u + w);
+}
+
+/// Output layout: old vertices, then one point per edge, then one per face.
+/// Old halfedge g (from v to w in face f) becomes the quad
+/// [v, edge(g), face(f), edge(prev(g))] with halfedges 4g .. 4g + 3.
+static void catmull_clark(Flat& in, Jobs& jobs) {
+
+	uint32_t n_v = (uint32_t)in.pos.size(), n_e = (uint32_t)in.edge_halfedge.size();
+	uint32_t n_f = (uint32_t)in.face_start.size() - 1, n_h = (uint32_t)in.vertex.size();
+	uint32_t e_pt = n_v, f_pt = n_v + n_e;
+
+	Flat out;
+	out.pos.resize(n_v + n_e + n_f);
+
+	jobs.parallel_for(0, n_f, grain, [&](size_t f) {
+		Vec3 c;
+		for(uint32_t h = in.face_start[f]; h < in.face_start[f + 1]; h++) c += in.pos[in.vertex[h]];
+		out.pos[f_pt + f] = c / (float)(in.face_start[f + 1] - in.face_start[f]);
+	});
+
+	jobs.parallel_for(0, n_e, grain, [&](size_t e) {
+		uint32_t h = in.edge_halfedge[e], t = in.twin[h];
+		Vec3 a = in.pos[in.vertex[h]], b = in.pos[in.vertex[in.next(h)]];
+		if(t == none) {
+			out.pos[e_pt + e] = 0.5f * (a + b);
+		} else {
+			out.pos[e_pt + e] = 0.25f * (a + b + out.pos[f_pt + in.face[h]] + out.pos[f_pt + in.face[t]]);
+		}
+	});
+
+	jobs.parallel_for(0, n_v, grain, [&](size_t i) {
+		uint32_t v = (uint32_t)i, start = in.vertex_halfedge[v], h = start;
+		if(start == none) {
+			out.pos[v] = in.pos[v];
+			return;
+		}
+		Vec3 q, r;
+		float n = 0.0f;
+		while(true) {
+			q += out.pos[f_pt + in.face[h]];
+			r += in.pos[in.vertex[in.next(h)]];
+			n += 1.0f;
+			if(in.twin[h] == none || in.next(in.twin[h]) == start) break;
+			h = in.next(in.twin[h]);
+		}
+		Vec3 p = in.pos[v];
+		if(in.on_boundary(v)) {
+			out.pos[v] = boundary_point(in, v, h);
+		} else {
+			// (Q + 2R + (n - 3)P) / n, where R averages edge midpoints
+			out.pos[v] = (q / n + p + r / n + (n - 3.0f) * p) / n;
+		}
+	});
+
+	out.face_start.resize(n_h + 1);
+	out.vertex.resize(4 * (size_t)n_h);
+	out.twin.resize(4 * (size_t)n_h);
+	out.edge.resize(4 * (size_t)n_h);
+	out.face.resize(4 * (size_t)n_h);
+
+	// Old edges split in two (2e next to the start of edge_halfedge[e], 2e + 1
+	// next to its end); each old halfedge adds the edge from its edge point
+	// to its face point
+	jobs.parallel_for(0, n_h, grain, [&](size_t i) {
+		uint32_t g = (uint32_t)i, p = in.prev(g), n = in.next(g);
+		uint32_t t = in.twin[g], tp = in.twin[p], e = in.edge[g], ep = in.edge[p];
+		uint32_t o = 4 * g;
+
+		out.face_start[g] = o;
+		out.vertex[o] = in.vertex[g];
+		out.vertex[o + 1] = e_pt + e;
+		out.vertex[o + 2] = f_pt + in.face[g];
+		out.vertex[o + 3] = e_pt + ep;
+
+		out.twin[o] = t == none ? none : 4 * in.next(t) + 3;
+		out.twin[o + 1] = 4 * n + 2;
+		out.twin[o + 2] = 4 * p + 1;
+		out.twin[o + 3] = tp == none ? none : 4 * tp;
+
+		out.edge[o] = 2 * e + (in.edge_halfedge[e] == g ? 0 : 1);
+		out.edge[o + 1] = 2 * n_e + g;
+		out.edge[o + 2] = 2 * n_e + p;
+		out.edge[o + 3] = 2 * ep + (in.edge_halfedge[ep] == p ? 1 : 0);
+
+		for(uint32_t j = 0; j < 4; j++) out.face[o + j] = g;
+	});
+	out.face_start[n_h] = 4 * n_h;
+
+	out.edge_halfedge.resize(2 * n_e + n_h);
+	jobs.parallel_for(0, n_e, grain, [&](size_t e) {
+		uint32_t h = in.edge_halfedge[e];
+		out.edge_halfedge[2 * e] = 4 * h;
+		out.edge_halfedge[2 * e + 1] = 4 * in.next(h) + 3;
+	});
+	jobs.parallel_for(0, n_h, grain, [&](size_t g) {
+		out.edge_halfedge[2 * n_e + g] = 4 * (uint32_t)g + 1;
+	});
+
+	// Starting halfedges keep the boundary convention: the one after the
+	// incoming boundary halfedge
+	out.vertex_halfedge.resize(n_v + n_e + n_f);
+	jobs.parallel_for(0, n_v, grain, [&](size_t v) {
+		uint32_t h = in.vertex_halfedge[v];
+		out.vertex_halfedge[v] = h == none ? none : 4 * h;
+	});
+	jobs.parallel_for(0, n_e, grain, [&](size_t e) {
+		out.vertex_halfedge[e_pt + e] = 4 * in.edge_halfedge[e] + 1;
+	});
+	jobs.parallel_for(0, n_f, grain, [&](size_t f) {
+		out.vertex_halfedge[f_pt + f] = 4 * in.face_start[f] + 2;
+	});
+
+	in = std::move(out);
+}
+
+/// Output layout: old vertices, then one point per edge. Triangle f with
+/// halfedges g = 3f + i becomes corner triangles [v(g), edge(g), edge(prev(g))]
+/// with halfedges 12f + 3i .. 12f + 3i + 2, then the center triangle
+/// [edge(3f), edge(3f + 1), edge(3f + 2)] with halfedges 12f + 9 .. 12f + 11.
+static std::string loop(Flat& in, Jobs& jobs) {
+
+	uint32_t n_v = (uint32_t)in.pos.size(), n_e = (uint32_t)in.edge_halfedge.size();
+	uint32_t n_f = (uint32_t)in.face_start.size() - 1, n_h = (uint32_t)in.vertex.size();
+	uint32_t e_pt = n_v;
+
+	if(n_h != 3 * n_f) return "Loop subdivision requires a triangle mesh.";
+
+	auto corner = [&](uint32_t g, uint32_t j) {
+		return 4 * g - (g - in.face_start[in.face[g]]) + j;
+	};
+	auto center = [](uint32_t f, uint32_t i) {
+		return 12 * f + 9 + i;
+	};
+
+	Flat out;
+	out.pos.resize(n_v + n_e);
+
+	jobs.parallel_for(0, n_e, grain, [&](size_t e) {
+		uint32_t h = in.edge_halfedge[e], t = in.twin[h];
+		Vec3 a = in.pos[in.vertex[h]], b = in.pos[in.vertex[in.next(h)]];
+		if(t == none) {
+			out.pos[e_pt + e] = 0.5f * (a + b);
+		} else {
+			Vec3 c = in.pos[in.vertex[in.prev(h)]], d = in.pos[in.vertex[in.prev(t)]];
+			out.pos[e_pt + e] = 0.375f * (a + b) + 0.125f * (c + d);
+		}
+	});
+
+	jobs.parallel_for(0, n_v, grain, [&](size_t i) {
+		uint32_t v = (uint32_t)i, start = in.vertex_halfedge[v], h = start;
+		if(start == none) {
+			out.pos[v] = in.pos[v];
+			return;
+		}
+		Vec3 r;
+		float n = 0.0f;
+		while(true) {
+			r += in.pos[in.vertex[in.next(h)]];
+			n += 1.0f;
+			if(in.twin[h] == none || in.next(in.twin[h]) == start) break;
+			h = in.next(in.twin[h]);
+		}
+		if(in.on_boundary(v)) {
+			out.pos[v] = boundary_point(in, v, h);
+		} else {
+			float beta = n == 3.0f ? 3.0f / 16.0f : 3.0f / (8.0f * n);
+			out.pos[v] = (1.0f - n * beta) * in.pos[v] + beta * r;
+		}
+	});
+
+	out.face_start.resize(4 * (size_t)n_f + 1);
+	out.vertex.resize(4 * (size_t)n_h);
+	out.twin.resize(4 * (size_t)n_h);
+	out.edge.resize(4 * (size_t)n_h);
+	out.face.resize(4 * (size_t)n_h);
+
+	// Old edges split in two as in catmull_clark; each triangle adds three
+	// edges around its center, 2 * n_e + 3f + i opposite corner i
+	jobs.parallel_for(0, n_h, grain, [&](size_t idx) {
+		uint32_t g = (uint32_t)idx, f = in.face[g], i = g - in.face_start[f];
+		uint32_t p = in.prev(g), t = in.twin[g], tp = in.twin[p];
+		uint32_t e = in.edge[g], ep = in.edge[p];
+		uint32_t o = corner(g, 0), c = center(f, i);
+
+		out.vertex[o] = in.vertex[g];
+		out.vertex[o + 1] = e_pt + e;
+		out.vertex[o + 2] = e_pt + ep;
+		out.vertex[c] = e_pt + e;
+
+		out.twin[o] = t == none ? none : corner(in.next(t), 2);
+		out.twin[o + 1] = center(f, (i + 2) % 3);
+		out.twin[o + 2] = tp == none ? none : corner(tp, 0);
+		out.twin[c] = 12 * f + 3 * ((i + 1) % 3) + 1;
+
+		out.edge[o] = 2 * e + (in.edge_halfedge[e] == g ? 0 : 1);
+		out.edge[o + 1] = 2 * n_e + 3 * f + i;
+		out.edge[o + 2] = 2 * ep + (in.edge_halfedge[ep] == p ? 1 : 0);
+		out.edge[c] = 2 * n_e + 3 * f + (i + 1) % 3;
+
+		for(uint32_t j = 0; j < 3; j++) out.face[o + j] = 4 * f + i;
+		out.face[c] = 4 * f + 3;
+	});
+	jobs.parallel_for(0, 4 * (size_t)n_f + 1, grain, [&](size_t f) {
+		out.face_start[f] = 3 * (uint32_t)f;
+	});
+
+	out.edge_halfedge.resize(2 * n_e + 3 * n_f);
+	jobs.parallel_for(0, n_e, grain, [&](size_t e) {
+		uint32_t h = in.edge_halfedge[e];
+		out.edge_halfedge[2 * e] = corner(h, 0);
+		out.edge_halfedge[2 * e + 1] = corner(in.next(h), 2);
+	});
+	jobs.parallel_for(0, n_h, grain, [&](size_t g) {
+		out.edge_halfedge[2 * n_e + g] = corner((uint32_t)g, 1);
+	});
+
+	out.vertex_halfedge.resize(n_v + n_e);
+	jobs.parallel_for(0, n_v, grain, [&](size_t v) {
+		uint32_t h = in.vertex_halfedge[v];
+		out.vertex_halfedge[v] = h == none ? none : corner(h, 0);
+	});
+	jobs.parallel_for(0, n_e, grain, [&](size_t e) {
+		out.vertex_halfedge[e_pt + e] = corner(in.edge_halfedge[e], 1);
+	});
+
+	in = std::move(out);
+	return {};
+}
+
+std::string step(Flat& mesh, Scheme scheme, Jobs& jobs) {
+
+	// Each level multiplies the halfedge count by four
+	if(mesh.vertex.size() >= UINT32_MAX / 4) return "The mesh is too large to subdivide further.";
+
+	switch(scheme) {
+	case Scheme::catmull_clark: catmull_clark(mesh, jobs); return {};
+	case Scheme::loop: return loop(mesh, jobs);
+	}
+	return {};
+}
+
+std::string mesh(Halfedge_Mesh& mesh, Scheme scheme, unsigned int levels, Jobs& jobs) {
+
+	Flat flat = mesh.to_flat();
+	for(unsigned int i = 0; i < levels; i++) {
+		std::string err = step(flat, scheme, jobs);
+		if(!err.empty()) return err;
+	}
+	mesh.from_flat(flat);
+	return {};
+}
+
+}
@@ -0,0 +1,29 @@
+
+#pragma once
+
+#include <string>
+
+#include "halfedge.h"
+
+class Jobs;
+
+/// Global subdivision over flat element arrays. Each level computes the new
+/// points and the refined connectivity in parallel, with every output index
+/// known in advance, instead of splitting the linked mesh element by element.
+namespace Subdivide {
+
+enum class Scheme {
+	catmull_clark,
+	loop
+};
+
+/// Refine the flat mesh by one level. Catmull-Clark accepts any polygons and
+/// produces quads; Loop requires triangles. Boundaries use the cubic B-spline
+/// curve rule for both.
+std::string step(Halfedge_Mesh::Flat& mesh, Scheme scheme, Jobs& jobs);
+
+/// Apply the given number of levels to a halfedge mesh, converting it to flat
+/// form once. On error the mesh is left unchanged.
+std::string mesh(Halfedge_Mesh& mesh, Scheme scheme, unsigned int levels, Jobs& jobs);
+
+}
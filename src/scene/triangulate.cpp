@@ -0,0 +1,390 @@
+
+#include "triangulate.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace Triangulate {
+
+static const uint32_t none = UINT32_MAX;
+
+/// Twice the signed area of abc; positive when counterclockwise
+static double orient(Vec2 a, Vec2 b, Vec2 c) {
+	return ((double)b.x - a.x) * ((double)c.y - a.y) - ((double)b.y - a.y) * ((double)c.x - a.x);
+}
+
+/// Area over summed squared edge lengths: largest for equilateral triangles
+static double quality(Vec2 a, Vec2 b, Vec2 c) {
+	double l = (b - a).norm_squared() + (c - b).norm_squared() + (a - c).norm_squared();
+	return l > 0.0 ? orient(a, b, c) / l : 0.0;
+}
+
+static void emit(std::vector<uint32_t>& out, uint32_t a, uint32_t b, uint32_t c) {
+	out.push_back(a);
+	out.push_back(b);
+	out.push_back(c);
+}
+
+void Polygon::run(const std::vector<Vec3>& pos, std::vector<uint32_t>& out) {
+
+	uint32_t n = (uint32_t)pos.size();
+	if(n < 3) return;
+	if(n == 3) {
+		emit(out, 0, 1, 2);
+		return;
+	}
+
+	if(n == 4) {
+		// Split along the diagonal whose triangles both face the same way as
+		// the quad, preferring the better-shaped pair when both do
+		Vec3 n0 = cross(pos[1] - pos[0], pos[2] - pos[0]), n1 = cross(pos[2] - pos[0], pos[3] - pos[0]);
+		Vec3 n2 = cross(pos[2] - pos[1], pos[3] - pos[1]), n3 = cross(pos[3] - pos[1], pos[0] - pos[1]);
+		Vec3 normal = n0 + n1;
+		bool ok02 = dot(n0, normal) > 0.0f && dot(n1, normal) > 0.0f;
+		bool ok13 = dot(n2, normal) > 0.0f && dot(n3, normal) > 0.0f;
+		auto shape = [&](uint32_t a, uint32_t b, uint32_t c) {
+			float l = (pos[b] - pos[a]).norm_squared() + (pos[c] - pos[b]).norm_squared() +
+			          (pos[a] - pos[c]).norm_squared();
+			return l > 0.0f ? cross(pos[b] - pos[a], pos[c] - pos[a]).norm() / l : 0.0f;
+		};
+		bool use13 = ok13 && (!ok02 || std::min(shape(1, 2, 3), shape(1, 3, 0)) >
+		                                   std::min(shape(0, 1, 2), shape(0, 2, 3)));
+		if(use13) {
+			emit(out, 1, 2, 3);
+			emit(out, 1, 3, 0);
+		} else {
+			emit(out, 0, 1, 2);
+			emit(out, 0, 2, 3);
+		}
+		return;
+	}
+
+	if(!project(pos)) {
+		for(uint32_t i = 1; i + 1 < n; i++) emit(out, 0, i, i + 1);
+		return;
+	}
+
+	size_t start = out.size();
+	if(n <= ear_limit || !monotone(out)) {
+		out.resize(start);
+		ear_clip(out);
+	}
+}
+
+bool Polygon::project(const std::vector<Vec3>& pos) {
+
+	// Newell's method gives the normal of non-planar and concave polygons
+	size_t n = pos.size();
+	Vec3 normal;
+	for(size_t i = 0; i < n; i++) {
+		Vec3 a = pos[i], b = pos[(i + 1) % n];
+		normal.x += (a.y - b.y) * (a.z + b.z);
+		normal.y += (a.z - b.z) * (a.x + b.x);
+		normal.z += (a.x - b.x) * (a.y + b.y);
+	}
+	Vec3 m = normal.abs();
+	int k = m.x > m.y ? (m.x > m.z ? 0 : 2) : (m.y > m.z ? 1 : 2);
+	if(!(m[k] > 0.0f)) return false;
+
+	// Drop the dominant axis, keeping the polygon counterclockwise
+	int u = (k + 1) % 3, v = (k + 2) % 3;
+	if(normal[k] < 0.0f) std::swap(u, v);
+	p.resize(n);
+	for(size_t i = 0; i < n; i++) p[i] = Vec2(pos[i][u], pos[i][v]);
+	return true;
+}
+
+void Polygon::ear_clip(std::vector<uint32_t>& out) {
+
+	uint32_t n = (uint32_t)p.size();
+	prev.resize(n);
+	next.resize(n);
+	for(uint32_t i = 0; i < n; i++) {
+		prev[i] = (i + n - 1) % n;
+		next[i] = (i + 1) % n;
+	}
+
+	auto inside = [&](uint32_t a, uint32_t b, uint32_t c) {
+		for(uint32_t j = next[c]; j != a; j = next[j]) {
+			Vec2 q = p[j];
+			if(q == p[a] || q == p[b] || q == p[c]) continue;
+			if(orient(p[a], p[b], q) >= 0.0 && orient(p[b], p[c], q) >= 0.0 && orient(p[c], p[a], q) >= 0.0) {
+				return true;
+			}
+		}
+		return false;
+	};
+
+	uint32_t start = 0;
+	for(uint32_t remaining = n; remaining > 3; remaining--) {
+
+		// Clip the best-shaped ear while that is cheap, else the first found.
+		// Without any ear the input is degenerate, so clip the least bad corner.
+		uint32_t best = none, fallback = start;
+		double best_q = -1.0, fallback_o = -INFINITY;
+		uint32_t i = start;
+		do {
+			uint32_t a = prev[i], c = next[i];
+			double o = orient(p[a], p[i], p[c]);
+			if(o > fallback_o) {
+				fallback_o = o;
+				fallback = i;
+			}
+			if(o > 0.0 && !inside(a, i, c)) {
+				double q = quality(p[a], p[i], p[c]);
+				if(q > best_q) {
+					best_q = q;
+					best = i;
+				}
+				if(remaining > ear_limit) break;
+			}
+			i = next[i];
+		} while(i != start);
+		if(best == none) best = fallback;
+
+		emit(out, prev[best], best, next[best]);
+		next[prev[best]] = next[best];
+		prev[next[best]] = prev[best];
+		start = next[best];
+	}
+	emit(out, prev[start], start, next[start]);
+}
+
+bool Polygon::monotone(std::vector<uint32_t>& out) {
+
+	uint32_t n = (uint32_t)p.size();
+	auto above = [this](uint32_t i, uint32_t j) {
+		return p[i].y > p[j].y || (p[i].y == p[j].y && p[i].x < p[j].x);
+	};
+
+	prev.resize(n);
+	next.resize(n);
+	order.resize(n);
+	for(uint32_t i = 0; i < n; i++) {
+		prev[i] = (i + n - 1) % n;
+		next[i] = (i + 1) % n;
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), above);
+
+	// Sweep downward, adding diagonals that split the polygon into pieces
+	// monotone in y (de Berg et al.). Edge e goes from corner e to next[e];
+	// the status holds edges with the interior to their right.
+	helper.assign(n, none);
+	merge.assign(n, 0);
+	active.clear();
+	halves.clear();
+
+	auto diagonal = [&](uint32_t a, uint32_t b) {
+		if(a == b || next[a] == b || next[b] == a) return;
+		halves.push_back({a, b, 0.0f, false});
+		halves.push_back({b, a, 0.0f, false});
+	};
+	auto fix_up = [&](uint32_t v, uint32_t e) {
+		if(helper[e] != none && merge[helper[e]]) diagonal(v, helper[e]);
+	};
+	auto remove = [&](uint32_t e) {
+		auto it = std::find(active.begin(), active.end(), e);
+		if(it != active.end()) active.erase(it);
+	};
+	auto left_of = [&](uint32_t v) {
+		uint32_t best = none;
+		float best_x = -INFINITY;
+		for(uint32_t e : active) {
+			if(e == v || e == prev[v]) continue;
+			Vec2 a = p[e], b = p[next[e]];
+			float x = a.y == b.y ? std::max(a.x, b.x) : a.x + (b.x - a.x) * (p[v].y - a.y) / (b.y - a.y);
+			if(x <= p[v].x && x > best_x) {
+				best_x = x;
+				best = e;
+			}
+		}
+		return best;
+	};
+
+	for(uint32_t v : order) {
+		uint32_t a = prev[v], b = next[v];
+		bool a_below = above(v, a), b_below = above(v, b);
+		bool convex = orient(p[a], p[v], p[b]) > 0.0;
+
+		if(a_below && b_below) {
+			if(!convex) {
+				// Split vertex
+				uint32_t e = left_of(v);
+				if(e == none || helper[e] == none) return false;
+				diagonal(v, helper[e]);
+				helper[e] = v;
+			}
+			active.push_back(v);
+			helper[v] = v;
+		} else if(!a_below && !b_below) {
+			fix_up(v, a);
+			remove(a);
+			if(!convex) {
+				// Merge vertex
+				merge[v] = 1;
+				uint32_t e = left_of(v);
+				if(e == none) return false;
+				fix_up(v, e);
+				helper[e] = v;
+			}
+		} else if(!a_below) {
+			// On the left chain, with the interior to the right
+			fix_up(v, a);
+			remove(a);
+			active.push_back(v);
+			helper[v] = v;
+		} else {
+			uint32_t e = left_of(v);
+			if(e == none) return false;
+			fix_up(v, e);
+			helper[e] = v;
+		}
+	}
+
+	// Walk the faces of the polygon plus diagonals. Around each corner, the
+	// next halfedge of a face is the one clockwise from the way it came in.
+	for(uint32_t i = 0; i < n; i++) {
+		halves.push_back({i, next[i], 0.0f, false});
+		halves.push_back({next[i], i, 0.0f, true});
+	}
+	for(Half& h : halves) {
+		Vec2 d = p[h.to] - p[h.from];
+		h.angle = std::atan2(d.y, d.x);
+	}
+	std::sort(halves.begin(), halves.end(), [](const Half& a, const Half& b) {
+		return a.from != b.from ? a.from < b.from : a.angle < b.angle;
+	});
+	first.assign(n + 1, 0);
+	for(const Half& h : halves) first[h.from + 1]++;
+	for(uint32_t i = 0; i < n; i++) first[i + 1] += first[i];
+
+	size_t start = out.size();
+	for(uint32_t h0 = 0; h0 < halves.size(); h0++) {
+		if(halves[h0].used) continue;
+		corners.clear();
+		uint32_t h = h0;
+		do {
+			Half& cur = halves[h];
+			if(cur.used || corners.size() > n) return false;
+			cur.used = true;
+			corners.push_back(cur.from);
+			uint32_t w = cur.to, r = first[w];
+			while(r < first[w + 1] && halves[r].to != cur.from) r++;
+			if(r == first[w + 1]) return false;
+			h = r == first[w] ? first[w + 1] - 1 : r - 1;
+		} while(h != h0);
+		piece(out);
+	}
+	return out.size() - start == 3 * (size_t)(n - 2);
+}
+
+void Polygon::piece(std::vector<uint32_t>& out) {
+
+	// Triangulate a y-monotone piece (de Berg et al.), with corners given
+	// counterclockwise as polygon corner indices
+	uint32_t m = (uint32_t)corners.size();
+	if(m < 3) return;
+
+	auto above = [this](uint32_t i, uint32_t j) {
+		return p[i].y > p[j].y || (p[i].y == p[j].y && p[i].x < p[j].x);
+	};
+	auto tri = [&](uint32_t a, uint32_t b, uint32_t c) {
+		if(orient(p[a], p[b], p[c]) < 0.0) std::swap(b, c);
+		emit(out, a, b, c);
+	};
+
+	// Counterclockwise from the top runs down the left chain
+	order.resize(m);
+	for(uint32_t i = 0; i < m; i++) order[i] = i;
+	uint32_t top = 0, bottom = 0;
+	for(uint32_t i = 1; i < m; i++) {
+		if(above(corners[i], corners[top])) top = i;
+		if(above(corners[bottom], corners[i])) bottom = i;
+	}
+	left.assign(m, 0);
+	for(uint32_t i = (top + 1) % m; i != bottom; i = (i + 1) % m) left[i] = 1;
+	std::sort(order.begin(), order.end(), [&](uint32_t i, uint32_t j) {
+		return above(corners[i], corners[j]);
+	});
+
+	stack.clear();
+	stack.push_back(order[0]);
+	stack.push_back(order[1]);
+	for(uint32_t j = 2; j + 1 < m; j++) {
+		uint32_t u = order[j];
+		if(left[u] != left[stack.back()]) {
+			while(stack.size() > 1) {
+				uint32_t a = stack.back();
+				stack.pop_back();
+				tri(corners[u], corners[a], corners[stack.back()]);
+			}
+			stack.clear();
+			stack.push_back(order[j - 1]);
+			stack.push_back(u);
+		} else {
+			uint32_t last = stack.back();
+			stack.pop_back();
+			while(!stack.empty()) {
+				uint32_t b = stack.back();
+				Vec2 pu = p[corners[u]], pl = p[corners[last]], pb = p[corners[b]];
+				if(!(left[u] ? orient(pb, pl, pu) > 0.0 : orient(pu, pl, pb) > 0.0)) break;
+				tri(corners[u], corners[last], corners[b]);
+				last = b;
+				stack.pop_back();
+			}
+			stack.push_back(last);
+			stack.push_back(u);
+		}
+	}
+	uint32_t u = order[m - 1];
+	while(stack.size() > 1) {
+		uint32_t a = stack.back();
+		stack.pop_back();
+		tri(corners[u], corners[a], corners[stack.back()]);
+	}
+}
+
+void Cache::begin() {
+	generation++;
+}
+
+const std::vector<uint32_t>& Cache::get(const void* face, const std::vector<const void*>& verts,
+                                        const std::vector<Vec3>& pos) {
+
+	// Quads are as cheap to split as to look up
+	if(pos.size() <= 4) {
+		scratch.clear();
+		polygon.run(pos, scratch);
+		return scratch;
+	}
+
+	// Positions are compared bit for bit, so any move redoes the face
+	Entry& entry = faces[face];
+	entry.used = generation;
+	if(!entry.tris.empty() && entry.verts == verts && entry.pos.size() == pos.size() &&
+	   std::memcmp(entry.pos.data(), pos.data(), sizeof(Vec3) * pos.size()) == 0) {
+		hits++;
+		return entry.tris;
+	}
+	misses++;
+	entry.verts = verts;
+	entry.pos = pos;
+	entry.tris.clear();
+	polygon.run(pos, entry.tris);
+	return entry.tris;
+}
+
+void Cache::end() {
+	for(auto it = faces.begin(); it != faces.end();) {
+		if(it->second.used != generation) it = faces.erase(it);
+		else it++;
+	}
+}
+
+void Cache::clear() {
+	faces.clear();
+}
+
+}
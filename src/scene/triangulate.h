@@ -0,0 +1,74 @@
+
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "../lib/vec2.h"
+#include "../lib/vec3.h"
+
+/// Triangulation of polygon faces, which may be concave. Polygons are
+/// projected onto the plane of their normal; small ones are ear clipped,
+/// choosing the best-shaped ear each time, and large ones are split into
+/// monotone pieces by a sweep and triangulated in linear time per piece.
+namespace Triangulate {
+
+/// Scratch space is kept between calls, so once warmed up a Polygon does not
+/// allocate
+class Polygon {
+public:
+	/// Corners up to this many are ear clipped
+	static constexpr size_t ear_limit = 32;
+
+	/// Append triangles of the polygon with the given corner positions, as
+	/// corner indices, to out. Always produces n - 2 triangles, even for
+	/// degenerate or self-intersecting input.
+	void run(const std::vector<Vec3>& pos, std::vector<uint32_t>& out);
+
+private:
+	bool project(const std::vector<Vec3>& pos);
+	void ear_clip(std::vector<uint32_t>& out);
+	bool monotone(std::vector<uint32_t>& out);
+	void piece(std::vector<uint32_t>& out);
+
+	std::vector<Vec2> p;
+	std::vector<uint32_t> prev, next, order, active, corners, stack;
+	std::vector<uint32_t> helper;
+	std::vector<uint8_t> merge, left;
+	struct Half {
+		uint32_t from, to;
+		float angle;
+		bool used;
+	};
+	std::vector<Half> halves;
+	std::vector<uint32_t> first;
+};
+
+/// Triangulations of polygon faces, kept until the face's corners or their
+/// positions change. Faces not looked up between begin and end are dropped.
+class Cache {
+public:
+	void begin();
+	/// Triangles, as corner indices, of the face with the given corners
+	const std::vector<uint32_t>& get(const void* face, const std::vector<const void*>& verts,
+	                                 const std::vector<Vec3>& pos);
+	void end();
+	void clear();
+
+	size_t hits = 0, misses = 0;
+
+private:
+	struct Entry {
+		std::vector<const void*> verts;
+		std::vector<Vec3> pos;
+		uint32_t used = 0;
+		std::vector<uint32_t> tris;
+	};
+	std::unordered_map<const void*, Entry> faces;
+	uint32_t generation = 0;
+	Polygon polygon;
+	std::vector<uint32_t> scratch;
+};
+
+}
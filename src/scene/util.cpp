@@ -1,17 +1,85 @@
 
 #include "util.h"
 
+#include <algorithm>
 #include <map>
+#include <mutex>
+#include <tuple>
 
 namespace Util {
 
+	/// Thread-safe cache of the most recently used values by parameter tuple.
+	/// Values are shared rather than copied out, and only a few are kept, so
+	/// parameters that change continuously (e.g. from a slider) stay cheap.
+	template<typename Key, typename Value>
+	class Memo {
+	public:
+		static constexpr size_t capacity = 8;
+
+		template<typename F>
+		std::shared_ptr<const Value> get(const Key& key, F make) {
+			std::lock_guard<std::mutex> guard(lock);
+			for(size_t i = 0; i < entries.size(); i++) {
+				if(entries[i].first == key) {
+					std::rotate(entries.begin(), entries.begin() + i, entries.begin() + i + 1);
+					return entries.front().second;
+				}
+			}
+			if(entries.size() == capacity) entries.pop_back();
+			entries.emplace(entries.begin(), key, std::make_shared<const Value>(make()));
+			return entries.front().second;
+		}
+	private:
+		std::mutex lock;
+		/// Most recently used first
+		std::vector<std::pair<Key, std::shared_ptr<const Value>>> entries;
+	};
+
+	/// Meshes are held weakly, so they are freed (before GL shutdown) once
+	/// their last user is destroyed
+	template<typename Key, typename F>
+	static std::shared_ptr<GL::Mesh> share(std::map<Key, std::weak_ptr<GL::Mesh>>& cache, const Key& key, F make) {
+		auto entry = cache.find(key);
+		if(entry != cache.end()) {
+			if(auto mesh = entry->second.lock()) return mesh;
+		}
+		auto mesh = std::make_shared<GL::Mesh>(make());
+		cache[key] = mesh;
+		return mesh;
+	}
+
+	std::shared_ptr<GL::Mesh> shared_square_mesh(float r) {
+		static std::map<float, std::weak_ptr<GL::Mesh>> cache;
+		return share(cache, r, [=]() { return square_mesh(r); });
+	}
+
+	std::shared_ptr<GL::Mesh> shared_torus_mesh(float iradius, float oradius) {
+		static std::map<std::tuple<float, float>, std::weak_ptr<GL::Mesh>> cache;
+		return share(cache, {iradius, oradius}, [=]() { return torus_mesh(iradius, oradius); });
+	}
+
+	std::shared_ptr<GL::Mesh> shared_sphere_mesh(float r, int l) {
+		static std::map<std::tuple<float, int>, std::weak_ptr<GL::Mesh>> cache;
+		return share(cache, {r, l}, [=]() { return sphere_mesh(r, l); });
+	}
+
+	std::shared_ptr<GL::Mesh> shared_arrow_mesh(float base, float tip, float height) {
+		static std::map<std::tuple<float, float, float>, std::weak_ptr<GL::Mesh>> cache;
+		return share(cache, {base, tip, height}, [=]() { return arrow_mesh(base, tip, height); });
+	}
+
+	std::shared_ptr<GL::Mesh> shared_scale_mesh() {
+		static std::map<int, std::weak_ptr<GL::Mesh>> cache;
+		return share(cache, 0, []() { return scale_mesh(); });
+	}
+
 	GL::Mesh cyl_mesh(float radius, float height) {
 		return cone_mesh(radius, radius, height);
 	}
 
 	GL::Mesh arrow_mesh(float rbase, float rtip, float height) {
-		Gen::Data base = Gen::cone(rbase, rbase, 0.75f * height);
-		Gen::Data tip = Gen::cone(rtip, 0.001f, 0.25f * height);
+		Gen::Data base = *Gen::cone(rbase, rbase, 0.75f * height);
+		Gen::Data tip = *Gen::cone(rtip, 0.001f, 0.25f * height);
 		for(auto& v : tip.verts) v.pos.y += 0.7f;
 		for(auto& i : tip.elems) i += base.verts.size();
 		base.verts.insert(base.verts.end(), tip.verts.begin(), tip.verts.end());
@@ -20,7 +88,7 @@ namespace Util {
 	}
 
 	GL::Mesh scale_mesh() {
-		Gen::Data base = Gen::cone(0.03f, 0.03f, 0.7f);
+		Gen::Data base = *Gen::cone(0.03f, 0.03f, 0.7f);
 		Gen::Data tip = Gen::cube(0.1f);
 		for(auto& v : tip.verts) v.pos.y += 0.7f;
 		for(auto& i : tip.elems) i += base.verts.size();
@@ -30,13 +98,13 @@ namespace Util {
 	}
 	
 	GL::Mesh cone_mesh(float bradius, float tradius, float height) {
-		Gen::Data cone = Gen::cone(bradius, tradius, height);
-		return GL::Mesh(std::move(cone.verts), std::move(cone.elems));
+		auto cone = Gen::cone(bradius, tradius, height);
+		return GL::Mesh(std::vector(cone->verts), std::vector(cone->elems));
 	}
 
 	GL::Mesh torus_mesh(float iradius, float oradius) {
-		Gen::Data torus = Gen::torus(iradius, oradius);
-		return GL::Mesh(std::move(torus.verts), std::move(torus.elems));
+		auto torus = Gen::torus(iradius, oradius);
+		return GL::Mesh(std::vector(torus->verts), std::vector(torus->elems));
 	}
 
 	GL::Mesh cube_mesh(float r) {
@@ -50,12 +118,31 @@ namespace Util {
 	}
 
 	GL::Mesh sphere_mesh(float r, int i) {
-		Gen::Data ico_sphere = Gen::ico_sphere(r, i);
-		return GL::Mesh(std::move(ico_sphere.verts), std::move(ico_sphere.elems));
+		auto ico_sphere = Gen::ico_sphere(r, i);
+		return GL::Mesh(std::vector(ico_sphere->verts), std::vector(ico_sphere->elems));
 	}
 
 	namespace Gen {
 
+		static Data make_cone(float bradius, float tradius, float height);
+		static Data make_torus(float iradius, float oradius);
+		static Data make_ico_sphere(float radius, int level);
+
+		std::shared_ptr<const Data> cone(float bradius, float tradius, float height) {
+			static Memo<std::tuple<float, float, float>, Data> memo;
+			return memo.get({bradius, tradius, height}, [=]() { return make_cone(bradius, tradius, height); });
+		}
+
+		std::shared_ptr<const Data> torus(float iradius, float oradius) {
+			static Memo<std::tuple<float, float>, Data> memo;
+			return memo.get({iradius, oradius}, [=]() { return make_torus(iradius, oradius); });
+		}
+
+		std::shared_ptr<const Data> ico_sphere(float radius, int level) {
+			static Memo<std::tuple<float, int>, Data> memo;
+			return memo.get({radius, level}, [=]() { return make_ico_sphere(radius, level); });
+		}
+
 		Data square(float r) {
 			return {{
 				{{-r, 0.0f, -r}, {0.0f, 1.0f, 0.0f}},
@@ -84,7 +171,7 @@ namespace Util {
 		}
 
 		// https://wiki.unity3d.com/index.php/ProceduralPrimitives
-		Data cone(float bradius, float tradius, float height) {
+		static Data make_cone(float bradius, float tradius, float height) {
 
 			const size_t n_sides = 12, n_cap = n_sides + 1;
 			const float _2pi = PI * 2.0f;
@@ -183,13 +270,14 @@ namespace Util {
 			}
 
 			std::vector<GL::Mesh::Vert> verts;
+			verts.reserve(vertices.size());
 			for(size_t i = 0; i < vertices.size(); i++) {
 				verts.push_back({vertices[i], normals[i]});
 			}
-			return {verts, triangles};
+			return {std::move(verts), std::move(triangles)};
 		}
 
-		Data torus(float iradius, float oradius) {
+		static Data make_torus(float iradius, float oradius) {
 
 			const int n_rad_sides = 48, n_sides = 24;
 			const float _2pi = PI * 2.0f;
@@ -249,43 +337,23 @@ namespace Util {
 			}
 
 			std::vector<GL::Mesh::Vert> verts;
+			verts.reserve(vertices.size());
 			for(size_t i = 0; i < vertices.size(); i++) {
 				verts.push_back({vertices[i], normals[i]});
 			}
-			return {verts, triangles};
+			return {std::move(verts), std::move(triangles)};
 		}
 
-		Data ico_sphere(float radius, int level) {
-			struct TriIdx {
-				int v1, v2, v3;
-			};
-		
-			auto middle_point = [&](int p1, int p2, std::vector<Vec3>& vertices, std::map<int64_t, size_t>& cache, float radius) -> size_t {
-				bool firstIsSmaller = p1 < p2;
-				int64_t smallerIndex = firstIsSmaller ? p1 : p2;
-				int64_t greaterIndex = firstIsSmaller ? p2 : p1;
-				int64_t key = (smallerIndex << 32ll) + greaterIndex;
-				
-				auto entry = cache.find(key);
-				if (entry != cache.end()) {
-					return entry->second;
-				}
-		
-				Vec3 point1 = vertices[p1];
-				Vec3 point2 = vertices[p2];
-				Vec3 middle (
-					(point1.x + point2.x) / 2.0f, 
-					(point1.y + point2.y) / 2.0f, 
-					(point1.z + point2.z) / 2.0f
-				);
-				size_t i = vertices.size();
-				vertices.push_back(middle.unit() * radius); 
-				cache[key] = i;
-				return i;
-			};
-		
+		static Data make_ico_sphere(float radius, int level) {
+
+			// Every level splits each triangle into four and adds one vertex
+			// per edge, so F = 20 * 4^L, E = 3F / 2, and V = F / 2 + 2.
+			size_t n_faces = (size_t)20 << (2 * level);
+			size_t n_verts = n_faces / 2 + 2;
+
 			std::vector<Vec3> vertices;
-			std::map<int64_t, size_t> middlePointIndexCache;
+			vertices.reserve(n_verts);
+
 			float t = (1.0f + std::sqrt(5.0f)) / 2.0f;
 			vertices.push_back(Vec3(-1.0f,  t, 0.0f).unit() * radius);
 			vertices.push_back(Vec3( 1.0f,  t, 0.0f).unit() * radius);
@@ -299,59 +367,69 @@ namespace Util {
 			vertices.push_back(Vec3( t, 0.0f,  1.0f).unit() * radius);
 			vertices.push_back(Vec3(-t, 0.0f, -1.0f).unit() * radius);
 			vertices.push_back(Vec3(-t, 0.0f,  1.0f).unit() * radius);
-	
-			std::vector<TriIdx> faces;
-			faces.push_back(TriIdx{0, 11, 5});
-			faces.push_back(TriIdx{0, 5, 1});
-			faces.push_back(TriIdx{0, 1, 7});
-			faces.push_back(TriIdx{0, 7, 10});
-			faces.push_back(TriIdx{0, 10, 11});
-			faces.push_back(TriIdx{1, 5, 9});
-			faces.push_back(TriIdx{5, 11, 4});
-			faces.push_back(TriIdx{11, 10, 2});
-			faces.push_back(TriIdx{10, 7, 6});
-			faces.push_back(TriIdx{7, 1, 8});
-			faces.push_back(TriIdx{3, 9, 4});
-			faces.push_back(TriIdx{3, 4, 2});
-			faces.push_back(TriIdx{3, 2, 6});
-			faces.push_back(TriIdx{3, 6, 8});
-			faces.push_back(TriIdx{3, 8, 9});
-			faces.push_back(TriIdx{4, 9, 5});
-			faces.push_back(TriIdx{2, 4, 11});
-			faces.push_back(TriIdx{6, 2, 10});
-			faces.push_back(TriIdx{8, 6, 7});
-			faces.push_back(TriIdx{9, 8, 1});
-	
-			for(int i = 0; i < level; i++) {
-				std::vector<TriIdx> faces2;
-				for(auto tri : faces) {
-					int a = middle_point(tri.v1, tri.v2, vertices, middlePointIndexCache, radius);
-					int b = middle_point(tri.v2, tri.v3, vertices, middlePointIndexCache, radius);
-					int c = middle_point(tri.v3, tri.v1, vertices, middlePointIndexCache, radius);
-					faces2.push_back(TriIdx{tri.v1, a, c});
-					faces2.push_back(TriIdx{tri.v2, b, a});
-					faces2.push_back(TriIdx{tri.v3, c, b});
-					faces2.push_back(TriIdx{a, b, c});
+
+			std::vector<GL::Mesh::Index> triangles = {
+				0, 11, 5,	0, 5, 1,	0, 1, 7,	0, 7, 10,	0, 10, 11,
+				1, 5, 9,	5, 11, 4,	11, 10, 2,	10, 7, 6,	7, 1, 8,
+				3, 9, 4,	3, 4, 2,	3, 2, 6,	3, 6, 8,	3, 8, 9,
+				4, 9, 5,	2, 4, 11,	6, 2, 10,	8, 6, 7,	9, 8, 1
+			};
+			triangles.reserve(n_faces * 3);
+
+			std::vector<GL::Mesh::Index> next;
+			next.reserve(n_faces * 3);
+
+			// Open-addressed table from undirected edge to its midpoint vertex,
+			// sized to at most half full for the current level's edges
+			const uint64_t empty = UINT64_MAX;
+			std::vector<uint64_t> keys;
+			std::vector<GL::Mesh::Index> mids;
+			size_t mask = 0;
+			int shift = 0;
+
+			auto middle_point = [&](GL::Mesh::Index p1, GL::Mesh::Index p2) -> GL::Mesh::Index {
+				uint64_t key = ((uint64_t)std::min(p1, p2) << 32) | std::max(p1, p2);
+				size_t slot = (size_t)((key * 0x9E3779B97F4A7C15ull) >> shift);
+				while(keys[slot] != empty) {
+					if(keys[slot] == key) return mids[slot];
+					slot = (slot + 1) & mask;
 				}
-				faces = faces2;
-			}
-	
-			std::vector<GL::Mesh::Index> triangles;
-			for(size_t i = 0; i < faces.size(); i++ ) {
-				triangles.push_back(faces[i].v1);
-				triangles.push_back(faces[i].v2);
-				triangles.push_back(faces[i].v3);
+				GL::Mesh::Index i = (GL::Mesh::Index)vertices.size();
+				vertices.push_back((0.5f * (vertices[p1] + vertices[p2])).unit() * radius);
+				keys[slot] = key;
+				mids[slot] = i;
+				return i;
+			};
+
+			for(int l = 0; l < level; l++) {
+
+				size_t n_edges = triangles.size() / 2;
+				int bits = 1;
+				while(((size_t)1 << bits) < 2 * n_edges) bits++;
+				keys.assign((size_t)1 << bits, empty);
+				mids.resize(keys.size());
+				mask = keys.size() - 1;
+				shift = 64 - bits;
+
+				next.clear();
+				for(size_t i = 0; i < triangles.size(); i += 3) {
+					GL::Mesh::Index v1 = triangles[i], v2 = triangles[i + 1], v3 = triangles[i + 2];
+					GL::Mesh::Index a = middle_point(v1, v2);
+					GL::Mesh::Index b = middle_point(v2, v3);
+					GL::Mesh::Index c = middle_point(v3, v1);
+					next.insert(next.end(), {v1, a, c, v2, b, a, v3, c, b, a, b, c});
+				}
+				std::swap(triangles, next);
 			}
-	
-			std::vector<Vec3> normals(vertices.size());
-			for(size_t i = 0; i < normals.size(); i++)
-				normals[i] = vertices[i].unit();
-	
+
+			assert(vertices.size() == n_verts && triangles.size() == n_faces * 3);
+
 			std::vector<GL::Mesh::Vert> verts;
+			verts.reserve(vertices.size());
 			for(size_t i = 0; i < vertices.size(); i++) {
-				verts.push_back({vertices[i], normals[i]});
+				verts.push_back({vertices[i], vertices[i].unit()});
 			}
-			return {verts, triangles};
+			return {std::move(verts), std::move(triangles)};
 		}
 	}
 }
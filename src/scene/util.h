@@ -4,6 +4,7 @@
 #include "../platform/gl.h"
 
 #include <string>
+#include <memory>
 
 namespace Util {
 
@@ -17,6 +18,15 @@ namespace Util {
 	GL::Mesh arrow_mesh(float base, float tip, float height);
 	GL::Mesh scale_mesh();
 
+	/// Calls with identical parameters share one GPU mesh for as long as
+	/// anyone holds it
+	std::shared_ptr<GL::Mesh> shared_square_mesh(float radius);
+	std::shared_ptr<GL::Mesh> shared_torus_mesh(float iradius, float oradius);
+	std::shared_ptr<GL::Mesh> shared_sphere_mesh(float r, int l);
+	std::shared_ptr<GL::Mesh> shared_arrow_mesh(float base, float tip, float height);
+	std::shared_ptr<GL::Mesh> shared_scale_mesh();
+
+	/// Curved primitives are memoized by parameters and shared
 	namespace Gen {
 		struct Data {
 			std::vector<GL::Mesh::Vert> verts;
@@ -27,8 +37,8 @@ namespace Util {
 		Data square(float r);
 
 		// https://wiki.unity3d.com/index.php/ProceduralPrimitives
-		Data ico_sphere(float radius, int level);
-		Data cone(float bradius, float tradius, float height);
-		Data torus(float iradius, float oradius);
+		std::shared_ptr<const Data> ico_sphere(float radius, int level);
+		std::shared_ptr<const Data> cone(float bradius, float tradius, float height);
+		std::shared_ptr<const Data> torus(float iradius, float oradius);
 	}
 }
@@ -0,0 +1,142 @@
+
+#include "weld.h"
+#include "../jobs.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace Weld {
+
+static const size_t grain = 1024;
+
+namespace {
+
+struct Cell {
+	int32_t x, y, z;
+	bool operator<(const Cell& c) const {
+		if(x != c.x) return x < c.x;
+		if(y != c.y) return y < c.y;
+		return z < c.z;
+	}
+	bool operator==(const Cell& c) const {
+		return x == c.x && y == c.y && z == c.z;
+	}
+};
+
+struct Entry {
+	Cell cell;
+	uint32_t idx;
+};
+
+}
+
+size_t points(const SoA_Vec3& pos, Options opt, std::vector<uint32_t>& remap, Jobs& jobs) {
+
+	size_t n = pos.size();
+	remap.resize(n);
+	for(size_t i = 0; i < n; i++) remap[i] = (uint32_t)i;
+
+	BBox box = SoA::bounds(pos);
+	float tol = opt.tolerance * (box.max - box.min).norm();
+	if(!opt.enabled || n < 2 || !(tol > 0.0f)) return 0;
+
+	// Cells are at least the tolerance wide; the coordinates must also fit
+	float cell = std::max(tol, (box.max - box.min).norm() / (float)(1 << 30));
+	std::vector<Entry> grid(n);
+	jobs.parallel_for(0, n, grain, [&](size_t i) {
+		Vec3 p = (pos.get(i) - box.min) / cell;
+		grid[i] = {{(int32_t)p.x, (int32_t)p.y, (int32_t)p.z}, (uint32_t)i};
+	});
+	std::sort(grid.begin(), grid.end(), [](const Entry& a, const Entry& b) {
+		return a.cell == b.cell ? a.idx < b.idx : a.cell < b.cell;
+	});
+
+	std::vector<uint32_t> cells;
+	for(uint32_t i = 0; i < n; i++) {
+		if(i == 0 || !(grid[i].cell == grid[i - 1].cell)) cells.push_back(i);
+	}
+	cells.push_back((uint32_t)n);
+
+	// Each cell lists its points' neighbors within the tolerance. Cells only
+	// write their own lists, so they can be searched in parallel.
+	float tol2 = tol * tol;
+	auto cell_less = [](const Entry& e, const Cell& c) {
+		return e.cell < c;
+	};
+	std::vector<std::vector<std::pair<uint32_t, uint32_t>>> pairs(cells.size() - 1);
+	jobs.parallel_for(0, cells.size() - 1, grain / 8, [&](size_t c) {
+		uint32_t begin = cells[c], end = cells[c + 1];
+		Cell home = grid[begin].cell;
+		for(int32_t dx = -1; dx <= 1; dx++) {
+			for(int32_t dy = -1; dy <= 1; dy++) {
+				for(int32_t dz = -1; dz <= 1; dz++) {
+					Cell adj = {home.x + dx, home.y + dy, home.z + dz};
+					auto j = std::lower_bound(grid.begin(), grid.end(), adj, cell_less);
+					for(; j != grid.end() && j->cell == adj; j++) {
+						Vec3 q = pos.get(j->idx);
+						for(uint32_t i = begin; i < end; i++) {
+							uint32_t idx = grid[i].idx;
+							if(j->idx < idx && (pos.get(idx) - q).norm_squared() <= tol2) {
+								pairs[c].push_back({j->idx, idx});
+							}
+						}
+					}
+				}
+			}
+		}
+	});
+
+	// Union-find over the pairs merges chains whatever their index order;
+	// the lowest index of each cluster is its root
+	auto find = [&](uint32_t i) {
+		while(remap[i] != i) {
+			remap[i] = remap[remap[i]];
+			i = remap[i];
+		}
+		return i;
+	};
+	for(const auto& list : pairs) {
+		for(auto [a, b] : list) {
+			uint32_t ra = find(a), rb = find(b);
+			if(ra < rb) remap[rb] = ra;
+			else if(rb < ra) remap[ra] = rb;
+		}
+	}
+
+	// Roots are lower than their members, so in index order each point's
+	// root is already resolved
+	size_t welded = 0;
+	for(size_t i = 0; i < n; i++) {
+		remap[i] = remap[remap[i]];
+		if(remap[i] != i) welded++;
+	}
+	return welded;
+}
+
+size_t polygons(std::vector<std::vector<Halfedge_Mesh::Index>>& polys, const std::vector<uint32_t>& remap) {
+
+	size_t dropped = 0, out = 0;
+	std::vector<Halfedge_Mesh::Index> sorted;
+	for(auto& poly : polys) {
+		size_t k = 0;
+		for(Halfedge_Mesh::Index i : poly) {
+			Halfedge_Mesh::Index w = i < remap.size() ? remap[i] : i;
+			if(k == 0 || poly[k - 1] != w) poly[k++] = w;
+		}
+		while(k > 1 && poly[k - 1] == poly[0]) k--;
+		poly.resize(k);
+
+		sorted = poly;
+		std::sort(sorted.begin(), sorted.end());
+		if(k < 3 || std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) {
+			dropped++;
+			continue;
+		}
+		if(&poly != &polys[out]) polys[out] = std::move(poly);
+		out++;
+	}
+	polys.resize(out);
+	return dropped;
+}
+
+}
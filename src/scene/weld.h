@@ -0,0 +1,35 @@
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "halfedge.h"
+#include "../lib/soa.h"
+
+class Jobs;
+
+/// Welding of nearby vertices, for meshes that arrive as triangle soup.
+/// Points are bucketed in a uniform grid with cells the size of the
+/// tolerance, so each point is only compared against the 27 cells around it,
+/// and close pairs are merged with union-find.
+namespace Weld {
+
+struct Options {
+	bool enabled = true;
+	/// Distance within which vertices are merged, relative to the diagonal
+	/// of the mesh's bounding box
+	float tolerance = 1e-5f;
+};
+
+/// Map every point to the lowest-indexed point it welds to, itself if none.
+/// Points within the tolerance of each other are merged, transitively.
+/// Returns the number of points merged away.
+size_t points(const SoA_Vec3& pos, Options opt, std::vector<uint32_t>& remap, Jobs& jobs);
+
+/// Rewrite polygons through the map, dropping corners repeated in a row.
+/// Polygons left with fewer than three corners, or still repeating one, are
+/// removed; returns how many.
+size_t polygons(std::vector<std::vector<Halfedge_Mesh::Index>>& polys, const std::vector<uint32_t>& remap);
+
+}